@@ -7,12 +7,14 @@ import argparse
 
 # tags
 CBDC_TAG_CLIENT_DEPLOYMENT_INFO = 100005        # deployment info: node/shard association
+CBDC_TAG_CLIENT_TRANSFER_INTENDED = 100008      # open-loop pacing: scheduled start of the transfer (extra: delay until the transfer was created, in ns)
 CBDC_TAG_CLIENT_TRANSFER_START = 100010         # client started preparing the transfer
 CBDC_TAG_CLIENT_TRANSFER_QUEUE = 100020         # client pushed the request to the thread
 CBDC_TAG_CLIENT_TRANSFER_SENDING = 100050       # client is calling put_and_forget
 CBDC_TAG_CLIENT_TRANSFER_SENT = 100080          # put is finished at the client
 CBDC_TAG_CLIENT_STATUS = 100100                 # status/version of a TX
 CBDC_TAG_CLIENT_BATCHING = 100110               # client request batching
+CBDC_TAG_CLIENT_COMPLETION = 100120             # client received the final status of a TX (extra: status)
 
 CBDC_TAG_UDL_HANDLER_START = 200010             # UDL main thread received a request
 CBDC_TAG_UDL_HANDLER_QUEUING = 200020           # UDL main thread is adding the request to a thread's queue
@@ -36,6 +38,22 @@ CBDC_TAG_UDL_BACKWARD_END = 200170              # put_and_forget finished to bac
 CBDC_TAG_UDL_WALLET_BATCHING = 200180           # wallet persistence batching
 CBDC_TAG_UDL_CHAIN_BATCHING = 200190            # chaining protocol batching
 CBDC_TAG_UDL_TX_BATCHING = 200200               # tx persistence batching
+CBDC_TAG_UDL_TX_REJECTED = 200210               # UDL worker thread rejected a new TX due to overload (admission control)
+CBDC_TAG_UDL_GROUP_COMMIT = 200220              # group commit: number of TXs admitted together
+CBDC_TAG_UDL_BULK_MINT_START = 200230           # UDL worker thread started its part of a bulk mint
+CBDC_TAG_UDL_BULK_MINT_END = 200240             # UDL worker thread finished its part of a bulk mint (extra: number of wallets)
+CBDC_TAG_UDL_RECOVERY_START = 200250            # UDL worker thread started loading its wallets (txid: thread)
+CBDC_TAG_UDL_RECOVERY_END = 200260              # UDL worker thread is ready (txid: thread, extra: number of wallets loaded)
+CBDC_TAG_UDL_WALLET_FETCH = 200270              # wallet fetch thread batching
+CBDC_TAG_UDL_CHECKPOINT_START = 200280          # UDL worker thread started a checkpoint (txid: thread, extra: last update)
+CBDC_TAG_UDL_CHECKPOINT_END = 200290            # UDL worker thread finished a checkpoint (txid: thread, extra: number of wallets)
+CBDC_TAG_UDL_WALLET_CACHE = 200300              # wallets cached by a UDL worker thread (txid: thread, extra: number of wallets)
+CBDC_TAG_UDL_MEMORY = 200310                    # resident memory of the server process (extra: bytes)
+CBDC_TAG_UDL_WALLET_BYTES = 200320              # wallet persistence thread put a batch (txid: delta batch, extra: bytes)
+CBDC_TAG_UDL_COMPACTION_BYTES = 200330          # delta compaction put the wallet images (txid: last delta batch, extra: bytes)
+CBDC_TAG_UDL_DIGEST_START = 200340              # UDL started computing the digests of its shard (txid: request id, extra: range size)
+CBDC_TAG_UDL_DIGEST_END = 200350                # last worker thread finished the digests (txid: request id, extra: number of ranges)
+CBDC_TAG_UDL_NOTIFICATION_BATCHING = 200360     # completion notification sent to a client (txid: number of TXs, extra: client)
 
 TLT_PERSISTED = 5001                            # time in which a given version was persisted
 
@@ -53,8 +71,10 @@ def load_logs(file_list):
     wallet_batching = []
     tx_batching = []
     chain_batching = []
+    group_commit = []
     node_min = {}
     node_max = {}
+    rejected = set()
         
     for fname in file_list:
         with open(fname,"r") as f:
@@ -68,7 +88,7 @@ def load_logs(file_list):
                 if txid not in data: data[txid] = {}
 
                 # client timestamps
-                if tag in (CBDC_TAG_CLIENT_TRANSFER_START,CBDC_TAG_CLIENT_TRANSFER_SENDING,CBDC_TAG_CLIENT_TRANSFER_SENT):
+                if tag in (CBDC_TAG_CLIENT_TRANSFER_START,CBDC_TAG_CLIENT_TRANSFER_SENDING,CBDC_TAG_CLIENT_TRANSFER_SENT,CBDC_TAG_CLIENT_COMPLETION):
                     data[txid][tag] = ts
                     if tag == CBDC_TAG_CLIENT_TRANSFER_START:
                         tx_list.append((ts,txid))
@@ -77,6 +97,8 @@ def load_logs(file_list):
                         if node not in node_max: node_max[node] = 0
                         node_min[node] = min(node_min[node],ts)
                         node_max[node] = max(node_max[node],ts)
+                elif tag == CBDC_TAG_CLIENT_TRANSFER_INTENDED:
+                    data[txid][tag] = ts - extra
                 elif tag == CBDC_TAG_CLIENT_STATUS:
                     tx_version[txid] = extra
                 elif tag == CBDC_TAG_CLIENT_DEPLOYMENT_INFO:
@@ -97,6 +119,10 @@ def load_logs(file_list):
                         if tag not in data[txid]: data[txid][tag] = {}
                         data[txid][tag][extra] = ts
 
+                # admission control
+                if tag == CBDC_TAG_UDL_TX_REJECTED:
+                    rejected.add(txid)
+
                 # Cascade timestamps
                 if tag == TLT_PERSISTED:
                     if node not in persisted_time: persisted_time[node] = {}
@@ -111,6 +137,8 @@ def load_logs(file_list):
                     tx_batching.append(txid)
                 elif tag == CBDC_TAG_UDL_CHAIN_BATCHING:
                     chain_batching.append(txid)
+                elif tag == CBDC_TAG_UDL_GROUP_COMMIT:
+                    group_commit.append(txid)
 
     first_ts = 0
     last_ts = sys.maxsize
@@ -127,6 +155,15 @@ def load_logs(file_list):
             data.pop(txid)
             if txid in tx_version: tx_version.pop(txid)
     
+    # rejected TXs are not part of the goodput
+    rejected_count = 0
+    for txid in rejected:
+        if txid in data:
+            rejected_count += 1
+            data.pop(txid)
+            if txid in tx_version: tx_version.pop(txid)
+    tx_list = [(ts,txid) for ts,txid in tx_list if txid not in rejected]
+
     # remove first SKIP TXs
     tx_list.sort()
     exclude_count = int(SKIP * len(tx_list))
@@ -172,7 +209,7 @@ def load_logs(file_list):
         else:
             data.pop(txid)
 
-    return data,tx_persisted_time,(client_batching,wallet_batching,chain_batching,tx_batching)
+    return data,tx_persisted_time,(client_batching,wallet_batching,chain_batching,tx_batching,group_commit),rejected_count
 
 def compute_throughput(data):
     timestamps = data[0]
@@ -184,6 +221,8 @@ def compute_throughput(data):
     first_thread_tx = sys.maxsize
     last_thread_tx = 0
     e2e = []
+    intended = []
+    notified = []
     for txid in timestamps:
         first_client_tx = min(first_client_tx,timestamps[txid][CBDC_TAG_CLIENT_TRANSFER_START])
         last_client_tx = max(last_client_tx,timestamps[txid][CBDC_TAG_CLIENT_TRANSFER_START])
@@ -195,6 +234,16 @@ def compute_throughput(data):
         lat = persisted[txid] - timestamps[txid][CBDC_TAG_CLIENT_TRANSFER_SENT]
         e2e.append(lat)
 
+        # e2e latency from the scheduled start (only with open-loop pacing): includes the time the client was behind schedule
+        if CBDC_TAG_CLIENT_TRANSFER_INTENDED in timestamps[txid]:
+            lat = persisted[txid] - timestamps[txid][CBDC_TAG_CLIENT_TRANSFER_INTENDED]
+            intended.append(lat)
+
+        # commit latency seen by the client (only with enable_notifications)
+        if CBDC_TAG_CLIENT_COMPLETION in timestamps[txid]:
+            lat = timestamps[txid][CBDC_TAG_CLIENT_COMPLETION] - timestamps[txid][CBDC_TAG_CLIENT_TRANSFER_SENT]
+            notified.append(lat)
+
     # persisted throughput
     #elapsed = float(last_persisted - first_udl_tx) / 1e+9 # to seconds
     elapsed = float(last_persisted - first_client_tx) / 1e+9 # to seconds
@@ -214,10 +263,10 @@ def compute_throughput(data):
     thr = num_sent / elapsed
     real_sending_rate = (thr,num_sent,elapsed)
 
-    return sending_rate,real_sending_rate,persisted_thr,e2e
+    return sending_rate,real_sending_rate,persisted_thr,e2e,intended,notified,data[3]
 
 def print_throughput(thr_data):
-    sending_rate,real_sending_rate,persisted_thr,e2e = thr_data
+    sending_rate,real_sending_rate,persisted_thr,e2e,intended,notified,rejected_count = thr_data
     
     thr,count,elapsed = sending_rate
     print(f"client sending rate: {thr:.2f} tx/s ({count} TXs in {elapsed:.2f} seconds)")
@@ -227,6 +276,8 @@ def print_throughput(thr_data):
 
     thr,count,elapsed = persisted_thr
     print(f"throughput: {thr:.2f} tx/s ({count} TXs in {elapsed:.2f} seconds)")
+    if rejected_count > 0:
+        print(f"rejected: {rejected_count} TXs (not included in the throughput and latency)")
     
     array = np.array(e2e) / 1e+6 # to milliseconds
 
@@ -240,6 +291,32 @@ def print_throughput(thr_data):
 
     print(f"e2e latency: avg {avg:6.3f} | std {std:6.3f} | med {med:6.3f} | min {min_v:6.3f} | max {max_v:6.3f} | p95 {p95:6.3f} | p99 {p99:6.3f}")
 
+    if len(intended) > 0:
+        array = np.array(intended) / 1e+6 # to milliseconds
+
+        avg = np.mean(array)
+        std = np.std(array)
+        med = np.median(array)
+        min_v = np.min(array)
+        max_v = np.max(array)
+        p95 = np.percentile(array,95)
+        p99 = np.percentile(array,99)
+
+        print(f"e2e latency (from intended start): avg {avg:6.3f} | std {std:6.3f} | med {med:6.3f} | min {min_v:6.3f} | max {max_v:6.3f} | p95 {p95:6.3f} | p99 {p99:6.3f}")
+
+    if len(notified) > 0:
+        array = np.array(notified) / 1e+6 # to milliseconds
+
+        avg = np.mean(array)
+        std = np.std(array)
+        med = np.median(array)
+        min_v = np.min(array)
+        max_v = np.max(array)
+        p95 = np.percentile(array,95)
+        p99 = np.percentile(array,99)
+
+        print(f"commit latency (notified, {len(notified)} TXs): avg {avg:6.3f} | std {std:6.3f} | med {med:6.3f} | min {min_v:6.3f} | max {max_v:6.3f} | p95 {p95:6.3f} | p99 {p99:6.3f}")
+
 def compute_batching(data):
     results = []
     for batching in data[2]:
@@ -261,7 +338,7 @@ def compute_batching(data):
     return results
 
 def print_batching(bat_data):
-    labels = ['client_batching','wallet_batching','chain_batching','tx_batching']
+    labels = ['client_batching','wallet_batching','chain_batching','tx_batching','group_commit']
 
     print("\nbatching statistics:")
     for label,results in zip(labels,bat_data):
@@ -352,6 +429,90 @@ def print_breakdown(lat):
 
         print(f"  {label}:".ljust(12),f"avg {avg:6.3f} | std {std:6.3f} | med {med:6.3f} | min {min_v:6.3f} | max {max_v:6.3f} | p95 {p95:6.3f} | p99 {p99:6.3f}")
 
+def compute_recovery(file_list):
+    start = {}
+    end = {}
+    count = {}
+    for fname in file_list:
+        with open(fname,"r") as f:
+            for line in f:
+                if line.startswith('#'): continue
+                tag,ts,node,txid,extra,extra2 = [int(x) for x in line.split()]
+
+                if tag == CBDC_TAG_UDL_RECOVERY_START:
+                    start[node] = min(start.get(node,sys.maxsize),ts)
+                elif tag == CBDC_TAG_UDL_RECOVERY_END:
+                    end[node] = max(end.get(node,0),ts)
+                    count[node] = count.get(node,0) + extra
+
+    # a node is ready when all its threads finished loading their wallets
+    results = []
+    for node in sorted(end):
+        elapsed = float(end[node] - start[node]) / 1e+9 # to seconds
+        results.append((node,count[node],elapsed))
+
+    return results
+
+def print_recovery(rec_data):
+    print("recovery:")
+    for node,count,elapsed in rec_data:
+        print(f"  node {node}: {count} wallets loaded in {elapsed:.2f} seconds")
+
+def compute_memory(file_list):
+    cached = {}
+    memory = {}
+    for fname in file_list:
+        with open(fname,"r") as f:
+            for line in f:
+                if line.startswith('#'): continue
+                tag,ts,node,txid,extra,extra2 = [int(x) for x in line.split()]
+
+                if tag == CBDC_TAG_UDL_WALLET_CACHE:
+                    if node not in cached: cached[node] = {}
+                    cached[node][txid] = max(cached[node].get(txid,0),extra)
+                elif tag == CBDC_TAG_UDL_MEMORY:
+                    memory[node] = max(memory.get(node,0),extra)
+
+    results = []
+    for node in sorted(memory):
+        results.append((node,sum(cached.get(node,{}).values()),memory[node]))
+
+    return results
+
+def print_memory(mem_data):
+    print("\nmemory:")
+    for node,count,rss in mem_data:
+        print(f"  node {node}: max {count} cached wallets | max resident memory {rss / 2**20:.1f} MB")
+
+def compute_persistence(file_list):
+    wallet_bytes = 0
+    compaction_bytes = 0
+    txs = set()
+    for fname in file_list:
+        with open(fname,"r") as f:
+            for line in f:
+                if line.startswith('#'): continue
+                tag,ts,node,txid,extra,extra2 = [int(x) for x in line.split()]
+
+                if tag == CBDC_TAG_UDL_WALLET_BYTES:
+                    wallet_bytes += extra
+                elif tag == CBDC_TAG_UDL_COMPACTION_BYTES:
+                    compaction_bytes += extra
+                elif tag == CBDC_TAG_UDL_TX_PERSIST_START:
+                    txs.add(txid)
+
+    return len(txs),wallet_bytes,compaction_bytes
+
+def print_persistence(per_data):
+    count,wallet_bytes,compaction_bytes = per_data
+    if count == 0:
+        return
+
+    print("\npersistence:")
+    print(f"  wallets/deltas: {wallet_bytes} bytes | {wallet_bytes / count:.1f} bytes/tx")
+    print(f"  compaction: {compaction_bytes} bytes | {compaction_bytes / count:.1f} bytes/tx")
+    print(f"  total: {(wallet_bytes + compaction_bytes) / count:.1f} bytes/tx")
+
 def main(argv):
     # command line arguments
     parser = argparse.ArgumentParser(
@@ -361,8 +522,16 @@ def main(argv):
     parser.add_argument('files',nargs='+',help="Cascade timestamp log files")
     parser.add_argument('-b','--batching',action='store_true',default=False,help="compute batching statistics")
     parser.add_argument('-l','--latency',action='store_true',default=False,help="compute latency breakdown")
+    parser.add_argument('-m','--memory',action='store_true',default=False,help="compute wallet cache size and memory of each server (with wallet_cache_capacity)")
+    parser.add_argument('-p','--persistence',action='store_true',default=False,help="compute wallet bytes persisted per TX (to compare with enable_delta_persistence)")
+    parser.add_argument('-r','--recovery',action='store_true',default=False,help="only compute the recovery time of each server")
     args = parser.parse_args()
 
+    if args.recovery:
+        rec = compute_recovery(args.files)
+        print_recovery(rec)
+        return
+
     data = load_logs(args.files)
     thr = compute_throughput(data)
     print_throughput(thr)
@@ -374,6 +543,14 @@ def main(argv):
     if args.latency:
         lat = compute_breakdown(data)
         print_breakdown(lat)
+    
+    if args.memory:
+        mem = compute_memory(args.files)
+        print_memory(mem)
+
+    if args.persistence:
+        per = compute_persistence(args.files)
+        print_persistence(per)
 
 if __name__ == "__main__":
     main(sys.argv)
@@ -62,6 +62,7 @@ ln -sf ../$DFG_TMP client/$DFG_CFG
 ln -sf ../../run_benchmark client/run_benchmark
 ln -sf ../../generate_workload client/generate_workload
 ln -sf ../../metrics.py client/metrics.py
+ln -sf ../../log_analyzer client/log_analyzer
 
 sed "s@^local_id = .*@local_id = $((NUM_SERVERS+100))@g" $CONFIG_TMP |
     sed "s@^gms_port = .*@gms_port = $gms_port@g" |
@@ -0,0 +1,116 @@
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "wallet_checkpoint.hpp"
+
+#define DEFAULT_WALLET_COUNTS "100000,1000000,10000000"
+#define DEFAULT_LOG_RECORDS 1000000
+#define DEFAULT_NUM_THREADS 4
+#define DEFAULT_CHECKPOINT_PATH "benchmark_checkpoint"
+
+void print_help(const std::string& bin_name){
+    std::cout << "usage: " << bin_name << " [options]" << std::endl;
+    std::cout << "options:" << std::endl;
+    std::cout << " -w <wallet_counts>\tcomma-separated list of number of wallets in the checkpoint (default: " << DEFAULT_WALLET_COUNTS << ")" << std::endl;
+    std::cout << " -l <log_records>\tnumber of wallet updates in the log after the checkpoint (default: " << DEFAULT_LOG_RECORDS << ")" << std::endl;
+    std::cout << " -t <num_threads>\tnumber of worker threads: each one checkpoints wallet_count/num_threads wallets (default: " << DEFAULT_NUM_THREADS << ")" << std::endl;
+    std::cout << " -p <path>\t\tcheckpoint files path (default: " << DEFAULT_CHECKPOINT_PATH << ")" << std::endl;
+    std::cout << " -h\t\t\tshow this help" << std::endl;
+}
+
+int main(int argc, char** argv){
+    char c;
+    std::string wallet_counts_str = DEFAULT_WALLET_COUNTS;
+    uint64_t log_records = DEFAULT_LOG_RECORDS;
+    uint64_t num_threads = DEFAULT_NUM_THREADS;
+    std::string path = DEFAULT_CHECKPOINT_PATH;
+
+    while ((c = getopt(argc, argv, "w:l:t:p:h")) != -1){
+        switch(c){
+            case 'w':
+                wallet_counts_str = optarg;
+                break;
+            case 'l':
+                log_records = strtoul(optarg,NULL,10);
+                break;
+            case 't':
+                num_threads = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case 'p':
+                path = optarg;
+                break;
+            case '?':
+            case 'h':
+            default:
+                print_help(argv[0]);
+                return 0;
+        }
+    }
+
+    std::vector<uint64_t> wallet_counts;
+    std::stringstream wallet_counts_stream(wallet_counts_str);
+    std::string count_str;
+    while(std::getline(wallet_counts_stream,count_str,',')){
+        wallet_counts.push_back(std::stoull(count_str));
+    }
+
+    // the threads checkpoint and recover in parallel: a single thread with wallet_count/num_threads wallets gives the time of each one
+    std::cout << "wallets,wallets_per_thread,log_records,file_bytes,write_ms,recover_ms,recover_with_log_ms" << std::endl;
+    std::mt19937 rng(3);
+    for(auto wallet_count : wallet_counts){
+        uint64_t per_thread = wallet_count / num_threads;
+        std::unordered_map<wallet_id_t,wallet_t> wallets;
+        wallets.reserve(per_thread);
+        for(uint64_t i=0;i<per_thread;i++){
+            wallets[i * num_threads] = CBDC_WALLET_FROM_BALANCE(100000);
+        }
+
+        WalletCheckpoint checkpoint(path);
+        checkpoint.clear();
+
+        // checkpoint write
+        auto start = std::chrono::steady_clock::now();
+        checkpoint.write(num_threads,0,0,wallets);
+        std::chrono::duration<double,std::milli> write_time = std::chrono::steady_clock::now() - start;
+
+        struct stat st;
+        stat((path + ".ckpt").c_str(),&st);
+
+        // recovery from the checkpoint only
+        uint64_t seq;
+        transaction_id_t last_txid;
+        std::unordered_map<wallet_id_t,wallet_t> recovered;
+        start = std::chrono::steady_clock::now();
+        checkpoint.recover(num_threads,seq,last_txid,recovered);
+        std::chrono::duration<double,std::milli> recover_time = std::chrono::steady_clock::now() - start;
+
+        // recovery from the checkpoint and the log
+        std::uniform_int_distribution<uint64_t> wallet_dist(0,per_thread > 0 ? per_thread-1 : 0);
+        for(uint64_t i=1;i<=log_records;i++){
+            checkpoint.log_wallet(i,wallet_dist(rng) * num_threads,CBDC_WALLET_FROM_BALANCE(i));
+        }
+        checkpoint.flush_log();
+
+        recovered.clear();
+        start = std::chrono::steady_clock::now();
+        checkpoint.recover(num_threads,seq,last_txid,recovered);
+        std::chrono::duration<double,std::milli> recover_log_time = std::chrono::steady_clock::now() - start;
+
+        if((recovered.size() != wallets.size()) || (seq != log_records)){
+            std::cout << "ERROR: recovered " << recovered.size() << " wallets up to update " << seq << std::endl;
+        }
+
+        std::cout << wallet_count << "," << per_thread << "," << log_records << "," << st.st_size << "," << write_time.count() << "," << recover_time.count() << "," << recover_log_time.count() << std::endl;
+        checkpoint.clear();
+    }
+
+    return 0;
+}
+
@@ -0,0 +1,134 @@
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <unistd.h>
+#include <stdlib.h>
+#include "coin_set.hpp"
+
+#define DEFAULT_COIN_COUNTS "1,2,4,8,16,32,64"
+#define DEFAULT_NUM_OPERATIONS 1000000
+#define DEFAULT_MAX_COIN_VALUE 1000
+#define DEFAULT_BUDGET_NS 500
+
+void print_help(const std::string& bin_name){
+    std::cout << "usage: " << bin_name << " [options]" << std::endl;
+    std::cout << "options:" << std::endl;
+    std::cout << " -c <coin_counts>\tcomma-separated list of number of coins in the wallet (default: " << DEFAULT_COIN_COUNTS << ", at most " << CBDC_COIN_SET_MAX_COINS << ")" << std::endl;
+    std::cout << " -o <num_operations>\tnumber of operations measured for each coin count (default: " << DEFAULT_NUM_OPERATIONS << ")" << std::endl;
+    std::cout << " -v <max_coin_value>\tcoins and amounts are drawn from [1,max_coin_value] (default: " << DEFAULT_MAX_COIN_VALUE << ")" << std::endl;
+    std::cout << " -b <budget_ns>\t\tmaximum extra time per wallet update compared to a plain balance (default: " << DEFAULT_BUDGET_NS << ")" << std::endl;
+    std::cout << " -h\t\t\tshow this help" << std::endl;
+}
+
+int main(int argc, char** argv){
+    char c;
+    std::string coin_counts_str = DEFAULT_COIN_COUNTS;
+    uint64_t num_operations = DEFAULT_NUM_OPERATIONS;
+    uint64_t max_coin_value = DEFAULT_MAX_COIN_VALUE;
+    double budget_ns = DEFAULT_BUDGET_NS;
+
+    while ((c = getopt(argc, argv, "c:o:v:b:h")) != -1){
+        switch(c){
+            case 'c':
+                coin_counts_str = optarg;
+                break;
+            case 'o':
+                num_operations = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case 'v':
+                max_coin_value = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case 'b':
+                budget_ns = strtod(optarg,NULL);
+                break;
+            case '?':
+            case 'h':
+            default:
+                print_help(argv[0]);
+                return 0;
+        }
+    }
+
+    std::vector<uint64_t> coin_counts;
+    std::stringstream coin_counts_stream(coin_counts_str);
+    std::string count_str;
+    while(std::getline(coin_counts_stream,count_str,',')){
+        coin_counts.push_back(std::min(std::stoull(count_str),(unsigned long long)CBDC_COIN_SET_MAX_COINS));
+    }
+
+    std::mt19937_64 rng(3);
+    std::uniform_int_distribution<uint64_t> value_dist(1,max_coin_value);
+    std::vector<uint64_t> amounts(num_operations);
+    for(auto& amount : amounts){
+        amount = value_dist(rng);
+    }
+
+    // baseline: the same updates on a plain balance
+    volatile uint64_t sink = 0;
+    uint64_t balance = max_coin_value * CBDC_COIN_SET_MAX_COINS;
+    auto start = std::chrono::steady_clock::now();
+    for(auto amount : amounts){
+        balance = (amount > balance) ? 0 : balance - amount;
+        balance += amount;
+        sink = sink + balance;
+    }
+    std::chrono::duration<double,std::nano> balance_time = std::chrono::steady_clock::now() - start;
+    double balance_ns = balance_time.count() / num_operations;
+
+    // select: inputs for an amount, without changing the wallet
+    // transfer: remove from one wallet (spending the inputs and keeping the change) and add a coin to another, as in a TX
+    // serialize: to_bytes and from_bytes of the wallet
+    std::cout << "coins,select_ns,transfer_ns,serialize_ns,bytes,balance_ns,overhead_ns,within_budget" << std::endl;
+    for(auto coin_count : coin_counts){
+        CoinSet wallet;
+        while(wallet.size() < coin_count){
+            wallet.add(value_dist(rng));
+        }
+
+        std::vector<std::size_t> inputs;
+        start = std::chrono::steady_clock::now();
+        for(auto amount : amounts){
+            wallet.select(amount,inputs);
+            sink = sink + inputs.size();
+        }
+        std::chrono::duration<double,std::nano> select_time = std::chrono::steady_clock::now() - start;
+
+        // coins move back and forth between two wallets with the same number of coins
+        CoinSet source = wallet;
+        CoinSet destination = wallet;
+        start = std::chrono::steady_clock::now();
+        for(auto amount : amounts){
+            if(source.balance() < amount){
+                std::swap(source,destination);
+            }
+            amount = std::min(amount,source.balance()); // with few small coins, neither wallet may cover the amount
+            source.remove(amount);
+            destination.add(amount);
+            sink = sink + source.balance();
+        }
+        std::chrono::duration<double,std::nano> transfer_time = std::chrono::steady_clock::now() - start;
+
+        std::vector<uint8_t> buffer(wallet.bytes_size());
+        uint64_t serialize_ops = std::max(num_operations / 10,(uint64_t)1);
+        start = std::chrono::steady_clock::now();
+        for(uint64_t i=0;i<serialize_ops;i++){
+            wallet.to_bytes(buffer.data());
+            sink = sink + CoinSet::from_bytes(buffer.data(),buffer.size()).balance();
+        }
+        std::chrono::duration<double,std::nano> serialize_time = std::chrono::steady_clock::now() - start;
+        if(CoinSet::from_bytes(buffer.data(),buffer.size()) != wallet){
+            std::cout << "ERROR: wallet with " << coin_count << " coins changed after serialization" << std::endl;
+        }
+
+        double transfer_ns = transfer_time.count() / num_operations;
+        double overhead_ns = transfer_ns - balance_ns;
+        std::cout << coin_count << "," << select_time.count() / num_operations << "," << transfer_ns << "," << serialize_time.count() / serialize_ops << "," << buffer.size() << "," << balance_ns << "," << overhead_ns << "," << (overhead_ns <= budget_ns ? "yes" : "no") << std::endl;
+    }
+
+    return 0;
+}
+
@@ -0,0 +1,332 @@
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <fstream>
+#include <unistd.h>
+#include <stdlib.h>
+#include "local_cluster.hpp"
+#include "benchmark_workload.hpp"
+
+#define DEFAULT_NUM_SHARDS 4
+#define DEFAULT_NUM_WALLETS 10000
+#define DEFAULT_TRANSFERS_PER_WALLET 10
+#define DEFAULT_MAX_IN_FLIGHT 10000
+#define DEFAULT_BULK_MINT_SIZE 1000
+#define DEFAULT_DFGS_FILE "cfg/dfgs.json"
+#define TXID_COUNTER_MASK ((1ULL << 48) - 1)
+
+void print_help(const std::string& bin_name){
+    std::cout << "usage: " << bin_name << " [options]" << std::endl;
+    std::cout << "options:" << std::endl;
+    std::cout << " -w <workload_file>\tworkload to run, in any format (default: generated in memory)" << std::endl;
+    std::cout << " -a <num_wallets>\tnumber of wallets of the generated workload (default: " << DEFAULT_NUM_WALLETS << ")" << std::endl;
+    std::cout << " -p <transfers>\t\ttransfers per wallet of the generated workload (default: " << DEFAULT_TRANSFERS_PER_WALLET << ")" << std::endl;
+    std::cout << " -k <hot_percent>\tpercentage of the generated transfers paying or paid by a single hot wallet (default: 0)" << std::endl;
+    std::cout << " -s <num_shards>\tnumber of shards (default: " << DEFAULT_NUM_SHARDS << ")" << std::endl;
+    std::cout << " -r <replicas>\t\tnodes of each shard (default: 1)" << std::endl;
+    std::cout << " -t <num_threads>\tworker threads of each node (default: from the UDL config)" << std::endl;
+    std::cout << " -g <dfgs_file>\t\tfile with the UDL config (default: " << DEFAULT_DFGS_FILE << ")" << std::endl;
+    std::cout << " -o <name=value,...>\tUDL config options replacing the ones in the file" << std::endl;
+    std::cout << " -f <max_in_flight>\tmaximum number of transfers sent and not completed (default: " << DEFAULT_MAX_IN_FLIGHT << ")" << std::endl;
+    std::cout << " -d <link_delay_us>\tdelay of the requests between nodes, in microseconds (default: 0)" << std::endl;
+    std::cout << " -M <bulk_mint_size>\twallets in each bulk mint of the initial balances (default: " << DEFAULT_BULK_MINT_SIZE << ")" << std::endl;
+    std::cout << " -h\t\t\tshow this help" << std::endl;
+}
+
+// UDL config of the CBDC DFG, as deployed
+nlohmann::json load_udl_config(const std::string& dfgs_file){
+    std::ifstream dfgs_stream(dfgs_file);
+    if(!dfgs_stream.is_open()){
+        std::cout << "WARNING: could not open " << dfgs_file << ": using the default UDL config" << std::endl;
+        return nlohmann::json::object();
+    }
+
+    nlohmann::json dfgs = nlohmann::json::parse(dfgs_stream,nullptr,false);
+    for(auto& dfg : dfgs){
+        for(auto& vertex : dfg["graph"]){
+            for(uint64_t i=0;i<vertex["user_defined_logic_list"].size();i++){
+                if(vertex["user_defined_logic_list"][i] == UDL_UUID){
+                    return vertex["user_defined_logic_config_list"][i];
+                }
+            }
+        }
+    }
+
+    std::cout << "WARNING: no CBDC UDL in " << dfgs_file << ": using the default UDL config" << std::endl;
+    return nlohmann::json::object();
+}
+
+/*
+ * Request and key of an operation, built as the client does: wallets are ordered by route (shard and thread) in
+ * descending order, with the destinations at the end when only sources conflict, and the request goes to the
+ * shard of the first wallet. Returns the shard.
+ */
+uint32_t build_request(LocalCluster& cluster,transaction_id_t txid,const benchmark_transfer_t& transfer,ObjectWithStringKey& obj){
+    auto& config = cluster.get_config();
+    std::vector<std::pair<uint64_t,wallet_id_t>> routes;
+    auto route = [&](wallet_id_t wallet_id){
+        return (uint64_t)cluster.key_to_shard(CBDC_BUILD_WALLET_KEY(wallet_id)) * config.num_threads + CBDC_WALLET_TO_THREAD(config,wallet_id,txid);
+    };
+
+    for(auto& item : transfer.senders){
+        routes.emplace_back(route(item.first),item.first);
+    }
+    if(!config.enable_source_only_conflicts){
+        for(auto& item : transfer.receivers){
+            routes.emplace_back(route(item.first),item.first);
+        }
+    }
+    std::sort(routes.begin(),routes.end(),std::greater<std::pair<uint64_t,wallet_id_t>>());
+
+    std::vector<wallet_id_t> sorted_wallets;
+    for(auto& item : routes){
+        sorted_wallets.push_back(item.second);
+    }
+    if(config.enable_source_only_conflicts){
+        for(auto& item : transfer.receivers){
+            sorted_wallets.push_back(item.first);
+        }
+    }
+
+    wallet_id_t first_wallet = sorted_wallets[0];
+    if(transfer.senders.empty()){
+        obj.key = CBDC_BUILD_MINT_KEY(first_wallet);
+    } else if(transfer.receivers.empty()){
+        obj.key = CBDC_BUILD_REDEEM_KEY(first_wallet);
+    } else {
+        obj.key = CBDC_BUILD_TRANSFER_KEY(first_wallet);
+    }
+
+    cbdc_request_t request(txid,transfer.senders,transfer.receivers,sorted_wallets);
+    obj.message_id = txid;
+    obj.blob = Blob([&request](uint8_t* buffer,const std::size_t size){
+            return mutils::to_bytes(request, buffer);
+        },mutils::bytes_size(request));
+
+    return routes.empty() ? cluster.key_to_shard(CBDC_BUILD_WALLET_KEY(first_wallet)) : routes[0].first / config.num_threads;
+}
+
+/*
+ * Runs the CBDC UDL of all shards in this process (see LocalCluster), so the protocol is measured without the
+ * network: the initial balances are bulk minted, then the transfers of the workload are sent as fast as the
+ * window of transfers in flight allows, and each one completes when its notification arrives.
+ */
+int main(int argc, char** argv){
+    char c;
+    std::string workload_file;
+    uint64_t num_wallets = DEFAULT_NUM_WALLETS;
+    uint64_t transfers_per_wallet = DEFAULT_TRANSFERS_PER_WALLET;
+    uint64_t hot_wallet_percent = 0;
+    uint64_t num_shards = DEFAULT_NUM_SHARDS;
+    uint64_t replicas = 1;
+    uint64_t num_threads = 0;
+    std::string dfgs_file = DEFAULT_DFGS_FILE;
+    std::string options_str;
+    uint64_t max_in_flight = DEFAULT_MAX_IN_FLIGHT;
+    uint64_t bulk_mint_size = DEFAULT_BULK_MINT_SIZE;
+    uint64_t link_delay_us = 0;
+
+    while ((c = getopt(argc, argv, "w:a:p:k:s:r:t:g:o:f:d:M:h")) != -1){
+        switch(c){
+            case 'w':
+                workload_file = optarg;
+                break;
+            case 'a':
+                num_wallets = std::max(strtoul(optarg,NULL,10),2UL);
+                break;
+            case 'p':
+                transfers_per_wallet = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case 'k':
+                hot_wallet_percent = std::min(strtoul(optarg,NULL,10),100UL);
+                break;
+            case 's':
+                num_shards = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case 'r':
+                replicas = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case 't':
+                num_threads = strtoul(optarg,NULL,10);
+                break;
+            case 'g':
+                dfgs_file = optarg;
+                break;
+            case 'o':
+                options_str = optarg;
+                break;
+            case 'f':
+                max_in_flight = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case 'd':
+                link_delay_us = strtoul(optarg,NULL,10);
+                break;
+            case 'M':
+                bulk_mint_size = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case '?':
+            case 'h':
+            default:
+                print_help(argv[0]);
+                return 0;
+        }
+    }
+
+    // workload
+    CBDCBenchmarkWorkload* generated = nullptr;
+    if(workload_file.empty()){
+        generated = new CBDCBenchmarkWorkload(num_wallets,0,transfers_per_wallet,1,1,100000,10,3,hot_wallet_percent);
+        generated->generate();
+    }
+    CBDCBenchmarkWorkload& benchmark = workload_file.empty() ? *generated : CBDCBenchmarkWorkload::load(workload_file);
+    uint64_t transfer_count = benchmark.get_transfer_count();
+    auto& wallets = benchmark.get_wallets();
+
+    // UDL config: the deployed one, with the changes given, without the features that read from the object pool
+    nlohmann::json udl_config = load_udl_config(dfgs_file);
+    std::stringstream options_stream(options_str);
+    std::string option;
+    while(std::getline(options_stream,option,',')){
+        auto pos = option.find("=");
+        if(pos == std::string::npos){
+            std::cout << "ERROR: invalid UDL option '" << option << "' (expected name=value)" << std::endl;
+            return 1;
+        }
+        udl_config[option.substr(0,pos)] = option.substr(pos+1);
+    }
+    if(num_threads > 0){
+        udl_config["num_threads"] = std::to_string(num_threads);
+    }
+    udl_config["enable_notifications"] = "1";
+    udl_config["enable_recovery"] = "0";
+    udl_config["enable_delta_persistence"] = "0";
+    udl_config["wallet_cache_capacity"] = "0";
+
+    // completions: TX counters index the send times and statuses
+    std::vector<std::chrono::steady_clock::time_point> send_time;
+    std::vector<uint64_t> latency_us;
+    std::vector<transaction_status_t> status;
+    std::mutex completion_mtx;
+    std::condition_variable completion_signal;
+    uint64_t completed = 0;
+    auto handle_notification = [&](const Blob& blob){
+        auto now = std::chrono::steady_clock::now();
+        auto batch = mutils::from_bytes<tx_completion_batch_t>(nullptr,blob.bytes);
+        std::unique_lock<std::mutex> lock(completion_mtx);
+        for(auto& completion : *batch){
+            uint64_t index = completion.first & TXID_COUNTER_MASK;
+            latency_us[index] = std::chrono::duration_cast<std::chrono::microseconds>(now - send_time[index]).count();
+            status[index] = completion.second;
+        }
+        completed += batch->size();
+        completion_signal.notify_all();
+    };
+
+    LocalCluster cluster(num_shards,udl_config,handle_notification,nullptr,replicas);
+    cluster.set_link_delay(link_delay_us);
+    auto& config = cluster.get_config();
+    transaction_id_t next_txid = static_cast<transaction_id_t>(cluster.client_id()) << 48;
+
+    // bulk mints of the initial balances, grouped by shard
+    std::vector<std::vector<std::pair<wallet_id_t,coin_value_t>>> shard_wallets(num_shards);
+    for(auto& item : wallets){
+        shard_wallets[cluster.key_to_shard(CBDC_BUILD_WALLET_KEY(item.first))].push_back(item);
+    }
+
+    uint64_t mint_count = 0;
+    for(auto& shard_list : shard_wallets){
+        mint_count += (shard_list.size() + bulk_mint_size - 1) / bulk_mint_size;
+    }
+    send_time.resize(mint_count + transfer_count);
+    latency_us.resize(mint_count + transfer_count);
+    status.resize(mint_count + transfer_count,transaction_status_t::UNKNOWN);
+
+    auto mint_start = std::chrono::steady_clock::now();
+    for(uint32_t shard=0;shard<num_shards;shard++){
+        auto& shard_list = shard_wallets[shard];
+        for(uint64_t start=0;start<shard_list.size();start+=bulk_mint_size){
+            uint64_t end = std::min(start+bulk_mint_size,(uint64_t)shard_list.size());
+            transaction_id_t txid = next_txid++;
+            cbdc_request_t request(txid,{},std::unordered_map<wallet_id_t,coin_value_t>(shard_list.begin()+start,shard_list.begin()+end),{shard_list[start].first});
+            ObjectWithStringKey obj;
+            obj.key = CBDC_BUILD_BULK_MINT_KEY(shard_list[start].first);
+            obj.message_id = txid;
+            obj.blob = Blob([&request](uint8_t* buffer,const std::size_t size){
+                    return mutils::to_bytes(request, buffer);
+                },mutils::bytes_size(request));
+            send_time[txid & TXID_COUNTER_MASK] = std::chrono::steady_clock::now();
+            cluster.put(obj,shard);
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lock(completion_mtx);
+        completion_signal.wait(lock,[&](){ return completed == mint_count; });
+    }
+    std::chrono::duration<double> mint_time = std::chrono::steady_clock::now() - mint_start;
+
+    std::cout << "engine benchmark:" << std::endl;
+    std::cout << "  workload = " << (workload_file.empty() ? "generated" : workload_file) << std::endl;
+    std::cout << "  wallets = " << wallets.size() << std::endl;
+    std::cout << "  transfers = " << transfer_count << std::endl;
+    std::cout << "  shards = " << num_shards << std::endl;
+    std::cout << "  replicas = " << replicas << std::endl;
+    std::cout << "  threads_per_node = " << config.num_threads << std::endl;
+    std::cout << "  max_in_flight = " << max_in_flight << std::endl;
+    std::cout << "  link_delay_us = " << link_delay_us << std::endl;
+    std::cout << "  mint_time = " << mint_time.count() << " seconds (" << mint_count << " bulk mints)" << std::endl;
+
+    // transfers, limited by the window of transfers in flight
+    benchmark_transfer_t buffer;
+    auto start = std::chrono::steady_clock::now();
+    for(uint64_t i=0;i<transfer_count;i++){
+        auto& transfer = benchmark.get_transfer(i,buffer);
+        transaction_id_t txid = next_txid++;
+        ObjectWithStringKey obj;
+        uint32_t shard = build_request(cluster,txid,transfer,obj);
+
+        {
+            std::unique_lock<std::mutex> lock(completion_mtx);
+            completion_signal.wait(lock,[&](){ return (mint_count + i) - completed < max_in_flight; });
+        }
+
+        send_time[txid & TXID_COUNTER_MASK] = std::chrono::steady_clock::now();
+        cluster.put(obj,shard);
+    }
+    {
+        std::unique_lock<std::mutex> lock(completion_mtx);
+        completion_signal.wait(lock,[&](){ return completed == mint_count + transfer_count; });
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // results: statuses are compared to the ones expected when the transfers run in the workload order
+    uint64_t commits = 0,aborts = 0,rejected = 0,mismatches = 0;
+    std::vector<uint64_t> latencies(latency_us.begin() + mint_count,latency_us.end());
+    for(uint64_t i=0;i<transfer_count;i++){
+        auto tx_status = status[mint_count + i];
+        commits += (tx_status == transaction_status_t::COMMIT);
+        aborts += (tx_status == transaction_status_t::ABORT);
+        rejected += (tx_status == transaction_status_t::REJECTED);
+        if((tx_status != transaction_status_t::REJECTED) && ((tx_status == transaction_status_t::COMMIT) != benchmark.get_expected_status(i))){
+            mismatches++;
+        }
+    }
+    std::sort(latencies.begin(),latencies.end());
+    auto percentile = [&](double p){ return latencies.empty() ? 0 : latencies[std::min((uint64_t)(p * latencies.size()),(uint64_t)latencies.size()-1)]; };
+    auto stored = cluster.stored();
+
+    std::cout << "shards,threads,transfers,seconds,transfers_per_second,p50_latency_us,p99_latency_us,max_latency_us,commits,aborts,rejected,status_mismatches,stored_objects,stored_bytes" << std::endl;
+    std::cout << num_shards << "," << config.num_threads << "," << transfer_count << "," << elapsed.count() << "," << transfer_count / elapsed.count() << "," << percentile(0.5) << "," << percentile(0.99) << "," << (latencies.empty() ? 0 : latencies.back()) << "," << commits << "," << aborts << "," << rejected << "," << mismatches << "," << stored.first << "," << stored.second << std::endl;
+
+    if(mismatches > 0){
+        std::cout << "WARNING: " << mismatches << " transfers finished with a status different from the one expected by the workload" << std::endl;
+    }
+
+    delete generated;
+    return 0;
+}
@@ -0,0 +1,496 @@
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <unistd.h>
+#include <stdlib.h>
+#include "cbdc_udl.hpp"
+#include "mpsc_queue.hpp"
+
+using namespace derecho::cascade;
+
+#define DEFAULT_NUM_OPERATIONS 1000000
+#define CONFLICT_BATCH_SIZE 256 // new TXs enqueued between two resets of the conflict tracking
+#define BATCH_OPERATIONS_DIVISOR 10 // the batch assembly cases run a tenth of the operations
+#define QUEUE_CAPACITY 65536
+#define PERSISTENCE_SHARDS 4
+#define TRACE_EVENTS_PER_TX 14 // events logged for a wallet of a transfer, from the handler to the TX persistence
+
+void print_help(const std::string& bin_name){
+    std::cout << "usage: " << bin_name << " [options]" << std::endl;
+    std::cout << "options:" << std::endl;
+    std::cout << " -o <num_operations>\toperations measured for each case and parameter (default: " << DEFAULT_NUM_OPERATIONS << ")" << std::endl;
+    std::cout << " -c <cases>\t\tcomma-separated list of cases to run (default: all)" << std::endl;
+    std::cout << " -j\t\t\twrite the results as JSON instead of CSV" << std::endl;
+    std::cout << " -l\t\t\tlist the cases and their parameters" << std::endl;
+    std::cout << " -h\t\t\tshow this help" << std::endl;
+}
+
+// puts are only counted: the cases measure how objects are built and batched, not how they are sent
+class CountingServiceClient: public CBDCServiceClient {
+public:
+    std::atomic<uint64_t> objects{0};
+
+    node_id_t get_my_id() override { return 0; }
+    uint32_t get_my_shard() override { return 0; }
+    uint32_t get_number_of_shards() override { return 1; }
+    std::vector<node_id_t> get_shard_members(uint32_t shard_index) override { return {0}; }
+    uint32_t key_to_shard(const std::string& key) override { return 0; }
+    void put_and_forget(const ObjectWithStringKey& obj,bool as_trigger = false) override { objects.fetch_add(1,std::memory_order_relaxed); }
+    void put_and_forget_to_shard(const ObjectWithStringKey& obj,uint32_t shard_index,bool as_trigger = false) override { objects.fetch_add(1,std::memory_order_relaxed); }
+    void put_objects_and_forget(const std::vector<ObjectWithStringKey>& objects) override { this->objects.fetch_add(objects.size(),std::memory_order_relaxed); }
+    void put_objects_and_forget_to_shard(const std::vector<ObjectWithStringKey>& objects,uint32_t shard_index,bool as_trigger = false) override { this->objects.fetch_add(objects.size(),std::memory_order_relaxed); }
+    void remove_and_forget(const std::string& key,uint32_t shard_index) override {}
+    void notify(const Blob& blob,node_id_t client) override {}
+};
+
+using probe_result_t = std::pair<uint64_t,double>; // operations, seconds
+
+/*
+ * Runs the protocol primitives of a single worker thread (and the persistence threads) of a CascadeCBDC that is
+ * never started, using the counting service client. Conflicts are tracked without the virtual balance
+ * optimization, and with source-only conflicts.
+ */
+class CBDCEngineProbe {
+    CascadeCBDC udl;
+    std::shared_ptr<CountingServiceClient> service;
+    volatile uint64_t sink = 0;
+
+    static cbdc_request_t* new_request(transaction_id_t txid,uint64_t wallets,wallet_id_t first_wallet){
+        std::unordered_map<wallet_id_t,coin_value_t> sources,destinations;
+        std::vector<wallet_id_t> sorted_wallets;
+        for(uint64_t i=0;i<wallets;i++){
+            sources[first_wallet + i] = 10;
+            sorted_wallets.push_back(first_wallet + i);
+        }
+        for(uint64_t i=0;i<wallets;i++){
+            destinations[first_wallet + wallets + i] = 10;
+            sorted_wallets.push_back(first_wallet + wallets + i);
+        }
+        return new cbdc_request_t(txid,sources,destinations,sorted_wallets);
+    }
+
+    static internal_transaction_t* new_transaction(cbdc_request_t* request){
+        auto tx = new internal_transaction_t;
+        tx->request = request;
+        tx->status = transaction_status_t::PENDING;
+        tx->pending_parts = 0;
+        return tx;
+    }
+
+    static void delete_transactions(std::vector<internal_transaction_t*>& txs){
+        for(auto tx : txs){
+            delete tx->request;
+            delete tx;
+        }
+        txs.clear();
+    }
+
+    // the events logged for a wallet of a transfer, in the order of a forwarded TX
+    template <typename F>
+    static void log_transaction(const F& log,transaction_id_t txid,wallet_id_t wallet_id){
+        log(CBDC_TAG_UDL_HANDLER_START,txid,wallet_id);
+        log(CBDC_TAG_UDL_HANDLER_QUEUING,txid,wallet_id);
+        log(CBDC_TAG_UDL_HANDLER_END,txid,wallet_id);
+        log(CBDC_TAG_UDL_OPERATION_START,txid,wallet_id);
+        log(CBDC_TAG_UDL_NEW_START,txid,wallet_id);
+        log(CBDC_TAG_UDL_ENQUEUE_END,txid,wallet_id);
+        log(CBDC_TAG_UDL_RUN_START,txid,wallet_id);
+        log(CBDC_TAG_UDL_FORWARD_START,txid,wallet_id);
+        log(CBDC_TAG_UDL_FORWARD_END,txid,wallet_id);
+        log(CBDC_TAG_UDL_OPERATION_END,txid,wallet_id);
+        log(CBDC_TAG_UDL_WALLET_PERSIST_START,txid,wallet_id);
+        log(CBDC_TAG_UDL_WALLET_PERSIST_END,txid,wallet_id);
+        log(CBDC_TAG_UDL_TX_PERSIST_START,txid,0);
+        log(CBDC_TAG_UDL_TX_PERSIST_END,txid,0);
+    }
+
+    // TXs logged by the given number of threads at the same time (the time ends when all threads finish)
+    template <typename F>
+    static probe_result_t log_transactions(const F& log,uint64_t threads,uint64_t operations){
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> logging_threads;
+        for(uint64_t t=0;t<threads;t++){
+            logging_threads.emplace_back([&,t](){
+                for(uint64_t i=t;i<operations;i+=threads){
+                    log_transaction(log,i,i * 2654435761ULL);
+                }
+            });
+        }
+        for(auto& thread : logging_threads){
+            thread.join();
+        }
+        return probe_result_t(operations,elapsed(start));
+    }
+
+    static double elapsed(std::chrono::steady_clock::time_point start){
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // the persistence thread starts with all items queued, and the time ends when the last object is put
+    template <typename T>
+    probe_result_t run_persistence_thread(T& thread,uint64_t operations){
+        service->objects = 0;
+        auto start = std::chrono::steady_clock::now();
+        thread.start();
+        while(service->objects.load() < operations){
+            std::this_thread::yield();
+        }
+        double seconds = elapsed(start);
+        thread.signal_stop();
+        thread.join();
+        return probe_result_t(operations,seconds);
+    }
+
+public:
+    CBDCEngineProbe(){
+        service = std::make_shared<CountingServiceClient>();
+        udl.service = service;
+        udl.config.num_threads = 1;
+        udl.config.enable_virtual_balance = false;
+        udl.config.enable_source_only_conflicts = true;
+    }
+
+    // cbdc_request_t with the given number of sources and as many destinations
+    probe_result_t request_to_bytes(uint64_t wallets,uint64_t operations){
+        std::unique_ptr<cbdc_request_t> request(new_request(1,wallets,0));
+        std::vector<uint8_t> buffer(mutils::bytes_size(*request));
+        auto start = std::chrono::steady_clock::now();
+        for(uint64_t i=0;i<operations;i++){
+            sink = sink + mutils::bytes_size(*request);
+            mutils::to_bytes(*request,buffer.data());
+        }
+        return probe_result_t(operations,elapsed(start));
+    }
+
+    probe_result_t request_from_bytes(uint64_t wallets,uint64_t operations){
+        std::unique_ptr<cbdc_request_t> request(new_request(1,wallets,0));
+        std::vector<uint8_t> buffer(mutils::bytes_size(*request));
+        mutils::to_bytes(*request,buffer.data());
+        auto start = std::chrono::steady_clock::now();
+        for(uint64_t i=0;i<operations;i++){
+            auto copy = mutils::from_bytes<cbdc_request_t>(nullptr,buffer.data());
+            sink = sink + std::get<3>(*copy).size();
+        }
+        return probe_result_t(operations,elapsed(start));
+    }
+
+    probe_result_t build_key(const std::function<std::string(uint64_t)>& build,uint64_t operations){
+        auto start = std::chrono::steady_clock::now();
+        for(uint64_t i=0;i<operations;i++){
+            sink = sink + build(i * 2654435761ULL).size();
+        }
+        return probe_result_t(operations,elapsed(start));
+    }
+
+    /*
+     * enqueue_transaction + has_conflict of new single-source TXs spread over hot_wallets wallets. Each wallet starts
+     * with one tracked pending TX, so every new TX conflicts with all previous TXs of its wallet in the batch.
+     */
+    probe_result_t enqueue_conflict(uint64_t hot_wallets,uint64_t operations){
+        CascadeCBDC::CBDCThread thread(0,&udl);
+        std::vector<internal_transaction_t*> seeds,txs;
+        for(uint64_t i=0;i<hot_wallets;i++){
+            seeds.push_back(new_transaction(new_request(i,1,i)));
+        }
+        for(uint64_t i=0;i<CONFLICT_BATCH_SIZE;i++){
+            txs.push_back(new_transaction(new_request(hot_wallets + i,1,i % hot_wallets)));
+        }
+
+        uint64_t count = 0;
+        double seconds = 0;
+        while(count < operations){
+            thread.reset();
+            for(uint64_t i=0;i<hot_wallets;i++){
+                thread.pending_transactions_wallet_dependencies[i].insert(seeds[i]);
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            for(uint64_t i=0;i<CONFLICT_BATCH_SIZE;i++){
+                thread.enqueue_transaction(txs[i],i % hot_wallets);
+                sink = sink + thread.has_conflict(txs[i],i % hot_wallets);
+            }
+            seconds += elapsed(start);
+            count += CONFLICT_BATCH_SIZE;
+        }
+
+        thread.reset();
+        delete_transactions(seeds);
+        delete_transactions(txs);
+        return probe_result_t(count,seconds);
+    }
+
+    /*
+     * tx_committed_recursive of a TX with length TXs queued behind it on the same wallet: the commit releases all of
+     * them in cascade (each one commits, including the puts of the wallet and the TX, and releases the next).
+     */
+    probe_result_t release_cascade(uint64_t length,uint64_t operations){
+        CascadeCBDC::CBDCThread thread(0,&udl);
+        wallet_id_t wallet_id = 1;
+        std::vector<internal_transaction_t*> txs;
+        for(uint64_t i=0;i<=length;i++){
+            txs.push_back(new_transaction(new cbdc_request_t(i,{{wallet_id,1}},{},{wallet_id})));
+        }
+
+        uint64_t count = 0;
+        double seconds = 0;
+        while(count < operations){
+            thread.reset();
+            thread.wallet_cache[wallet_id] = CBDC_WALLET_FROM_BALANCE(1ULL << 40);
+            thread.committed_balance[wallet_id] = 1ULL << 40;
+            thread.virtual_balance[wallet_id] = 1ULL << 40;
+
+            thread.enqueue_transaction(txs[0],wallet_id);
+            thread.pending_transactions_wallet_dependencies[wallet_id].insert(txs[0]);
+            for(uint64_t i=1;i<=length;i++){
+                thread.enqueue_transaction(txs[i],wallet_id);
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            thread.tx_committed_recursive(txs[0],wallet_id);
+            seconds += elapsed(start);
+            count += length + 1;
+        }
+
+        thread.reset();
+        delete_transactions(txs);
+        return probe_result_t(count,seconds);
+    }
+
+    // push_operation from producer threads, and pops as the worker thread does (one at a time, under the lock)
+    probe_result_t thread_queue(uint64_t producers,uint64_t operations){
+        CascadeCBDC::CBDCThread thread(0,&udl);
+        queued_operation_t queued_op(operation_type_t::TRANSFER,0,nullptr);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> producer_threads;
+        for(uint64_t p=0;p<producers;p++){
+            producer_threads.emplace_back([&,p](){
+                for(uint64_t i=p;i<operations;i+=producers){
+                    thread.push_operation(&queued_op);
+                }
+            });
+        }
+
+        uint64_t popped = 0;
+        while(popped < operations){
+            std::unique_lock<std::mutex> lock(thread.thread_mtx);
+            if(thread.operation_queue.empty()){
+                lock.unlock();
+                std::this_thread::yield();
+                continue;
+            }
+            sink = sink + (uint64_t)thread.operation_queue.front();
+            thread.operation_queue.pop();
+            popped++;
+        }
+        double seconds = elapsed(start);
+
+        for(auto& t : producer_threads){
+            t.join();
+        }
+        return probe_result_t(operations,seconds);
+    }
+
+    // the client queue of a shard: try_push from producer threads, try_pop by the sender thread
+    probe_result_t mpsc_queue(uint64_t producers,uint64_t operations){
+        MPSCQueue<cbdc_request_t*> queue(QUEUE_CAPACITY);
+        cbdc_request_t request;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> producer_threads;
+        for(uint64_t p=0;p<producers;p++){
+            producer_threads.emplace_back([&,p](){
+                for(uint64_t i=p;i<operations;i+=producers){
+                    while(!queue.try_push(&request)){
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+
+        uint64_t popped = 0;
+        cbdc_request_t* value;
+        while(popped < operations){
+            if(queue.try_pop(value)){
+                sink = sink + (uint64_t)value;
+                popped++;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        double seconds = elapsed(start);
+
+        for(auto& t : producer_threads){
+            t.join();
+        }
+        return probe_result_t(operations,seconds);
+    }
+
+    // TRACE_EVENTS_PER_TX events per TX, in the per-thread ring buffers of CBDCTrace (events are dropped as the rings wrap:
+    // only the logging cost is measured, not the writes of the spill thread)
+    probe_result_t trace(uint64_t threads,uint64_t operations){
+        CBDCTrace::set_spill(false);
+        auto result = log_transactions([](uint64_t tag,transaction_id_t txid,uint64_t extra){ CBDCTrace::log(tag,0,txid,extra); },threads,operations);
+        CBDCTrace::clear(); // frees the buffers of the threads
+        return result;
+    }
+
+    // the same events with TimestampLogger, shared by all threads
+    probe_result_t timestamp_logger(uint64_t threads,uint64_t operations){
+        auto result = log_transactions([](uint64_t tag,transaction_id_t txid,uint64_t extra){ TimestampLogger::log(tag,0,txid,extra); },threads,operations);
+        TimestampLogger::clear();
+        return result;
+    }
+
+    // wallet objects built and put in batches of up to batch_max_size
+    probe_result_t wallet_batch(uint64_t batch_max_size,uint64_t operations){
+        udl.config.wallet_persistence_batch_min_size = 0;
+        udl.config.wallet_persistence_batch_max_size = batch_max_size;
+        CascadeCBDC::WalletPersistenceThread thread(&udl);
+        for(uint64_t i=0;i<operations;i++){
+            queued_wallet_t queued_wallet(i,CBDC_WALLET_FROM_BALANCE(100000),i,10);
+            thread.push_wallet(queued_wallet);
+        }
+        return run_persistence_thread(thread,operations);
+    }
+
+    // forwarded TXs (serialized requests) built and put in batches of up to batch_max_size, for each next shard
+    probe_result_t chain_batch(uint64_t batch_max_size,uint64_t operations){
+        udl.config.chaining_batch_min_size = 0;
+        udl.config.chaining_batch_max_size = batch_max_size;
+        CascadeCBDC::ChainingThread thread(&udl);
+        std::unique_ptr<cbdc_request_t> request(new_request(1,1,0));
+        for(uint64_t i=0;i<operations;i++){
+            queued_chain_t queued_chain(operation_type_t::FORWARD,i,request.get());
+            thread.push_chain(queued_chain,i % PERSISTENCE_SHARDS);
+        }
+        return run_persistence_thread(thread,operations);
+    }
+
+    // finished TXs built and put in batches of up to batch_max_size, for each shard
+    probe_result_t tx_batch(uint64_t batch_max_size,uint64_t operations){
+        udl.config.tx_persistence_batch_min_size = 0;
+        udl.config.tx_persistence_batch_max_size = batch_max_size;
+        CascadeCBDC::TXPersistenceThread thread(&udl);
+        std::vector<internal_transaction_t*> txs;
+        for(uint64_t i=0;i<operations;i++){
+            txs.push_back(new_transaction(new_request(i,1,i)));
+            txs.back()->status = transaction_status_t::COMMIT;
+            thread.push_tx(txs.back(),i % PERSISTENCE_SHARDS);
+        }
+        auto result = run_persistence_thread(thread,operations);
+        delete_transactions(txs);
+        return result;
+    }
+};
+
+using probe_case_t = struct probe_case_t {
+    std::string name;
+    std::vector<std::string> parameters;
+    std::function<probe_result_t(CBDCEngineProbe&,const std::string&,uint64_t)> run;
+};
+
+int main(int argc, char** argv){
+    char c;
+    uint64_t num_operations = DEFAULT_NUM_OPERATIONS;
+    std::string cases_str;
+    bool json = false;
+    bool list = false;
+
+    while ((c = getopt(argc, argv, "o:c:jlh")) != -1){
+        switch(c){
+            case 'o':
+                num_operations = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case 'c':
+                cases_str = optarg;
+                break;
+            case 'j':
+                json = true;
+                break;
+            case 'l':
+                list = true;
+                break;
+            case '?':
+            case 'h':
+            default:
+                print_help(argv[0]);
+                return 0;
+        }
+    }
+
+    std::unordered_map<std::string,std::function<std::string(uint64_t)>> keys = {
+        {"transfer",[](uint64_t id){ return CBDC_BUILD_TRANSFER_KEY(id); }},
+        {"forward",[](uint64_t id){ return CBDC_BUILD_FORWARD_KEY(id); }},
+        {"commit",[](uint64_t id){ return CBDC_BUILD_COMMIT_KEY(id); }},
+        {"wallet",[](uint64_t id){ return CBDC_BUILD_WALLET_KEY(id); }},
+        {"transaction",[](uint64_t id){ return CBDC_BUILD_TRANSACTION_KEY(id); }},
+        {"delta",[](uint64_t id){ return CBDC_BUILD_DELTA_KEY(id % 64,id); }}
+    };
+    auto number = [](const std::string& parameter){ return std::stoull(parameter); };
+    uint64_t batch_operations = std::max(num_operations / BATCH_OPERATIONS_DIVISOR,(uint64_t)1);
+
+    std::vector<probe_case_t> cases = {
+        {"request_to_bytes",{"1","2","4","8"},[&](CBDCEngineProbe& probe,const std::string& p,uint64_t n){ return probe.request_to_bytes(number(p),n); }},
+        {"request_from_bytes",{"1","2","4","8"},[&](CBDCEngineProbe& probe,const std::string& p,uint64_t n){ return probe.request_from_bytes(number(p),n); }},
+        {"build_key",{"transfer","forward","commit","wallet","transaction","delta"},[&](CBDCEngineProbe& probe,const std::string& p,uint64_t n){ return probe.build_key(keys.at(p),n); }},
+        {"enqueue_conflict",{"256","16","4","1"},[&](CBDCEngineProbe& probe,const std::string& p,uint64_t n){ return probe.enqueue_conflict(number(p),n); }},
+        {"release_cascade",{"1","16","256"},[&](CBDCEngineProbe& probe,const std::string& p,uint64_t n){ return probe.release_cascade(number(p),n); }},
+        {"thread_queue",{"1","2","4"},[&](CBDCEngineProbe& probe,const std::string& p,uint64_t n){ return probe.thread_queue(number(p),n); }},
+        {"mpsc_queue",{"1","2","4"},[&](CBDCEngineProbe& probe,const std::string& p,uint64_t n){ return probe.mpsc_queue(number(p),n); }},
+        {"wallet_batch",{"1","16","270"},[&](CBDCEngineProbe& probe,const std::string& p,uint64_t n){ return probe.wallet_batch(number(p),batch_operations); }},
+        {"chain_batch",{"1","16","150"},[&](CBDCEngineProbe& probe,const std::string& p,uint64_t n){ return probe.chain_batch(number(p),batch_operations); }},
+        {"tx_batch",{"1","16","128"},[&](CBDCEngineProbe& probe,const std::string& p,uint64_t n){ return probe.tx_batch(number(p),batch_operations); }},
+        {"trace",{"1","2","4"},[&](CBDCEngineProbe& probe,const std::string& p,uint64_t n){ return probe.trace(number(p),n); }},
+        {"timestamp_logger",{"1","2","4"},[&](CBDCEngineProbe& probe,const std::string& p,uint64_t n){ return probe.timestamp_logger(number(p),n); }}
+    };
+
+    if(list){
+        for(auto& probe_case : cases){
+            std::cout << probe_case.name << ":";
+            for(auto& parameter : probe_case.parameters){
+                std::cout << " " << parameter;
+            }
+            std::cout << std::endl;
+        }
+        return 0;
+    }
+
+    std::unordered_set<std::string> selected;
+    std::stringstream cases_stream(cases_str);
+    std::string case_str;
+    while(std::getline(cases_stream,case_str,',')){
+        selected.insert(case_str);
+    }
+
+    // one row per case and parameter, in the same order in every run, so results of two commits can be compared
+    CBDCEngineProbe probe;
+    bool first = true;
+    std::cout << (json ? "[" : "case,parameter,operations,ns_per_operation,operations_per_second") << std::endl;
+    for(auto& probe_case : cases){
+        if(!selected.empty() && (selected.count(probe_case.name) == 0)){
+            continue;
+        }
+
+        for(auto& parameter : probe_case.parameters){
+            auto result = probe_case.run(probe,parameter,num_operations);
+            double ns_per_operation = result.second * 1e9 / result.first;
+            double operations_per_second = result.first / result.second;
+            if(json){
+                std::cout << (first ? "" : ",\n") << "  {\"case\":\"" << probe_case.name << "\",\"parameter\":\"" << parameter << "\",\"operations\":" << result.first << ",\"ns_per_operation\":" << ns_per_operation << ",\"operations_per_second\":" << operations_per_second << "}";
+            } else {
+                std::cout << probe_case.name << "," << parameter << "," << result.first << "," << ns_per_operation << "," << operations_per_second << std::endl;
+            }
+            first = false;
+        }
+    }
+    if(json){
+        std::cout << std::endl << "]" << std::endl;
+    }
+
+    return 0;
+}
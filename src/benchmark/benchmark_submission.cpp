@@ -0,0 +1,151 @@
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+#include <stdlib.h>
+#include "cbdc_client.hpp"
+
+#define DEFAULT_SENDER_THREAD_COUNTS "1,2,4,8"
+#define DEFAULT_PRODUCERS 4
+#define DEFAULT_NUM_SHARDS 8
+#define DEFAULT_NUM_REQUESTS 4000000
+#define DEFAULT_BATCH_MAX_SIZE 150
+#define DEFAULT_QUEUE_CAPACITY 65536
+
+void print_help(const std::string& bin_name){
+    std::cout << "usage: " << bin_name << " [options]" << std::endl;
+    std::cout << "options:" << std::endl;
+    std::cout << " -t <sender_threads>\tcomma-separated list of number of sender threads (default: " << DEFAULT_SENDER_THREAD_COUNTS << ")" << std::endl;
+    std::cout << " -p <producers>\t\tnumber of threads creating requests (default: " << DEFAULT_PRODUCERS << ")" << std::endl;
+    std::cout << " -s <num_shards>\tnumber of shards (default: " << DEFAULT_NUM_SHARDS << ")" << std::endl;
+    std::cout << " -n <num_requests>\ttotal number of requests (default: " << DEFAULT_NUM_REQUESTS << ")" << std::endl;
+    std::cout << " -x <batch_max_size>\tmaximum number of requests sent together (default: " << DEFAULT_BATCH_MAX_SIZE << ")" << std::endl;
+    std::cout << " -h\t\t\tshow this help" << std::endl;
+}
+
+/*
+ * Client submission path without a service: producers allocate txids and push 2-wallet transfers to
+ * per-shard MPSCQueues, as CascadeCBDC::push_request does, and each sender thread drains its shards in
+ * batches and builds their objects as ClientThread::send_batch does (the put itself is not included).
+ */
+int main(int argc, char** argv){
+    char c;
+    std::string thread_counts_str = DEFAULT_SENDER_THREAD_COUNTS;
+    uint64_t producers = DEFAULT_PRODUCERS;
+    uint64_t num_shards = DEFAULT_NUM_SHARDS;
+    uint64_t num_requests = DEFAULT_NUM_REQUESTS;
+    uint64_t batch_max_size = DEFAULT_BATCH_MAX_SIZE;
+
+    while ((c = getopt(argc, argv, "t:p:s:n:x:h")) != -1){
+        switch(c){
+            case 't':
+                thread_counts_str = optarg;
+                break;
+            case 'p':
+                producers = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case 's':
+                num_shards = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case 'n':
+                num_requests = strtoul(optarg,NULL,10);
+                break;
+            case 'x':
+                batch_max_size = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case '?':
+            case 'h':
+            default:
+                print_help(argv[0]);
+                return 0;
+        }
+    }
+
+    std::vector<uint64_t> thread_counts;
+    std::stringstream thread_counts_stream(thread_counts_str);
+    std::string count_str;
+    while(std::getline(thread_counts_stream,count_str,',')){
+        thread_counts.push_back(std::max(std::min(std::stoull(count_str),(unsigned long long)num_shards),1ULL));
+    }
+
+    std::cout << "sender_threads,producers,shards,requests,seconds,requests_per_second" << std::endl;
+    for(auto sender_threads : thread_counts){
+        std::vector<std::unique_ptr<MPSCQueue<queued_request_t>>> queues;
+        for(uint64_t i=0;i<num_shards;i++){
+            queues.emplace_back(new MPSCQueue<queued_request_t>(DEFAULT_QUEUE_CAPACITY));
+        }
+
+        std::atomic<uint64_t> tx_count{0};
+        std::atomic<uint64_t> sent{0};
+        std::atomic<uint64_t> bytes{0};
+        auto start = std::chrono::steady_clock::now();
+
+        // sender threads: thread i owns shards i, i+sender_threads, ...
+        std::vector<std::thread> senders;
+        for(uint64_t i=0;i<sender_threads;i++){
+            senders.emplace_back([&,i](){
+                std::vector<queued_request_t> batch(batch_max_size);
+                std::vector<ObjectWithStringKey> objects;
+                uint64_t local_bytes = 0;
+                while(sent.load(std::memory_order_relaxed) < num_requests){
+                    bool empty = true;
+                    for(uint64_t shard=i;shard<num_shards;shard+=sender_threads){
+                        uint64_t count = 0;
+                        while((count < batch_max_size) && queues[shard]->try_pop(batch[count])){
+                            count++;
+                        }
+                        empty = empty && (count == 0);
+
+                        objects.clear();
+                        CascadeCBDC::build_request_objects(batch.data(),count,objects);
+                        for(auto& obj : objects){
+                            local_bytes += obj.key.size() + obj.blob.size;
+                        }
+                        sent.fetch_add(count,std::memory_order_relaxed);
+                    }
+
+                    if(empty){
+                        std::this_thread::yield();
+                    }
+                }
+                bytes.fetch_add(local_bytes);
+            });
+        }
+
+        // producers: txids from a shared atomic counter, as in CascadeCBDC::next_transaction_id
+        std::vector<std::thread> producer_threads;
+        for(uint64_t p=0;p<producers;p++){
+            producer_threads.emplace_back([&,p](){
+                for(uint64_t i=p;i<num_requests;i+=producers){
+                    transaction_id_t txid = (1ULL << 48) | tx_count.fetch_add(1,std::memory_order_relaxed);
+                    wallet_id_t source = (i * 2654435761ULL) % 1000000;
+                    wallet_id_t destination = (source + 1) % 1000000;
+                    queued_request_t request(thread_request_t::TRANSFER,new cbdc_request_t(txid,{{source,1}},{{destination,1}},{source,destination}));
+                    auto& queue = *queues[source % num_shards];
+                    while(!queue.try_push(request)){
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+
+        for(auto& t : producer_threads){
+            t.join();
+        }
+
+        for(auto& t : senders){
+            t.join();
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << sender_threads << "," << producers << "," << num_shards << "," << sent.load() << "," << elapsed.count() << "," << sent.load() / elapsed.count() << std::endl;
+    }
+
+    return 0;
+}
+
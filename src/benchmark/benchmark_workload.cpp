@@ -1,5 +1,10 @@
 
 #include "benchmark_workload.hpp"
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <atomic>
+#include <memory>
 
 // helper function to shuffle a list: usually this is not recommended, but using a vector in the generate() method below incurs a much bigger overhead due to the frequent erase() calls. Thus we need a list, but we also need to shuffle it for the randomness.
 static void shuffle_list(std::list<wallet_id_t>& list, std::mt19937& rng){
@@ -29,6 +34,13 @@ void CBDCBenchmarkWorkload::generate(){
         wallets[wid] = wallet_initial_balance;
         expected_balance[wid] = wallet_initial_balance;
     }
+    
+    // the hot wallet has enough coins to pay for all transfers it may take part in
+    wallet_id_t hot_wallet = get_hot_wallet();
+    if(hot_wallet_percent > 0){
+        wallets[hot_wallet] = wallet_initial_balance * num_wallets;
+        expected_balance[hot_wallet] = wallet_initial_balance * num_wallets;
+    }
 
     // generate list of all wallets that are going to be used (with repetitions), and shuffle it. 
     std::list<wallet_id_t> wallet_list;
@@ -46,6 +58,8 @@ void CBDCBenchmarkWorkload::generate(){
     uint64_t wallets_per_transfer = senders_per_transfer + receivers_per_transfer;
     auto next_wallet_it = wallet_list.begin();
     uint64_t transfer_idx = 0;
+    uint64_t hot_count = 0;
+    std::uniform_int_distribution<uint64_t> percent_dist(0,99);
     while(wallet_list.size() >= wallets_per_transfer){
         benchmark_transfer_t transfer;
         std::unordered_map<wallet_id_t,bool> picked;
@@ -136,6 +150,21 @@ void CBDCBenchmarkWorkload::generate(){
             transfer.receivers[last_receiver_id] += diff;
         }
 
+        // the hot wallet replaces a receiver (payment to the merchant) or a sender (payment from the merchant), alternately
+        if(!finish && (hot_wallet_percent > 0) && (percent_dist(rng) < hot_wallet_percent)){
+            auto& side = (hot_count % 2 == 0) ? transfer.receivers : transfer.senders;
+            auto replaced = side.begin();
+            coin_value_t value = replaced->second;
+            side.erase(replaced);
+            side[hot_wallet] = value;
+            hot_count++;
+
+            success = true;
+            for(auto& sender : transfer.senders){
+                success = success && (expected_balance[sender.first] >= sender.second);
+            }
+        }
+
         if(!finish){
             // update expected balance, status
             expected_status[transfer_idx] = success;
@@ -165,12 +194,15 @@ void CBDCBenchmarkWorkload::to_file(const std::string fname){
     ogzstream fout(fname.c_str());
 
     // parameters
-    fout << num_wallets << " " << wallet_start_id << " " << transfers_per_wallet << " " << senders_per_transfer << " " << receivers_per_transfer << " " << wallet_initial_balance << " " << transfer_value << " " << random_seed << " " << transfers.size() << " " << expected_balance.size() << " " << expected_status.size() << std::endl; 
+    fout << num_wallets << " " << wallet_start_id << " " << transfers_per_wallet << " " << senders_per_transfer << " " << receivers_per_transfer << " " << wallet_initial_balance << " " << transfer_value << " " << random_seed << " " << hot_wallet_percent << " " << transfers.size() << " " << expected_balance.size() << " " << expected_status.size() << std::endl; 
 
     // wallets and initial balances
     for(wallet_id_t wid=wallet_start_id;wid<(wallet_start_id+num_wallets);wid++){
         fout << wid << " " << wallets[wid] << std::endl;
     }
+    if(hot_wallet_percent > 0){
+        fout << get_hot_wallet() << " " << wallets[get_hot_wallet()] << std::endl;
+    }
 
     // transfers
     for(std::size_t i=0;i<transfers.size();i++){
@@ -193,6 +225,9 @@ void CBDCBenchmarkWorkload::to_file(const std::string fname){
     for(wallet_id_t wid=wallet_start_id;wid<(wallet_start_id+num_wallets);wid++){
         fout << wid << " " << expected_balance[wid] << std::endl;
     }
+    if(hot_wallet_percent > 0){
+        fout << get_hot_wallet() << " " << expected_balance[get_hot_wallet()] << std::endl;
+    }
     
     // expected_status
     for(uint64_t i=0;i<transfers.size();i++){
@@ -213,17 +248,19 @@ CBDCBenchmarkWorkload& CBDCBenchmarkWorkload::from_file(const std::string fname)
     coin_value_t wallet_initial_balance;
     coin_value_t transfer_value;
     uint64_t random_seed;
+    uint64_t hot_wallet_percent;
     uint64_t transfer_count;
     uint64_t expected_count;
     uint64_t expected_status_count;
     
     // read parameters
-    fin >> num_wallets >> wallet_start_id >> transfers_per_wallet >> senders_per_transfer >> receivers_per_transfer >> wallet_initial_balance >> transfer_value >> random_seed >> transfer_count >> expected_count >> expected_status_count;
+    fin >> num_wallets >> wallet_start_id >> transfers_per_wallet >> senders_per_transfer >> receivers_per_transfer >> wallet_initial_balance >> transfer_value >> random_seed >> hot_wallet_percent >> transfer_count >> expected_count >> expected_status_count;
 
-    CBDCBenchmarkWorkload* benchmark = new CBDCBenchmarkWorkload(num_wallets,wallet_start_id,transfers_per_wallet,senders_per_transfer,receivers_per_transfer,wallet_initial_balance,transfer_value,random_seed);
+    CBDCBenchmarkWorkload* benchmark = new CBDCBenchmarkWorkload(num_wallets,wallet_start_id,transfers_per_wallet,senders_per_transfer,receivers_per_transfer,wallet_initial_balance,transfer_value,random_seed,hot_wallet_percent);
 
     // fill benchmark->wallets
-    for(wallet_id_t i=0;i<num_wallets;i++){
+    wallet_id_t wallet_count = (hot_wallet_percent > 0) ? num_wallets + 1 : num_wallets;
+    for(wallet_id_t i=0;i<wallet_count;i++){
         wallet_id_t wid;
         coin_value_t balance;
         fin >> wid >> balance;
@@ -275,3 +312,732 @@ CBDCBenchmarkWorkload& CBDCBenchmarkWorkload::from_file(const std::string fname)
     return *benchmark;
 }
 
+
+CBDCBenchmarkWorkload::~CBDCBenchmarkWorkload(){
+    if(mapped_data != nullptr){
+        munmap(mapped_data,mapped_size);
+    }
+}
+
+// write a column followed by zeros up to the next multiple of 8 bytes
+static void write_column(std::ofstream& fout,const void* data,uint64_t size){
+    static const char zeros[8] = {0};
+    fout.write(reinterpret_cast<const char*>(data),size);
+    if(size % 8 != 0){
+        fout.write(zeros,8 - (size % 8));
+    }
+}
+
+static uint64_t column_size(uint64_t size){
+    return (size + 7) & ~7ULL;
+}
+
+// position of each column in the binary format (in the order of workload_file_header_t), followed by the file size
+enum workload_column_t { WALLET_IDS, INITIAL_BALANCES, EXPECTED_BALANCES, TRANSFER_OFFSETS, TRANSFER_SENDERS, ENTRY_WALLETS, ENTRY_VALUES, TRANSFER_STATUS, FILE_SIZE };
+static std::vector<uint64_t> column_positions(uint64_t wallet_count,uint64_t transfer_count,uint64_t entry_count){
+    uint64_t sizes[FILE_SIZE] = {
+        wallet_count * sizeof(wallet_id_t),
+        wallet_count * sizeof(coin_value_t),
+        wallet_count * sizeof(coin_value_t),
+        (transfer_count + 1) * sizeof(uint64_t),
+        transfer_count * sizeof(uint32_t),
+        entry_count * sizeof(wallet_id_t),
+        entry_count * sizeof(coin_value_t),
+        transfer_count};
+
+    std::vector<uint64_t> positions(FILE_SIZE + 1);
+    positions[0] = column_size(sizeof(workload_file_header_t));
+    for(uint64_t i=0;i<FILE_SIZE;i++){
+        positions[i+1] = positions[i] + column_size(sizes[i]);
+    }
+    return positions;
+}
+
+void CBDCBenchmarkWorkload::to_binary_file(const std::string fname){
+    if(!generated){
+        generate();
+    }
+
+    std::vector<wallet_id_t> wallet_column;
+    for(wallet_id_t wid=wallet_start_id;wid<(wallet_start_id+num_wallets);wid++){
+        wallet_column.push_back(wid);
+    }
+    if(hot_wallet_percent > 0){
+        wallet_column.push_back(get_hot_wallet());
+    }
+
+    workload_file_header_t file_header;
+    file_header.magic = CBDC_WORKLOAD_MAGIC;
+    file_header.version = CBDC_WORKLOAD_VERSION;
+    uint64_t parameters[9] = {num_wallets,wallet_start_id,transfers_per_wallet,senders_per_transfer,receivers_per_transfer,wallet_initial_balance,transfer_value,random_seed,hot_wallet_percent};
+    std::copy(parameters,parameters + 9,file_header.parameters);
+    file_header.wallet_count = wallet_column.size();
+    file_header.transfer_count = transfers.size();
+    file_header.entry_count = 0;
+    file_header.distribution = distribution;
+    for(auto& transfer : transfers){
+        file_header.entry_count += transfer.senders.size() + transfer.receivers.size();
+    }
+
+    std::ofstream fout(fname,std::ios::binary);
+    write_column(fout,&file_header,sizeof(file_header));
+
+    // wallets, initial and expected balances
+    std::vector<coin_value_t> balance_column(wallet_column.size());
+    write_column(fout,wallet_column.data(),wallet_column.size() * sizeof(wallet_id_t));
+    for(std::size_t i=0;i<wallet_column.size();i++){
+        balance_column[i] = wallets[wallet_column[i]];
+    }
+    write_column(fout,balance_column.data(),balance_column.size() * sizeof(coin_value_t));
+    for(std::size_t i=0;i<wallet_column.size();i++){
+        balance_column[i] = expected_balance[wallet_column[i]];
+    }
+    write_column(fout,balance_column.data(),balance_column.size() * sizeof(coin_value_t));
+
+    // transfer offsets and number of senders
+    std::vector<uint64_t> offsets(transfers.size() + 1,0);
+    std::vector<uint32_t> senders(transfers.size());
+    for(std::size_t i=0;i<transfers.size();i++){
+        offsets[i+1] = offsets[i] + transfers[i].senders.size() + transfers[i].receivers.size();
+        senders[i] = transfers[i].senders.size();
+    }
+    write_column(fout,offsets.data(),offsets.size() * sizeof(uint64_t));
+    write_column(fout,senders.data(),senders.size() * sizeof(uint32_t));
+
+    // entries: wallet ids, then values
+    std::vector<wallet_id_t> entry_column;
+    entry_column.reserve(file_header.entry_count);
+    for(auto& transfer : transfers){
+        for(auto& sender : transfer.senders){
+            entry_column.push_back(sender.first);
+        }
+        for(auto& receiver : transfer.receivers){
+            entry_column.push_back(receiver.first);
+        }
+    }
+    write_column(fout,entry_column.data(),entry_column.size() * sizeof(wallet_id_t));
+    entry_column.clear();
+    for(auto& transfer : transfers){
+        for(auto& sender : transfer.senders){
+            entry_column.push_back(sender.second);
+        }
+        for(auto& receiver : transfer.receivers){
+            entry_column.push_back(receiver.second);
+        }
+    }
+    write_column(fout,entry_column.data(),entry_column.size() * sizeof(coin_value_t));
+
+    // expected status
+    std::vector<uint8_t> status_column(transfers.size());
+    for(uint64_t i=0;i<transfers.size();i++){
+        status_column[i] = expected_status[i] ? 1 : 0;
+    }
+    write_column(fout,status_column.data(),status_column.size());
+
+    fout.close();
+}
+
+CBDCBenchmarkWorkload& CBDCBenchmarkWorkload::from_binary_file(const std::string fname){
+    CBDCBenchmarkWorkload* benchmark = new CBDCBenchmarkWorkload();
+    benchmark->generated = true;
+
+    int fd = open(fname.c_str(),O_RDONLY);
+    struct stat file_stat;
+    if((fd < 0) || (fstat(fd,&file_stat) != 0) || ((uint64_t)file_stat.st_size < sizeof(workload_file_header_t))){
+        std::cout << "ERROR: could not open binary workload '" << fname << "'" << std::endl;
+        if(fd >= 0) close(fd);
+        return *benchmark;
+    }
+
+    void* data = mmap(nullptr,file_stat.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(data == MAP_FAILED){
+        std::cout << "ERROR: could not map binary workload '" << fname << "'" << std::endl;
+        return *benchmark;
+    }
+
+    auto file_header = reinterpret_cast<const workload_file_header_t*>(data);
+    uint64_t wallet_count = file_header->wallet_count;
+    uint64_t transfer_count = file_header->transfer_count;
+    uint64_t entry_count = file_header->entry_count;
+    auto positions = column_positions(wallet_count,transfer_count,entry_count);
+    if((file_header->magic != CBDC_WORKLOAD_MAGIC) || (file_header->version != CBDC_WORKLOAD_VERSION) || ((uint64_t)file_stat.st_size != positions[FILE_SIZE])){
+        std::cout << "ERROR: '" << fname << "' is not a binary workload of version " << CBDC_WORKLOAD_VERSION << std::endl;
+        munmap(data,file_stat.st_size);
+        return *benchmark;
+    }
+
+    // transfers are read in order: let the kernel read ahead
+    madvise(data,file_stat.st_size,MADV_SEQUENTIAL);
+
+    benchmark->mapped_data = data;
+    benchmark->mapped_size = file_stat.st_size;
+    benchmark->header = file_header;
+    benchmark->num_wallets = file_header->parameters[0];
+    benchmark->wallet_start_id = file_header->parameters[1];
+    benchmark->transfers_per_wallet = file_header->parameters[2];
+    benchmark->senders_per_transfer = file_header->parameters[3];
+    benchmark->receivers_per_transfer = file_header->parameters[4];
+    benchmark->wallet_initial_balance = file_header->parameters[5];
+    benchmark->transfer_value = file_header->parameters[6];
+    benchmark->random_seed = file_header->parameters[7];
+    benchmark->hot_wallet_percent = file_header->parameters[8];
+    benchmark->distribution = file_header->distribution;
+
+    const uint8_t* base = reinterpret_cast<const uint8_t*>(data);
+    benchmark->wallet_ids = reinterpret_cast<const wallet_id_t*>(base + positions[WALLET_IDS]);
+    benchmark->initial_balances = reinterpret_cast<const coin_value_t*>(base + positions[INITIAL_BALANCES]);
+    benchmark->expected_balances = reinterpret_cast<const coin_value_t*>(base + positions[EXPECTED_BALANCES]);
+    benchmark->transfer_offsets = reinterpret_cast<const uint64_t*>(base + positions[TRANSFER_OFFSETS]);
+    benchmark->transfer_senders = reinterpret_cast<const uint32_t*>(base + positions[TRANSFER_SENDERS]);
+    benchmark->entry_wallets = reinterpret_cast<const wallet_id_t*>(base + positions[ENTRY_WALLETS]);
+    benchmark->entry_values = reinterpret_cast<const coin_value_t*>(base + positions[ENTRY_VALUES]);
+    benchmark->transfer_status = base + positions[TRANSFER_STATUS];
+
+    return *benchmark;
+}
+
+CBDCBenchmarkWorkload& CBDCBenchmarkWorkload::load(const std::string fname){
+    uint64_t magic = 0;
+    std::ifstream fin(fname,std::ios::binary);
+    fin.read(reinterpret_cast<char*>(&magic),sizeof(magic));
+    fin.close();
+
+    if(magic == CBDC_WORKLOAD_MAGIC){
+        return from_binary_file(fname);
+    }
+    return from_file(fname);
+}
+
+const std::unordered_map<wallet_id_t,coin_value_t>& CBDCBenchmarkWorkload::get_wallets(){
+    if(is_mapped() && wallets.empty()){
+        for(uint64_t i=0;i<header->wallet_count;i++){
+            wallets[wallet_ids[i]] = initial_balances[i];
+        }
+    }
+    return wallets;
+}
+
+const std::unordered_map<wallet_id_t,coin_value_t>& CBDCBenchmarkWorkload::get_expected_balance(){
+    if(is_mapped() && expected_balance.empty()){
+        for(uint64_t i=0;i<header->wallet_count;i++){
+            expected_balance[wallet_ids[i]] = expected_balances[i];
+        }
+    }
+    return expected_balance;
+}
+
+const benchmark_transfer_t& CBDCBenchmarkWorkload::get_transfer(uint64_t index,benchmark_transfer_t& buffer){
+    if(!is_mapped()){
+        return transfers[index];
+    }
+
+    buffer.senders.clear();
+    buffer.receivers.clear();
+    uint64_t first = transfer_offsets[index];
+    uint64_t receivers = first + transfer_senders[index];
+    for(uint64_t i=first;i<receivers;i++){
+        buffer.senders[entry_wallets[i]] = entry_values[i];
+    }
+    for(uint64_t i=receivers;i<transfer_offsets[index+1];i++){
+        buffer.receivers[entry_wallets[i]] = entry_values[i];
+    }
+    return buffer;
+}
+
+bool CBDCBenchmarkWorkload::default_distribution(){
+    workload_distribution_t zero = {};
+    return memcmp(&distribution,&zero,sizeof(zero)) == 0;
+}
+
+// number of wallets on one side of an operation: from the histogram, or the given default if it is empty
+static uint64_t draw_arity(const uint64_t weights[],uint64_t default_arity,WorkloadRandom& random){
+    uint64_t total = 0;
+    for(uint64_t i=1;i<=CBDC_WORKLOAD_MAX_ARITY;i++){
+        total += weights[i];
+    }
+    if(total == 0){
+        return default_arity;
+    }
+
+    uint64_t x = random.next() % total;
+    for(uint64_t i=1;i<=CBDC_WORKLOAD_MAX_ARITY;i++){
+        if(x < weights[i]){
+            return i;
+        }
+        x -= weights[i];
+    }
+    return default_arity;
+}
+
+void CBDCBenchmarkWorkload::generate_range(uint64_t first_occurrence,uint64_t last_occurrence,uint64_t stream,std::function<void(const benchmark_transfer_t&)> consumer){
+    uint64_t occurrences = num_wallets * transfers_per_wallet;
+    if(first_occurrence >= last_occurrence){
+        return;
+    }
+
+    // default model: the occurrences of each wallet in a permuted order. Otherwise: independent draws of wallets (the
+    // zipf ranks are permuted, so the popular wallets are spread across shards), each one using an occurrence
+    bool independent = (distribution.zipf_skew > 0) || (distribution.num_shards > 0);
+    FeistelPermutation permutation(occurrences,random_seed);
+    FeistelPermutation wallet_permutation(num_wallets,workload_hash(random_seed,~0ULL));
+    ZipfDistribution zipf(num_wallets,distribution.zipf_skew);
+    uint64_t next_occurrence = first_occurrence;
+    uint64_t hot_key = workload_hash(random_seed,stream);
+    WorkloadRandom random(workload_hash(hot_key,~0ULL));
+    wallet_id_t hot_wallet = get_hot_wallet();
+    std::deque<wallet_id_t> deferred;
+    std::vector<wallet_id_t> picked;
+
+    // shard constraint for the next wallet: in required_shard (if >= 0), and not in excluded_shard (if >= 0)
+    int64_t required_shard = -1;
+    int64_t excluded_shard = -1;
+    auto in_shard = [&](wallet_id_t wallet_id){
+        if((required_shard < 0) && (excluded_shard < 0)){
+            return true;
+        }
+        int64_t shard = workload_wallet_shard(wallet_id,distribution.num_shards);
+        return ((required_shard < 0) || (shard == required_shard)) && (shard != excluded_shard);
+    };
+
+    // next wallet that is not in the current transfer yet: deferred wallets go first
+    auto next_wallet = [&](wallet_id_t& wallet_id){
+        if(independent){
+            if(next_occurrence >= last_occurrence){
+                return false;
+            }
+
+            for(uint64_t draws=0;;draws++){
+                uint64_t rank = (distribution.zipf_skew > 0) ? zipf(random) : random.next() % num_wallets;
+                wallet_id = wallet_start_id + wallet_permutation(rank);
+                bool is_new = std::find(picked.begin(),picked.end(),wallet_id) == picked.end();
+                if(is_new && ((draws >= CBDC_WORKLOAD_MAX_DRAWS) || in_shard(wallet_id))){
+                    next_occurrence++;
+                    return true;
+                }
+                if(draws >= 2 * CBDC_WORKLOAD_MAX_DRAWS){
+                    // too few wallets for the arity
+                    next_occurrence = last_occurrence;
+                    return false;
+                }
+            }
+        }
+
+        for(auto it = deferred.begin();it != deferred.end();it++){
+            if(std::find(picked.begin(),picked.end(),*it) == picked.end()){
+                wallet_id = *it;
+                deferred.erase(it);
+                return true;
+            }
+        }
+
+        while(next_occurrence < last_occurrence){
+            wallet_id = wallet_start_id + permutation(next_occurrence++) / transfers_per_wallet;
+            if(std::find(picked.begin(),picked.end(),wallet_id) == picked.end()){
+                return true;
+            }
+            deferred.push_back(wallet_id);
+        }
+        return false;
+    };
+
+    auto draw_amount = [&](){
+        switch(distribution.amount){
+            case workload_amount_t::UNIFORM:
+                return 1 + random.next() % std::max(2 * transfer_value - 1,(coin_value_t)1);
+            case workload_amount_t::EXPONENTIAL:
+                return std::max(static_cast<coin_value_t>(std::llround(-std::log1p(-random.uniform()) * transfer_value)),(coin_value_t)1);
+            default:
+                return transfer_value;
+        }
+    };
+
+    uint64_t transfer_idx = 0;
+    uint64_t hot_count = 0;
+    std::vector<std::pair<wallet_id_t,coin_value_t>> senders,receivers;
+    benchmark_transfer_t transfer;
+    while(true){
+        picked.clear();
+        senders.clear();
+        receivers.clear();
+
+        // operation: mint (a receiver), redeem (a sender) or transfer
+        uint64_t sender_count = senders_per_transfer;
+        uint64_t receiver_count = receivers_per_transfer;
+        uint64_t operation = (distribution.mint_percent + distribution.redeem_percent > 0) ? random.next() % 100 : 100;
+        if(operation < distribution.mint_percent){
+            sender_count = 0;
+            receiver_count = 1;
+        } else if(operation < distribution.mint_percent + distribution.redeem_percent){
+            sender_count = 1;
+            receiver_count = 0;
+        } else {
+            sender_count = draw_arity(distribution.sender_weights,senders_per_transfer,random);
+            receiver_count = draw_arity(distribution.receiver_weights,receivers_per_transfer,random);
+        }
+
+        // locality: all wallets in the shard of the first one, or the second one in another shard
+        bool same_shard = false;
+        if((distribution.num_shards > 0) && (sender_count + receiver_count > 1)){
+            same_shard = (distribution.num_shards == 1) || (random.next() % 100 < distribution.same_shard_percent);
+        }
+
+        // pick senders and receivers
+        bool finish = false;
+        wallet_id_t wallet_id;
+        required_shard = -1;
+        excluded_shard = -1;
+        for(uint64_t i=0;(i<sender_count+receiver_count) && !finish;i++){
+            finish = !next_wallet(wallet_id);
+            if(finish){
+                break;
+            }
+            picked.push_back(wallet_id);
+
+            if((i == 0) && (distribution.num_shards > 0)){
+                int64_t shard = workload_wallet_shard(wallet_id,distribution.num_shards);
+                required_shard = same_shard ? shard : -1;
+                excluded_shard = same_shard ? -1 : shard;
+            } else if(i == 1){
+                excluded_shard = -1;
+            }
+        }
+
+        if(finish){
+            // impossible to form a new transfer
+            break;
+        }
+
+        coin_value_t value_in = 0;
+        for(uint64_t i=0;i<sender_count;i++){
+            senders.emplace_back(picked[i],draw_amount());
+            value_in += senders.back().second;
+        }
+        for(uint64_t i=sender_count;i<picked.size();i++){
+            receivers.emplace_back(picked[i],(sender_count > 0) ? value_in / receiver_count : draw_amount());
+        }
+
+        // the last receiver gets the remainder of the division, so the transfer moves exactly value_in
+        if((sender_count > 0) && !receivers.empty()){
+            receivers.back().second += value_in % receiver_count;
+        }
+
+        // the hot wallet replaces a receiver (payment to the merchant) or a sender (payment from the merchant), alternately
+        if((hot_wallet_percent > 0) && !senders.empty() && !receivers.empty() && (workload_hash(hot_key,transfer_idx) % 100 < hot_wallet_percent)){
+            auto& side = (hot_count % 2 == 0) ? receivers : senders;
+            side[0].first = hot_wallet;
+            hot_count++;
+        }
+
+        transfer.senders.clear();
+        transfer.receivers.clear();
+        transfer.senders.insert(senders.begin(),senders.end());
+        transfer.receivers.insert(receivers.begin(),receivers.end());
+        consumer(transfer);
+        transfer_idx++;
+    }
+}
+
+std::vector<coin_value_t> CBDCBenchmarkWorkload::initial_balance_column(){
+    // indexed by wallet_id - wallet_start_id: the hot wallet comes last
+    std::vector<coin_value_t> balance(num_wallets,wallet_initial_balance);
+    if(hot_wallet_percent > 0){
+        balance.push_back(wallet_initial_balance * num_wallets);
+    }
+    return balance;
+}
+
+std::vector<coin_value_t> CBDCBenchmarkWorkload::generate_stream(std::function<void(const benchmark_transfer_t&,bool)> consumer){
+    auto balance = initial_balance_column();
+    generate_range(0,num_wallets * transfers_per_wallet,0,[&](const benchmark_transfer_t& transfer){
+        bool success = true;
+        for(auto& sender : transfer.senders){
+            success = success && (balance[sender.first - wallet_start_id] >= sender.second);
+        }
+
+        // update expected balance
+        if(success){
+            for(auto& sender : transfer.senders){
+                balance[sender.first - wallet_start_id] -= sender.second;
+            }
+            for(auto& receiver : transfer.receivers){
+                balance[receiver.first - wallet_start_id] += receiver.second;
+            }
+        }
+
+        consumer(transfer,success);
+    });
+
+    return balance;
+}
+
+// buffered writes to a column of the binary format, starting at a given position of the file
+class ColumnWriter {
+    int fd;
+    uint64_t position;
+    std::vector<uint8_t> buffer;
+
+    public:
+
+    ColumnWriter(int fd,uint64_t position) : fd(fd), position(position) {
+        buffer.reserve(1 << 20);
+    }
+
+    ~ColumnWriter(){
+        flush();
+    }
+
+    template <typename T>
+    void append(const T& value){
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+        buffer.insert(buffer.end(),bytes,bytes + sizeof(T));
+        if(buffer.size() + sizeof(T) > buffer.capacity()){
+            flush();
+        }
+    }
+
+    void flush(){
+        uint64_t written = 0;
+        while(written < buffer.size()){
+            ssize_t ret = pwrite(fd,buffer.data() + written,buffer.size() - written,position + written);
+            if(ret <= 0){
+                std::cout << "ERROR: could not write workload column: " << strerror(errno) << std::endl;
+                break;
+            }
+            written += ret;
+        }
+        position += buffer.size();
+        buffer.clear();
+    }
+};
+
+int CBDCBenchmarkWorkload::create_binary_file(const std::string fname,const std::vector<uint64_t>& positions,uint64_t wallet_count,uint64_t transfer_count,uint64_t entry_count){
+    int fd = open(fname.c_str(),O_RDWR | O_CREAT | O_TRUNC,0644);
+    if(fd < 0){
+        std::cout << "ERROR: could not create '" << fname << "': " << strerror(errno) << std::endl;
+        return fd;
+    }
+
+    if(ftruncate(fd,positions[FILE_SIZE]) != 0){
+        std::cout << "ERROR: could not resize '" << fname << "': " << strerror(errno) << std::endl;
+    }
+
+    workload_file_header_t file_header;
+    file_header.magic = CBDC_WORKLOAD_MAGIC;
+    file_header.version = CBDC_WORKLOAD_VERSION;
+    uint64_t parameters[9] = {num_wallets,wallet_start_id,transfers_per_wallet,senders_per_transfer,receivers_per_transfer,wallet_initial_balance,transfer_value,random_seed,hot_wallet_percent};
+    std::copy(parameters,parameters + 9,file_header.parameters);
+    file_header.wallet_count = wallet_count;
+    file_header.transfer_count = transfer_count;
+    file_header.entry_count = entry_count;
+    file_header.distribution = distribution;
+    ColumnWriter(fd,0).append(file_header);
+
+    // wallets and initial balances
+    ColumnWriter wallet_column(fd,positions[WALLET_IDS]);
+    ColumnWriter initial_column(fd,positions[INITIAL_BALANCES]);
+    for(uint64_t i=0;i<wallet_count;i++){
+        wallet_column.append(wallet_start_id + i);
+        initial_column.append((i < num_wallets) ? wallet_initial_balance : wallet_initial_balance * num_wallets);
+    }
+
+    return fd;
+}
+
+uint64_t CBDCBenchmarkWorkload::stream_to_binary_file(const std::string fname){
+    // first pass: counts and expected balances, so the position of each column is known
+    uint64_t transfer_count = 0;
+    uint64_t entry_count = 0;
+    auto final_balance = generate_stream([&](const benchmark_transfer_t& transfer,bool success){
+        transfer_count++;
+        entry_count += transfer.senders.size() + transfer.receivers.size();
+    });
+
+    auto positions = column_positions(final_balance.size(),transfer_count,entry_count);
+    int fd = create_binary_file(fname,positions,final_balance.size(),transfer_count,entry_count);
+    if(fd < 0){
+        return 0;
+    }
+
+    {
+        ColumnWriter expected_column(fd,positions[EXPECTED_BALANCES]);
+        for(auto balance : final_balance){
+            expected_column.append(balance);
+        }
+
+        // second pass: the same transfers, appended to their columns
+        ColumnWriter offset_column(fd,positions[TRANSFER_OFFSETS]);
+        ColumnWriter sender_column(fd,positions[TRANSFER_SENDERS]);
+        ColumnWriter entry_wallet_column(fd,positions[ENTRY_WALLETS]);
+        ColumnWriter entry_value_column(fd,positions[ENTRY_VALUES]);
+        ColumnWriter status_column(fd,positions[TRANSFER_STATUS]);
+        uint64_t offset = 0;
+        offset_column.append(offset);
+        generate_stream([&](const benchmark_transfer_t& transfer,bool success){
+            for(auto& sender : transfer.senders){
+                entry_wallet_column.append(sender.first);
+                entry_value_column.append(sender.second);
+            }
+            for(auto& receiver : transfer.receivers){
+                entry_wallet_column.append(receiver.first);
+                entry_value_column.append(receiver.second);
+            }
+            offset += transfer.senders.size() + transfer.receivers.size();
+            offset_column.append(offset);
+            sender_column.append(static_cast<uint32_t>(transfer.senders.size()));
+            status_column.append(static_cast<uint8_t>(success ? 1 : 0));
+        });
+    }
+
+    close(fd);
+    return transfer_count;
+}
+
+// run fn(0) ... fn(num_threads-1) in parallel
+static void run_partitions(uint64_t num_threads,std::function<void(uint64_t)> fn){
+    std::vector<std::thread> threads;
+    for(uint64_t p=0;p<num_threads;p++){
+        threads.emplace_back(fn,p);
+    }
+    for(auto& thread : threads){
+        thread.join();
+    }
+}
+
+uint64_t CBDCBenchmarkWorkload::parallel_to_binary_file(const std::string fname,uint64_t num_threads){
+    uint64_t occurrences = num_wallets * transfers_per_wallet;
+    num_threads = std::max(std::min(num_threads,occurrences),(uint64_t)1);
+
+    // partition p forms its transfers from the occurrences [first[p],first[p+1]) of the permutation
+    std::vector<uint64_t> first(num_threads + 1);
+    for(uint64_t p=0;p<=num_threads;p++){
+        first[p] = occurrences / num_threads * p + std::min(p,occurrences % num_threads);
+    }
+
+    // first pass: transfers and entries of each partition, so each one knows where to write its part of the columns
+    std::vector<uint64_t> transfer_base(num_threads + 1,0);
+    std::vector<uint64_t> entry_base(num_threads + 1,0);
+    run_partitions(num_threads,[&](uint64_t p){
+        uint64_t transfer_count = 0,entry_count = 0;
+        generate_range(first[p],first[p+1],p,[&](const benchmark_transfer_t& transfer){
+            transfer_count++;
+            entry_count += transfer.senders.size() + transfer.receivers.size();
+        });
+        transfer_base[p+1] = transfer_count;
+        entry_base[p+1] = entry_count;
+    });
+    for(uint64_t p=0;p<num_threads;p++){
+        transfer_base[p+1] += transfer_base[p];
+        entry_base[p+1] += entry_base[p];
+    }
+
+    uint64_t wallet_count = initial_balance_column().size();
+    uint64_t transfer_count = transfer_base[num_threads];
+    uint64_t entry_count = entry_base[num_threads];
+    auto positions = column_positions(wallet_count,transfer_count,entry_count);
+    int fd = create_binary_file(fname,positions,wallet_count,transfer_count,entry_count);
+    if(fd < 0){
+        return 0;
+    }
+
+    // in the default model, each wallet sends transfer_value at most transfers_per_wallet times (and the hot wallet
+    // holds the coins of all wallets): if that many transfers fit in the initial balance, every transfer commits, and the order of the balance updates
+    // does not matter. Otherwise the status of each transfer is computed in order by the merge pass below
+    bool all_commit = default_distribution() && (wallet_initial_balance >= transfers_per_wallet * transfer_value);
+    auto initial_balance = initial_balance_column();
+    std::unique_ptr<std::atomic<coin_value_t>[]> balance(new std::atomic<coin_value_t>[wallet_count]);
+    for(uint64_t i=0;i<wallet_count;i++){
+        balance[i].store(initial_balance[i],std::memory_order_relaxed);
+    }
+
+    // second pass: each partition writes its transfers, and updates the balances of regular wallets in place (the
+    // hot wallet is in most transfers, so each partition keeps its own change, added in the merge pass)
+    std::vector<coin_value_t> hot_change(num_threads,0);
+    run_partitions(num_threads,[&](uint64_t p){
+        ColumnWriter offset_column(fd,positions[TRANSFER_OFFSETS] + (transfer_base[p] + 1) * sizeof(uint64_t));
+        ColumnWriter sender_column(fd,positions[TRANSFER_SENDERS] + transfer_base[p] * sizeof(uint32_t));
+        ColumnWriter entry_wallet_column(fd,positions[ENTRY_WALLETS] + entry_base[p] * sizeof(wallet_id_t));
+        ColumnWriter entry_value_column(fd,positions[ENTRY_VALUES] + entry_base[p] * sizeof(coin_value_t));
+        ColumnWriter status_column(fd,positions[TRANSFER_STATUS] + transfer_base[p]);
+        if(p == 0){
+            ColumnWriter(fd,positions[TRANSFER_OFFSETS]).append((uint64_t)0);
+        }
+
+        wallet_id_t hot_wallet = get_hot_wallet();
+        uint64_t offset = entry_base[p];
+        generate_range(first[p],first[p+1],p,[&](const benchmark_transfer_t& transfer){
+            for(auto& sender : transfer.senders){
+                entry_wallet_column.append(sender.first);
+                entry_value_column.append(sender.second);
+                if(all_commit && (sender.first == hot_wallet)){
+                    hot_change[p] -= sender.second;
+                } else if(all_commit){
+                    balance[sender.first - wallet_start_id].fetch_sub(sender.second,std::memory_order_relaxed);
+                }
+            }
+            for(auto& receiver : transfer.receivers){
+                entry_wallet_column.append(receiver.first);
+                entry_value_column.append(receiver.second);
+                if(all_commit && (receiver.first == hot_wallet)){
+                    hot_change[p] += receiver.second;
+                } else if(all_commit){
+                    balance[receiver.first - wallet_start_id].fetch_add(receiver.second,std::memory_order_relaxed);
+                }
+            }
+            offset += transfer.senders.size() + transfer.receivers.size();
+            offset_column.append(offset);
+            sender_column.append(static_cast<uint32_t>(transfer.senders.size()));
+            status_column.append(static_cast<uint8_t>(all_commit ? 1 : 0));
+        });
+    });
+
+    // merge pass: with aborts, replay the written transfers in order to compute the status and the final balances
+    if(all_commit){
+        for(uint64_t p=0;p<num_threads;p++){
+            balance[wallet_count - 1].fetch_add(hot_change[p],std::memory_order_relaxed);
+        }
+    } else {
+        void* data = mmap(nullptr,positions[FILE_SIZE],PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+        if(data == MAP_FAILED){
+            std::cout << "ERROR: could not map '" << fname << "' to compute the expected status: " << strerror(errno) << std::endl;
+            close(fd);
+            return 0;
+        }
+
+        uint8_t* base = reinterpret_cast<uint8_t*>(data);
+        auto offsets = reinterpret_cast<const uint64_t*>(base + positions[TRANSFER_OFFSETS]);
+        auto senders = reinterpret_cast<const uint32_t*>(base + positions[TRANSFER_SENDERS]);
+        auto wallets = reinterpret_cast<const wallet_id_t*>(base + positions[ENTRY_WALLETS]);
+        auto values = reinterpret_cast<const coin_value_t*>(base + positions[ENTRY_VALUES]);
+        auto status = base + positions[TRANSFER_STATUS];
+        madvise(data,positions[FILE_SIZE],MADV_SEQUENTIAL);
+        for(uint64_t i=0;i<transfer_count;i++){
+            uint64_t receivers = offsets[i] + senders[i];
+            bool success = true;
+            for(uint64_t j=offsets[i];j<receivers;j++){
+                success = success && (balance[wallets[j] - wallet_start_id].load(std::memory_order_relaxed) >= values[j]);
+            }
+
+            if(success){
+                for(uint64_t j=offsets[i];j<receivers;j++){
+                    balance[wallets[j] - wallet_start_id].fetch_sub(values[j],std::memory_order_relaxed);
+                }
+                for(uint64_t j=receivers;j<offsets[i+1];j++){
+                    balance[wallets[j] - wallet_start_id].fetch_add(values[j],std::memory_order_relaxed);
+                }
+            }
+            status[i] = success ? 1 : 0;
+        }
+        munmap(data,positions[FILE_SIZE]);
+    }
+
+    {
+        ColumnWriter expected_column(fd,positions[EXPECTED_BALANCES]);
+        for(uint64_t i=0;i<wallet_count;i++){
+            expected_column.append(balance[i].load(std::memory_order_relaxed));
+        }
+    }
+
+    close(fd);
+    return transfer_count;
+}
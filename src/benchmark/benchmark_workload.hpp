@@ -15,12 +15,176 @@
 #include <list>
 #include <iterator>
 #include <gzstream.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <deque>
+#include <functional>
+#include <cmath>
+
+#define CBDC_WORKLOAD_MAGIC 0x444c4b5743444243ULL // "CBDCWKLD" in the first bytes of the file
+#define CBDC_WORKLOAD_VERSION 2
+#define CBDC_FEISTEL_ROUNDS 4
+#define CBDC_WORKLOAD_MAX_ARITY 16
+#define CBDC_WORKLOAD_MAX_DRAWS 1000 // draws for a wallet in the required shard before accepting any shard
 
 using benchmark_transfer_t = struct benchmark_transfer_t {
     std::unordered_map<wallet_id_t,coin_value_t> senders;
     std::unordered_map<wallet_id_t,coin_value_t> receivers;
 };
 
+// counter-based random numbers: the value for a given (key,counter) does not depend on any previous draw (splitmix64 finalizer)
+inline uint64_t workload_hash(uint64_t key,uint64_t counter){
+    uint64_t z = key + (counter + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * Seeded permutation of [0,size) computed one index at a time, without storing it: a Feistel network over the
+ * smallest power of four not below size is a bijection of that domain, and values outside [0,size) are encrypted
+ * again until they fall inside it (cycle walking: fewer than 4 encryptions on average).
+ */
+class FeistelPermutation {
+    uint64_t size;
+    uint64_t half_bits = 1;
+    uint64_t half_mask;
+    uint64_t keys[CBDC_FEISTEL_ROUNDS];
+
+    uint64_t encrypt(uint64_t value) const {
+        uint64_t left = value >> half_bits;
+        uint64_t right = value & half_mask;
+        for(uint64_t i=0;i<CBDC_FEISTEL_ROUNDS;i++){
+            uint64_t next = left ^ (workload_hash(keys[i],right) & half_mask);
+            left = right;
+            right = next;
+        }
+        return (left << half_bits) | right;
+    }
+
+    public:
+
+    FeistelPermutation(uint64_t size,uint64_t seed) : size(size) {
+        while((half_bits < 32) && ((1ULL << (2 * half_bits)) < size)){
+            half_bits++;
+        }
+        half_mask = (1ULL << half_bits) - 1;
+        for(uint64_t i=0;i<CBDC_FEISTEL_ROUNDS;i++){
+            keys[i] = workload_hash(seed,i);
+        }
+    }
+
+    uint64_t operator()(uint64_t index) const {
+        uint64_t value = encrypt(index);
+        while(value >= size){
+            value = encrypt(value);
+        }
+        return value;
+    }
+};
+
+// counter-based random stream: the n-th draw only depends on the key and n
+class WorkloadRandom {
+    uint64_t key;
+    uint64_t counter = 0;
+
+    public:
+
+    WorkloadRandom(uint64_t key) : key(key) {}
+
+    uint64_t next(){
+        return workload_hash(key,counter++);
+    }
+
+    // in [0,1)
+    double uniform(){
+        return (next() >> 11) * 0x1.0p-53;
+    }
+};
+
+/*
+ * Zipf distribution over the ranks [0,size), with P(rank) proportional to 1/(rank+1)^skew, sampled by rejection-inversion
+ * (Hormann and Derflinger): constant memory and time, so it works for any number of wallets.
+ */
+class ZipfDistribution {
+    uint64_t size;
+    double skew;
+    double h_integral_x1;
+    double h_integral_size;
+    double s;
+
+    static double helper1(double x){ return (std::abs(x) > 1e-8) ? std::log1p(x) / x : 1.0 - x * (0.5 - x * (1.0/3.0 - 0.25 * x)); }
+    static double helper2(double x){ return (std::abs(x) > 1e-8) ? std::expm1(x) / x : 1.0 + x * 0.5 * (1.0 + x * (1.0/3.0) * (1.0 + 0.25 * x)); }
+    double h(double x) const { return std::exp(-skew * std::log(x)); }
+    double h_integral(double x) const { double log_x = std::log(x); return helper2((1.0 - skew) * log_x) * log_x; }
+    double h_integral_inverse(double x) const { double t = std::max(x * (1.0 - skew),-1.0); return std::exp(helper1(t) * x); }
+
+    public:
+
+    ZipfDistribution(uint64_t size,double skew) : size(size), skew(skew) {
+        h_integral_x1 = h_integral(1.5) - 1.0;
+        h_integral_size = h_integral(size + 0.5);
+        s = 2.0 - h_integral_inverse(h_integral(2.5) - h(2.0));
+    }
+
+    uint64_t operator()(WorkloadRandom& random) const {
+        while(true){
+            double u = h_integral_size + random.uniform() * (h_integral_x1 - h_integral_size);
+            double x = h_integral_inverse(u);
+            uint64_t k = std::min(std::max(static_cast<uint64_t>(x + 0.5),(uint64_t)1),size);
+            if((k - x <= s) || (u >= h_integral(k + 0.5) - h(static_cast<double>(k)))){
+                return k - 1;
+            }
+        }
+    }
+};
+
+// shard of a wallet in the object pool: HASH sharding of the affinity key matched by CBDC_OBJECT_POOL_REGEX
+inline uint32_t workload_wallet_shard(wallet_id_t wallet_id,uint64_t num_shards){
+    return std::hash<std::string>{}("/WID_" + std::to_string(wallet_id)) % num_shards;
+}
+
+enum class workload_amount_t : uint64_t {
+    FIXED,          // transfer_value
+    UNIFORM,        // uniform in [1,2*transfer_value-1]
+    EXPONENTIAL     // exponential with mean transfer_value, at least 1
+};
+
+/*
+ * Distributions of the streaming generator. All zeros is the default model: each wallet appears transfers_per_wallet
+ * times, with senders_per_transfer senders sending transfer_value each and receivers_per_transfer receivers. Any
+ * other value draws the wallets of each operation independently (from a Zipf distribution if zipf_skew > 0).
+ */
+using workload_distribution_t = struct workload_distribution_t {
+    double zipf_skew;                                       // 0: every wallet equally likely
+    uint64_t num_shards;                                    // shards assumed when controlling the same-shard fraction (0: no control)
+    uint64_t same_shard_percent;                            // transfers with all wallets in the same shard (the others span at least two)
+    uint64_t sender_weights[CBDC_WORKLOAD_MAX_ARITY + 1];   // relative weight of each number of senders (all 0: senders_per_transfer)
+    uint64_t receiver_weights[CBDC_WORKLOAD_MAX_ARITY + 1]; // relative weight of each number of receivers (all 0: receivers_per_transfer)
+    workload_amount_t amount;                               // amount sent by each sender, minted or redeemed
+    uint64_t mint_percent;                                  // operations minting coins into a single wallet
+    uint64_t redeem_percent;                                // operations redeeming coins from a single wallet
+};
+
+/*
+ * Header of the binary workload format. It is followed by these columns, each one starting at a multiple of 8 bytes:
+ * wallet ids, initial balances and expected balances (wallet_count each), offsets of each transfer into the entries
+ * (transfer_count + 1), number of senders of each transfer (uint32_t, transfer_count), wallet ids and values of the
+ * entries (entry_count each, senders before receivers) and expected status of each transfer (uint8_t, transfer_count).
+ * An operation without senders is a mint to its receiver, and one without receivers is a redeem from its sender.
+ */
+using workload_file_header_t = struct workload_file_header_t {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t parameters[9];
+    uint64_t wallet_count;
+    uint64_t transfer_count;
+    uint64_t entry_count;
+    workload_distribution_t distribution;
+};
+
 class CBDCBenchmarkWorkload {
     // benchmark parameters
     wallet_id_t num_wallets = 10;
@@ -31,6 +195,8 @@ class CBDCBenchmarkWorkload {
     coin_value_t wallet_initial_balance = 100000;
     coin_value_t transfer_value = 10;
     uint64_t random_seed = 3;
+    uint64_t hot_wallet_percent = 0;
+    workload_distribution_t distribution = {};
 
     // internal
     bool generated = false;
@@ -39,8 +205,30 @@ class CBDCBenchmarkWorkload {
     std::unordered_map<wallet_id_t,coin_value_t> expected_balance;
     std::unordered_map<uint64_t,bool> expected_status;
 
+    // binary workload mapped from a file: the columns are read in place, without parsing
+    void* mapped_data = nullptr;
+    uint64_t mapped_size = 0;
+    const workload_file_header_t* header = nullptr;
+    const wallet_id_t* wallet_ids = nullptr;
+    const coin_value_t* initial_balances = nullptr;
+    const coin_value_t* expected_balances = nullptr;
+    const uint64_t* transfer_offsets = nullptr;
+    const uint32_t* transfer_senders = nullptr;
+    const wallet_id_t* entry_wallets = nullptr;
+    const coin_value_t* entry_values = nullptr;
+    const uint8_t* transfer_status = nullptr;
+
+    // streaming generator: transfers formed from the occurrences [first_occurrence,last_occurrence) of the permutation,
+    // with the hot wallet picked by the counter-based random stream of the given number
+    void generate_range(uint64_t first_occurrence,uint64_t last_occurrence,uint64_t stream,std::function<void(const benchmark_transfer_t&)> consumer);
+    std::vector<coin_value_t> initial_balance_column();
+
+    // binary file of the final size, with the header, wallet ids and initial balances: returns the file descriptor
+    int create_binary_file(const std::string fname,const std::vector<uint64_t>& positions,uint64_t wallet_count,uint64_t transfer_count,uint64_t entry_count);
+
     public:
         CBDCBenchmarkWorkload(){}
+        ~CBDCBenchmarkWorkload();
         CBDCBenchmarkWorkload(
                 wallet_id_t num_wallets,
                 wallet_id_t wallet_start_id,
@@ -49,7 +237,8 @@ class CBDCBenchmarkWorkload {
                 uint64_t receivers_per_transfer,
                 coin_value_t wallet_initial_balance,
                 coin_value_t transfer_value,
-                uint64_t random_seed):
+                uint64_t random_seed,
+                uint64_t hot_wallet_percent):
             num_wallets(num_wallets),
             wallet_start_id(wallet_start_id),
             transfers_per_wallet(transfers_per_wallet),
@@ -57,16 +246,61 @@ class CBDCBenchmarkWorkload {
             receivers_per_transfer(receivers_per_transfer),
             wallet_initial_balance(wallet_initial_balance),
             transfer_value(transfer_value),
-            random_seed(random_seed){}
+            random_seed(random_seed),
+            hot_wallet_percent(hot_wallet_percent){}
 
+        // the default generator only produces the default model: the distributions are used by the streaming generator
         void generate();
+        void set_distribution(const workload_distribution_t& distribution){ this->distribution = distribution; }
+        const workload_distribution_t& get_distribution(){ return distribution; }
+        bool default_distribution();
+
+        /*
+         * Streaming generator: the wallet occurrences (each wallet appears transfers_per_wallet times) are visited in
+         * the order of a FeistelPermutation seeded with random_seed, and consecutive occurrences form each transfer
+         * (an occurrence repeating a wallet of the current transfer is deferred to the next ones). Transfers are
+         * passed to the consumer with their expected status as they are generated, and are not stored: memory is
+         * O(num_wallets), for the expected balances, which are returned. The workload differs from generate(), but
+         * is the same for the same parameters in every run.
+         */
+        std::vector<coin_value_t> generate_stream(std::function<void(const benchmark_transfer_t&,bool)> consumer);
+
+        // streaming generator written directly to the binary format: returns the number of transfers
+        uint64_t stream_to_binary_file(const std::string fname);
+
+        /*
+         * Streaming generator split across threads: the occurrences of the permutation are divided into num_threads
+         * consecutive ranges, each one forming its own transfers (with its own random stream), which are written in
+         * the order of the ranges. The workload is the same for the same parameters and number of threads (a single
+         * thread generates the same workload as generate_stream()). The expected balances are updated by all threads
+         * when no transfer can abort, or computed by a sequential merge pass over the written transfers otherwise.
+         */
+        uint64_t parallel_to_binary_file(const std::string fname,uint64_t num_threads);
         void to_file(const std::string fname);
         static CBDCBenchmarkWorkload& from_file(const std::string fname);
+        void to_binary_file(const std::string fname);
+        static CBDCBenchmarkWorkload& from_binary_file(const std::string fname);
 
-        std::tuple<wallet_id_t,wallet_id_t,uint64_t,uint64_t,uint64_t,coin_value_t,coin_value_t,uint64_t> get_parameters(){ return std::make_tuple(num_wallets,wallet_start_id,transfers_per_wallet,senders_per_transfer,receivers_per_transfer,wallet_initial_balance,transfer_value,random_seed); }
-        const std::unordered_map<wallet_id_t,coin_value_t>& get_wallets(){ return wallets; }
+        // binary or gz text format, according to the first bytes of the file
+        static CBDCBenchmarkWorkload& load(const std::string fname);
+        bool is_mapped(){ return mapped_data != nullptr; }
+
+        std::tuple<wallet_id_t,wallet_id_t,uint64_t,uint64_t,uint64_t,coin_value_t,coin_value_t,uint64_t,uint64_t> get_parameters(){ return std::make_tuple(num_wallets,wallet_start_id,transfers_per_wallet,senders_per_transfer,receivers_per_transfer,wallet_initial_balance,transfer_value,random_seed,hot_wallet_percent); }
+
+        // the hot (merchant) wallet comes right after the regular wallets, and only exists if hot_wallet_percent > 0
+        wallet_id_t get_hot_wallet(){ return wallet_start_id + num_wallets; }
+
+        // for a mapped workload, the wallet maps are built from the columns on the first call
+        const std::unordered_map<wallet_id_t,coin_value_t>& get_wallets();
+        const std::unordered_map<wallet_id_t,coin_value_t>& get_expected_balance();
+
+        // in-memory workload only: a mapped workload is read with the accessors below
         const std::vector<benchmark_transfer_t>& get_transfers(){ return transfers; }
-        const std::unordered_map<wallet_id_t,coin_value_t>& get_expected_balance(){ return expected_balance; }
         const std::unordered_map<uint64_t,bool>& get_expected_status(){ return expected_status; }
+
+        // accessors for both formats: a mapped transfer is copied into the given buffer, which is returned
+        uint64_t get_transfer_count(){ return is_mapped() ? header->transfer_count : transfers.size(); }
+        const benchmark_transfer_t& get_transfer(uint64_t index,benchmark_transfer_t& buffer);
+        bool get_expected_status(uint64_t index){ return is_mapped() ? transfer_status[index] != 0 : expected_status.at(index); }
 };
 
@@ -5,11 +5,17 @@ CascadeCBDC::CascadeCBDC(){
 }
 
 CascadeCBDC::~CascadeCBDC(){
-    client_thread->signal_stop();
-    client_thread->join();
+    for(auto client_thread : client_threads){
+        client_thread->signal_stop();
+    }
+
+    for(auto client_thread : client_threads){
+        client_thread->join();
+        delete client_thread;
+    }
 }
 
-void CascadeCBDC::setup(uint64_t batch_min_size,uint64_t batch_max_size,uint64_t batch_time_us){
+void CascadeCBDC::setup(uint64_t batch_min_size,uint64_t batch_max_size,uint64_t batch_time_us,uint64_t queue_max_size,uint64_t num_sender_threads){
     // create object pools
     // check if already exists
     auto opm = capi.find_object_pool(CBDC_OBJECT_POOL_PREFIX);
@@ -47,68 +53,112 @@ void CascadeCBDC::setup(uint64_t batch_min_size,uint64_t batch_max_size,uint64_t
 
     // log deployment
     auto shards = capi.get_subgroup_members(CBDC_PREFIX);
+    routing_num_shards = shards.size();
     for(uint64_t i=0;i<shards.size();i++){
         for(auto node : shards[i]){
-            TimestampLogger::log(CBDC_TAG_CLIENT_DEPLOYMENT_INFO,node,i,0);
+            CBDC_TRACE(CBDC_TAG_CLIENT_DEPLOYMENT_INFO,node,i,0);
+        }
+    }
+
+    // receive the final status of TXs instead of polling
+    if(config.enable_notifications){
+        capi.register_notification_handler([this](const Blob& blob){
+                handle_notification(blob);
+            },CBDC_OBJECT_POOL_PREFIX);
+    }
+
+    // start sender threads: each one owns every num_sender_threads-th shard
+    num_sender_threads = std::max(std::min(num_sender_threads,(uint64_t)shards.size()),(uint64_t)1);
+    for(uint64_t i=0;i<num_sender_threads;i++){
+        std::vector<uint32_t> thread_shards;
+        for(uint32_t shard_index = i; shard_index < shards.size(); shard_index += num_sender_threads){
+            thread_shards.push_back(shard_index);
         }
+        client_threads.push_back(new ClientThread(batch_min_size,batch_max_size,batch_time_us,queue_max_size,thread_shards));
     }
 
-    // start client thread
-    client_thread = new ClientThread(batch_min_size,batch_max_size,batch_time_us);
-    client_thread->start();
+    for(auto client_thread : client_threads){
+        client_thread->start();
+    }
 }
 
 transaction_id_t CascadeCBDC::next_transaction_id(){
-    std::unique_lock<std::mutex> lock(txid_mtx);
-    transaction_id_t txid = (my_id << 48) | tx_count;
-    tx_count++;
-    return txid;
+    return (my_id << 48) | tx_count.fetch_add(1,std::memory_order_relaxed);
+}
+
+void CascadeCBDC::push_request(queued_request_t &queued_request,uint32_t shard){
+    wait_backoff();
+    client_threads[shard % client_threads.size()]->push_request(queued_request,shard);
+}
+
+void CascadeCBDC::observe_status(transaction_status_t status){
+    if(status == transaction_status_t::REJECTED){
+        rejected_count++;
+        uint64_t backoff = std::min(std::max(backoff_us.load() * 2,(uint64_t)REJECT_BACKOFF_MIN_US),(uint64_t)REJECT_BACKOFF_MAX_US);
+        backoff_us = backoff;
+        auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(backoff);
+        backoff_until_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(until.time_since_epoch()).count();
+    } else if(((status == transaction_status_t::COMMIT) || (status == transaction_status_t::ABORT)) && (backoff_us.load(std::memory_order_relaxed) > 0)){
+        backoff_us = backoff_us.load() / 2;
+    }
+}
+
+void CascadeCBDC::wait_backoff(){
+    auto until = backoff_until_ns.load(std::memory_order_relaxed);
+    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    if(until > now){
+        std::this_thread::sleep_for(std::chrono::nanoseconds(until - now));
+    }
 }
 
 transaction_id_t CascadeCBDC::mint(wallet_id_t wallet_id,coin_value_t value){
     transaction_id_t txid = next_transaction_id();
-    auto shard = std::get<2>(capi.key_to_shard(CBDC_BUILD_MINT_KEY(wallet_id)));
+    send_mint(txid,wallet_id,value);
+    return txid;
+}
+
+void CascadeCBDC::send_mint(transaction_id_t txid,wallet_id_t wallet_id,coin_value_t value){
+    auto shard = get_wallet_shard(wallet_id);
     cbdc_request_t *request = new cbdc_request_t(txid,{},{{wallet_id,value}},{wallet_id});
     queued_request_t queued_request(thread_request_t::MINT,request);
-    client_thread->push_request(queued_request,shard);
-    
-    return txid;
+    push_request(queued_request,shard);
 }
 
 transaction_id_t CascadeCBDC::transfer(const std::unordered_map<wallet_id_t,coin_value_t>& senders,const std::unordered_map<wallet_id_t,coin_value_t>& receivers){
     transaction_id_t txid = next_transaction_id();
-    TimestampLogger::log(CBDC_TAG_CLIENT_TRANSFER_START,my_id,txid,0);
+    send_transfer(txid,senders,receivers);
+    return txid;
+}
+
+bool CascadeCBDC::send_transfer(transaction_id_t txid,const std::unordered_map<wallet_id_t,coin_value_t>& senders,const std::unordered_map<wallet_id_t,coin_value_t>& receivers){
+    CBDC_TRACE(CBDC_TAG_CLIENT_TRANSFER_START,my_id,txid,0);
    
-    std::vector<wallet_id_t> sorted_wallets; 
+    // each wallet with its route (shard and thread), ordered by route in descending order
+    thread_local std::vector<std::pair<uint64_t,wallet_id_t>> routes; // reused across transfers
+    routes.clear();
     coin_value_t value_in = 0;
     coin_value_t value_out = 0;
     
     for(auto& item : senders){
-        sorted_wallets.push_back(item.first);
+        routes.emplace_back(get_wallet_shard(item.first) * config.num_threads + CBDC_WALLET_TO_THREAD(config,item.first,txid),item.first);
         value_in += item.second;
     }
 
     if(!config.enable_source_only_conflicts){
         // add destinations before ordering if this optimization is disabled
         for(auto& item : receivers){
-            sorted_wallets.push_back(item.first);
+            routes.emplace_back(get_wallet_shard(item.first) * config.num_threads + CBDC_WALLET_TO_THREAD(config,item.first,txid),item.first);
             value_out += item.second;
         }
     }
 
-    std::sort(sorted_wallets.begin(),sorted_wallets.end(),[&](const wallet_id_t &a, const wallet_id_t &b){
-                uint32_t subgroup_type_index,subgroup_index,shard_index;
+    std::sort(routes.begin(),routes.end(),std::greater<std::pair<uint64_t,wallet_id_t>>());
 
-                std::string a_key = CBDC_BUILD_TRANSFER_KEY(a);
-                std::tie(subgroup_type_index,subgroup_index,shard_index) = capi.key_to_shard(a_key);
-                uint64_t a_index = shard_index * config.num_threads + (a % config.num_threads);
-                
-                std::string b_key = CBDC_BUILD_TRANSFER_KEY(b);
-                std::tie(subgroup_type_index,subgroup_index,shard_index) = capi.key_to_shard(b_key);
-                uint64_t b_index = shard_index * config.num_threads + (b % config.num_threads);
-
-                return a_index > b_index;
-            });
+    std::vector<wallet_id_t> sorted_wallets;
+    sorted_wallets.reserve(senders.size() + receivers.size());
+    for(auto& route : routes){
+        sorted_wallets.push_back(route.second);
+    }
 
     if(config.enable_source_only_conflicts){
         // add destinations after ordering if this optimization is enabled
@@ -121,35 +171,155 @@ transaction_id_t CascadeCBDC::transfer(const std::unordered_map<wallet_id_t,coin
     // validate if value_in == value_out
     if(value_in != value_out){
         std::cout << "ERROR: value_in(" << value_in << ") != value_out(" << value_out << ") in TX " << txid << std::endl;
-        return txid;
+        return false;
     }
 
     if(sorted_wallets.empty()){
         std::cout << "ERROR: empty transfer for TX " << txid << std::endl;
-        return txid;
+        return false;
     }
     
     wallet_id_t first_wallet = sorted_wallets[0];
-    auto first_shard = std::get<2>(capi.key_to_shard(CBDC_BUILD_TRANSFER_KEY(first_wallet)));
+    auto first_shard = routes.empty() ? get_wallet_shard(first_wallet) : routes[0].first / config.num_threads;
     cbdc_request_t *request = new cbdc_request_t(txid,senders,receivers,sorted_wallets);
     queued_request_t queued_request(thread_request_t::TRANSFER,request);
     
-    TimestampLogger::log(CBDC_TAG_CLIENT_TRANSFER_QUEUE,my_id,txid,first_wallet);
-    client_thread->push_request(queued_request,first_shard);
+    CBDC_TRACE(CBDC_TAG_CLIENT_TRANSFER_QUEUE,my_id,txid,first_wallet);
+    push_request(queued_request,first_shard);
     
-    return txid;
+    return true;
 }
 
 transaction_id_t CascadeCBDC::redeem(wallet_id_t wallet_id,coin_value_t value){
     transaction_id_t txid = next_transaction_id();
-    auto shard = std::get<2>(capi.key_to_shard(CBDC_BUILD_REDEEM_KEY(wallet_id)));
+    send_redeem(txid,wallet_id,value);
+    return txid;
+}
+
+void CascadeCBDC::send_redeem(transaction_id_t txid,wallet_id_t wallet_id,coin_value_t value){
+    auto shard = get_wallet_shard(wallet_id);
     cbdc_request_t *request = new cbdc_request_t(txid,{{wallet_id,value}},{},{wallet_id});
     queued_request_t queued_request(thread_request_t::REDEEM,request);
-    client_thread->push_request(queued_request,shard);
-    
+    push_request(queued_request,shard);
+}
+
+// asynchronous TXs: the callback is registered before the request is queued, so the notification always finds it
+
+transaction_id_t CascadeCBDC::mint_async(wallet_id_t wallet_id,coin_value_t value,const completion_callback_t& callback){
+    transaction_id_t txid = next_transaction_id();
+    if(add_callback(txid,callback)){
+        send_mint(txid,wallet_id,value);
+    }
+    return txid;
+}
+
+transaction_id_t CascadeCBDC::transfer_async(const std::unordered_map<wallet_id_t,coin_value_t>& senders,const std::unordered_map<wallet_id_t,coin_value_t>& receivers,const completion_callback_t& callback){
+    transaction_id_t txid = next_transaction_id();
+    if(add_callback(txid,callback) && !send_transfer(txid,senders,receivers)){
+        run_callback(txid,transaction_status_t::UNKNOWN);
+    }
+    return txid;
+}
+
+transaction_id_t CascadeCBDC::redeem_async(wallet_id_t wallet_id,coin_value_t value,const completion_callback_t& callback){
+    transaction_id_t txid = next_transaction_id();
+    if(add_callback(txid,callback)){
+        send_redeem(txid,wallet_id,value);
+    }
     return txid;
 }
 
+std::future<transaction_status_t> CascadeCBDC::mint_async(wallet_id_t wallet_id,coin_value_t value){
+    auto promise = std::make_shared<std::promise<transaction_status_t>>();
+    mint_async(wallet_id,value,[promise](transaction_id_t txid,transaction_status_t status){
+            promise->set_value(status);
+        });
+    return promise->get_future();
+}
+
+std::future<transaction_status_t> CascadeCBDC::transfer_async(const std::unordered_map<wallet_id_t,coin_value_t>& senders,const std::unordered_map<wallet_id_t,coin_value_t>& receivers){
+    auto promise = std::make_shared<std::promise<transaction_status_t>>();
+    transfer_async(senders,receivers,[promise](transaction_id_t txid,transaction_status_t status){
+            promise->set_value(status);
+        });
+    return promise->get_future();
+}
+
+std::future<transaction_status_t> CascadeCBDC::redeem_async(wallet_id_t wallet_id,coin_value_t value){
+    auto promise = std::make_shared<std::promise<transaction_status_t>>();
+    redeem_async(wallet_id,value,[promise](transaction_id_t txid,transaction_status_t status){
+            promise->set_value(status);
+        });
+    return promise->get_future();
+}
+
+transaction_status_t CascadeCBDC::poll_async(const transaction_id_t& txid,bool abandon){
+    // the notification may still arrive: whichever comes first runs the callback
+    auto status = get_status(txid);
+    if((status != transaction_status_t::UNKNOWN) || abandon){
+        run_callback(txid,status);
+    }
+    return status;
+}
+
+bool CascadeCBDC::add_callback(transaction_id_t txid,const completion_callback_t& callback){
+    // without notifications the TX would never complete
+    if(!config.enable_notifications){
+        std::cout << "ERROR: asynchronous TX " << txid << " requires enable_notifications" << std::endl;
+        callback(txid,transaction_status_t::UNKNOWN);
+        return false;
+    }
+
+    auto& stripe = completion_stripes[txid % COMPLETION_STRIPES];
+    std::unique_lock<std::mutex> lock(stripe.mtx);
+    stripe.callbacks.emplace(txid,callback);
+    return true;
+}
+
+bool CascadeCBDC::run_callback(transaction_id_t txid,transaction_status_t status){
+    auto& stripe = completion_stripes[txid % COMPLETION_STRIPES];
+    std::unique_lock<std::mutex> lock(stripe.mtx);
+    auto it = stripe.callbacks.find(txid);
+    if(it == stripe.callbacks.end()){
+        return false;
+    }
+
+    auto callback = std::move(it->second);
+    stripe.callbacks.erase(it);
+    lock.unlock();
+
+    callback(txid,status);
+    return true;
+}
+
+std::vector<transaction_id_t> CascadeCBDC::bulk_mint(const std::unordered_map<wallet_id_t,coin_value_t>& wallets,uint64_t max_bulk_size){
+    // group wallets by shard
+    std::unordered_map<uint32_t,std::vector<std::pair<wallet_id_t,coin_value_t>>> shard_wallets;
+    for(auto& item : wallets){
+        auto shard = get_wallet_shard(item.first);
+        shard_wallets[shard].push_back(item);
+    }
+
+    // one request for each chunk of up to max_bulk_size wallets in the same shard
+    std::vector<transaction_id_t> txids;
+    for(auto& item : shard_wallets){
+        auto& shard = item.first;
+        auto& shard_list = item.second;
+
+        for(uint64_t start=0;start<shard_list.size();start+=max_bulk_size){
+            uint64_t end = std::min(start+max_bulk_size,(uint64_t)shard_list.size());
+            transaction_id_t txid = next_transaction_id();
+            std::unordered_map<wallet_id_t,coin_value_t> destinations(shard_list.begin()+start,shard_list.begin()+end);
+            cbdc_request_t *request = new cbdc_request_t(txid,{},destinations,{shard_list[start].first});
+            queued_request_t queued_request(thread_request_t::BULK_MINT,request);
+            push_request(queued_request,shard);
+            txids.push_back(txid);
+        }
+    }
+    
+    return txids;
+}
+
 std::string CascadeCBDC::status_to_string(const transaction_status_t status){
     switch(status){
         case transaction_status_t::PENDING:
@@ -164,6 +334,9 @@ std::string CascadeCBDC::status_to_string(const transaction_status_t status){
         case transaction_status_t::ABORT:
             return "abort";
             break;
+        case transaction_status_t::REJECTED:
+            return "rejected";
+            break;
         default:
             break;
     }
@@ -172,16 +345,73 @@ std::string CascadeCBDC::status_to_string(const transaction_status_t status){
 
 wallet_t CascadeCBDC::get_wallet(wallet_id_t wallet_id){
     const std::string& key = CBDC_BUILD_WALLET_KEY(wallet_id);
+    if(config.enable_delta_persistence){
+        return get_delta_wallet(wallet_id);
+    }
+
     auto res = capi.get(key,CURRENT_VERSION,false);
     for (auto& reply_future : res.get()){
         auto& obj = reply_future.second.get();
 
         if(obj.version != INVALID_VERSION){
-            return *mutils::from_bytes<wallet_t>(nullptr,obj.blob.bytes);
+            return CBDC_WALLET_FROM_BYTES(obj.blob.bytes,obj.blob.size);
         }
     }
   
-    return 0;
+    return wallet_t{};
+}
+
+wallet_t CascadeCBDC::get_delta_wallet(wallet_id_t wallet_id){
+    const std::string& key = CBDC_BUILD_WALLET_KEY(wallet_id);
+    auto shard_index = get_wallet_shard(wallet_id);
+
+    // last batch compacted into the wallets: read before the wallet, so a wallet without an image has no delta up to it
+    uint64_t seq = 0;
+    auto marker_res = capi.get<CBDC_OBJECT_POOL_TYPE>(CBDC_BUILD_DELTA_COMPACTED_KEY(shard_index),CURRENT_VERSION,false,CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+    for (auto& reply_future : marker_res.get()){
+        auto& obj = reply_future.second.get();
+        if(obj.version != INVALID_VERSION){
+            seq = *mutils::from_bytes<uint64_t>(nullptr,obj.blob.bytes);
+        }
+        break;
+    }
+
+    // latest image of the wallet
+    wallet_t wallet{};
+    uint64_t image_seq = 0;
+    auto res = capi.get<CBDC_OBJECT_POOL_TYPE>(key,CURRENT_VERSION,false,CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+    for (auto& reply_future : res.get()){
+        auto& obj = reply_future.second.get();
+        if(obj.version != INVALID_VERSION){
+            wallet = CBDC_WALLET_IMAGE_FROM_BYTES(obj.blob.bytes,obj.blob.size,image_seq);
+        }
+        break;
+    }
+
+    // deltas not compacted yet: the wallet has none up to its image nor up to the marker (older batches may be removed)
+    seq = std::max(seq,image_seq);
+    while(true){
+        bool found = false;
+        auto delta_res = capi.get<CBDC_OBJECT_POOL_TYPE>(CBDC_BUILD_DELTA_KEY(shard_index,seq+1),CURRENT_VERSION,false,CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+        for (auto& reply_future : delta_res.get()){
+            auto& obj = reply_future.second.get();
+            if(obj.version != INVALID_VERSION){
+                auto batch = mutils::from_bytes<wallet_delta_batch_t>(nullptr,obj.blob.bytes);
+                for(auto& delta : *batch){
+                    if(std::get<0>(delta) == wallet_id){
+                        CBDC_APPLY_WALLET_DELTA(wallet,std::get<1>(delta));
+                    }
+                }
+                found = true;
+            }
+            break;
+        }
+
+        if(!found){
+            return wallet;
+        }
+        seq++;
+    }
 }
 
 transaction_status_t CascadeCBDC::get_status(const transaction_id_t& txid){
@@ -191,14 +421,264 @@ transaction_status_t CascadeCBDC::get_status(const transaction_id_t& txid){
         auto& obj = reply_future.second.get();
 
         if(obj.version != INVALID_VERSION){
-            TimestampLogger::log(CBDC_TAG_CLIENT_STATUS,my_id,txid,obj.version);
-            return std::get<1>(*mutils::from_bytes<transaction_t>(nullptr,obj.blob.bytes));
+            CBDC_TRACE(CBDC_TAG_CLIENT_STATUS,my_id,txid,obj.version);
+            auto status = std::get<1>(*mutils::from_bytes<transaction_t>(nullptr,obj.blob.bytes));
+            observe_status(status);
+            return status;
         }
     }
   
     return transaction_status_t::UNKNOWN;
 }
 
+void CascadeCBDC::handle_notification(const Blob& blob){
+    auto batch = mutils::from_bytes<tx_completion_batch_t>(nullptr,blob.bytes);
+    bool stored = false;
+    for(auto& completion : *batch){
+        CBDC_TRACE(CBDC_TAG_CLIENT_COMPLETION,my_id,completion.first,static_cast<uint64_t>(completion.second));
+        observe_status(completion.second);
+        if(run_callback(completion.first,completion.second)){
+            continue;
+        }
+
+        // not sent asynchronously: kept only if wait_completion is waiting for it, otherwise the map would grow with every TX
+        std::unique_lock<std::mutex> lock(completion_mtx);
+        if(completion_waiters.count(completion.first) > 0){
+            completions[completion.first] = completion.second;
+            stored = true;
+        }
+    }
+
+    if(stored){
+        completion_signal.notify_all();
+    }
+}
+
+transaction_status_t CascadeCBDC::wait_completion(const transaction_id_t& txid,std::chrono::milliseconds timeout){
+    std::unique_lock<std::mutex> lock(completion_mtx);
+    completion_waiters[txid]++;
+    auto status = transaction_status_t::UNKNOWN;
+    if(completion_signal.wait_for(lock,timeout,[&](){ return completions.count(txid) > 0; })){
+        status = completions[txid];
+    }
+
+    // the completion is kept until the last waiter returns
+    if(--completion_waiters[txid] == 0){
+        completion_waiters.erase(txid);
+        completions.erase(txid);
+    }
+    return status;
+}
+
+void CascadeCBDC::multi_get(const std::vector<std::pair<std::string,uint32_t>>& keys,uint64_t max_in_flight,const std::function<void(uint64_t,const ObjectWithStringKey&)>& on_reply){
+    // alternate between shards, so all shards are serving gets at the same time
+    std::map<uint32_t,std::vector<uint64_t>> shard_keys;
+    for(uint64_t i=0;i<keys.size();i++){
+        shard_keys[keys[i].second].push_back(i);
+    }
+
+    std::vector<uint64_t> order;
+    order.reserve(keys.size());
+    for(uint64_t j=0;order.size() < keys.size();j++){
+        for(auto& item : shard_keys){
+            if(j < item.second.size()){
+                order.push_back(item.second[j]);
+            }
+        }
+    }
+
+    // sliding window: a new get is issued as soon as the oldest one returns
+    max_in_flight = std::max(max_in_flight,(uint64_t)1);
+    std::deque<std::pair<uint64_t,derecho::rpc::QueryResults<const ObjectWithStringKey>>> in_flight;
+    for(uint64_t i=0;(i < order.size()) || !in_flight.empty();){
+        if((i < order.size()) && (in_flight.size() < max_in_flight)){
+            auto& key = keys[order[i]];
+            in_flight.emplace_back(order[i],capi.get<CBDC_OBJECT_POOL_TYPE>(key.first,CURRENT_VERSION,false,CBDC_OBJECT_POOL_SUBGROUP,key.second));
+            i++;
+            continue;
+        }
+
+        auto& oldest = in_flight.front();
+        for(auto& reply_future : oldest.second.get()){
+            on_reply(oldest.first,reply_future.second.get());
+            break;
+        }
+        in_flight.pop_front();
+    }
+}
+
+std::unordered_map<wallet_id_t,wallet_t> CascadeCBDC::get_wallets(const std::vector<wallet_id_t>& wallet_ids,uint64_t max_in_flight){
+    std::unordered_map<wallet_id_t,wallet_t> wallets;
+    wallets.reserve(wallet_ids.size());
+    std::vector<std::pair<std::string,uint32_t>> keys;
+    keys.reserve(wallet_ids.size());
+    for(auto& wallet_id : wallet_ids){
+        keys.emplace_back(CBDC_BUILD_WALLET_KEY(wallet_id),get_wallet_shard(wallet_id));
+        wallets[wallet_id] = wallet_t{};
+    }
+
+    if(!config.enable_delta_persistence){
+        multi_get(keys,max_in_flight,[&](uint64_t i,const ObjectWithStringKey& obj){
+            if(obj.version != INVALID_VERSION){
+                wallets[wallet_ids[i]] = CBDC_WALLET_FROM_BYTES(obj.blob.bytes,obj.blob.size);
+            }
+        });
+        return wallets;
+    }
+
+    // last compacted batch of each shard: read before the wallets (see get_delta_wallet)
+    std::map<uint32_t,uint64_t> compacted_seq;
+    for(auto& item : keys){
+        compacted_seq[item.second] = 0;
+    }
+
+    std::vector<std::pair<std::string,uint32_t>> marker_keys;
+    for(auto& item : compacted_seq){
+        marker_keys.emplace_back(CBDC_BUILD_DELTA_COMPACTED_KEY(item.first),item.first);
+    }
+
+    multi_get(marker_keys,max_in_flight,[&](uint64_t i,const ObjectWithStringKey& obj){
+        compacted_seq[marker_keys[i].second] = (obj.version != INVALID_VERSION) ? *mutils::from_bytes<uint64_t>(nullptr,obj.blob.bytes) : 0;
+    });
+
+    std::vector<uint64_t> wallet_seq(wallet_ids.size());
+    multi_get(keys,max_in_flight,[&](uint64_t i,const ObjectWithStringKey& obj){
+        uint64_t image_seq = 0;
+        if(obj.version != INVALID_VERSION){
+            wallets[wallet_ids[i]] = CBDC_WALLET_IMAGE_FROM_BYTES(obj.blob.bytes,obj.blob.size,image_seq);
+        }
+        wallet_seq[i] = std::max(compacted_seq[keys[i].second],image_seq);
+    });
+
+    // deltas not compacted yet, after the image or the marker of each wallet (older batches may be removed): each batch is read once per shard
+    std::unordered_map<uint32_t,uint64_t> from_seq;
+    std::unordered_map<wallet_id_t,uint64_t> seq_of;
+    for(uint64_t i=0;i<wallet_ids.size();i++){
+        auto shard_index = keys[i].second;
+        from_seq[shard_index] = from_seq.count(shard_index) > 0 ? std::min(from_seq[shard_index],wallet_seq[i]) : wallet_seq[i];
+        seq_of[wallet_ids[i]] = wallet_seq[i];
+    }
+
+    for(auto& item : from_seq){
+        auto shard_index = item.first;
+        for(uint64_t seq = item.second + 1;;seq++){
+            bool found = false;
+            auto res = capi.get<CBDC_OBJECT_POOL_TYPE>(CBDC_BUILD_DELTA_KEY(shard_index,seq),CURRENT_VERSION,false,CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+            for (auto& reply_future : res.get()){
+                auto& obj = reply_future.second.get();
+                if(obj.version != INVALID_VERSION){
+                    auto batch = mutils::from_bytes<wallet_delta_batch_t>(nullptr,obj.blob.bytes);
+                    for(auto& delta : *batch){
+                        auto it = seq_of.find(std::get<0>(delta));
+                        if((it != seq_of.end()) && (seq > it->second)){
+                            CBDC_APPLY_WALLET_DELTA(wallets[it->first],std::get<1>(delta));
+                        }
+                    }
+                    found = true;
+                }
+                break;
+            }
+
+            if(!found){
+                break;
+            }
+        }
+    }
+
+    return wallets;
+}
+
+std::unordered_map<transaction_id_t,transaction_status_t> CascadeCBDC::get_statuses(const std::vector<transaction_id_t>& txids,uint64_t max_in_flight){
+    std::unordered_map<transaction_id_t,transaction_status_t> statuses;
+    statuses.reserve(txids.size());
+    std::vector<std::pair<std::string,uint32_t>> keys;
+    keys.reserve(txids.size());
+    for(auto& txid : txids){
+        const std::string& key = CBDC_BUILD_TRANSACTION_KEY(txid);
+        keys.emplace_back(key,std::get<2>(capi.key_to_shard(key)));
+        statuses[txid] = transaction_status_t::UNKNOWN;
+    }
+
+    multi_get(keys,max_in_flight,[&](uint64_t i,const ObjectWithStringKey& obj){
+        if(obj.version != INVALID_VERSION){
+            CBDC_TRACE(CBDC_TAG_CLIENT_STATUS,my_id,txids[i],obj.version);
+            statuses[txids[i]] = std::get<1>(*mutils::from_bytes<transaction_t>(nullptr,obj.blob.bytes));
+        }
+    });
+
+    return statuses;
+}
+
+uint32_t CascadeCBDC::get_wallet_shard(wallet_id_t wallet_id){
+    std::shared_lock<std::shared_mutex> lock(routing_mtx);
+    auto it = routing_cache.find(wallet_id);
+    if(it != routing_cache.end()){
+        return it->second;
+    }
+    lock.unlock();
+
+    // first time: a single key (any key of the wallet is in the same shard)
+    auto shard = std::get<2>(capi.key_to_shard(CBDC_BUILD_WALLET_KEY(wallet_id)));
+    std::unique_lock<std::shared_mutex> write_lock(routing_mtx);
+    routing_cache.emplace(wallet_id,shard);
+    return shard;
+}
+
+void CascadeCBDC::refresh_routing(){
+    auto num_shards = capi.get_subgroup_members(CBDC_PREFIX).size();
+    std::unique_lock<std::shared_mutex> lock(routing_mtx);
+    if(num_shards != routing_num_shards){
+        routing_cache.clear();
+        routing_num_shards = num_shards;
+    }
+}
+
+std::vector<shard_digest_t> CascadeCBDC::get_digests(uint64_t range_size){
+    digest_request_t digest_request(next_transaction_id(),range_size);
+    auto request_id = std::get<0>(digest_request);
+
+    ObjectWithStringKey obj;
+    obj.key = CBDC_REQUEST_DIGEST_KEY;
+    obj.blob = Blob([&](uint8_t* buffer,const std::size_t size){
+            return mutils::to_bytes(digest_request, buffer);
+        },mutils::bytes_size(digest_request));
+
+    std::vector<std::vector<uint32_t>> shards = capi.get_subgroup_members(CBDC_PREFIX);
+    for(uint32_t shard_index = 0; shard_index < shards.size(); shard_index++){
+        capi.put_and_forget<CBDC_OBJECT_POOL_TYPE>(obj,CBDC_OBJECT_POOL_SUBGROUP,shard_index,true);
+    }
+
+    // poll until each shard put its digest
+    std::vector<shard_digest_t> digests(shards.size());
+    auto poll_interval = std::chrono::milliseconds(DIGEST_POLL_INTERVAL_MS);
+    for(uint32_t shard_index = 0; shard_index < shards.size(); shard_index++){
+        const std::string& key = CBDC_BUILD_DIGEST_KEY(shard_index,request_id);
+        bool found = false;
+        while(!found){
+            auto res = capi.get<CBDC_OBJECT_POOL_TYPE>(key,CURRENT_VERSION,false,CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+            for (auto& reply_future : res.get()){
+                auto& digest_obj = reply_future.second.get();
+                if(digest_obj.version != INVALID_VERSION){
+                    digests[shard_index] = *mutils::from_bytes<shard_digest_t>(nullptr,digest_obj.blob.bytes);
+                    found = true;
+                }
+                break;
+            }
+
+            if(!found){
+                std::this_thread::sleep_for(poll_interval);
+            }
+        }
+    }
+
+    return digests;
+}
+
+void CascadeCBDC::log_intended_start(transaction_id_t txid,std::chrono::steady_clock::time_point intended){
+    auto delay = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - intended).count();
+    CBDC_TRACE(CBDC_TAG_CLIENT_TRANSFER_INTENDED,my_id,txid,std::max(delay,(decltype(delay))0));
+}
+
 void CascadeCBDC::reset(){
     ObjectWithStringKey obj;
     obj.key = CBDC_REQUEST_RESET_KEY;
@@ -207,10 +687,14 @@ void CascadeCBDC::reset(){
     for(uint32_t shard_index = 0; shard_index < shards.size(); shard_index++){
         capi.put_and_forget<CBDC_OBJECT_POOL_TYPE>(obj,CBDC_OBJECT_POOL_SUBGROUP,shard_index,true);
     }
+
+    std::unique_lock<std::mutex> lock(completion_mtx);
+    completions.clear();
 }
 
 void CascadeCBDC::write_logs(const std::string local_log,const std::string remote_logs){
     TimestampLogger::flush(local_log);
+    CBDCTrace::flush(local_log + ".trace");
 
     if(remote_logs == "-"){
         return;
@@ -228,16 +712,33 @@ void CascadeCBDC::write_logs(const std::string local_log,const std::string remot
 
 // client thread methods
 
-CascadeCBDC::ClientThread::ClientThread(uint64_t batch_min_size,uint64_t batch_max_size,uint64_t batch_time_us){
+CascadeCBDC::ClientThread::ClientThread(uint64_t batch_min_size,uint64_t batch_max_size,uint64_t batch_time_us,uint64_t queue_max_size,const std::vector<uint32_t>& shards){
     this->batch_min_size = batch_min_size;
     this->batch_max_size = batch_max_size;
     this->batch_time_us = batch_time_us;
+    this->queue_max_size = queue_max_size;
+
+    uint64_t capacity = (queue_max_size > 0) ? queue_max_size : CLIENT_QUEUE_CAPACITY;
+    for(auto shard : shards){
+        request_queues[shard].reset(new MPSCQueue<queued_request_t>(capacity));
+    }
 }
 
 void CascadeCBDC::ClientThread::push_request(queued_request_t &queued_request,uint32_t shard){
-    std::unique_lock<std::mutex> lock(thread_mtx);
-    request_queues[shard].push(queued_request);
-    thread_signal.notify_all();
+    auto& queue = *request_queues.at(shard);
+
+    // backpressure: wait until the thread has sent enough requests to this shard
+    while(((queue_max_size > 0) && (queue.size() >= queue_max_size)) || !queue.try_push(queued_request)){
+        if(!running) return;
+        std::this_thread::yield();
+    }
+
+    // wake up the thread if it is waiting (the fence orders the push before reading the flag, as the thread sets the flag before checking the queues)
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(sleeping.load()){
+        std::unique_lock<std::mutex> lock(thread_mtx);
+        thread_signal.notify_all();
+    }
 }
 
 void CascadeCBDC::ClientThread::signal_stop(){
@@ -250,103 +751,112 @@ void CascadeCBDC::ClientThread::main_loop(){
     if(!running) return;
    
     // thread main loop 
-    std::unordered_map<uint32_t,queued_request_t*> to_persist;
+    queued_request_t* requests = new queued_request_t[batch_max_size];
     std::unordered_map<uint32_t,std::chrono::steady_clock::time_point> wait_time;
     auto batch_time = std::chrono::microseconds(batch_time_us);
-    while(true){
-        std::unique_lock<std::mutex> lock(thread_mtx);
-        bool empty = true;
-        for(auto& item : request_queues){
-            empty = empty && item.second.empty();
-        }
-
-        if(empty){
-            thread_signal.wait_for(lock,batch_time);
-        }
-
-        if(!running) break;
+    auto start = std::chrono::steady_clock::now();
+    for(auto& item : request_queues){
+        wait_time[item.first] = start;
+    }
 
-        std::unordered_map<uint32_t,uint64_t> persist_count;
+    while(running){
+        bool empty = true;
         auto now = std::chrono::steady_clock::now();
         for(auto& item : request_queues){
             auto& shard = item.first;
-            auto& queue = item.second;
+            auto& queue = *item.second;
 
-            if(to_persist.count(shard) == 0){
-                to_persist[shard] = new queued_request_t[batch_max_size];
-                wait_time[shard] = now;
-            }
-        
             uint64_t queued_count = queue.size();
+            if(queued_count == 0){
+                continue;
+            }
+            empty = false;
+
             if((queued_count >= batch_min_size) || ((now-wait_time[shard]) >= batch_time)){
-                persist_count[shard] = std::min(queued_count,batch_max_size);
                 wait_time[shard] = now;
             
-                // copy out wallets
-                for(uint64_t i=0;i<persist_count[shard];i++){
-                    to_persist[shard][i] = queue.front();
-                    queue.pop();
+                // copy out requests
+                uint64_t count = 0;
+                while((count < batch_max_size) && queue.try_pop(requests[count])){
+                    count++;
                 }
+
+                // the queues are not locked (i.e the client can continue adding requests to them): build objects and call put_objects
+                send_batch(shard,requests,count);
             }
         }
-        
-        lock.unlock();
-        
-        // now we are outside the locked region (i.e the client can continue adding requests to the queues): build objects and call put_objects
-        for(auto& item : persist_count){
-            auto& shard = item.first;
-            auto count = item.second;
 
-            if(count == 0){
-                continue;
+        if(empty){
+            std::unique_lock<std::mutex> lock(thread_mtx);
+            sleeping = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            for(auto& item : request_queues){
+                empty = empty && (item.second->size() == 0);
             }
 
-            auto requests = to_persist[shard];
-
-            std::vector<ObjectWithStringKey> objects;
-            objects.reserve(count);
-
-            for(uint64_t i=0;i<count;i++){
-                auto& queued_request = requests[i];
-                auto& operation = queued_request.first;
-                auto request = queued_request.second;
-                auto& txid = std::get<0>(*request);
-                auto& sorted_wallets = std::get<3>(*request);
-                auto first_wallet = sorted_wallets[0];
-
-                std::size_t sz = mutils::bytes_size(*request);
-                uint8_t* buffer = new uint8_t[sz];
-                mutils::to_bytes(*request, buffer);
-
-                std::string key;
-                switch(operation){
-                    case thread_request_t::MINT:
-                        key = CBDC_BUILD_MINT_KEY(first_wallet);
-                        break;
-                    case thread_request_t::TRANSFER:
-                        key = CBDC_BUILD_TRANSFER_KEY(first_wallet);
-                        break;
-                    case thread_request_t::REDEEM:
-                        key = CBDC_BUILD_REDEEM_KEY(first_wallet);
-                        break;
-                }
-                    
-                objects.emplace_back(key,Blob(buffer,sz));
-                objects[i].message_id = txid;
-                delete request;
-            }
-    
-            for(auto& obj : objects){
-                TimestampLogger::log(CBDC_TAG_CLIENT_TRANSFER_SENDING,node_id,obj.message_id,0);
+            if(empty && running){
+                thread_signal.wait_for(lock,batch_time);
             }
+            sleeping = false;
+        }
+    }
 
-            TimestampLogger::log(CBDC_TAG_CLIENT_BATCHING,node_id,objects.size(),shard);
-            capi.put_objects_and_forget<CBDC_OBJECT_POOL_TYPE>(objects,CBDC_OBJECT_POOL_SUBGROUP,shard,true);
-            
-            for(auto& obj : objects){
-                TimestampLogger::log(CBDC_TAG_CLIENT_TRANSFER_SENT,node_id,obj.message_id,0);
-            }
+    delete[] requests;
+}
+
+void CascadeCBDC::build_request_objects(const queued_request_t* requests,uint64_t count,std::vector<ObjectWithStringKey>& objects){
+    objects.reserve(objects.size() + count);
+    for(uint64_t i=0;i<count;i++){
+        auto& queued_request = requests[i];
+        auto& operation = queued_request.first;
+        auto request = queued_request.second;
+        auto& txid = std::get<0>(*request);
+        auto& sorted_wallets = std::get<3>(*request);
+        auto first_wallet = sorted_wallets[0];
+
+        std::size_t sz = mutils::bytes_size(*request);
+        uint8_t* buffer = new uint8_t[sz];
+        mutils::to_bytes(*request, buffer);
+
+        std::string key;
+        switch(operation){
+            case thread_request_t::MINT:
+                key = CBDC_BUILD_MINT_KEY(first_wallet);
+                break;
+            case thread_request_t::TRANSFER:
+                key = CBDC_BUILD_TRANSFER_KEY(first_wallet);
+                break;
+            case thread_request_t::REDEEM:
+                key = CBDC_BUILD_REDEEM_KEY(first_wallet);
+                break;
+            case thread_request_t::BULK_MINT:
+                key = CBDC_BUILD_BULK_MINT_KEY(first_wallet);
+                break;
         }
+            
+        objects.emplace_back(key,Blob(buffer,sz));
+        objects.back().message_id = txid;
+        delete request;
+    }
+}
+
+void CascadeCBDC::ClientThread::send_batch(uint32_t shard,queued_request_t* requests,uint64_t count){
+    if(count == 0){
+        return;
+    }
+
+    std::vector<ObjectWithStringKey> objects;
+    build_request_objects(requests,count,objects);
+
+    for(auto& obj : objects){
+        CBDC_TRACE(CBDC_TAG_CLIENT_TRANSFER_SENDING,node_id,obj.message_id,0);
+    }
+
+    CBDC_TRACE(CBDC_TAG_CLIENT_BATCHING,node_id,objects.size(),shard);
+    capi.put_objects_and_forget<CBDC_OBJECT_POOL_TYPE>(objects,CBDC_OBJECT_POOL_SUBGROUP,shard,true);
+    
+    for(auto& obj : objects){
+        CBDC_TRACE(CBDC_TAG_CLIENT_TRANSFER_SENT,node_id,obj.message_id,0);
     }
 }
 
@@ -11,19 +11,38 @@
 #include <shared_mutex>
 #include <thread>
 #include <limits>
+#include <functional>
+#include <deque>
+#include <map>
+#include <condition_variable>
+#include <future>
+#include <atomic>
 #include "common.hpp"
+#include "cbdc_trace.hpp"
+#include "mpsc_queue.hpp"
 
 using namespace derecho::cascade;
 
+#define DIGEST_POLL_INTERVAL_MS 100
+#define DEFAULT_MAX_GETS_IN_FLIGHT 256
+#define COMPLETION_STRIPES 64
+#define DEFAULT_SENDER_THREADS 1
+#define CLIENT_QUEUE_CAPACITY 65536 // requests queued per shard when queue_max_size is 0
+#define REJECT_BACKOFF_MIN_US 100 // delay of new requests after a TX is rejected by the service
+#define REJECT_BACKOFF_MAX_US 100000
+
 enum class thread_request_t : uint8_t {
     MINT,
     TRANSFER,
-    REDEEM
+    REDEEM,
+    BULK_MINT
 };
 
 using queued_request_t = std::pair<thread_request_t,cbdc_request_t*>;
+using completion_callback_t = std::function<void(transaction_id_t,transaction_status_t)>; // called once with the final status of an asynchronous TX
 
 class CascadeCBDC {
+    // sender thread: batches and sends the requests of its shards, pushed by any number of threads to lock-free queues
     class ClientThread {
     private:
         std::thread real_thread;
@@ -32,16 +51,19 @@ class CascadeCBDC {
         uint64_t batch_min_size = 0;
         uint64_t batch_max_size = 16;
         uint64_t batch_time_us = 10000;
+        uint64_t queue_max_size = 0; // push_request blocks while the shard queue is full (0 = up to CLIENT_QUEUE_CAPACITY)
 
-        bool running = false;
+        std::atomic<bool> running{false};
+        std::atomic<bool> sleeping{false}; // the thread is waiting for requests: producers must signal it
         std::mutex thread_mtx;
         std::condition_variable thread_signal;
-        std::unordered_map<uint32_t,std::queue<queued_request_t>> request_queues;
+        std::unordered_map<uint32_t,std::unique_ptr<MPSCQueue<queued_request_t>>> request_queues; // shards of this thread, fixed after construction
 
         void main_loop();
+        void send_batch(uint32_t shard,queued_request_t* requests,uint64_t count);
 
     public:
-        ClientThread(uint64_t batch_min_size,uint64_t batch_max_size,uint64_t batch_time_us);
+        ClientThread(uint64_t batch_min_size,uint64_t batch_max_size,uint64_t batch_time_us,uint64_t queue_max_size,const std::vector<uint32_t>& shards);
         void push_request(queued_request_t &queued_request,uint32_t shard);
         void signal_stop();
 
@@ -57,27 +79,102 @@ class CascadeCBDC {
 
     ServiceClientAPI& capi = ServiceClientAPI::get_service_client();
     uint64_t my_id = capi.get_my_id();
-    uint64_t tx_count = 0;
+    std::atomic<uint64_t> tx_count{0};
     cascade_cbdc_config_t config;
-    ClientThread *client_thread;
+    std::vector<ClientThread*> client_threads; // shard i is sent by client_threads[i % client_threads.size()]
 
-    std::mutex txid_mtx;
     transaction_id_t next_transaction_id();
+    void push_request(queued_request_t &queued_request,uint32_t shard);
+
+    // backpressure: after the service rejects a TX (admission control), new requests are delayed; the delay doubles with each rejected TX and halves with each admitted one
+    std::atomic<uint64_t> backoff_us{0};
+    std::atomic<int64_t> backoff_until_ns{0}; // steady clock
+    std::atomic<uint64_t> rejected_count{0};
+    void observe_status(transaction_status_t status);
+    void wait_backoff();
+
+    // routing cache: shard of each wallet (all keys of a wallet share its affinity key), so requests are routed without building keys
+    std::shared_mutex routing_mtx;
+    std::unordered_map<wallet_id_t,uint32_t> routing_cache;
+    uint64_t routing_num_shards = 0; // number of shards when the cache was filled
+    void send_mint(transaction_id_t txid,wallet_id_t wallet_id,coin_value_t value);
+    bool send_transfer(transaction_id_t txid,const std::unordered_map<wallet_id_t,coin_value_t>& senders,const std::unordered_map<wallet_id_t,coin_value_t>& receivers);
+    void send_redeem(transaction_id_t txid,wallet_id_t wallet_id,coin_value_t value);
+    wallet_t get_delta_wallet(wallet_id_t wallet_id); // persisted wallet plus the deltas not compacted yet
+
+    // completion notifications (enable_notifications): final status of the TXs of this client
+    std::mutex completion_mtx;
+    std::condition_variable completion_signal;
+    std::unordered_map<transaction_id_t,transaction_status_t> completions; // only the TXs someone is waiting for
+    std::unordered_map<transaction_id_t,uint64_t> completion_waiters; // number of wait_completion calls blocked on each TX
+    void handle_notification(const Blob& blob);
+
+    // asynchronous TXs: callbacks waiting for their completion, split by txid so that submitting threads and the notification handler rarely share a lock
+    struct completion_stripe_t {
+        std::mutex mtx;
+        std::unordered_map<transaction_id_t,completion_callback_t> callbacks;
+    };
+    completion_stripe_t completion_stripes[COMPLETION_STRIPES];
+    bool add_callback(transaction_id_t txid,const completion_callback_t& callback);
+    bool run_callback(transaction_id_t txid,transaction_status_t status); // false if there is no callback for txid
+
+    // get (key,shard) pairs with up to max_in_flight concurrent gets, alternating between shards: on_reply gets the position of the key and the object (which may have INVALID_VERSION)
+    void multi_get(const std::vector<std::pair<std::string,uint32_t>>& keys,uint64_t max_in_flight,const std::function<void(uint64_t,const ObjectWithStringKey&)>& on_reply);
     
     public:
 
     CascadeCBDC();
     ~CascadeCBDC();
     
-    void setup(uint64_t batch_min_size,uint64_t batch_max_size,uint64_t batch_time_us);
+    void setup(uint64_t batch_min_size,uint64_t batch_max_size,uint64_t batch_time_us,uint64_t queue_max_size,uint64_t num_sender_threads = DEFAULT_SENDER_THREADS);
+
+    // objects put by a sender thread for a batch of requests, which are deleted (also used by benchmark_submission)
+    static void build_request_objects(const queued_request_t* requests,uint64_t count,std::vector<ObjectWithStringKey>& objects);
     
     transaction_id_t mint(wallet_id_t wallet_id,coin_value_t value);
     transaction_id_t transfer(const std::unordered_map<wallet_id_t,coin_value_t>& senders,const std::unordered_map<wallet_id_t,coin_value_t>& receivers);
     transaction_id_t redeem(wallet_id_t wallet_id,coin_value_t value);
+    std::vector<transaction_id_t> bulk_mint(const std::unordered_map<wallet_id_t,coin_value_t>& wallets,uint64_t max_bulk_size);
+
+    // asynchronous versions (require enable_notifications): the callback is called, from the notification handler, with the final status of the TX
+    transaction_id_t mint_async(wallet_id_t wallet_id,coin_value_t value,const completion_callback_t& callback);
+    transaction_id_t transfer_async(const std::unordered_map<wallet_id_t,coin_value_t>& senders,const std::unordered_map<wallet_id_t,coin_value_t>& receivers,const completion_callback_t& callback);
+    transaction_id_t redeem_async(wallet_id_t wallet_id,coin_value_t value,const completion_callback_t& callback);
+    std::future<transaction_status_t> mint_async(wallet_id_t wallet_id,coin_value_t value);
+    std::future<transaction_status_t> transfer_async(const std::unordered_map<wallet_id_t,coin_value_t>& senders,const std::unordered_map<wallet_id_t,coin_value_t>& receivers);
+    std::future<transaction_status_t> redeem_async(wallet_id_t wallet_id,coin_value_t value);
+
+    // asynchronous TX not notified in time: reads its status and runs its callback if the status is final, or with UNKNOWN if abandon is set (returns the status read)
+    transaction_status_t poll_async(const transaction_id_t& txid,bool abandon = false);
 
     wallet_t get_wallet(wallet_id_t wallet_id);
     transaction_status_t get_status(const transaction_id_t& txid);
+    
+    // with enable_notifications: block until the service notifies the final status of txid (UNKNOWN after the timeout), for TXs not sent asynchronously
+    // (a notification received while nobody waits for txid is dropped, so a TX that may be final already should be checked with get_status)
+    transaction_status_t wait_completion(const transaction_id_t& txid,std::chrono::milliseconds timeout);
+    
+    inline bool notifications_enabled() const {
+        return config.enable_notifications;
+    }
+
+    // TXs seen rejected by the service (in notifications or get_status), which made the client back off
+    inline uint64_t get_rejected_count() const {
+        return rejected_count.load();
+    }
+    uint32_t get_wallet_shard(wallet_id_t wallet_id);
+    void refresh_routing(); // clear the routing cache if the number of shards changed (call after a view change)
+
+    // bulk versions of get_wallet and get_status: keys are grouped by shard and fetched concurrently
+    std::unordered_map<wallet_id_t,wallet_t> get_wallets(const std::vector<wallet_id_t>& wallet_ids,uint64_t max_in_flight = DEFAULT_MAX_GETS_IN_FLIGHT);
+    std::unordered_map<transaction_id_t,transaction_status_t> get_statuses(const std::vector<transaction_id_t>& txids,uint64_t max_in_flight = DEFAULT_MAX_GETS_IN_FLIGHT);
+
+    // ask every shard for the digests of its wallets (in ranges of range_size wallet IDs) and TX statuses: returns the digest of each shard
+    std::vector<shard_digest_t> get_digests(uint64_t range_size);
    
+    // open-loop pacing: log when the transfer txid should have started, so latency includes the time the client was behind schedule
+    void log_intended_start(transaction_id_t txid,std::chrono::steady_clock::time_point intended);
+
     void reset(); 
     void write_logs(const std::string local_log,const std::string remote_logs);
 
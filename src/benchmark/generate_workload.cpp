@@ -4,6 +4,9 @@
 #include <unistd.h>
 #include <string>
 #include <stdlib.h>
+#include <chrono>
+#include <sys/resource.h>
+#include <sstream>
 
 void print_help(const std::string& bin_name){
     std::cout << "usage: " << bin_name << " [options]" << std::endl;
@@ -16,10 +19,61 @@ void print_help(const std::string& bin_name){
     std::cout << " -i <wallet_initial_balance>\tinitial balance of each wallet" << std::endl;
     std::cout << " -v <transfer_value>\t\tamount transfered from each sender" << std::endl;
     std::cout << " -g <random_seed>\t\tseed for the RNG" << std::endl;
+    std::cout << " -k <hot_wallet_percent>\tpercentage of transfers paying to or from a single hot (merchant) wallet" << std::endl;
     std::cout << " -o <output_file>\t\tfile to write the generated workload (zipped)" << std::endl;
+    std::cout << " -b\t\t\t\twrite the binary format, which run_benchmark maps into memory instead of parsing" << std::endl;
+    std::cout << " -S\t\t\t\tstreaming generator: write the binary format as transfers are generated, without keeping them in memory (a different workload from the default generator)" << std::endl;
+    std::cout << " -j <threads>\t\t\tstreaming generator split across this many threads (the workload depends on the number of threads)" << std::endl;
+    std::cout << "streaming generator distributions (any of these implies -S):" << std::endl;
+    std::cout << " -z <zipf_skew>\t\t\twallets drawn from a Zipf distribution with this skew (e.g. 0.99), instead of each one appearing transfers_per_wallet times" << std::endl;
+    std::cout << " -d <num_shards>\t\tnumber of shards of the service, for -l" << std::endl;
+    std::cout << " -l <same_shard_percent>\tpercentage of transfers with all wallets in the same shard (the others span at least two shards)" << std::endl;
+    std::cout << " -X <sender_histogram>\t\tnumber of senders of each transfer, as comma-separated count:weight pairs (e.g. 1:80,2:20; count up to " << CBDC_WORKLOAD_MAX_ARITY << ")" << std::endl;
+    std::cout << " -Y <receiver_histogram>\tnumber of receivers of each transfer, as comma-separated count:weight pairs" << std::endl;
+    std::cout << " -V <amount_distribution>\tamount sent by each sender, minted or redeemed: 'fixed' (transfer_value), 'uniform' (1 to 2*transfer_value-1) or 'exponential' (mean transfer_value)" << std::endl;
+    std::cout << " -M <mint_percent>\t\tpercentage of operations minting coins into a wallet" << std::endl;
+    std::cout << " -R <redeem_percent>\t\tpercentage of operations redeeming coins from a wallet" << std::endl;
     std::cout << " -h\t\t\t\tshow this help" << std::endl;
 }
 
+// comma-separated count:weight pairs
+void parse_histogram(const std::string& histogram,uint64_t weights[]){
+    std::stringstream histogram_stream(histogram);
+    std::string pair;
+    while(std::getline(histogram_stream,pair,',')){
+        auto separator = pair.find(":");
+        uint64_t count = std::stoull(pair.substr(0,separator));
+        if((count == 0) || (count > CBDC_WORKLOAD_MAX_ARITY) || (separator == std::string::npos)){
+            std::cout << "ERROR: invalid histogram entry '" << pair << "'" << std::endl;
+            continue;
+        }
+        weights[count] = std::stoull(pair.substr(separator + 1));
+    }
+}
+
+std::string histogram_to_string(const uint64_t weights[]){
+    std::string histogram;
+    for(uint64_t i=1;i<=CBDC_WORKLOAD_MAX_ARITY;i++){
+        if(weights[i] > 0){
+            histogram += (histogram.empty() ? "" : ",") + std::to_string(i) + ":" + std::to_string(weights[i]);
+        }
+    }
+    return histogram;
+}
+
+// distributions that differ from the default model, for the default output file name
+std::string distribution_suffix(const workload_distribution_t& distribution,const std::string& amount_str){
+    std::stringstream suffix;
+    if(distribution.zipf_skew > 0) suffix << "_z" << distribution.zipf_skew;
+    if(distribution.num_shards > 0) suffix << "_l" << distribution.same_shard_percent << "of" << distribution.num_shards;
+    if(!histogram_to_string(distribution.sender_weights).empty()) suffix << "_X" << histogram_to_string(distribution.sender_weights);
+    if(!histogram_to_string(distribution.receiver_weights).empty()) suffix << "_Y" << histogram_to_string(distribution.receiver_weights);
+    if(distribution.amount != workload_amount_t::FIXED) suffix << "_" << amount_str;
+    if(distribution.mint_percent > 0) suffix << "_M" << distribution.mint_percent;
+    if(distribution.redeem_percent > 0) suffix << "_R" << distribution.redeem_percent;
+    return suffix.str();
+}
+
 int main(int argc, char** argv){
     wallet_id_t num_wallets = 10;
     wallet_id_t wallet_start_id = 0;
@@ -29,11 +83,17 @@ int main(int argc, char** argv){
     coin_value_t wallet_initial_balance = 100000;
     coin_value_t transfer_value = 10;
     uint64_t random_seed = 3;
+    uint64_t hot_wallet_percent = 0;
     std::string fname;
+    bool binary = false;
+    bool streaming = false;
+    uint64_t num_threads = 1;
+    workload_distribution_t distribution = {};
+    std::string amount_str = "fixed";
 
     // parse arguments
     char c;
-    while ((c = getopt(argc, argv, "w:n:t:s:r:i:v:g:o:h")) != -1){
+    while ((c = getopt(argc, argv, "w:n:t:s:r:i:v:g:k:o:bSj:z:d:l:X:Y:V:M:R:h")) != -1){
         switch(c){
             case 'w':
                 num_wallets = strtoul(optarg,NULL,10);
@@ -67,10 +127,69 @@ int main(int argc, char** argv){
                 random_seed = strtoul(optarg,NULL,10);
                 break;
             
+            case 'k':
+                hot_wallet_percent = std::min(strtoul(optarg,NULL,10),100UL);
+                break;
+            
             case 'o':
                 fname = optarg;
                 break;
 
+            case 'b':
+                binary = true;
+                break;
+
+            case 'S':
+                streaming = true;
+                binary = true;
+                break;
+
+            case 'j':
+                num_threads = std::max(strtoul(optarg,NULL,10),1UL);
+                streaming = true;
+                binary = true;
+                break;
+
+            case 'z':
+                distribution.zipf_skew = strtod(optarg,NULL);
+                break;
+
+            case 'd':
+                distribution.num_shards = strtoul(optarg,NULL,10);
+                break;
+
+            case 'l':
+                distribution.same_shard_percent = std::min(strtoul(optarg,NULL,10),100UL);
+                break;
+
+            case 'X':
+                parse_histogram(optarg,distribution.sender_weights);
+                break;
+
+            case 'Y':
+                parse_histogram(optarg,distribution.receiver_weights);
+                break;
+
+            case 'V':
+                amount_str = optarg;
+                if(amount_str == "uniform"){
+                    distribution.amount = workload_amount_t::UNIFORM;
+                } else if(amount_str == "exponential"){
+                    distribution.amount = workload_amount_t::EXPONENTIAL;
+                } else {
+                    amount_str = "fixed";
+                    distribution.amount = workload_amount_t::FIXED;
+                }
+                break;
+
+            case 'M':
+                distribution.mint_percent = std::min(strtoul(optarg,NULL,10),100UL);
+                break;
+
+            case 'R':
+                distribution.redeem_percent = std::min(strtoul(optarg,NULL,10),100UL - distribution.mint_percent);
+                break;
+
             case '?':
             case 'h':
             default:
@@ -79,6 +198,14 @@ int main(int argc, char** argv){
         }
     }
     
+    CBDCBenchmarkWorkload benchmark(num_wallets,wallet_start_id,transfers_per_wallet,senders_per_transfer,receivers_per_transfer,wallet_initial_balance,transfer_value,random_seed,hot_wallet_percent);
+    benchmark.set_distribution(distribution);
+    if(!benchmark.default_distribution()){
+        // only the streaming generator implements the distributions
+        streaming = true;
+        binary = true;
+    }
+
     if(fname.empty()){
         fname = std::to_string(num_wallets) + "_" + 
             std::to_string(wallet_start_id) + "_" + 
@@ -88,7 +215,9 @@ int main(int argc, char** argv){
             std::to_string(wallet_initial_balance) + "_" + 
             std::to_string(transfer_value) + "_" + 
             std::to_string(random_seed) + 
-            ".gz";
+            (hot_wallet_percent > 0 ? "_" + std::to_string(hot_wallet_percent) : "") +
+            distribution_suffix(distribution,amount_str) +
+            (binary ? ".bin" : ".gz");
     }
 
     // print summary
@@ -101,15 +230,49 @@ int main(int argc, char** argv){
     std::cout << " wallet_initial_balance = " << wallet_initial_balance << std::endl;
     std::cout << " transfer_value = " << transfer_value << std::endl;
     std::cout << " random_seed = " << random_seed << std::endl;
+    std::cout << " hot_wallet_percent = " << hot_wallet_percent << std::endl;
     std::cout << " output_file = " << fname << std::endl;
+    std::cout << " format = " << (binary ? "binary" : "gz") << std::endl;
+    std::cout << " streaming = " << streaming << std::endl;
+    std::cout << " threads = " << num_threads << std::endl;
+    if(!benchmark.default_distribution()){
+        std::cout << " zipf_skew = " << distribution.zipf_skew << std::endl;
+        std::cout << " num_shards = " << distribution.num_shards << std::endl;
+        std::cout << " same_shard_percent = " << distribution.same_shard_percent << std::endl;
+        std::cout << " sender_histogram = " << histogram_to_string(distribution.sender_weights) << std::endl;
+        std::cout << " receiver_histogram = " << histogram_to_string(distribution.receiver_weights) << std::endl;
+        std::cout << " amount_distribution = " << amount_str << std::endl;
+        std::cout << " mint_percent = " << distribution.mint_percent << std::endl;
+        std::cout << " redeem_percent = " << distribution.redeem_percent << std::endl;
+    }
 
     std::cout << std::endl << "generating ..." << std::endl;
 
-    CBDCBenchmarkWorkload benchmark(num_wallets,wallet_start_id,transfers_per_wallet,senders_per_transfer,receivers_per_transfer,wallet_initial_balance,transfer_value,random_seed);
-    benchmark.generate();
-    
-    std::cout << "writing to '" << fname << "' ..." << std::endl;
-    benchmark.to_file(fname);
+    auto start = std::chrono::steady_clock::now();
+    uint64_t transfer_count = 0;
+    if(streaming && (num_threads > 1)){
+        std::cout << "writing to '" << fname << "' with " << num_threads << " threads ..." << std::endl;
+        transfer_count = benchmark.parallel_to_binary_file(fname,num_threads);
+    } else if(streaming){
+        std::cout << "writing to '" << fname << "' ..." << std::endl;
+        transfer_count = benchmark.stream_to_binary_file(fname);
+    } else {
+        benchmark.generate();
+        transfer_count = benchmark.get_transfer_count();
+
+        std::cout << "writing to '" << fname << "' ..." << std::endl;
+        if(binary){
+            benchmark.to_binary_file(fname);
+        } else {
+            benchmark.to_file(fname);
+        }
+    }
+
+    // generation and writing, and the peak resident memory of the whole run
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    std::cout << "  " << transfer_count << " transfers in " << elapsed.count() << " seconds (" << transfer_count / elapsed.count() << " transfers/s), peak memory " << usage.ru_maxrss / 1024 << " MB" << std::endl;
 
     std::cout << "done" << std::endl;
     return 0;
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <climits>
+#include <vector>
+#include <algorithm>
+
+#define HISTOGRAM_EXACT_VALUES 2048 // values below this have their own bucket
+#define HISTOGRAM_SUB_BUCKETS 1024  // buckets for each power of two above it
+
+/*
+ * Mergeable histogram of integer values (latencies in nanoseconds, batch sizes). Larger values share buckets of
+ * 1/1024 of their magnitude, so percentiles are within 0.05% of the exact ones, while the count, average,
+ * standard deviation, minimum and maximum are exact. Negative values (e.g. differences between the clocks of two
+ * hosts) go to a mirrored set of buckets. Histograms filled by different threads can be merged.
+ */
+class Histogram {
+    std::vector<uint64_t> positive; // grown on demand
+    std::vector<uint64_t> negative; // by magnitude
+    uint64_t total = 0;
+    double mean_value = 0;
+    double m2 = 0;                  // sum of squared differences from the mean (Welford)
+    int64_t min_value = INT64_MAX;
+    int64_t max_value = INT64_MIN;
+
+    static uint64_t bucket_index(uint64_t magnitude){
+        if(magnitude < HISTOGRAM_EXACT_VALUES){
+            return magnitude;
+        }
+        uint64_t shift = 63 - __builtin_clzll(magnitude) - 10; // keeps the 11 most significant bits
+        return HISTOGRAM_EXACT_VALUES + (shift - 1) * HISTOGRAM_SUB_BUCKETS + ((magnitude >> shift) - HISTOGRAM_SUB_BUCKETS);
+    }
+
+    // middle of the range of magnitudes of a bucket
+    static double bucket_value(uint64_t index){
+        if(index < HISTOGRAM_EXACT_VALUES){
+            return index;
+        }
+        uint64_t shift = (index - HISTOGRAM_EXACT_VALUES) / HISTOGRAM_SUB_BUCKETS + 1;
+        uint64_t low = ((index - HISTOGRAM_EXACT_VALUES) % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) << shift;
+        return low + ((1ULL << shift) - 1) / 2.0;
+    }
+
+    static void add_to(std::vector<uint64_t>& buckets,uint64_t index,uint64_t count){
+        if(index >= buckets.size()){
+            buckets.resize(index + 1,0);
+        }
+        buckets[index] += count;
+    }
+
+    // value of the k-th smallest element (k < count)
+    double value_at(uint64_t k) const {
+        if(k == 0) return min_value;
+        if(k == total - 1) return max_value;
+
+        double value = max_value;
+        uint64_t seen = 0;
+        bool found = false;
+        for(uint64_t i=negative.size();i>0 && !found;i--){
+            seen += negative[i-1];
+            if(seen > k){
+                value = -bucket_value(i-1);
+                found = true;
+            }
+        }
+        for(uint64_t i=0;i<positive.size() && !found;i++){
+            seen += positive[i];
+            if(seen > k){
+                value = bucket_value(i);
+                found = true;
+            }
+        }
+        return std::min(std::max(value,(double)min_value),(double)max_value);
+    }
+
+    public:
+
+    void add(int64_t value){
+        if(value >= 0){
+            add_to(positive,bucket_index(value),1);
+        } else {
+            add_to(negative,bucket_index(-(uint64_t)value),1);
+        }
+
+        total++;
+        double delta = value - mean_value;
+        mean_value += delta / total;
+        m2 += delta * (value - mean_value);
+        min_value = std::min(min_value,value);
+        max_value = std::max(max_value,value);
+    }
+
+    void merge(const Histogram& other){
+        if(other.total == 0){
+            return;
+        }
+        for(uint64_t i=0;i<other.positive.size();i++){
+            if(other.positive[i] > 0) add_to(positive,i,other.positive[i]);
+        }
+        for(uint64_t i=0;i<other.negative.size();i++){
+            if(other.negative[i] > 0) add_to(negative,i,other.negative[i]);
+        }
+
+        uint64_t merged_total = total + other.total;
+        double delta = other.mean_value - mean_value;
+        mean_value += delta * other.total / merged_total;
+        m2 += other.m2 + delta * delta * ((double)total * other.total / merged_total);
+        total = merged_total;
+        min_value = std::min(min_value,other.min_value);
+        max_value = std::max(max_value,other.max_value);
+    }
+
+    uint64_t count() const { return total; }
+    double mean() const { return total == 0 ? 0 : mean_value; }
+    double stddev() const { return total == 0 ? 0 : std::sqrt(m2 / total); } // population standard deviation, as numpy.std
+    double min() const { return total == 0 ? 0 : min_value; }
+    double max() const { return total == 0 ? 0 : max_value; }
+
+    // linear interpolation between the two closest ranks, as numpy.percentile
+    double percentile(double p) const {
+        if(total == 0){
+            return 0;
+        }
+        double rank = p / 100.0 * (total - 1);
+        uint64_t low = std::floor(rank);
+        uint64_t high = std::min(low + 1,total - 1);
+        double low_value = value_at(low);
+        return low_value + (value_at(high) - low_value) * (rank - low);
+    }
+};
+
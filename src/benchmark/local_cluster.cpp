@@ -0,0 +1,186 @@
+
+#include "local_cluster.hpp"
+
+#define CBDC_REQUEST_PATH CBDC_REQUEST_PREFIX "/"
+#define CBDC_AFFINITY_PREFIX "/WID_"
+
+LocalCluster::LocalCluster(uint32_t num_shards,const nlohmann::json& udl_config,const std::function<void(const Blob&)>& notification_handler,const std::function<void(const ObjectWithStringKey&,uint32_t)>& request_interceptor,uint32_t replicas){
+    this->notification_handler = notification_handler;
+    this->request_interceptor = request_interceptor;
+    this->replicas = std::max(replicas,(uint32_t)1);
+    for(uint32_t i=0;i<std::max(num_shards,(uint32_t)1) * this->replicas;i++){
+        nodes.emplace_back(new LocalNode(this,i));
+    }
+
+    // all nodes exist before any UDL starts sending to the others
+    for(auto& node : nodes){
+        node->start();
+    }
+
+    // the UDL does not own its node (the node owns the UDL)
+    for(auto& node : nodes){
+        node->udl.configure(std::shared_ptr<CBDCServiceClient>(std::shared_ptr<CBDCServiceClient>(),node.get()),udl_config);
+    }
+}
+
+LocalCluster::~LocalCluster(){
+    // handlers stop first, so no new operation reaches the UDL threads while they stop
+    for(auto& node : nodes){
+        node->stop();
+    }
+
+    for(auto& node : nodes){
+        node->udl.stop();
+    }
+}
+
+uint32_t LocalCluster::key_to_shard(const std::string& key){
+    // same routing as the object pool: hash of the affinity key (the wallet ID) if there is one
+    auto pos = key.find(CBDC_AFFINITY_PREFIX);
+    if(pos == std::string::npos){
+        return std::hash<std::string>{}(key) % num_shards();
+    }
+
+    auto end = pos + std::string(CBDC_AFFINITY_PREFIX).size();
+    while((end < key.size()) && std::isdigit(key[end])){
+        end++;
+    }
+    return std::hash<std::string>{}(key.substr(pos,end - pos)) % num_shards();
+}
+
+void LocalCluster::put(const ObjectWithStringKey& obj,uint32_t shard_index){
+    shard_index %= num_shards();
+    for(uint32_t i=0;i<replicas;i++){
+        nodes[shard_index * replicas + i]->deliver(obj,client_id());
+    }
+}
+
+void LocalCluster::route(const ObjectWithStringKey& obj,uint32_t shard_index,node_id_t sender){
+    if(request_interceptor && (obj.key.compare(0,std::string(CBDC_REQUEST_PATH).size(),CBDC_REQUEST_PATH) == 0)){
+        request_interceptor(obj,shard_index);
+        return;
+    }
+
+    // requests reach all the nodes of the shard, while stored objects are counted once
+    bool is_request = obj.key.compare(0,std::string(CBDC_REQUEST_PATH).size(),CBDC_REQUEST_PATH) == 0;
+    for(uint32_t i=0;i<(is_request ? replicas : 1);i++){
+        nodes[shard_index * replicas + i]->deliver(obj,sender);
+    }
+}
+
+std::pair<uint64_t,uint64_t> LocalCluster::stored(){
+    uint64_t objects = 0,bytes = 0;
+    for(auto& node : nodes){
+        objects += node->stored_objects.load();
+        bytes += node->stored_bytes.load();
+    }
+    return std::make_pair(objects,bytes);
+}
+
+// node
+
+void LocalCluster::LocalNode::deliver(const ObjectWithStringKey& obj,node_id_t sender){
+    if(obj.key.compare(0,std::string(CBDC_REQUEST_PATH).size(),CBDC_REQUEST_PATH) != 0){
+        stored_objects.fetch_add(1,std::memory_order_relaxed);
+        stored_bytes.fetch_add(obj.blob.size,std::memory_order_relaxed);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(thread_mtx);
+    if(!running){
+        return; // in flight when the cluster stopped
+    }
+    auto delivery_time = std::chrono::steady_clock::now();
+    if((sender != node_id) && (sender != cluster->client_id())){
+        delivery_time += cluster->link_delay;
+    }
+    request_queue.emplace(sender,obj.key.substr(std::string(CBDC_REQUEST_PATH).size()),obj,delivery_time);
+    thread_signal.notify_all();
+}
+
+void LocalCluster::LocalNode::start(){
+    running = true;
+    real_thread = std::thread(&LocalNode::main_loop,this);
+}
+
+void LocalCluster::LocalNode::stop(){
+    {
+        std::unique_lock<std::mutex> lock(thread_mtx);
+        running = false;
+        thread_signal.notify_all();
+    }
+    real_thread.join();
+}
+
+void LocalCluster::LocalNode::main_loop(){
+    std::queue<std::tuple<node_id_t,std::string,ObjectWithStringKey,std::chrono::steady_clock::time_point>> to_handle;
+    while(true){
+        std::unique_lock<std::mutex> lock(thread_mtx);
+        thread_signal.wait(lock,[&](){ return !running || !request_queue.empty(); });
+        if(!running) break;
+
+        std::swap(to_handle,request_queue);
+        lock.unlock();
+
+        while(!to_handle.empty()){
+            auto& request = to_handle.front();
+            if(cluster->link_delay.count() > 0){
+                std::this_thread::sleep_until(std::get<3>(request)); // the delay is the same for all nodes, so requests are due in order
+            }
+            udl.handle_request(std::get<0>(request),std::get<1>(request),std::get<2>(request));
+            to_handle.pop();
+        }
+    }
+}
+
+node_id_t LocalCluster::LocalNode::get_my_id(){
+    return node_id;
+}
+
+uint32_t LocalCluster::LocalNode::get_my_shard(){
+    return node_id / cluster->replicas;
+}
+
+uint32_t LocalCluster::LocalNode::get_number_of_shards(){
+    return cluster->num_shards();
+}
+
+std::vector<node_id_t> LocalCluster::LocalNode::get_shard_members(uint32_t shard_index){
+    std::vector<node_id_t> members;
+    for(uint32_t i=0;i<cluster->replicas;i++){
+        members.push_back(shard_index * cluster->replicas + i);
+    }
+    return members;
+}
+
+uint32_t LocalCluster::LocalNode::key_to_shard(const std::string& key){
+    return cluster->key_to_shard(key);
+}
+
+void LocalCluster::LocalNode::put_and_forget(const ObjectWithStringKey& obj,bool as_trigger){
+    cluster->route(obj,cluster->key_to_shard(obj.key),node_id);
+}
+
+void LocalCluster::LocalNode::put_and_forget_to_shard(const ObjectWithStringKey& obj,uint32_t shard_index,bool as_trigger){
+    cluster->route(obj,shard_index,node_id);
+}
+
+void LocalCluster::LocalNode::put_objects_and_forget(const std::vector<ObjectWithStringKey>& objects){
+    for(auto& obj : objects){
+        put_and_forget(obj);
+    }
+}
+
+void LocalCluster::LocalNode::put_objects_and_forget_to_shard(const std::vector<ObjectWithStringKey>& objects,uint32_t shard_index,bool as_trigger){
+    for(auto& obj : objects){
+        put_and_forget_to_shard(obj,shard_index,as_trigger);
+    }
+}
+
+void LocalCluster::LocalNode::remove_and_forget(const std::string& key,uint32_t shard_index){
+    // objects are not stored, only counted when put
+}
+
+void LocalCluster::LocalNode::notify(const Blob& blob,node_id_t client){
+    cluster->notification_handler(blob);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <tuple>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <condition_variable>
+#include "cbdc_udl.hpp"
+
+using namespace derecho::cascade;
+
+/*
+ * In-process stand-in for a Cascade deployment of the CBDC UDL, to measure the protocol without Derecho:
+ * one CascadeCBDC instance per node (a single node per shard by default, or several replicas, with node i in shard
+ * i / replicas), connected through the CBDCServiceClient interface. Keys are routed to shards as the object pool
+ * does (hash of the "/WID_<id>" affinity key, or of the whole key), puts under CBDC_REQUEST_PREFIX are handled by
+ * the UDL of every node of the target shard, one at a time by a handler thread (as a single-threaded UDL in Cascade),
+ * and other puts are only counted (once per shard). Notifications go to a single callback, for a client with node ID
+ * equal to the number of nodes.
+ * Reads are not supported: recovery, delta persistence and the bounded wallet cache must be disabled.
+ * When replaying captured requests (see replay_capture.cpp), the capture of each node already contains the
+ * requests the other nodes sent to it: requests put by the UDLs then go to an interceptor instead of the target.
+ * A link delay can be added to the requests between nodes, so protocol round trips cost about as much as on a network.
+ */
+class LocalCluster {
+    class LocalNode: public CBDCServiceClient {
+        LocalCluster* cluster;
+        node_id_t node_id;
+        std::thread real_thread;
+
+        bool running = false;
+        std::mutex thread_mtx;
+        std::condition_variable thread_signal;
+        std::queue<std::tuple<node_id_t,std::string,ObjectWithStringKey,std::chrono::steady_clock::time_point>> request_queue; // sender, key relative to CBDC_REQUEST_PREFIX, object, delivery time
+
+        void main_loop();
+
+    public:
+        CascadeCBDC udl;
+        std::atomic<uint64_t> stored_objects{0};
+        std::atomic<uint64_t> stored_bytes{0};
+
+        LocalNode(LocalCluster* cluster,node_id_t node_id): cluster(cluster), node_id(node_id) {}
+        void deliver(const ObjectWithStringKey& obj,node_id_t sender);
+        void start();
+        void stop();
+
+        node_id_t get_my_id() override;
+        uint32_t get_my_shard() override;
+        uint32_t get_number_of_shards() override;
+        std::vector<node_id_t> get_shard_members(uint32_t shard_index) override;
+        uint32_t key_to_shard(const std::string& key) override;
+        void put_and_forget(const ObjectWithStringKey& obj,bool as_trigger = false) override;
+        void put_and_forget_to_shard(const ObjectWithStringKey& obj,uint32_t shard_index,bool as_trigger = false) override;
+        void put_objects_and_forget(const std::vector<ObjectWithStringKey>& objects) override;
+        void put_objects_and_forget_to_shard(const std::vector<ObjectWithStringKey>& objects,uint32_t shard_index,bool as_trigger = false) override;
+        void remove_and_forget(const std::string& key,uint32_t shard_index) override;
+        void notify(const Blob& blob,node_id_t client) override;
+    };
+
+    std::vector<std::shared_ptr<LocalNode>> nodes;
+    std::function<void(const Blob&)> notification_handler;
+    std::function<void(const ObjectWithStringKey&,uint32_t)> request_interceptor;
+    std::chrono::microseconds link_delay{0};
+    uint32_t replicas; // nodes of each shard: node i is in shard i / replicas
+
+    void route(const ObjectWithStringKey& obj,uint32_t shard_index,node_id_t sender); // put from a UDL
+
+public:
+    LocalCluster(uint32_t num_shards,const nlohmann::json& udl_config,const std::function<void(const Blob&)>& notification_handler,const std::function<void(const ObjectWithStringKey&,uint32_t)>& request_interceptor = nullptr,uint32_t replicas = 1);
+    ~LocalCluster();
+
+    uint32_t num_shards(){ return nodes.size() / replicas; }
+    node_id_t client_id(){ return nodes.size(); }
+    uint32_t key_to_shard(const std::string& key);
+    void put(const ObjectWithStringKey& obj,uint32_t shard_index); // from the client, as a trigger put to the shard (all its nodes)
+    const cascade_cbdc_config_t& get_config(){ return nodes[0]->udl.config; }
+    void set_link_delay(uint64_t delay_us){ link_delay = std::chrono::microseconds(delay_us); } // requests from one node to another (not from the client)
+
+    // objects put outside CBDC_REQUEST_PREFIX (wallets, TXs, deltas) by all nodes, and their total size
+    std::pair<uint64_t,uint64_t> stored();
+};
@@ -0,0 +1,829 @@
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <tuple>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdio>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.hpp"
+#include "cbdc_trace.hpp"
+#include "histogram.hpp"
+
+#define TLT_PERSISTED 5001                      // Cascade tag: time in which a given version was persisted
+#define SKIP 0.1                                // fraction of the TXs excluded (half at the start, half at the end)
+#define CHUNK_SIZE (32 << 20)                   // bytes of log parsed at a time by each thread
+#define NUM_PARTITIONS 256                      // TX events are split by TX ID, and each part is joined separately
+
+void print_help(const std::string& bin_name){
+    std::cout << "usage: " << bin_name << " [options] <log_file> [<log_file> ...]" << std::endl;
+    std::cout << "Compute metrics from Cascade timestamp log files and CBDC trace files (<log_file>.trace), as metrics.py. Always compute throughput, other metrics are optional." << std::endl;
+    std::cout << "options:" << std::endl;
+    std::cout << " -b\t\t\tcompute batching statistics" << std::endl;
+    std::cout << " -l\t\t\tcompute latency breakdown" << std::endl;
+    std::cout << " -m\t\t\tcompute wallet cache size and memory of each server (with wallet_cache_capacity)" << std::endl;
+    std::cout << " -p\t\t\tcompute wallet bytes persisted per TX (to compare with enable_delta_persistence)" << std::endl;
+    std::cout << " -r\t\t\tonly compute the recovery time of each server" << std::endl;
+    std::cout << " -d\t\t\tonly print the events of the files in the text format (e.g. to use traces with metrics.py)" << std::endl;
+    std::cout << " -t <num_threads>\tparsing threads (default: number of cores)" << std::endl;
+    std::cout << " -h\t\t\tshow this help" << std::endl;
+}
+
+// one line of a log: tag timestamp node txid extra extra2
+using log_event_t = struct log_event_t {
+    uint64_t tag;
+    int64_t ts;
+    uint64_t node;
+    uint64_t txid;
+    uint64_t extra;
+    uint64_t extra2;
+};
+
+// timestamps of a TX, and of each of its wallets (the slots they go to)
+enum tx_slot_t { START, SENDING, SENT, COMPLETION, INTENDED, TX_PERSIST_START, TX_PERSIST_END, NUM_TX_SLOTS };
+enum wallet_slot_t { HANDLER_START, HANDLER_END, OPERATION_START, OPERATION_END, NEW_START, ENQUEUE_END, WALLET_PERSIST_START, WALLET_PERSIST_END, FORWARD_START, FORWARD_END, BACKWARD_START, BACKWARD_END, NUM_WALLET_SLOTS };
+#define STATUS_SLOT 100                         // version of the TX (in extra)
+#define WALLET_SLOT(slot) (200 + (slot))        // timestamp of a wallet (in extra)
+
+using tx_event_t = struct tx_event_t {
+    transaction_id_t txid;
+    int64_t ts;
+    uint64_t extra;
+    uint32_t slot;
+};
+
+int wallet_slot(uint64_t tag){
+    switch(tag){
+        case CBDC_TAG_UDL_HANDLER_START: return HANDLER_START;
+        case CBDC_TAG_UDL_HANDLER_END: return HANDLER_END;
+        case CBDC_TAG_UDL_OPERATION_START: return OPERATION_START;
+        case CBDC_TAG_UDL_OPERATION_END: return OPERATION_END;
+        case CBDC_TAG_UDL_NEW_START: return NEW_START;
+        case CBDC_TAG_UDL_ENQUEUE_END: return ENQUEUE_END;
+        case CBDC_TAG_UDL_WALLET_PERSIST_START: return WALLET_PERSIST_START;
+        case CBDC_TAG_UDL_WALLET_PERSIST_END: return WALLET_PERSIST_END;
+        case CBDC_TAG_UDL_FORWARD_START: return FORWARD_START;
+        case CBDC_TAG_UDL_FORWARD_END: return FORWARD_END;
+        case CBDC_TAG_UDL_BACKWARD_START: return BACKWARD_START;
+        case CBDC_TAG_UDL_BACKWARD_END: return BACKWARD_END;
+        default: return -1;
+    }
+}
+
+/*
+ * Results of a chunk of log. TX events go to partitions by TX ID, in log order, and everything else is
+ * aggregated as it is parsed. Chunks are merged in the order of the files and of the lines, so values logged
+ * more than once for the same key keep the last one, as in metrics.py.
+ */
+using chunk_result_t = struct chunk_result_t {
+    std::vector<std::vector<tx_event_t>> partitions;
+    std::vector<std::pair<int64_t,transaction_id_t>> starts;
+    std::vector<transaction_id_t> rejected;
+    std::map<uint64_t,std::pair<int64_t,int64_t>> node_sent;                    // node: first and last TX sent
+    std::vector<std::pair<uint64_t,uint64_t>> node_shard;
+    std::vector<std::tuple<uint64_t,uint64_t,int64_t>> persisted;               // node, version, timestamp
+    Histogram batching[5];                                                      // client, wallet, chain, tx, group commit
+
+    // other metrics
+    std::map<uint64_t,int64_t> recovery_start,recovery_end;
+    std::map<uint64_t,uint64_t> recovery_count;
+    std::map<std::pair<uint64_t,uint64_t>,uint64_t> cached;                     // node and thread: wallets
+    std::map<uint64_t,uint64_t> memory;
+    uint64_t wallet_bytes = 0;
+    uint64_t compaction_bytes = 0;
+};
+
+// parse one line (false at the end of the chunk): comments and incomplete lines are skipped
+inline bool next_text_event(const char*& cursor,const char* end,log_event_t& event){
+    while(cursor < end){
+        const char* line_end = static_cast<const char*>(memchr(cursor,'\n',end - cursor));
+        if(line_end == nullptr) line_end = end;
+
+        if(*cursor != '#'){
+            int64_t values[6];
+            int count = 0;
+            const char* p = cursor;
+            while((count < 6) && (p < line_end)){
+                while((p < line_end) && ((*p == ' ') || (*p == '\t') || (*p == '\r'))) p++;
+                if(p == line_end) break;
+                bool negative = (*p == '-');
+                if(negative) p++;
+                if((p == line_end) || (*p < '0') || (*p > '9')) break;
+                int64_t value = 0;
+                while((p < line_end) && (*p >= '0') && (*p <= '9')){
+                    value = value * 10 + (*p - '0');
+                    p++;
+                }
+                values[count++] = negative ? -value : value;
+            }
+
+            if(count == 6){
+                event.tag = values[0];
+                event.ts = values[1];
+                event.node = values[2];
+                event.txid = values[3];
+                event.extra = values[4];
+                event.extra2 = values[5];
+                cursor = line_end + 1;
+                return true;
+            }
+        }
+        cursor = line_end + 1;
+    }
+    return false;
+}
+
+// read one event of a trace file (see cbdc_trace.hpp): chunks only have complete events
+inline bool next_trace_event(const char*& cursor,const char* end,log_event_t& event){
+    if(cursor + sizeof(trace_event_t) > end){
+        return false;
+    }
+    trace_event_t trace_event;
+    memcpy(&trace_event,cursor,sizeof(trace_event));
+    cursor += sizeof(trace_event);
+
+    event.tag = trace_event.tag;
+    event.ts = trace_event.timestamp;
+    event.node = trace_event.node_id;
+    event.txid = trace_event.msg_id;
+    event.extra = trace_event.extra;
+    event.extra2 = 0;
+    return true;
+}
+
+template <bool (*next_event)(const char*&,const char*,log_event_t&)>
+void parse_chunk(const char* begin,const char* end,bool recovery_only,chunk_result_t& result){
+    if(!recovery_only){
+        result.partitions.resize(NUM_PARTITIONS);
+    }
+
+    auto push = [&](transaction_id_t txid,int64_t ts,uint64_t extra,uint32_t slot){
+        result.partitions[std::hash<transaction_id_t>{}(txid) % NUM_PARTITIONS].push_back({txid,ts,extra,slot});
+    };
+
+    log_event_t event;
+    const char* cursor = begin;
+    while(next_event(cursor,end,event)){
+        // recovery
+        switch(event.tag){
+            case CBDC_TAG_UDL_RECOVERY_START:
+                if((result.recovery_start.count(event.node) == 0) || (event.ts < result.recovery_start[event.node])){
+                    result.recovery_start[event.node] = event.ts;
+                }
+                continue;
+            case CBDC_TAG_UDL_RECOVERY_END:
+                result.recovery_end[event.node] = std::max(result.recovery_end[event.node],event.ts);
+                result.recovery_count[event.node] += event.extra;
+                continue;
+        }
+        if(recovery_only){
+            continue;
+        }
+
+        switch(event.tag){
+            // client timestamps
+            case CBDC_TAG_CLIENT_TRANSFER_START:
+                push(event.txid,event.ts,0,START);
+                result.starts.emplace_back(event.ts,event.txid);
+                break;
+            case CBDC_TAG_CLIENT_TRANSFER_SENDING:
+                push(event.txid,event.ts,0,SENDING);
+                break;
+            case CBDC_TAG_CLIENT_TRANSFER_SENT:
+                push(event.txid,event.ts,0,SENT);
+                if(result.node_sent.count(event.node) == 0){
+                    result.node_sent[event.node] = std::make_pair(event.ts,event.ts);
+                }
+                result.node_sent[event.node].first = std::min(result.node_sent[event.node].first,event.ts);
+                result.node_sent[event.node].second = std::max(result.node_sent[event.node].second,event.ts);
+                break;
+            case CBDC_TAG_CLIENT_COMPLETION:
+                push(event.txid,event.ts,0,COMPLETION);
+                break;
+            case CBDC_TAG_CLIENT_TRANSFER_INTENDED:
+                push(event.txid,event.ts - event.extra,0,INTENDED);
+                break;
+            case CBDC_TAG_CLIENT_STATUS:
+                push(event.txid,0,event.extra,STATUS_SLOT);
+                break;
+            case CBDC_TAG_CLIENT_DEPLOYMENT_INFO:
+                result.node_shard.emplace_back(event.node,event.txid);
+                break;
+
+            // UDL timestamps of the TX
+            case CBDC_TAG_UDL_TX_PERSIST_START:
+                push(event.txid,event.ts,event.extra,TX_PERSIST_START);
+                break;
+            case CBDC_TAG_UDL_TX_PERSIST_END:
+                push(event.txid,event.ts,0,TX_PERSIST_END);
+                break;
+
+            // admission control
+            case CBDC_TAG_UDL_TX_REJECTED:
+                result.rejected.push_back(event.txid);
+                break;
+
+            // Cascade timestamps
+            case TLT_PERSISTED:
+                result.persisted.emplace_back(event.node,event.extra,event.ts);
+                break;
+
+            // batching
+            case CBDC_TAG_CLIENT_BATCHING:
+                result.batching[0].add(event.txid);
+                break;
+            case CBDC_TAG_UDL_WALLET_BATCHING:
+                result.batching[1].add(event.txid);
+                break;
+            case CBDC_TAG_UDL_CHAIN_BATCHING:
+                result.batching[2].add(event.txid);
+                break;
+            case CBDC_TAG_UDL_TX_BATCHING:
+                result.batching[3].add(event.txid);
+                break;
+            case CBDC_TAG_UDL_GROUP_COMMIT:
+                result.batching[4].add(event.txid);
+                break;
+
+            // memory and persistence
+            case CBDC_TAG_UDL_WALLET_CACHE:
+                result.cached[std::make_pair(event.node,event.txid)] = std::max(result.cached[std::make_pair(event.node,event.txid)],event.extra);
+                break;
+            case CBDC_TAG_UDL_MEMORY:
+                result.memory[event.node] = std::max(result.memory[event.node],event.extra);
+                break;
+            case CBDC_TAG_UDL_WALLET_BYTES:
+                result.wallet_bytes += event.extra;
+                break;
+            case CBDC_TAG_UDL_COMPACTION_BYTES:
+                result.compaction_bytes += event.extra;
+                break;
+
+            // UDL timestamps of each wallet of the TX
+            default:
+                int slot = wallet_slot(event.tag);
+                if(slot >= 0){
+                    push(event.txid,event.ts,event.extra,WALLET_SLOT(slot));
+                }
+                break;
+        }
+    }
+}
+
+/*
+ * Formats of the log files. A format reads the events of a chunk of a file in order: the chunks are parsed in
+ * parallel and merged in order, so chunks only need to start at an event.
+ */
+using log_format_t = struct log_format_t {
+    bool (*next_event)(const char*&,const char*,log_event_t&);
+    void (*parse_chunk)(const char*,const char*,bool,chunk_result_t&);
+};
+
+const log_format_t text_format = {next_text_event,parse_chunk<next_text_event>};
+const log_format_t trace_format = {next_trace_event,parse_chunk<next_trace_event>};
+
+using log_chunk_t = struct log_chunk_t {
+    const char* begin;
+    const char* end;
+    const log_format_t* format;
+};
+
+// split a mapped file in chunks of about CHUNK_SIZE bytes: trace files start with their magic, other files are text
+void split_file(const std::string& filename,const char* data,std::size_t size,std::vector<log_chunk_t>& chunks){
+    const char* file_end = data + size;
+    trace_file_header_t header;
+    header.magic = 0;
+    if(size >= sizeof(header)){
+        memcpy(&header,data,sizeof(header));
+    }
+
+    if(header.magic == CBDC_TRACE_MAGIC){
+        if(header.dropped_count > 0){
+            std::cout << "WARNING: " << filename << ": " << header.dropped_count << " events were dropped when tracing (buffers too small, or spilling disabled)" << std::endl;
+        }
+        if((size - sizeof(header)) / sizeof(trace_event_t) < header.event_count){
+            std::cout << "WARNING: " << filename << " is truncated" << std::endl;
+        }
+
+        const char* begin = data + sizeof(header);
+        file_end = begin + std::min<uint64_t>(header.event_count,(size - sizeof(header)) / sizeof(trace_event_t)) * sizeof(trace_event_t);
+        while(begin < file_end){
+            const char* end = begin + std::min<uint64_t>(CHUNK_SIZE / sizeof(trace_event_t) * sizeof(trace_event_t),file_end - begin);
+            chunks.push_back({begin,end,&trace_format});
+            begin = end;
+        }
+        return;
+    }
+
+    // each chunk has the lines starting in its range
+
+    const char* begin = data;
+    while(begin < file_end){
+        const char* end = std::min(begin + CHUNK_SIZE,file_end);
+        auto line_end = static_cast<const char*>(memchr(end - 1,'\n',file_end - (end - 1)));
+        end = (line_end == nullptr) ? file_end : line_end + 1;
+        chunks.push_back({begin,end,&text_format});
+        begin = end;
+    }
+}
+
+// timestamps of a wallet of a TX
+using wallet_record_t = struct wallet_record_t {
+    wallet_id_t wallet;
+    uint32_t present;                                   // bitmap of the slots logged
+    int64_t ts[NUM_WALLET_SLOTS];
+};
+
+// timestamps of a TX, after applying its events in log order
+using tx_record_t = struct tx_record_t {
+    int64_t ts[NUM_TX_SLOTS];
+    bool has[NUM_TX_SLOTS];
+    uint64_t shard;
+    uint64_t version;
+    bool has_version;
+    std::vector<wallet_record_t> wallets;
+};
+
+// global information needed to filter the TXs, and the persistence time of each version of each shard
+using join_context_t = struct join_context_t {
+    int64_t first_ts;
+    int64_t last_ts;
+    std::unordered_set<transaction_id_t> rejected;
+    bool skip_enabled;
+    std::pair<int64_t,transaction_id_t> skip_low;       // TXs up to this one (sorted by start time) are excluded
+    std::pair<int64_t,transaction_id_t> skip_high;      // TXs from this one are excluded
+    std::unordered_map<uint64_t,std::vector<std::pair<uint64_t,int64_t>>> shard_versions; // sorted by version
+};
+
+using join_result_t = struct join_result_t {
+    uint64_t count = 0;
+    uint64_t rejected = 0;
+    uint64_t persisted_txs = 0;                         // TXs with a TX persistence timestamp (before filtering)
+    int64_t first_start = INT64_MAX,last_start = INT64_MIN;
+    int64_t first_sending = INT64_MAX,last_sent = INT64_MIN;
+    int64_t last_persisted = INT64_MIN;
+    Histogram e2e,intended,notified;
+    Histogram breakdown[10];                            // e2e, handler, queue, thread, stable, conflict, wallet, txput, forward, backward
+};
+
+// persistence time of a version: the first persisted version at or after it
+bool persisted_time(const join_context_t& context,uint64_t shard,uint64_t version,int64_t& ts){
+    auto it = context.shard_versions.find(shard);
+    if((it == context.shard_versions.end()) || it->second.empty()){
+        return false;
+    }
+    auto& versions = it->second;
+    if((version < versions.front().first) || (version > versions.back().first)){
+        return false;
+    }
+    ts = std::lower_bound(versions.begin(),versions.end(),std::make_pair(version,INT64_MIN))->second;
+    return true;
+}
+
+void join_transaction(const join_context_t& context,tx_record_t& tx,transaction_id_t txid,bool breakdown,join_result_t& result){
+    if(tx.has[TX_PERSIST_START]){
+        result.persisted_txs++;
+    }
+
+    // only transfers sent while all clients were sending, and not rejected
+    if(!tx.has[START] || !tx.has[SENT] || (tx.ts[SENT] < context.first_ts) || (tx.ts[SENT] > context.last_ts)){
+        return;
+    }
+    if(context.rejected.count(txid) > 0){
+        result.rejected++;
+        return;
+    }
+    auto order = std::make_pair(tx.ts[START],txid);
+    if(context.skip_enabled && ((order <= context.skip_low) || (order >= context.skip_high))){
+        return;
+    }
+
+    int64_t persisted;
+    if(!tx.has_version || !tx.has[TX_PERSIST_START] || !tx.has[SENDING] || !persisted_time(context,tx.shard,tx.version,persisted)){
+        return;
+    }
+
+    result.count++;
+    result.first_start = std::min(result.first_start,tx.ts[START]);
+    result.last_start = std::max(result.last_start,tx.ts[START]);
+    result.first_sending = std::min(result.first_sending,tx.ts[SENDING]);
+    result.last_sent = std::max(result.last_sent,tx.ts[SENT]);
+    result.last_persisted = std::max(result.last_persisted,persisted);
+
+    result.e2e.add(persisted - tx.ts[SENT]);
+    if(tx.has[INTENDED]){
+        result.intended.add(persisted - tx.ts[INTENDED]);
+    }
+    if(tx.has[COMPLETION]){
+        result.notified.add(tx.ts[COMPLETION] - tx.ts[SENT]);
+    }
+
+    if(!breakdown){
+        return;
+    }
+
+    result.breakdown[0].add(persisted - tx.ts[SENT]);
+    if(tx.has[TX_PERSIST_END]){
+        result.breakdown[4].add(persisted - tx.ts[TX_PERSIST_END]);
+        result.breakdown[7].add(tx.ts[TX_PERSIST_END] - tx.ts[TX_PERSIST_START]);
+    }
+
+    // durations between two timestamps of the same wallet
+    auto add = [](Histogram& histogram,const wallet_record_t& record,int start,int end){
+        if((record.present & (1 << start)) && (record.present & (1 << end))){
+            histogram.add(record.ts[end] - record.ts[start]);
+        }
+    };
+    for(auto& record : tx.wallets){
+        add(result.breakdown[1],record,HANDLER_START,HANDLER_END);
+        add(result.breakdown[2],record,HANDLER_END,OPERATION_START);
+        add(result.breakdown[3],record,OPERATION_START,OPERATION_END);
+        add(result.breakdown[5],record,NEW_START,ENQUEUE_END);
+        add(result.breakdown[6],record,WALLET_PERSIST_START,WALLET_PERSIST_END);
+        add(result.breakdown[8],record,FORWARD_START,FORWARD_END);
+        add(result.breakdown[9],record,BACKWARD_START,BACKWARD_END);
+    }
+}
+
+// gather the events of a partition (in log order), group them by TX, and join each TX
+void join_partition(std::vector<chunk_result_t>& chunks,uint64_t partition,const join_context_t& context,bool breakdown,join_result_t& result){
+    std::vector<tx_event_t> events;
+    uint64_t size = 0;
+    for(auto& chunk : chunks){
+        size += chunk.partitions[partition].size();
+    }
+    events.reserve(size);
+    for(auto& chunk : chunks){
+        events.insert(events.end(),chunk.partitions[partition].begin(),chunk.partitions[partition].end());
+        std::vector<tx_event_t>().swap(chunk.partitions[partition]);
+    }
+    std::stable_sort(events.begin(),events.end(),[](const tx_event_t& a,const tx_event_t& b){ return a.txid < b.txid; });
+
+    tx_record_t tx;
+    for(uint64_t i=0;i<events.size();){
+        transaction_id_t txid = events[i].txid;
+        std::fill(tx.has,tx.has + NUM_TX_SLOTS,false);
+        tx.has_version = false;
+        tx.wallets.clear();
+
+        for(;(i < events.size()) && (events[i].txid == txid);i++){
+            auto& event = events[i];
+            if(event.slot == STATUS_SLOT){
+                tx.version = event.extra;
+                tx.has_version = true;
+            } else if(event.slot >= WALLET_SLOT(0)){
+                uint32_t slot = event.slot - WALLET_SLOT(0);
+                auto it = std::find_if(tx.wallets.begin(),tx.wallets.end(),[&](const wallet_record_t& record){ return record.wallet == event.extra; });
+                if(it == tx.wallets.end()){
+                    it = tx.wallets.insert(tx.wallets.end(),wallet_record_t{event.extra,0,{}});
+                }
+                it->present |= (1 << slot);
+                it->ts[slot] = event.ts;
+            } else {
+                tx.ts[event.slot] = event.ts;
+                tx.has[event.slot] = true;
+                if(event.slot == TX_PERSIST_START){
+                    tx.shard = event.extra;
+                }
+            }
+        }
+
+        join_transaction(context,tx,txid,breakdown,result);
+    }
+}
+
+void print_statistics(const std::string& label,const Histogram& histogram,double scale,std::size_t width){
+    std::string padded = "  " + label + ":";
+    if(padded.size() < width){
+        padded.resize(width,' ');
+    }
+    printf("%s avg %6.3f | std %6.3f | med %6.3f | min %6.3f | max %6.3f | p95 %6.3f | p99 %6.3f\n",padded.c_str(),
+            histogram.mean() / scale,histogram.stddev() / scale,histogram.percentile(50) / scale,histogram.min() / scale,
+            histogram.max() / scale,histogram.percentile(95) / scale,histogram.percentile(99) / scale);
+}
+
+void print_latency(const std::string& label,const Histogram& histogram){
+    printf("%s: avg %6.3f | std %6.3f | med %6.3f | min %6.3f | max %6.3f | p95 %6.3f | p99 %6.3f\n",label.c_str(),
+            histogram.mean() / 1e+6,histogram.stddev() / 1e+6,histogram.percentile(50) / 1e+6,histogram.min() / 1e+6,
+            histogram.max() / 1e+6,histogram.percentile(95) / 1e+6,histogram.percentile(99) / 1e+6);
+}
+
+/*
+ * Same metrics as metrics.py, for logs too large for it. Files are memory-mapped and parsed in chunks by
+ * several threads. Events of each TX are joined by partition of the TX IDs (also in parallel), and the
+ * distributions go to mergeable histograms instead of lists of values: memory grows with the number of TX
+ * events (32 bytes each), not with their text.
+ */
+int main(int argc, char** argv){
+    char c;
+    bool batching = false,latency = false,memory = false,persistence = false,recovery = false,dump = false;
+    uint64_t num_threads = std::max(std::thread::hardware_concurrency(),1U);
+
+    while ((c = getopt(argc, argv, "blmprdt:h")) != -1){
+        switch(c){
+            case 'b':
+                batching = true;
+                break;
+            case 'l':
+                latency = true;
+                break;
+            case 'm':
+                memory = true;
+                break;
+            case 'p':
+                persistence = true;
+                break;
+            case 'r':
+                recovery = true;
+                break;
+            case 'd':
+                dump = true;
+                break;
+            case 't':
+                num_threads = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case '?':
+            case 'h':
+            default:
+                print_help(argv[0]);
+                return 0;
+        }
+    }
+
+    if(optind >= argc){
+        print_help(argv[0]);
+        return 1;
+    }
+
+    // map the files and split them in chunks
+    std::vector<std::pair<const char*,std::size_t>> files;
+    std::vector<log_chunk_t> ranges;
+    for(int i=optind;i<argc;i++){
+        int fd = open(argv[i],O_RDONLY);
+        struct stat st;
+        if((fd < 0) || (fstat(fd,&st) != 0)){
+            std::cout << "ERROR: could not open " << argv[i] << std::endl;
+            return 1;
+        }
+        std::size_t size = st.st_size;
+        if(size == 0){
+            close(fd);
+            continue;
+        }
+        void* addr = mmap(nullptr,size,PROT_READ,MAP_PRIVATE,fd,0);
+        close(fd);
+        if(addr == MAP_FAILED){
+            std::cout << "ERROR: could not map " << argv[i] << std::endl;
+            return 1;
+        }
+        madvise(addr,size,MADV_SEQUENTIAL);
+        auto data = static_cast<const char*>(addr);
+        files.emplace_back(data,size);
+        split_file(argv[i],data,size,ranges);
+    }
+
+    if(dump){
+        log_event_t event;
+        for(auto& range : ranges){
+            const char* cursor = range.begin;
+            while(range.format->next_event(cursor,range.end,event)){
+                printf("%lu %ld %lu %lu %lu %lu\n",event.tag,event.ts,event.node,event.txid,event.extra,event.extra2);
+            }
+        }
+        return 0;
+    }
+
+    // parse
+    std::vector<chunk_result_t> chunks(ranges.size());
+    std::atomic<uint64_t> next_chunk{0};
+    std::vector<std::thread> threads;
+    for(uint64_t t=0;t<num_threads;t++){
+        threads.emplace_back([&](){
+            for(uint64_t i=next_chunk++;i<ranges.size();i=next_chunk++){
+                ranges[i].format->parse_chunk(ranges[i].begin,ranges[i].end,recovery,chunks[i]);
+
+                // the chunk is not needed anymore (pages shared with the next chunk are read again if needed)
+                uintptr_t page_size = sysconf(_SC_PAGESIZE);
+                uintptr_t begin = reinterpret_cast<uintptr_t>(ranges[i].begin) & ~(page_size - 1);
+                madvise(reinterpret_cast<void*>(begin),reinterpret_cast<uintptr_t>(ranges[i].end) - begin,MADV_DONTNEED);
+            }
+        });
+    }
+    for(auto& thread : threads){
+        thread.join();
+    }
+    threads.clear();
+    for(auto& file : files){
+        munmap(const_cast<char*>(file.first),file.second);
+    }
+
+    if(recovery){
+        std::map<uint64_t,int64_t> start,end;
+        std::map<uint64_t,uint64_t> count;
+        for(auto& chunk : chunks){
+            for(auto& item : chunk.recovery_start){
+                start[item.first] = start.count(item.first) == 0 ? item.second : std::min(start[item.first],item.second);
+            }
+            for(auto& item : chunk.recovery_end){
+                end[item.first] = std::max(end.count(item.first) == 0 ? 0 : end[item.first],item.second);
+            }
+            for(auto& item : chunk.recovery_count){
+                count[item.first] += item.second;
+            }
+        }
+
+        // a node is ready when all its threads finished loading their wallets
+        printf("recovery:\n");
+        for(auto& item : end){
+            if(start.count(item.first) > 0){
+                printf("  node %lu: %lu wallets loaded in %.2f seconds\n",item.first,count[item.first],(item.second - start[item.first]) / 1e+9);
+            }
+        }
+        return 0;
+    }
+
+    // merge what does not depend on the TX
+    join_context_t context;
+    std::map<uint64_t,std::pair<int64_t,int64_t>> node_sent;
+    std::unordered_map<uint64_t,uint64_t> node_shard;
+    std::vector<uint64_t> persisted_nodes;                                  // in order of appearance
+    std::unordered_map<uint64_t,std::unordered_map<uint64_t,int64_t>> node_versions;
+    std::vector<std::pair<int64_t,transaction_id_t>> starts;
+    Histogram batching_histograms[5];
+    for(auto& chunk : chunks){
+        for(auto& item : chunk.node_sent){
+            if(node_sent.count(item.first) == 0){
+                node_sent[item.first] = item.second;
+            }
+            node_sent[item.first].first = std::min(node_sent[item.first].first,item.second.first);
+            node_sent[item.first].second = std::max(node_sent[item.first].second,item.second.second);
+        }
+        for(auto& item : chunk.node_shard){
+            node_shard[item.first] = item.second;
+        }
+        for(auto& item : chunk.persisted){
+            if(node_versions.count(std::get<0>(item)) == 0){
+                persisted_nodes.push_back(std::get<0>(item));
+            }
+            node_versions[std::get<0>(item)][std::get<1>(item)] = std::get<2>(item);
+        }
+        std::vector<std::tuple<uint64_t,uint64_t,int64_t>>().swap(chunk.persisted);
+        context.rejected.insert(chunk.rejected.begin(),chunk.rejected.end());
+        starts.insert(starts.end(),chunk.starts.begin(),chunk.starts.end());
+        std::vector<std::pair<int64_t,transaction_id_t>>().swap(chunk.starts);
+        for(int i=0;i<5;i++){
+            batching_histograms[i].merge(chunk.batching[i]);
+        }
+    }
+
+    // clients overlap from the last one that started to the first one that finished
+    context.first_ts = 0;
+    context.last_ts = INT64_MAX;
+    for(auto& item : node_sent){
+        context.first_ts = std::max(context.first_ts,item.second.first);
+        context.last_ts = std::min(context.last_ts,item.second.second);
+    }
+
+    // first and last SKIP/2 of the TXs (by start time) are excluded
+    starts.erase(std::remove_if(starts.begin(),starts.end(),[&](const std::pair<int64_t,transaction_id_t>& item){ return context.rejected.count(item.second) > 0; }),starts.end());
+    uint64_t half = static_cast<uint64_t>(SKIP * starts.size()) / 2;
+    context.skip_enabled = half > 0;
+    if(context.skip_enabled){
+        std::nth_element(starts.begin(),starts.begin() + (half - 1),starts.end());
+        context.skip_low = starts[half - 1];
+        std::nth_element(starts.begin(),starts.begin() + (starts.size() - half),starts.end());
+        context.skip_high = starts[starts.size() - half];
+    }
+    std::vector<std::pair<int64_t,transaction_id_t>>().swap(starts);
+
+    // persisted versions of each shard, from the last node of the shard to appear in the logs
+    for(auto node : persisted_nodes){
+        if(node_shard.count(node) == 0){
+            continue;
+        }
+        auto& versions = context.shard_versions[node_shard[node]];
+        versions.assign(node_versions[node].begin(),node_versions[node].end());
+        std::sort(versions.begin(),versions.end());
+    }
+    node_versions.clear();
+
+    // join the events of each TX
+    std::vector<join_result_t> results(num_threads);
+    std::atomic<uint64_t> next_partition{0};
+    for(uint64_t t=0;t<num_threads;t++){
+        threads.emplace_back([&,t](){
+            for(uint64_t p=next_partition++;p<NUM_PARTITIONS;p=next_partition++){
+                join_partition(chunks,p,context,latency,results[t]);
+            }
+        });
+    }
+    for(auto& thread : threads){
+        thread.join();
+    }
+
+    join_result_t total;
+    for(auto& result : results){
+        total.count += result.count;
+        total.rejected += result.rejected;
+        total.persisted_txs += result.persisted_txs;
+        total.first_start = std::min(total.first_start,result.first_start);
+        total.last_start = std::max(total.last_start,result.last_start);
+        total.first_sending = std::min(total.first_sending,result.first_sending);
+        total.last_sent = std::max(total.last_sent,result.last_sent);
+        total.last_persisted = std::max(total.last_persisted,result.last_persisted);
+        total.e2e.merge(result.e2e);
+        total.intended.merge(result.intended);
+        total.notified.merge(result.notified);
+        for(int i=0;i<10;i++){
+            total.breakdown[i].merge(result.breakdown[i]);
+        }
+    }
+
+    if(total.count == 0){
+        std::cout << "ERROR: no complete transfer in the logs" << std::endl;
+        return 1;
+    }
+
+    // throughput
+    double elapsed = (total.last_start - total.first_start) / 1e+9;
+    printf("client sending rate: %.2f tx/s (%lu TXs in %.2f seconds)\n",total.count / elapsed,total.count,elapsed);
+    elapsed = (total.last_sent - total.first_sending) / 1e+9;
+    printf("real sending rate: %.2f tx/s (%lu TXs in %.2f seconds)\n",total.count / elapsed,total.count,elapsed);
+    elapsed = (total.last_persisted - total.first_start) / 1e+9;
+    printf("throughput: %.2f tx/s (%lu TXs in %.2f seconds)\n",total.count / elapsed,total.count,elapsed);
+    if(total.rejected > 0){
+        printf("rejected: %lu TXs (not included in the throughput and latency)\n",total.rejected);
+    }
+
+    print_latency("e2e latency",total.e2e);
+    if(total.intended.count() > 0){
+        print_latency("e2e latency (from intended start)",total.intended);
+    }
+    if(total.notified.count() > 0){
+        print_latency("commit latency (notified, " + std::to_string(total.notified.count()) + " TXs)",total.notified);
+    }
+
+    if(batching){
+        printf("\nbatching statistics:\n");
+        std::string labels[] = {"client_batching","wallet_batching","chain_batching","tx_batching","group_commit"};
+        for(int i=0;i<5;i++){
+            print_statistics(labels[i],batching_histograms[i],1,20);
+        }
+    }
+
+    if(latency){
+        printf("\nlatency breakdown:\n");
+        std::string labels[] = {"e2e","handler","queue","thread","stable","conflict","wallet","txput","forward","backward"};
+        for(int i=0;i<10;i++){
+            print_statistics(labels[i],total.breakdown[i],1e+6,12);
+        }
+    }
+
+    if(memory){
+        std::map<uint64_t,uint64_t> max_memory;
+        std::map<std::pair<uint64_t,uint64_t>,uint64_t> cached;
+        for(auto& chunk : chunks){
+            for(auto& item : chunk.memory){
+                max_memory[item.first] = std::max(max_memory[item.first],item.second);
+            }
+            for(auto& item : chunk.cached){
+                cached[item.first] = std::max(cached[item.first],item.second);
+            }
+        }
+
+        printf("\nmemory:\n");
+        for(auto& item : max_memory){
+            uint64_t count = 0;
+            for(auto it = cached.lower_bound(std::make_pair(item.first,0UL));(it != cached.end()) && (it->first.first == item.first);it++){
+                count += it->second;
+            }
+            printf("  node %lu: max %lu cached wallets | max resident memory %.1f MB\n",item.first,count,item.second / (double)(1 << 20));
+        }
+    }
+
+    if(persistence && (total.persisted_txs > 0)){
+        uint64_t wallet_bytes = 0,compaction_bytes = 0;
+        for(auto& chunk : chunks){
+            wallet_bytes += chunk.wallet_bytes;
+            compaction_bytes += chunk.compaction_bytes;
+        }
+
+        printf("\npersistence:\n");
+        printf("  wallets/deltas: %lu bytes | %.1f bytes/tx\n",wallet_bytes,(double)wallet_bytes / total.persisted_txs);
+        printf("  compaction: %lu bytes | %.1f bytes/tx\n",compaction_bytes,(double)compaction_bytes / total.persisted_txs);
+        printf("  total: %.1f bytes/tx\n",(double)(wallet_bytes + compaction_bytes) / total.persisted_txs);
+    }
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+
+/*
+ * Bounded lock-free queue for many producers and a single consumer (the sender thread of a shard).
+ * Each cell has a sequence number telling whether it is free for the producer of a given position or
+ * ready for the consumer: producers claim positions with a CAS, and the consumer never takes a lock.
+ * The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class MPSCQueue {
+    struct cell_t {
+        std::atomic<uint64_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<cell_t[]> buffer;
+    uint64_t mask;
+    alignas(64) std::atomic<uint64_t> enqueue_pos{0};
+    alignas(64) std::atomic<uint64_t> dequeue_pos{0};
+
+    public:
+
+    explicit MPSCQueue(uint64_t capacity){
+        uint64_t size = 2;
+        while(size < capacity){
+            size <<= 1;
+        }
+
+        buffer.reset(new cell_t[size]);
+        mask = size - 1;
+        for(uint64_t i=0;i<size;i++){
+            buffer[i].sequence.store(i,std::memory_order_relaxed);
+        }
+    }
+
+    // false if the queue is full
+    bool try_push(const T& value){
+        uint64_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while(true){
+            cell_t& cell = buffer[pos & mask];
+            uint64_t sequence = cell.sequence.load(std::memory_order_acquire);
+            int64_t diff = static_cast<int64_t>(sequence) - static_cast<int64_t>(pos);
+            if(diff == 0){
+                if(enqueue_pos.compare_exchange_weak(pos,pos + 1,std::memory_order_relaxed)){
+                    cell.data = value;
+                    cell.sequence.store(pos + 1,std::memory_order_release);
+                    return true;
+                }
+            } else if(diff < 0){
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // consumer only: false if the queue is empty (or the next value is still being written)
+    bool try_pop(T& value){
+        uint64_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        cell_t& cell = buffer[pos & mask];
+        uint64_t sequence = cell.sequence.load(std::memory_order_acquire);
+        if(sequence != pos + 1){
+            return false;
+        }
+
+        value = cell.data;
+        cell.sequence.store(pos + mask + 1,std::memory_order_release);
+        dequeue_pos.store(pos + 1,std::memory_order_relaxed);
+        return true;
+    }
+
+    // approximate when called concurrently with push/pop
+    inline uint64_t size() const {
+        uint64_t head = dequeue_pos.load(std::memory_order_relaxed);
+        uint64_t tail = enqueue_pos.load(std::memory_order_relaxed);
+        return (tail > head) ? tail - head : 0;
+    }
+
+    inline uint64_t capacity() const {
+        return mask + 1;
+    }
+};
@@ -0,0 +1,298 @@
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <unistd.h>
+#include <stdlib.h>
+#include "local_cluster.hpp"
+#include "request_capture.hpp"
+
+#define DEFAULT_SPEED 1.0
+#define DEFAULT_WAIT_SECONDS 10
+#define MAX_REPORTED_DIFFERENCES 10
+
+void print_help(const std::string& bin_name){
+    std::cout << "usage: " << bin_name << " [options] <capture_file> [<capture_file> ...]" << std::endl;
+    std::cout << "options:" << std::endl;
+    std::cout << " -x <speed>\t\treplay speed relative to the capture, or 0 to replay as fast as possible (default: " << DEFAULT_SPEED << ")" << std::endl;
+    std::cout << " -o <name=value,...>\tUDL config options replacing the captured ones (TX outcomes may change)" << std::endl;
+    std::cout << " -w <seconds>\t\ttime to wait for a message from another node, or for a new outcome after the last request (default: " << DEFAULT_WAIT_SECONDS << ")" << std::endl;
+    std::cout << " -h\t\t\tshow this help" << std::endl;
+}
+
+// forward, commit and abort messages come from other nodes: the rest comes from clients
+bool is_node_message(const std::string& key){
+    return (key.size() > 1) && (key[1] == '/') && ((key[0] == 'f') || (key[0] == 'c') || (key[0] == 'a'));
+}
+
+std::string status_to_string(transaction_status_t status){
+    switch(status){
+        case transaction_status_t::PENDING:
+            return "pending";
+        case transaction_status_t::COMMIT:
+            return "commit";
+        case transaction_status_t::ABORT:
+            return "abort";
+        case transaction_status_t::REJECTED:
+            return "rejected";
+        default:
+            return "unknown";
+    }
+}
+
+/*
+ * Replays the requests captured by the nodes of a deployment (see capture_path in the UDL config) on the
+ * in-process cluster (see LocalCluster), one node per captured shard. Each node gets exactly the requests of its
+ * capture, in the same order, so it makes the same commit/abort decisions as in the capture. Messages from other
+ * nodes come from the capture too (the ones the UDLs put are intercepted), but each one waits until the replayed
+ * sender has produced it: this keeps the causal order with the messages between threads of a node, which are
+ * not captured. Requests are sent with the captured timing (scaled by the speed) or as fast as possible, and the
+ * outcomes are compared with the captured ones.
+ */
+int main(int argc, char** argv){
+    char c;
+    double speed = DEFAULT_SPEED;
+    std::string options_str;
+    uint64_t wait_seconds = DEFAULT_WAIT_SECONDS;
+
+    while ((c = getopt(argc, argv, "x:o:w:h")) != -1){
+        switch(c){
+            case 'x':
+                speed = std::max(strtod(optarg,NULL),0.0);
+                break;
+            case 'o':
+                options_str = optarg;
+                break;
+            case 'w':
+                wait_seconds = strtoul(optarg,NULL,10);
+                break;
+            case '?':
+            case 'h':
+            default:
+                print_help(argv[0]);
+                return 0;
+        }
+    }
+
+    if(optind >= argc){
+        print_help(argv[0]);
+        return 1;
+    }
+
+    // captures: one per shard, taken with the same number of shards
+    std::vector<std::string> capture_files(argv + optind,argv + argc);
+    std::vector<std::unique_ptr<CaptureReader>> captures;
+    for(auto& capture_file : capture_files){
+        captures.emplace_back(new CaptureReader());
+        if(!captures.back()->open(capture_file)){
+            std::cout << "ERROR: could not open capture file " << capture_file << std::endl;
+            return 1;
+        }
+    }
+
+    uint32_t num_shards = captures[0]->header().num_shards;
+    std::vector<bool> captured_shards(num_shards,false);
+    for(uint64_t i=0;i<captures.size();i++){
+        auto& header = captures[i]->header();
+        if((header.num_shards != num_shards) || (header.shard_index >= num_shards)){
+            std::cout << "ERROR: " << capture_files[i] << " was captured with " << header.num_shards << " shards, instead of " << num_shards << std::endl;
+            return 1;
+        }
+        if(captured_shards[header.shard_index]){
+            std::cout << "ERROR: more than one capture of shard " << header.shard_index << " (" << capture_files[i] << "): give a single node of each shard" << std::endl;
+            return 1;
+        }
+        captured_shards[header.shard_index] = true;
+        if(captures[i]->config() != captures[0]->config()){
+            std::cout << "WARNING: " << capture_files[i] << " has a different UDL config than " << capture_files[0] << ": using the latter" << std::endl;
+        }
+    }
+    if(captures.size() < num_shards){
+        std::cout << "WARNING: " << num_shards - captures.size() << " of " << num_shards << " shards were not captured: TXs involving them will not complete" << std::endl;
+    }
+
+    // captured outcomes, and the start of the replay timeline (first request of all captures)
+    std::unordered_map<transaction_id_t,transaction_status_t> captured_status;
+    uint64_t input_count = 0;
+    uint64_t first_ns = UINT64_MAX;
+    capture_record_t record;
+    const char* key;
+    const uint8_t* blob;
+    for(auto& capture : captures){
+        while(capture->next(record,key,blob)){
+            if(record.type == capture_record_type_t::OUTCOME){
+                captured_status[record.id] = record.status;
+                continue;
+            }
+            if(std::string(key,record.key_size) == "log"){
+                continue;
+            }
+            first_ns = std::min(first_ns,capture->header().start_ns + record.timestamp_ns);
+            input_count++;
+        }
+        capture->rewind();
+    }
+
+    // UDL config: the captured one, with the changes given, without the features that read from the object pool
+    nlohmann::json udl_config = nlohmann::json::parse(captures[0]->config(),nullptr,false);
+    if(udl_config.is_discarded()){
+        std::cout << "ERROR: invalid UDL config in " << capture_files[0] << std::endl;
+        return 1;
+    }
+    std::stringstream options_stream(options_str);
+    std::string option;
+    while(std::getline(options_stream,option,',')){
+        auto pos = option.find("=");
+        if(pos == std::string::npos){
+            std::cout << "ERROR: invalid UDL option '" << option << "' (expected name=value)" << std::endl;
+            return 1;
+        }
+        udl_config[option.substr(0,pos)] = option.substr(pos+1);
+    }
+    for(auto& name : {"enable_recovery","enable_delta_persistence","wallet_cache_capacity"}){
+        if((udl_config.count(name) > 0) && (std::string(udl_config[name]) != "0")){
+            std::cout << "WARNING: the capture was taken with " << name << " set: the replay runs without it" << std::endl;
+        }
+        udl_config[name] = "0";
+    }
+    udl_config["enable_notifications"] = "1";
+    udl_config["capture_path"] = "";
+
+    // replayed outcomes, from the notifications
+    std::unordered_map<transaction_id_t,transaction_status_t> replayed_status;
+    std::mutex completion_mtx;
+    std::condition_variable completion_signal;
+    uint64_t completed = 0;
+    auto handle_notification = [&](const Blob& blob){
+        auto batch = mutils::from_bytes<tx_completion_batch_t>(nullptr,blob.bytes);
+        std::unique_lock<std::mutex> lock(completion_mtx);
+        for(auto& completion : *batch){
+            replayed_status[completion.first] = completion.second;
+        }
+        completed += batch->size();
+        completion_signal.notify_all();
+    };
+
+    // messages produced by the replayed nodes, by target shard, key and TX, and not yet consumed from the captures
+    std::map<std::tuple<uint32_t,std::string,transaction_id_t>,uint64_t> produced;
+    std::mutex produced_mtx;
+    std::condition_variable produced_signal;
+    uint64_t unmatched = 0;
+    auto intercept_request = [&](const ObjectWithStringKey& obj,uint32_t shard){
+        auto request = mutils::from_bytes<cbdc_request_t>(nullptr,obj.blob.bytes);
+        std::unique_lock<std::mutex> lock(produced_mtx);
+        produced[std::make_tuple(shard,obj.key.substr(std::string(CBDC_REQUEST_PREFIX "/").size()),std::get<0>(*request))]++;
+        produced_signal.notify_all();
+    };
+
+    LocalCluster cluster(num_shards,udl_config,handle_notification,intercept_request);
+
+    // one sender per capture: requests go to the node of the captured shard, in the captured order
+    std::vector<std::thread> senders;
+    std::vector<uint64_t> max_lag_us(captures.size(),0);
+    auto start = std::chrono::steady_clock::now();
+    for(uint64_t i=0;i<captures.size();i++){
+        senders.emplace_back([&,i](){
+            auto& capture = captures[i];
+            uint64_t start_ns = capture->header().start_ns;
+            uint32_t shard = capture->header().shard_index;
+            capture_record_t record;
+            const char* key;
+            const uint8_t* blob;
+            while(capture->next(record,key,blob)){
+                if(record.type != capture_record_type_t::INPUT){
+                    continue;
+                }
+
+                std::string key_string(key,record.key_size);
+                if(key_string == "log"){
+                    continue; // the replay does not write timestamp logs
+                }
+
+                if(speed > 0){
+                    auto due = start + std::chrono::nanoseconds(static_cast<uint64_t>((start_ns + record.timestamp_ns - first_ns) / speed));
+                    auto now = std::chrono::steady_clock::now();
+                    if(now < due){
+                        std::this_thread::sleep_until(due);
+                    } else {
+                        max_lag_us[i] = std::max(max_lag_us[i],(uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - due).count());
+                    }
+                }
+
+                if(is_node_message(key_string)){
+                    auto request = mutils::from_bytes<cbdc_request_t>(nullptr,blob);
+                    auto message = std::make_tuple(shard,key_string,std::get<0>(*request));
+                    std::unique_lock<std::mutex> lock(produced_mtx);
+                    if(!produced_signal.wait_for(lock,std::chrono::seconds(wait_seconds),[&](){ return produced[message] > 0; })){
+                        unmatched++; // the replay diverged (e.g. a different config): the node would get a message for a TX it does not know
+                        continue;
+                    }
+                    produced[message]--;
+                }
+
+                ObjectWithStringKey obj;
+                obj.key = CBDC_REQUEST_PREFIX "/" + key_string;
+                obj.blob = Blob(blob,record.blob_size);
+                cluster.put(obj,shard);
+            }
+        });
+    }
+    for(auto& sender : senders){
+        sender.join();
+    }
+    std::chrono::duration<double> send_time = std::chrono::steady_clock::now() - start;
+
+    // outcomes arrive until every captured TX completes, or nothing completes for a while
+    {
+        std::unique_lock<std::mutex> lock(completion_mtx);
+        uint64_t last_completed = completed;
+        while(replayed_status.size() < captured_status.size()){
+            completion_signal.wait_for(lock,std::chrono::seconds(wait_seconds));
+            if(completed == last_completed){
+                break;
+            }
+            last_completed = completed;
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // results
+    uint64_t reproduced = 0,different = 0,missing = 0;
+    std::unique_lock<std::mutex> lock(completion_mtx);
+    for(auto& item : captured_status){
+        auto it = replayed_status.find(item.first);
+        if(it == replayed_status.end()){
+            missing++;
+        } else if(it->second == item.second){
+            reproduced++;
+        } else {
+            if(different < MAX_REPORTED_DIFFERENCES){
+                std::cout << "TX " << item.first << ": captured " << status_to_string(item.second) << ", replayed " << status_to_string(it->second) << std::endl;
+            }
+            different++;
+        }
+    }
+    uint64_t not_captured = replayed_status.size() - reproduced - different;
+
+    std::cout << "captures,shards,requests,send_seconds,seconds,requests_per_second,max_lag_us,captured_outcomes,reproduced,different,missing,not_captured,unmatched_messages" << std::endl;
+    std::cout << captures.size() << "," << num_shards << "," << input_count << "," << send_time.count() << "," << elapsed.count() << "," << input_count / send_time.count() << "," << *std::max_element(max_lag_us.begin(),max_lag_us.end()) << "," << captured_status.size() << "," << reproduced << "," << different << "," << missing << "," << not_captured << "," << unmatched << std::endl;
+
+    if((different > 0) || (missing > 0)){
+        std::cout << "WARNING: " << different << " TXs finished with a different status than in the capture, and " << missing << " did not finish" << std::endl;
+    }
+    if(unmatched > 0){
+        std::cout << "WARNING: " << unmatched << " captured messages from other nodes were not produced by the replay, and were skipped" << std::endl;
+    }
+
+    return 0;
+}
@@ -7,14 +7,228 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <unordered_set>
+#include <condition_variable>
+#include <random>
+#include <sstream>
+#include <algorithm>
 #include "cbdc_client.hpp"
 #include "benchmark_workload.hpp"
 
 #define LAST_TX_POLL_INTERVAL_MS 1000
+#define IN_FLIGHT_POLL_MS 5000 // closed loop and rate sweep: transfers in flight for longer are polled with get_status, in case their notification was lost
+#define IN_FLIGHT_ABANDON_MS 60000 // transfers still without a final status are no longer waited for (the check step finds them)
 #define DEFAULT_SECONDS_AFTER_STEP 5
 #define DEFAULT_BATCH_MIN_SIZE 0
 #define DEFAULT_BATCH_MAX_SIZE 150
 #define DEFAULT_BATCH_TIME_US 500
+#define DEFAULT_QUEUE_MAX_SIZE 0
+#define DEFAULT_BULK_MINT_SIZE 0
+#define DEFAULT_DIGEST_RANGE_SIZE 1024
+#define DEFAULT_OUTSTANDING_TRANSFERS 0
+#define PACING_SPIN_US 100 // the pacer sleeps until this close to the next send time, then spins
+
+// resident memory of this process, in bytes
+static uint64_t resident_memory(){
+    uint64_t size = 0,resident = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> size >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// open-loop arrivals: send times are fixed in advance (constant or Poisson intervals), independent of how long each send takes
+class OpenLoopPacer {
+    std::chrono::steady_clock::time_point start;
+    double elapsed_ns = 0; // from start to the next send time
+    double mean_interval_ns;
+    bool poisson;
+    std::mt19937_64 rng;
+    std::exponential_distribution<double> interval_dist;
+
+    public:
+
+    OpenLoopPacer(uint64_t rate,bool poisson) : mean_interval_ns(1e9 / rate), poisson(poisson), rng(3), interval_dist(1.0) {
+        start = std::chrono::steady_clock::now();
+    }
+
+    // intended start of the next request
+    std::chrono::steady_clock::time_point next(){
+        auto next_time = start + std::chrono::nanoseconds(static_cast<int64_t>(elapsed_ns));
+        elapsed_ns += poisson ? mean_interval_ns * interval_dist(rng) : mean_interval_ns;
+        return next_time;
+    }
+
+    // sleep while far from the intended time (sleep_for overshoots by tens of microseconds), then spin: returns immediately when behind schedule, so late requests go out back to back
+    static void wait_until(std::chrono::steady_clock::time_point intended){
+        auto spin = std::chrono::microseconds(PACING_SPIN_US);
+        auto now = std::chrono::steady_clock::now();
+        if(intended - now > spin){
+            std::this_thread::sleep_for(intended - now - spin);
+        }
+
+        while(std::chrono::steady_clock::now() < intended){}
+    }
+};
+
+// a workload operation without senders is a mint to its receiver, and one without receivers is a redeem from its sender
+transaction_id_t send_operation(CascadeCBDC& cbdc,const benchmark_transfer_t& transfer){
+    if(transfer.senders.empty()){
+        return cbdc.mint(transfer.receivers.begin()->first,transfer.receivers.begin()->second);
+    } else if(transfer.receivers.empty()){
+        return cbdc.redeem(transfer.senders.begin()->first,transfer.senders.begin()->second);
+    }
+    return cbdc.transfer(transfer.senders,transfer.receivers);
+}
+
+transaction_id_t send_operation_async(CascadeCBDC& cbdc,const benchmark_transfer_t& transfer,const completion_callback_t& callback){
+    if(transfer.senders.empty()){
+        return cbdc.mint_async(transfer.receivers.begin()->first,transfer.receivers.begin()->second,callback);
+    } else if(transfer.receivers.empty()){
+        return cbdc.redeem_async(transfer.senders.begin()->first,transfer.senders.begin()->second,callback);
+    }
+    return cbdc.transfer_async(transfer.senders,transfer.receivers,callback);
+}
+
+// wait until a TX is final: notified by the service (enable_notifications) or polling its persisted status
+void wait_transaction(CascadeCBDC& cbdc,transaction_id_t txid){
+    auto poll_interval = std::chrono::milliseconds(LAST_TX_POLL_INTERVAL_MS);
+    while(true){
+        if(cbdc.notifications_enabled()){
+            if(cbdc.wait_completion(txid,poll_interval) != transaction_status_t::UNKNOWN){
+                return;
+            }
+        } else {
+            std::this_thread::sleep_for(poll_interval);
+        }
+
+        // also covers a notification sent before the handler was registered
+        if(cbdc.get_status(txid) != transaction_status_t::UNKNOWN){
+            return;
+        }
+    }
+}
+
+// check the given wallets: returns the number of wrong balances
+uint64_t check_wallets(CascadeCBDC& cbdc,const std::unordered_map<wallet_id_t,coin_value_t>& expected_balance,const std::vector<wallet_id_t>& wallets,uint64_t max_gets_in_flight){
+    auto start = std::chrono::steady_clock::now();
+    auto fetched = cbdc.get_wallets(wallets,max_gets_in_flight);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "  read " << wallets.size() << " wallets in " << elapsed.count() << " seconds" << std::endl;
+
+    uint64_t error_count = 0;
+    for(auto& wallet_id : wallets){
+        auto balance = CBDC_COMPUTE_WALLET_BALANCE(fetched[wallet_id]);
+        if(balance != expected_balance.at(wallet_id)){
+            error_count++;
+            //std::cout << "  - balance error for wallet " << wallet_id << ": expected " << expected_balance.at(wallet_id) << " but got " << balance << std::endl;
+        }
+    }
+    return error_count;
+}
+
+// read the status of all transfers
+std::unordered_map<transaction_id_t,transaction_status_t> read_statuses(CascadeCBDC& cbdc,uint64_t transfer_count,std::unordered_map<uint64_t,transaction_id_t>& transfer_id,uint64_t max_gets_in_flight){
+    std::vector<transaction_id_t> txids;
+    txids.reserve(transfer_count);
+    for(uint64_t i = 0;i<transfer_count;i++){
+        txids.push_back(transfer_id[i]);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto statuses = cbdc.get_statuses(txids,max_gets_in_flight);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "  read " << txids.size() << " status in " << elapsed.count() << " seconds" << std::endl;
+    return statuses;
+}
+
+// expected balances and status when some transfers were rejected by the service (not admitted due to overload): replays the
+// workload in order without them, with the rule used to generate it (a transfer commits if all its senders have enough coins)
+void replay_without_rejected(CBDCBenchmarkWorkload& benchmark,const std::vector<bool>& rejected,std::unordered_map<wallet_id_t,coin_value_t>& expected_balance,std::vector<transaction_status_t>& expected_status){
+    expected_balance = benchmark.get_wallets();
+    expected_status.assign(rejected.size(),transaction_status_t::REJECTED);
+
+    benchmark_transfer_t buffer;
+    for(uint64_t i = 0;i<rejected.size();i++){
+        if(rejected[i]){
+            continue;
+        }
+
+        auto& transfer = benchmark.get_transfer(i,buffer);
+        bool success = true;
+        for(auto& sender : transfer.senders){
+            success = success && (expected_balance[sender.first] >= sender.second);
+        }
+
+        expected_status[i] = success ? transaction_status_t::COMMIT : transaction_status_t::ABORT;
+        if(success){
+            for(auto& sender : transfer.senders){
+                expected_balance[sender.first] -= sender.second;
+            }
+            for(auto& receiver : transfer.receivers){
+                expected_balance[receiver.first] += receiver.second;
+            }
+        }
+    }
+}
+
+// check the status of all transfers against the workload, or against the replayed status if given: returns the number of wrong status
+uint64_t check_transfers(CBDCBenchmarkWorkload& benchmark,std::unordered_map<uint64_t,transaction_id_t>& transfer_id,std::unordered_map<transaction_id_t,transaction_status_t>& statuses,const std::vector<transaction_status_t>& replayed_status){
+    uint64_t transfer_count = benchmark.get_transfer_count();
+    uint64_t error_count = 0;
+    for(uint64_t i = 0;i<transfer_count;i++){
+        auto& txid = transfer_id[i];
+        auto status = statuses[txid];
+
+        transaction_status_t expected = transaction_status_t::ABORT;
+        if(!replayed_status.empty()){
+            expected = replayed_status[i];
+        } else if(benchmark.get_expected_status(i)){
+            expected = transaction_status_t::COMMIT;
+        }
+
+        if(status != expected){
+            error_count++;
+            //std::cout << "  - status error for TX (" << i << "," << txid << "): expected " << cbdc.status_to_string(expected) << " but got " << cbdc.status_to_string(status) << std::endl;
+        }
+    }
+    return error_count;
+}
+
+// compare the digests of each shard with the expected balances: returns the wallets in ranges that do not match
+std::vector<wallet_id_t> mismatching_wallets(CascadeCBDC& cbdc,const std::unordered_map<wallet_id_t,coin_value_t>& expected_balance,const std::vector<shard_digest_t>& digests,uint64_t range_size){
+    std::vector<std::unordered_map<uint64_t,range_digest_t>> expected(digests.size());
+    std::vector<std::unordered_map<uint64_t,std::vector<wallet_id_t>>> range_wallets(digests.size());
+    for(auto& item : expected_balance){
+        auto shard_index = cbdc.get_wallet_shard(item.first);
+        CBDC_DIGEST_ADD_WALLET(expected[shard_index],range_size,item.first,item.second);
+        range_wallets[shard_index][item.first / range_size].push_back(item.first);
+    }
+
+    std::vector<wallet_id_t> wallets;
+    uint64_t range_count = 0;
+    uint64_t mismatch_count = 0;
+    for(uint32_t shard_index = 0; shard_index < digests.size(); shard_index++){
+        auto& ranges = std::get<0>(digests[shard_index]);
+        std::unordered_set<uint64_t> all_ranges;
+        for(auto& item : ranges) all_ranges.insert(item.first);
+        for(auto& item : expected[shard_index]) all_ranges.insert(item.first);
+
+        for(auto range : all_ranges){
+            range_count++;
+            auto it = ranges.find(range);
+            auto exp_it = expected[shard_index].find(range);
+            if((it != ranges.end()) && (exp_it != expected[shard_index].end()) && (it->second == exp_it->second)){
+                continue;
+            }
+
+            mismatch_count++;
+            auto& range_list = range_wallets[shard_index][range];
+            wallets.insert(wallets.end(),range_list.begin(),range_list.end());
+        }
+    }
+
+    std::cout << "  " << mismatch_count << " of " << range_count << " ranges do not match the digests: checking their " << wallets.size() << " wallets one by one ..." << std::endl;
+    return wallets;
+}
 
 void print_help(const std::string& bin_name){
     std::cout << "usage: " << bin_name << " [options] <benchmark_workload_file>" << std::endl;
@@ -22,10 +236,20 @@ void print_help(const std::string& bin_name){
     std::cout << " -o <output_file>\tfile to write the local measurements log" << std::endl;
     std::cout << " -l <remote_log>\tfile to write the remote measurements logs" << std::endl;
     std::cout << " -r <send_rate>\trate (in transfers/second) at which to send transfers (default: unlimited)" << std::endl;
+    std::cout << " -A <arrivals>\t\twith -r or -S: 'constant' intervals between transfers or 'poisson' arrivals (default: constant)" << std::endl;
+    std::cout << " -S <rates>\t\trate sweep: comma-separated list of rates, each one used for an equal part of the transfers, reporting latency for each rate (requires enable_notifications)" << std::endl;
     std::cout << " -w <wait_time>\ttime to wait (in seconds) after each step (default: " << DEFAULT_SECONDS_AFTER_STEP << ")" << std::endl;
     std::cout << " -b <batch_min_size>\tminimum batch size (default: " << DEFAULT_BATCH_MIN_SIZE << ")" << std::endl;
     std::cout << " -x <batch_max_size>\tmaximum batch size (default: " << DEFAULT_BATCH_MAX_SIZE << ")" << std::endl;
     std::cout << " -u <batch_time_us>\tmaximum time to wait for the batch minimum size, in microseconds (default: " << DEFAULT_BATCH_TIME_US << ")" << std::endl;
+    std::cout << " -q <queue_max_size>\tmaximum number of requests queued per shard before the client blocks (default: " << DEFAULT_QUEUE_MAX_SIZE << ", up to " << CLIENT_QUEUE_CAPACITY << ")" << std::endl;
+    std::cout << " -T <sender_threads>\tnumber of client threads sending requests, each one to a subset of the shards (default: " << DEFAULT_SENDER_THREADS << ", at most one per shard)" << std::endl;
+    std::cout << " -M <bulk_mint_size>\tmint wallets using bulk requests with up to this many wallets each (default: " << DEFAULT_BULK_MINT_SIZE << ", one mint per wallet)" << std::endl;
+    std::cout << " -V <digest_range_size>\tcheck step: compare digests of ranges of this many wallet IDs with each shard, reading only the wallets in mismatching ranges (default: " << DEFAULT_DIGEST_RANGE_SIZE << ", 0 reads every wallet and TX)" << std::endl;
+    std::cout << " -G <max_gets_in_flight>\tcheck step: maximum number of concurrent gets when reading wallets and TX status (default: " << DEFAULT_MAX_GETS_IN_FLIGHT << ", 1 reads one at a time)" << std::endl;
+    std::cout << " -B <trace_buffer_size>\tevents kept in memory by each client thread, older ones are spilled to a temporary file until the log is written (default: " << CBDC_TRACE_DEFAULT_BUFFER_SIZE << ")" << std::endl;
+    std::cout << " -n <outstanding>\tclosed loop: keep this many transfers in flight, sending the next one when a transfer completes (default: " << DEFAULT_OUTSTANDING_TRANSFERS << ", open loop; requires enable_notifications)" << std::endl;
+    std::cout << " -D\t\t\tdrop the older trace events instead of spilling them: only the last trace_buffer_size events of each client thread are written" << std::endl;
     std::cout << " -a\t\t\tdo not reset the service (Note: this can lead to incorrect final balances if re-executing the same benchmark)" << std::endl;
     std::cout << " -m\t\t\tskip minting step" << std::endl;
     std::cout << " -s\t\t\tskip transfer step" << std::endl;
@@ -41,13 +265,22 @@ int main(int argc, char** argv){
     bool mint_step = true;
     bool transfer_step = true;
     bool check_step = true;
-    bool rate_control = false;
+    bool poisson = false;
+    std::vector<uint64_t> sweep_rates;
     bool reset_service = true;
     uint64_t batch_min_size = DEFAULT_BATCH_MIN_SIZE;
     uint64_t batch_max_size = DEFAULT_BATCH_MAX_SIZE;
     uint64_t batch_time_us = DEFAULT_BATCH_TIME_US;
+    uint64_t queue_max_size = DEFAULT_QUEUE_MAX_SIZE;
+    uint64_t trace_buffer_size = CBDC_TRACE_DEFAULT_BUFFER_SIZE;
+    bool trace_spill = true;
+    uint64_t bulk_mint_size = DEFAULT_BULK_MINT_SIZE;
+    uint64_t digest_range_size = DEFAULT_DIGEST_RANGE_SIZE;
+    uint64_t max_gets_in_flight = DEFAULT_MAX_GETS_IN_FLIGHT;
+    uint64_t outstanding = DEFAULT_OUTSTANDING_TRANSFERS;
+    uint64_t sender_threads = DEFAULT_SENDER_THREADS;
 
-    while ((c = getopt(argc, argv, "o:r:w:l:b:x:u:amsch")) != -1){
+    while ((c = getopt(argc, argv, "o:r:A:S:w:l:b:x:u:q:T:M:V:G:B:n:Damsch")) != -1){
         switch(c){
             case 'o':
                 fname = optarg;
@@ -58,6 +291,18 @@ int main(int argc, char** argv){
             case 'r':
                 send_rate = strtoul(optarg,NULL,10);
                 break;
+            case 'A':
+                poisson = (std::string(optarg) == "poisson");
+                break;
+            case 'S':
+            {
+                std::stringstream rates_stream(optarg);
+                std::string rate_str;
+                while(std::getline(rates_stream,rate_str,',')){
+                    sweep_rates.push_back(std::stoull(rate_str));
+                }
+                break;
+            }
             case 'w':
                 wait_time = strtoul(optarg,NULL,10);
                 break;
@@ -70,6 +315,30 @@ int main(int argc, char** argv){
             case 'u':
                 batch_time_us = strtoul(optarg,NULL,10);
                 break;
+            case 'q':
+                queue_max_size = strtoul(optarg,NULL,10);
+                break;
+            case 'T':
+                sender_threads = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case 'M':
+                bulk_mint_size = strtoul(optarg,NULL,10);
+                break;
+            case 'V':
+                digest_range_size = strtoul(optarg,NULL,10);
+                break;
+            case 'G':
+                max_gets_in_flight = std::max(strtoul(optarg,NULL,10),1UL);
+                break;
+            case 'B':
+                trace_buffer_size = strtoul(optarg,NULL,10);
+                break;
+            case 'D':
+                trace_spill = false;
+                break;
+            case 'n':
+                outstanding = strtoul(optarg,NULL,10);
+                break;
             case 'a':
                 reset_service = false;
                 break;
@@ -105,26 +374,58 @@ int main(int argc, char** argv){
         remote_logs = "cbdc.log";
     }
 
+    // the binary format is mapped into memory: pages are only read when the transfers are sent
+    auto load_start = std::chrono::steady_clock::now();
+    CBDCBenchmarkWorkload& benchmark = CBDCBenchmarkWorkload::load(workload_file);
+    std::chrono::duration<double> load_time = std::chrono::steady_clock::now() - load_start;
+
     CascadeCBDC cbdc;
-    CBDCBenchmarkWorkload& benchmark = CBDCBenchmarkWorkload::from_file(workload_file);
     std::unordered_map<uint64_t,transaction_id_t> transfer_id;
 
     std::cout << "setting up ..." << std::endl;
     std::cout << "  workload_file = " << workload_file << std::endl;
+    std::cout << "  workload_format = " << (benchmark.is_mapped() ? "binary" : "gz") << std::endl;
+    std::cout << "  workload_load_time = " << load_time.count() << " seconds" << std::endl;
+    std::cout << "  workload_memory = " << resident_memory() / (1024*1024) << " MB resident after loading" << std::endl;
     std::cout << "  send_rate = " << send_rate << std::endl;
+    std::cout << "  arrivals = " << (poisson ? "poisson" : "constant") << std::endl;
+    std::cout << "  sweep_rates =";
+    for(auto rate : sweep_rates){
+        std::cout << " " << rate;
+    }
+    std::cout << std::endl;
     std::cout << "  wait_time = " << wait_time << std::endl;
     std::cout << "  batch_min_size = " << batch_min_size << std::endl;
     std::cout << "  batch_max_size = " << batch_max_size << std::endl;
     std::cout << "  batch_time_us = " << batch_time_us << std::endl;
+    std::cout << "  queue_max_size = " << queue_max_size << std::endl;
+    std::cout << "  sender_threads = " << sender_threads << std::endl;
+    std::cout << "  bulk_mint_size = " << bulk_mint_size << std::endl;
+    std::cout << "  digest_range_size = " << digest_range_size << std::endl;
+    std::cout << "  max_gets_in_flight = " << max_gets_in_flight << std::endl;
+    std::cout << "  outstanding = " << outstanding << std::endl;
+    std::cout << "  trace_buffer_size = " << trace_buffer_size << std::endl;
+    std::cout << "  trace_spill = " << trace_spill << std::endl;
     std::cout << "  output_file = " << fname << std::endl;
     std::cout << "  remote_log = " << remote_logs << std::endl;
 
-    cbdc.setup(batch_min_size,batch_max_size,batch_time_us); 
+    CBDCTrace::set_buffer_size(trace_buffer_size);
+    CBDCTrace::set_spill(trace_spill);
+    cbdc.setup(batch_min_size,batch_max_size,batch_time_us,queue_max_size,sender_threads); 
 
-    std::chrono::nanoseconds iteration_time;
-    if(send_rate != 0){
-        rate_control = true;
-        iteration_time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::seconds(1)) / send_rate;
+    // the same-shard fraction of the workload assumes a shard for each wallet: compare with the service for a sample of wallets
+    auto& distribution = benchmark.get_distribution();
+    if(distribution.num_shards > 0){
+        uint64_t mismatches = 0;
+        uint64_t sample_size = std::min(std::get<0>(benchmark.get_parameters()),(wallet_id_t)1000);
+        for(wallet_id_t wallet_id=std::get<1>(benchmark.get_parameters());wallet_id<std::get<1>(benchmark.get_parameters())+sample_size;wallet_id++){
+            if(workload_wallet_shard(wallet_id,distribution.num_shards) != cbdc.get_wallet_shard(wallet_id)){
+                mismatches++;
+            }
+        }
+        if(mismatches > 0){
+            std::cout << "WARNING: the workload assumes " << distribution.num_shards << " shards, but " << mismatches << " of " << sample_size << " wallets are in a different shard: the same-shard fraction does not hold" << std::endl;
+        }
     }
 
     // reset the CBDC UDL state in all nodes
@@ -135,107 +436,293 @@ int main(int argc, char** argv){
     }
 
     // mint coins
-    if(mint_step){
+    if(mint_step && (bulk_mint_size > 0)){
+        auto& wallets = benchmark.get_wallets();
+        std::cout << "minting " << wallets.size() << " wallets in bulk ..." << std::endl;
+
+        auto start = std::chrono::steady_clock::now();
+        auto txids = cbdc.bulk_mint(wallets,bulk_mint_size);
+
+        // wait until all bulk mints are finished
+        std::cout << "waiting " << txids.size() << " bulk mints to finish ..." << std::endl;
+        for(auto& txid : txids){
+            wait_transaction(cbdc,txid);
+        }
+        
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "  minted " << wallets.size() << " wallets in " << elapsed.count() << " seconds" << std::endl;
+        std::this_thread::sleep_for(std::chrono::seconds(wait_time));
+    } else if(mint_step){
         std::cout << "minting wallets ..." << std::endl;
         auto& wallets = benchmark.get_wallets();
 
-        auto extra_time = std::chrono::nanoseconds(0);
+        OpenLoopPacer pacer(std::max(send_rate,(uint64_t)1),poisson);
         transaction_id_t last_tx;
         for(auto& wallet : wallets){
-            auto start = std::chrono::steady_clock::now();
-            last_tx = cbdc.mint(wallet.first,wallet.second);
-            auto end = std::chrono::steady_clock::now();
-
-            if(rate_control){
-                auto elapsed = end - start + extra_time;
-                auto sleep_time = iteration_time - elapsed;
-                start = std::chrono::steady_clock::now();
-                std::this_thread::sleep_for(sleep_time);
-                extra_time = std::chrono::steady_clock::now() - start - sleep_time;
+            if(send_rate > 0){
+                OpenLoopPacer::wait_until(pacer.next());
             }
+            last_tx = cbdc.mint(wallet.first,wallet.second);
         }
-        std::this_thread::sleep_for(std::chrono::seconds(2));
 
-        // poll until last TX is finished
+        // wait until last TX is finished
         std::cout << "waiting last mint to finish ..." << std::endl;
-        auto poll_interval = std::chrono::milliseconds(LAST_TX_POLL_INTERVAL_MS);
-        while(cbdc.get_status(last_tx) == transaction_status_t::UNKNOWN){
-            std::this_thread::sleep_for(poll_interval);
-        }
+        wait_transaction(cbdc,last_tx);
         std::this_thread::sleep_for(std::chrono::seconds(wait_time));
     }
 
     // perform transfers
     if(transfer_step){
-        auto& transfers = benchmark.get_transfers();
-        std::cout << "performing " << transfers.size() << " transfers ..." << std::endl;
+        uint64_t transfer_count = benchmark.get_transfer_count();
+        benchmark_transfer_t transfer_buffer;
+        if((outstanding > 0) && !cbdc.notifications_enabled()){
+            std::cout << "WARNING: closed loop requires enable_notifications in the service: sending transfers in open loop" << std::endl;
+            outstanding = 0;
+        }
+        if(!sweep_rates.empty() && !cbdc.notifications_enabled()){
+            std::cout << "WARNING: rate sweep latency requires enable_notifications in the service: use metrics.py on the logs of each rate instead" << std::endl;
+        }
+        bool measure_latency = !sweep_rates.empty() && cbdc.notifications_enabled();
+        std::cout << "performing " << transfer_count << " transfers ..." << std::endl;
+
+        // a single rate, unless sweeping: each rate sends a consecutive part of the transfers, so the final balances are the same
+        std::vector<uint64_t> rates = sweep_rates;
+        if(rates.empty()){
+            rates.push_back(send_rate);
+        }
+        uint64_t part_size = transfer_count / rates.size();
+
+        // closed loop and rate sweep: the completion callback frees a slot for the next transfer and records the latency from the intended start
+        std::mutex in_flight_mtx;
+        std::condition_variable in_flight_signal;
+        uint64_t in_flight = 0;
+        uint64_t abandoned = 0;
+        std::vector<double> latencies;
+        std::unordered_map<transaction_id_t,std::chrono::steady_clock::time_point> sent_at; // transfers in flight
+        std::unordered_set<transaction_id_t> completed_early; // completed before sent_at was updated
+
+        // wait until fewer than limit transfers are in flight: as in wait_transaction, the ones without a notification for too long
+        // are polled with get_status, and given up after IN_FLIGHT_ABANDON_MS, so a lost notification neither blocks the loop nor leaks its callback
+        auto wait_in_flight = [&](std::unique_lock<std::mutex>& lock,uint64_t limit){
+            auto poll_interval = std::chrono::milliseconds(LAST_TX_POLL_INTERVAL_MS);
+            while(!in_flight_signal.wait_for(lock,poll_interval,[&](){ return in_flight < limit; })){
+                auto now = std::chrono::steady_clock::now();
+                std::vector<std::pair<transaction_id_t,bool>> overdue; // txid, abandon
+                for(auto& item : sent_at){
+                    if(now - item.second > std::chrono::milliseconds(IN_FLIGHT_POLL_MS)){
+                        overdue.emplace_back(item.first,now - item.second > std::chrono::milliseconds(IN_FLIGHT_ABANDON_MS));
+                    }
+                }
+
+                lock.unlock();
+                for(auto& item : overdue){
+                    cbdc.poll_async(item.first,item.second);
+                }
+                lock.lock();
+            }
+        };
+
+        if(measure_latency){
+            std::cout << "  rate sweep (latency from the intended start to the completion notification, in ms):" << std::endl;
+            std::cout << "  offered_rate,achieved_rate,transfers,p50,p90,p99,p999,max" << std::endl;
+        }
        
-        auto extra_time = std::chrono::nanoseconds(0);
-        for(uint64_t i=0;i<transfers.size();i++){
-            auto start = std::chrono::steady_clock::now();
-            auto& transfer = transfers[i];
-            auto txid = cbdc.transfer(transfer.senders,transfer.receivers);
-            transfer_id[i] = txid;
-            auto end = std::chrono::steady_clock::now();
-            
-            if(rate_control){
-                auto elapsed = end - start + extra_time;
-                auto sleep_time = iteration_time - elapsed;
-                start = std::chrono::steady_clock::now();
-                std::this_thread::sleep_for(sleep_time);
-                extra_time = std::chrono::steady_clock::now() - start - sleep_time;
+        auto loop_start = std::chrono::steady_clock::now();
+        for(uint64_t r=0;r<rates.size();r++){
+            uint64_t first = r * part_size;
+            uint64_t last = (r == rates.size()-1) ? transfer_count : first + part_size;
+            auto rate = rates[r];
+            OpenLoopPacer pacer(std::max(rate,(uint64_t)1),poisson);
+            latencies.clear();
+            auto part_start = std::chrono::steady_clock::now();
+
+            for(uint64_t i=first;i<last;i++){
+                auto& transfer = benchmark.get_transfer(i,transfer_buffer);
+                auto intended = std::chrono::steady_clock::now();
+                if(rate > 0){
+                    intended = pacer.next();
+                    OpenLoopPacer::wait_until(intended);
+                }
+
+                transaction_id_t txid;
+                if((outstanding > 0) || measure_latency){
+                    std::unique_lock<std::mutex> lock(in_flight_mtx);
+                    if(outstanding > 0){
+                        wait_in_flight(lock,outstanding);
+                    }
+                    in_flight++;
+                    lock.unlock();
+                    txid = send_operation_async(cbdc,transfer,[&,intended](transaction_id_t txid,transaction_status_t status){
+                        std::chrono::duration<double,std::milli> latency = std::chrono::steady_clock::now() - intended;
+                        std::unique_lock<std::mutex> lock(in_flight_mtx);
+                        if(status != transaction_status_t::UNKNOWN){
+                            latencies.push_back(latency.count());
+                        } else {
+                            abandoned++;
+                        }
+                        if(sent_at.erase(txid) == 0){
+                            completed_early.insert(txid);
+                        }
+                        in_flight--;
+                        in_flight_signal.notify_all();
+                    });
+
+                    lock.lock();
+                    if(completed_early.erase(txid) == 0){
+                        sent_at.emplace(txid,std::chrono::steady_clock::now());
+                    }
+                } else {
+                    txid = send_operation(cbdc,transfer);
+                }
+
+                if(rate > 0){
+                    cbdc.log_intended_start(txid,intended);
+                }
+                transfer_id[i] = txid;
+            }
+
+            if(measure_latency){
+                // all transfers of this rate completed before the next rate starts
+                std::unique_lock<std::mutex> lock(in_flight_mtx);
+                wait_in_flight(lock,1);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - part_start;
+                std::sort(latencies.begin(),latencies.end());
+                auto percentile = [&](double p){ return latencies.empty() ? 0.0 : latencies[std::min((uint64_t)(p * latencies.size()),(uint64_t)latencies.size()-1)]; };
+                std::cout << "  " << rate << "," << (last - first) / elapsed.count() << "," << (last - first) << "," << percentile(0.5) << "," << percentile(0.9) << "," << percentile(0.99) << "," << percentile(0.999) << "," << (latencies.empty() ? 0.0 : latencies.back()) << std::endl;
             }
         }
-        std::this_thread::sleep_for(std::chrono::seconds(2));
 
-        // poll until last TX is finished
-        std::cout << "waiting last TX to finish ..." << std::endl;
-        auto last_tx = transfer_id[transfers.size()-1];
-        auto poll_interval = std::chrono::milliseconds(LAST_TX_POLL_INTERVAL_MS);
-        while(cbdc.get_status(last_tx) == transaction_status_t::UNKNOWN){
-            std::this_thread::sleep_for(poll_interval);
+        // client-side cost of building, routing and queuing the transfers (a single submitting thread)
+        std::chrono::duration<double> submit_time = std::chrono::steady_clock::now() - loop_start;
+        std::cout << "  submitted " << transfer_count << " transfers in " << submit_time.count() << " seconds: " << transfer_count / submit_time.count() << " tx/s" << std::endl;
+
+        if((outstanding > 0) || measure_latency){
+            // all transfers completed: closed-loop throughput
+            std::unique_lock<std::mutex> lock(in_flight_mtx);
+            wait_in_flight(lock,1);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - loop_start;
+            if(outstanding > 0) std::cout << "  " << transfer_count << " transfers completed in " << elapsed.count() << " seconds with " << outstanding << " in flight: " << transfer_count / elapsed.count() << " tx/s" << std::endl;
+            if(abandoned > 0){
+                std::cout << "WARNING: " << abandoned << " transfers had no final status after " << IN_FLIGHT_ABANDON_MS << " ms and were no longer waited for" << std::endl;
+            }
+        } else {
+            // wait until last TX is finished
+            std::cout << "waiting last TX to finish ..." << std::endl;
+            auto last_tx = transfer_id[transfer_count-1];
+            auto start = std::chrono::steady_clock::now();
+            wait_transaction(cbdc,last_tx);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "  last TX finished " << elapsed.count() << " seconds after the last transfer was sent" << std::endl;
+        }
+        if(cbdc.get_rejected_count() > 0){
+            std::cout << "  " << cbdc.get_rejected_count() << " TXs rejected by the service: the client backed off after each one" << std::endl;
         }
         std::this_thread::sleep_for(std::chrono::seconds(wait_time));
     }
 
     // check final values
     if(check_step){
-        auto& expected_balance = benchmark.get_expected_balance();
-        auto& expected_status = benchmark.get_expected_status();
+        const std::unordered_map<wallet_id_t,coin_value_t>* expected_balance = &benchmark.get_expected_balance();
+        std::unordered_map<wallet_id_t,coin_value_t> replayed_balance;
+        std::vector<transaction_status_t> replayed_status; // empty unless transfers were rejected
+        uint64_t transfer_count = benchmark.get_transfer_count();
         uint64_t error_count = 0;
 
+        // digests of all shards: O(shards) requests instead of a get for every wallet and TX
+        std::vector<shard_digest_t> digests;
+        uint64_t digest_rejected = 0;
+        if(digest_range_size > 0){
+            std::cout << "getting digests from all shards ..." << std::endl;
+            digests = cbdc.get_digests(digest_range_size);
+            auto rejected_index = static_cast<uint64_t>(transaction_status_t::REJECTED);
+            for(auto& digest : digests){
+                if(std::get<1>(digest).size() > rejected_index){
+                    digest_rejected += std::get<1>(digest)[rejected_index];
+                }
+            }
+        }
+
+        // rejected transfers never ran, so the expected values of the workload do not hold: the status of every transfer is
+        // read first (unless the digests show that none was rejected), and the expected values are replayed without them
+        bool use_status_digests = (digest_range_size > 0) && (transfer_id.size() == transfer_count);
+        std::unordered_map<transaction_id_t,transaction_status_t> statuses;
+        bool statuses_read = false;
+        uint64_t rejected_count = 0;
+        if(!use_status_digests || (digest_rejected > 0)){
+            std::cout << "reading " << transfer_count << " final status ..." << std::endl;
+            statuses = read_statuses(cbdc,transfer_count,transfer_id,max_gets_in_flight);
+            statuses_read = true;
+
+            std::vector<bool> rejected(transfer_count,false);
+            for(uint64_t i=0;i<transfer_count;i++){
+                if(statuses[transfer_id[i]] == transaction_status_t::REJECTED){
+                    rejected[i] = true;
+                    rejected_count++;
+                }
+            }
+
+            if(rejected_count > 0){
+                std::cout << "  " << rejected_count << " transfers rejected by the service: replaying the workload without them ..." << std::endl;
+                replay_without_rejected(benchmark,rejected,replayed_balance,replayed_status);
+                expected_balance = &replayed_balance;
+            }
+        }
+
         // check balances
-        std::cout << "checking " << expected_balance.size() << " final balances ..." << std::endl;
-        for(auto& item : expected_balance){
-            auto wallet = cbdc.get_wallet(item.first);
-            auto balance = CBDC_COMPUTE_WALLET_BALANCE(wallet);
-            if(balance != item.second){
-                error_count++;
-                //std::cout << "  - balance error for wallet " << item.first << ": expected " << item.second << " but got " << balance << std::endl;
+        std::cout << "checking " << expected_balance->size() << " final balances ..." << std::endl;
+        std::vector<wallet_id_t> wallets;
+        if(digest_range_size > 0){
+            wallets = mismatching_wallets(cbdc,*expected_balance,digests,digest_range_size);
+        } else {
+            for(auto& item : *expected_balance){
+                wallets.push_back(item.first);
             }
         }
+        error_count = check_wallets(cbdc,*expected_balance,wallets,max_gets_in_flight);
 
         std::cout << "  " << error_count << " balance errors found" << std::endl;
         std::this_thread::sleep_for(std::chrono::seconds(2));
 
         // check status
-        std::cout << "checking " << expected_status.size() << " final status ..." << std::endl;
+        std::cout << "checking " << transfer_count << " final status ..." << std::endl;
         error_count = 0;
-        for(uint64_t i = 0;i<expected_status.size();i++){
-            auto& txid = transfer_id[i];
-            auto status = cbdc.get_status(txid);
-            transaction_status_t expected = transaction_status_t::ABORT;
-            if(expected_status.at(i)){
-                expected = transaction_status_t::COMMIT;
+        bool status_match = false;
+        if(use_status_digests && !statuses_read){
+            // each transfer is counted by a single shard
+            std::vector<uint64_t> status_count(static_cast<uint64_t>(transaction_status_t::UNKNOWN) + 1,0);
+            uint64_t status_hash = 0;
+            for(auto& digest : digests){
+                for(uint64_t i=0;i<std::get<1>(digest).size();i++){
+                    status_count[i] += std::get<1>(digest)[i];
+                }
+                status_hash += std::get<2>(digest);
+            }
+
+            std::vector<uint64_t> expected_count(status_count.size(),0);
+            uint64_t expected_hash = 0;
+            for(uint64_t i=0;i<transfer_count;i++){
+                auto expected = benchmark.get_expected_status(i) ? transaction_status_t::COMMIT : transaction_status_t::ABORT;
+                expected_count[static_cast<uint64_t>(expected)]++;
+                expected_hash += CBDC_DIGEST_HASH(transfer_id[i],static_cast<uint64_t>(expected));
             }
 
-            if(status != expected){
-                error_count++;
-                //std::cout << "  - status error for TX (" << i << "," << txid << "): expected " << cbdc.status_to_string(expected) << " but got " << cbdc.status_to_string(status) << std::endl;
+            status_match = (status_count == expected_count) && (status_hash == expected_hash);
+            if(!status_match){
+                std::cout << "  status digests do not match: checking each transfer ..." << std::endl;
             }
         }
+
+        if(!status_match){
+            if(!statuses_read){
+                statuses = read_statuses(cbdc,transfer_count,transfer_id,max_gets_in_flight);
+            }
+            error_count = check_transfers(benchmark,transfer_id,statuses,replayed_status);
+        }
         
         std::cout << "  " << error_count << " status errors found" << std::endl;
+        if(rejected_count > 0){
+            std::cout << "  " << rejected_count << " transfers rejected by the service (expected values computed without them)" << std::endl;
+        }
         std::this_thread::sleep_for(std::chrono::seconds(wait_time));
     }
 
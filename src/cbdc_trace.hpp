@@ -0,0 +1,412 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <queue>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <time.h>
+#include <unistd.h>
+
+#define CBDC_TRACE_MAGIC 0x4342444354524331 // "CBDCTRC1"
+#define CBDC_TRACE_DEFAULT_BUFFER_SIZE (1 << 18) // events per thread (8 MB, only used as the buffer fills)
+#define CBDC_TRACE_SPILL_INTERVAL_MS 1 // how often the spill thread looks at the rings
+#define CBDC_TRACE_SPILL_FRACTION 4 // a ring is spilled once this fraction of it (1/4) holds events not spilled yet
+#define CBDC_TRACE_READ_CHUNK (1 << 16) // events read at a time from a spill file when flushing
+
+// tags whose CBDC_TRACE calls are removed at compile time (comma-separated, e.g. -DCBDC_TRACE_DISABLED_TAGS=200020,200115)
+#ifndef CBDC_TRACE_DISABLED_TAGS
+#define CBDC_TRACE_DISABLED_TAGS
+#endif
+
+constexpr uint64_t cbdc_trace_disabled_tags[] = {0,CBDC_TRACE_DISABLED_TAGS};
+
+// false for every tag with -DCBDC_TRACE_DISABLED
+constexpr bool cbdc_trace_enabled(uint64_t tag){
+#ifdef CBDC_TRACE_DISABLED
+    return false;
+#else
+    for(auto disabled : cbdc_trace_disabled_tags){
+        if(disabled == tag){
+            return false;
+        }
+    }
+    return true;
+#endif
+}
+
+// same arguments as TimestampLogger::log: neither the call nor its arguments are compiled for disabled tags
+#define CBDC_TRACE(tag,node_id,msg_id,extra) do { if constexpr (cbdc_trace_enabled(tag)) { CBDCTrace::log(tag,node_id,msg_id,extra); } } while(0)
+
+// trace file: header, then the events of all threads by timestamp
+using trace_file_header_t = struct trace_file_header_t {
+    uint64_t magic;
+    uint64_t event_count;
+    uint64_t dropped_count;                 // events overwritten before being flushed (buffers too small, or spilling disabled)
+};
+
+using trace_event_t = struct trace_event_t {
+    uint64_t timestamp;                     // nanoseconds, from the same clock as TimestampLogger
+    uint64_t msg_id;                        // TX ID in most tags
+    uint64_t extra;
+    uint32_t tag;
+    uint32_t node_id;
+};
+
+/*
+ * Timestamp log of the CBDC tags, replacing TimestampLogger in the hot paths. Each thread writes its events to its
+ * own ring buffer, without locks or shared cache lines: logging is a clock read and a 32-byte store. A background
+ * thread moves the events of rings filling up to a temporary spill file per thread, so no event is lost however long
+ * the run is: a thread whose ring is full of events not spilled yet waits for it. With spilling disabled (set_spill),
+ * a full ring overwrites its oldest events instead (counted as dropped in the next flush). Flushes and clears take a lock, and can run while the threads keep logging: events
+ * overwritten during the copy are discarded. The binary file is read by log_analyzer, which can also convert it to
+ * the text format of metrics.py.
+ */
+class CBDCTrace {
+    using buffer_t = struct buffer_t {
+        std::unique_ptr<trace_event_t[]> events;
+        uint64_t mask;
+        alignas(64) std::atomic<uint64_t> head{0};  // events written (only by the owner thread)
+        uint64_t limit = 0;                         // the owner thread checks for room in the ring when head reaches it
+        alignas(64) std::atomic<uint64_t> released{0}; // tail, for the owner thread
+        uint64_t tail = 0;                          // events flushed, cleared or spilled (under the registry lock)
+        std::atomic<bool> retired{false};           // the owner thread exited
+        std::FILE* spill = nullptr;                 // events moved out of the ring, in order (under the registry lock)
+        uint64_t spilled = 0;                       // events in the spill file
+        uint64_t dropped = 0;                       // events overwritten before being spilled, not reported yet
+
+        ~buffer_t(){
+            if(spill != nullptr){
+                std::fclose(spill); // temporary file: removed when closed
+            }
+        }
+    };
+
+    using registry_t = struct registry_t {
+        std::mutex mtx;
+        std::vector<std::unique_ptr<buffer_t>> buffers;
+        uint64_t buffer_size = CBDC_TRACE_DEFAULT_BUFFER_SIZE;
+        std::atomic<bool> spill{true};
+        bool spill_started = false;
+    };
+
+    // events of a thread in a flush: its spill file, then what was still in its ring
+    using source_t = struct source_t {
+        int fd = -1;                                // duplicate of the spill file descriptor, so it outlives the buffer
+        uint64_t spilled = 0;
+        uint64_t offset = 0;                        // events read from the spill file
+        std::vector<trace_event_t> ring;
+        std::vector<trace_event_t> events;          // events being merged
+        uint64_t position = 0;
+    };
+
+    // marks the buffer of a thread as retired when the thread exits: it is freed once flushed
+    using owner_t = struct owner_t {
+        buffer_t* buffer = nullptr;
+        ~owner_t(){
+            if(buffer != nullptr){
+                buffer->retired.store(true,std::memory_order_release);
+            }
+        }
+    };
+
+    // never destroyed, since threads may log (or exit) after static destructors run
+    static registry_t& registry(){
+        static registry_t* instance = new registry_t();
+        return *instance;
+    }
+
+    static buffer_t* thread_buffer(){
+        thread_local owner_t owner;
+        if(owner.buffer == nullptr){
+            auto& reg = registry();
+            std::unique_lock<std::mutex> lock(reg.mtx);
+            uint64_t size = 2;
+            while(size < reg.buffer_size){
+                size <<= 1;
+            }
+            reg.buffers.emplace_back(new buffer_t());
+            owner.buffer = reg.buffers.back().get();
+            owner.buffer->events.reset(new trace_event_t[size]);
+            owner.buffer->mask = size - 1;
+            owner.buffer->limit = size - 1;
+            start_spill(reg);
+        }
+        return owner.buffer;
+    }
+
+    // with the registry lock
+    static void start_spill(registry_t& reg){
+        if(reg.spill && !reg.spill_started){
+            reg.spill_started = true;
+            std::thread(spill_loop).detach(); // runs until the process exits, as the registry is never destroyed
+        }
+    }
+
+    static void spill_loop(){
+        auto& reg = registry();
+        std::vector<trace_event_t> events;
+        while(true){
+            std::this_thread::sleep_for(std::chrono::milliseconds(CBDC_TRACE_SPILL_INTERVAL_MS));
+
+            std::unique_lock<std::mutex> lock(reg.mtx);
+            if(!reg.spill){
+                continue;
+            }
+            for(auto& buffer : reg.buffers){
+                uint64_t capacity = buffer->mask + 1;
+                if(buffer->head.load(std::memory_order_acquire) - buffer->tail < capacity / CBDC_TRACE_SPILL_FRACTION){
+                    continue;
+                }
+
+                events.clear();
+                buffer->dropped += copy_events(*buffer,events,true);
+                spill_events(*buffer,events);
+            }
+        }
+    }
+
+    // with the registry lock
+    static void spill_events(buffer_t& buffer,const std::vector<trace_event_t>& events){
+        if(buffer.spill == nullptr){
+            buffer.spill = std::tmpfile();
+        }
+        if((buffer.spill == nullptr) || (std::fwrite(events.data(),sizeof(trace_event_t),events.size(),buffer.spill) != events.size()) || (std::fflush(buffer.spill) != 0)){
+            std::cout << "WARNING: could not spill " << events.size() << " trace events to a temporary file" << std::endl;
+            buffer.dropped += events.size(); // a partial write is not counted, and is overwritten by the next one
+            return;
+        }
+        buffer.spilled += events.size();
+    }
+
+    // next events of a thread to merge: false when there are no more
+    static bool next_events(source_t& source){
+        source.events.clear();
+        source.position = 0;
+        if(source.offset < source.spilled){
+            uint64_t count = std::min(source.spilled - source.offset,(uint64_t)CBDC_TRACE_READ_CHUNK);
+            source.events.resize(count);
+            uint64_t size = count * sizeof(trace_event_t);
+            uint64_t done = 0;
+            while(done < size){
+                ssize_t ret = pread(source.fd,reinterpret_cast<char*>(source.events.data()) + done,size - done,source.offset * sizeof(trace_event_t) + done);
+                if(ret <= 0){
+                    std::cout << "WARNING: could not read " << source.spilled - source.offset << " spilled trace events" << std::endl;
+                    source.events.resize(done / sizeof(trace_event_t));
+                    source.spilled = source.offset; // the rest of the file is skipped
+                    return !source.events.empty() || next_events(source);
+                }
+                done += ret;
+            }
+            source.offset += count;
+            return true;
+        }
+
+        source.events.swap(source.ring);
+        return !source.events.empty();
+    }
+
+    // events of a buffer not flushed yet (in order), and how many were overwritten before this copy
+    static uint64_t copy_events(buffer_t& buffer,std::vector<trace_event_t>& events,bool clear){
+        uint64_t capacity = buffer.mask + 1;
+        uint64_t head = buffer.head.load(std::memory_order_acquire);
+        uint64_t first = std::max(buffer.tail,head > capacity ? head - capacity : 0);
+        for(uint64_t i=first;i<head;i++){
+            events.push_back(buffer.events[i & buffer.mask]);
+        }
+
+        // the writer may have overwritten (or be overwriting) the oldest events during the copy
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t new_head = buffer.head.load(std::memory_order_relaxed);
+        uint64_t valid = (new_head + 1 > capacity) ? new_head + 1 - capacity : 0;
+        if(valid > first){
+            uint64_t overwritten = std::min(valid,head) - first;
+            events.erase(events.begin(),events.begin() + overwritten);
+            first += overwritten;
+        }
+
+        uint64_t dropped = first - buffer.tail;
+        if(clear){
+            buffer.tail = head;
+            buffer.released.store(head,std::memory_order_release);
+        }
+        return dropped;
+    }
+
+    // the ring is full up to the events not copied yet: wait for the spill thread to copy them (or overwrite them when spilling is disabled).
+    // One slot is left free, since copy_events takes the slot of the event being written as overwritten
+    static void wait_for_room(buffer_t* buffer,uint64_t head){
+        uint64_t capacity = buffer->mask + 1;
+        auto& reg = registry();
+        while(true){
+            uint64_t released = buffer->released.load(std::memory_order_acquire);
+            if(head - released < capacity - 1){
+                buffer->limit = released + capacity - 1;
+                return;
+            }
+            if(!reg.spill.load(std::memory_order_relaxed)){
+                buffer->limit = head + capacity;
+                return;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    public:
+
+    static void log(uint64_t tag,uint64_t node_id,uint64_t msg_id,uint64_t extra=0){
+        buffer_t* buffer = thread_buffer();
+        uint64_t head = buffer->head.load(std::memory_order_relaxed);
+        if(head == buffer->limit){
+            wait_for_room(buffer,head);
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME,&now);
+        trace_event_t& event = buffer->events[head & buffer->mask];
+        event.timestamp = static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+        event.msg_id = msg_id;
+        event.extra = extra;
+        event.tag = static_cast<uint32_t>(tag);
+        event.node_id = static_cast<uint32_t>(node_id);
+        buffer->head.store(head + 1,std::memory_order_release);
+    }
+
+    // ring size of the threads that did not log yet
+    static void set_buffer_size(uint64_t buffer_size){
+        auto& reg = registry();
+        std::unique_lock<std::mutex> lock(reg.mtx);
+        reg.buffer_size = std::max(buffer_size,(uint64_t)2);
+    }
+
+    // false: keep only the last events of each ring in memory, instead of spilling the older ones to temporary files
+    static void set_spill(bool spill){
+        auto& reg = registry();
+        std::unique_lock<std::mutex> lock(reg.mtx);
+        reg.spill = spill;
+        if(!reg.buffers.empty()){
+            start_spill(reg);
+        }
+    }
+
+    static void flush(const std::string& filename,bool clear=true){
+        auto& reg = registry();
+        std::unique_lock<std::mutex> lock(reg.mtx);
+
+        std::vector<source_t> sources(reg.buffers.size());
+        trace_file_header_t header;
+        header.magic = CBDC_TRACE_MAGIC;
+        header.event_count = 0;
+        header.dropped_count = 0;
+        for(uint64_t i=0;i<reg.buffers.size();i++){
+            auto& buffer = *reg.buffers[i];
+            header.dropped_count += buffer.dropped + copy_events(buffer,sources[i].ring,clear);
+            if(buffer.spill != nullptr){
+                sources[i].fd = dup(fileno(buffer.spill));
+                sources[i].spilled = (sources[i].fd >= 0) ? buffer.spilled : 0;
+            }
+            header.event_count += sources[i].spilled + sources[i].ring.size();
+
+            if(clear){
+                buffer.dropped = 0;
+                if(buffer.spill != nullptr){
+                    std::fclose(buffer.spill);
+                    buffer.spill = nullptr;
+                    buffer.spilled = 0;
+                }
+            }
+        }
+
+        if(clear){
+            reg.buffers.erase(std::remove_if(reg.buffers.begin(),reg.buffers.end(),[](const std::unique_ptr<buffer_t>& buffer){
+                        return buffer->retired.load(std::memory_order_acquire) && (buffer->tail == buffer->head.load(std::memory_order_relaxed));
+                    }),reg.buffers.end());
+        }
+        lock.unlock();
+
+        std::ofstream file(filename,std::ios::binary | std::ios::trunc);
+        if(!file.is_open()){
+            std::cout << "WARNING: could not open trace file " << filename << std::endl;
+            for(auto& source : sources){
+                if(source.fd >= 0){
+                    close(source.fd);
+                }
+            }
+            return;
+        }
+        file.write(reinterpret_cast<const char*>(&header),sizeof(header));
+
+        // merge the threads by timestamp, as TimestampLogger writes them
+        using cursor_t = std::pair<uint64_t,uint64_t>; // timestamp, thread
+        std::priority_queue<cursor_t,std::vector<cursor_t>,std::greater<cursor_t>> cursors;
+        for(uint64_t i=0;i<sources.size();i++){
+            if(next_events(sources[i])){
+                cursors.emplace(sources[i].events[0].timestamp,i);
+            }
+        }
+
+        std::vector<trace_event_t> output;
+        output.reserve(65536);
+        uint64_t written = 0;
+        while(!cursors.empty()){
+            uint64_t i = cursors.top().second;
+            cursors.pop();
+            auto& source = sources[i];
+            output.push_back(source.events[source.position++]);
+            if((source.position < source.events.size()) || next_events(source)){
+                cursors.emplace(source.events[source.position].timestamp,i);
+            }
+            if(output.size() == output.capacity()){
+                file.write(reinterpret_cast<const char*>(output.data()),output.size() * sizeof(trace_event_t));
+                written += output.size();
+                output.clear();
+            }
+        }
+        file.write(reinterpret_cast<const char*>(output.data()),output.size() * sizeof(trace_event_t));
+        written += output.size();
+
+        for(auto& source : sources){
+            if(source.fd >= 0){
+                close(source.fd);
+            }
+        }
+
+        // spilled events that could not be read back
+        if(written < header.event_count){
+            header.dropped_count += header.event_count - written;
+            header.event_count = written;
+            file.seekp(0);
+            file.write(reinterpret_cast<const char*>(&header),sizeof(header));
+        }
+
+        if(header.dropped_count > 0){
+            std::cout << "WARNING: " << header.dropped_count << " trace events were lost before being flushed to " << filename << " (increase the trace buffer size, or enable spilling)" << std::endl;
+        }
+    }
+
+    static void clear(){
+        auto& reg = registry();
+        std::unique_lock<std::mutex> lock(reg.mtx);
+        for(auto& buffer : reg.buffers){
+            buffer->tail = buffer->head.load(std::memory_order_acquire);
+            buffer->released.store(buffer->tail,std::memory_order_release);
+            buffer->dropped = 0;
+            if(buffer->spill != nullptr){
+                std::fclose(buffer->spill);
+                buffer->spill = nullptr;
+                buffer->spilled = 0;
+            }
+        }
+        reg.buffers.erase(std::remove_if(reg.buffers.begin(),reg.buffers.end(),[](const std::unique_ptr<buffer_t>& buffer){
+                    return buffer->retired.load(std::memory_order_acquire);
+                }),reg.buffers.end());
+    }
+};
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+#define CBDC_COIN_SET_MAX_COINS 64 // above this, the smallest coins are merged into a single coin
+
+/*
+ * Coins of a wallet, kept sorted by value in a single vector (no per-coin allocation).
+ * Spending an amount selects the inputs and adds the change as a new coin:
+ *  - a coin with exactly the amount, or else the smallest coin above it (binary search, a single input)
+ *  - if all coins are below the amount, the largest coins until it is covered (taken from the end of the vector)
+ * Serialization encodes the differences between consecutive coins as varints, so wallets with many similar coins stay small.
+ */
+class CoinSet {
+    std::vector<uint64_t> coins; // ascending
+    uint64_t total = 0;
+
+    static inline std::size_t varint_size(uint64_t value){
+        std::size_t size = 1;
+        while(value >= 0x80){
+            value >>= 7;
+            size++;
+        }
+        return size;
+    }
+
+    static inline std::size_t write_varint(uint64_t value,uint8_t* buffer){
+        std::size_t size = 0;
+        while(value >= 0x80){
+            buffer[size++] = static_cast<uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        buffer[size++] = static_cast<uint8_t>(value);
+        return size;
+    }
+
+    // false if the varint does not end before end (or is longer than 64 bits)
+    static inline bool read_varint(const uint8_t*& buffer,const uint8_t* end,uint64_t& value){
+        value = 0;
+        int shift = 0;
+        while((buffer < end) && (*buffer & 0x80)){
+            value |= static_cast<uint64_t>(*buffer & 0x7f) << shift;
+            shift += 7;
+            buffer++;
+            if(shift > 63){
+                return false;
+            }
+        }
+        if(buffer == end){
+            return false;
+        }
+        value |= static_cast<uint64_t>(*buffer) << shift;
+        buffer++;
+        return true;
+    }
+
+    // merge the smallest half of the coins, keeping the vector (and selection) bounded
+    void consolidate(){
+        std::size_t merged = coins.size() / 2;
+        uint64_t value = 0;
+        for(std::size_t i=0;i<merged;i++){
+            value += coins[i];
+        }
+        coins.erase(coins.begin(),coins.begin() + merged);
+        coins.insert(std::lower_bound(coins.begin(),coins.end(),value),value);
+    }
+
+    public:
+
+    CoinSet() = default;
+
+    explicit CoinSet(uint64_t value){
+        add(value);
+    }
+
+    inline uint64_t balance() const {
+        return total;
+    }
+
+    inline std::size_t size() const {
+        return coins.size();
+    }
+
+    inline const std::vector<uint64_t>& get_coins() const {
+        return coins;
+    }
+
+    inline void add(uint64_t value){
+        if(value == 0){
+            return;
+        }
+
+        coins.insert(std::upper_bound(coins.begin(),coins.end(),value),value);
+        total += value;
+        if(coins.size() > CBDC_COIN_SET_MAX_COINS){
+            consolidate();
+        }
+    }
+
+    // positions of the coins spent to cover amount (in descending order): empty if amount is 0 or above the balance
+    void select(uint64_t amount,std::vector<std::size_t>& inputs) const {
+        inputs.clear();
+        if((amount == 0) || (amount > total)){
+            return;
+        }
+
+        auto it = std::lower_bound(coins.begin(),coins.end(),amount);
+        if(it != coins.end()){
+            inputs.push_back(it - coins.begin());
+            return;
+        }
+
+        uint64_t covered = 0;
+        for(std::size_t i=coins.size();(i > 0) && (covered < amount);i--){
+            inputs.push_back(i-1);
+            covered += coins[i-1];
+        }
+    }
+
+    // spend coins covering amount and keep the change: returns the change (an amount above the balance empties the set)
+    uint64_t remove(uint64_t amount){
+        if(amount == 0){
+            return 0;
+        }
+
+        if(amount >= total){
+            coins.clear();
+            total = 0;
+            return 0;
+        }
+
+        uint64_t covered = 0;
+        auto it = std::lower_bound(coins.begin(),coins.end(),amount);
+        if(it != coins.end()){
+            covered = *it;
+            coins.erase(it);
+        } else {
+            while(covered < amount){
+                covered += coins.back();
+                coins.pop_back();
+            }
+        }
+
+        total -= covered;
+        uint64_t change = covered - amount;
+        add(change);
+        return change;
+    }
+
+    inline void clear(){
+        coins.clear();
+        total = 0;
+    }
+
+    inline bool operator==(const CoinSet& other) const {
+        return coins == other.coins;
+    }
+
+    inline bool operator!=(const CoinSet& other) const {
+        return coins != other.coins;
+    }
+
+    // serialization: count, first coin, then the difference to the previous coin (all varints)
+    std::size_t bytes_size() const {
+        std::size_t size = varint_size(coins.size());
+        uint64_t previous = 0;
+        for(auto coin : coins){
+            size += varint_size(coin - previous);
+            previous = coin;
+        }
+        return size;
+    }
+
+    std::size_t to_bytes(uint8_t* buffer) const {
+        std::size_t offset = write_varint(coins.size(),buffer);
+        uint64_t previous = 0;
+        for(auto coin : coins){
+            offset += write_varint(coin - previous,buffer + offset);
+            previous = coin;
+        }
+        return offset;
+    }
+
+    // reads at most size bytes: a truncated buffer, or one with more coins than a set can hold, gives an empty set
+    static CoinSet from_bytes(const uint8_t* buffer,std::size_t size){
+        CoinSet set;
+        const uint8_t* end = buffer + size;
+        uint64_t count;
+        if(!read_varint(buffer,end,count) || (count > CBDC_COIN_SET_MAX_COINS)){
+            return set;
+        }
+
+        set.coins.reserve(count);
+        uint64_t previous = 0;
+        for(uint64_t i=0;i<count;i++){
+            uint64_t difference;
+            if(!read_varint(buffer,end,difference)){
+                set.clear();
+                return set;
+            }
+            previous += difference;
+            set.coins.push_back(previous);
+            set.total += previous;
+        }
+        return set;
+    }
+};
+
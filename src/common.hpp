@@ -6,11 +6,17 @@
 #include <unordered_map>
 #include <string>
 #include <vector>
+#include <cstring>
+#include "coin_set.hpp"
 
 // basic CBDC types
 using wallet_id_t = uint64_t;
 using coin_value_t = uint64_t;
-using wallet_t = coin_value_t; // TODO use separate coins instead of just a balance?
+#ifdef CBDC_COIN_WALLET
+using wallet_t = CoinSet; // separate coins, see coin_set.hpp
+#else
+using wallet_t = coin_value_t; // just the balance
+#endif
 using transaction_id_t = uint64_t; // std::hash | TODO use something bigger for lower chance of collision?
 using cbdc_request_t = std::tuple<transaction_id_t,std::unordered_map<wallet_id_t,coin_value_t>,std::unordered_map<wallet_id_t,coin_value_t>,std::vector<wallet_id_t>>; // txid, source, destination, sorted_wallets
 
@@ -19,11 +25,27 @@ enum class transaction_status_t : uint8_t {
     RUNNING,
     COMMIT,
     ABORT,
+    REJECTED,   // not admitted by the service (overload)
     UNKNOWN
 };
 
 using transaction_t = std::tuple<cbdc_request_t,transaction_status_t>; // request, status
 
+// delta persistence
+using wallet_delta_t = std::tuple<wallet_id_t,int64_t,transaction_id_t>; // wallet_id, change in the balance, txid
+using wallet_delta_batch_t = std::vector<wallet_delta_t>;
+
+// digest verification
+using digest_request_t = std::tuple<uint64_t,uint64_t>; // request id, range size (in wallet IDs)
+using range_digest_t = std::tuple<coin_value_t,uint64_t,uint64_t>; // sum of the balances, hash of the wallets, number of wallets (only wallets with coins)
+using shard_digest_t = std::tuple<std::unordered_map<uint64_t,range_digest_t>,std::vector<uint64_t>,uint64_t>; // digest of each range, number of transfers in each status, hash of the committed and aborted transfers
+
+// completion notifications
+using tx_completion_t = std::pair<transaction_id_t,transaction_status_t>; // txid, final status
+using tx_completion_batch_t = std::vector<tx_completion_t>; // completed TXs of a single client
+
+#define CBDC_MAX_ESCROW_WALLETS 16
+
 using cascade_cbdc_config_t = struct cascade_cbdc_config_t {
     bool enable_cross_thread_communication;             // thread send a request directly to another thread if next wallet is in the same shard (instead of multicasting)
     bool enable_wallet_persistence_thread;              // start a thread responsible for putting wallets in batches (instead of individually putting them in each thread)
@@ -31,12 +53,20 @@ using cascade_cbdc_config_t = struct cascade_cbdc_config_t {
     bool enable_chaining_thread;                        // start a thread responsible for chaining requests (instead of doing it in each thread)
     bool enable_virtual_balance;                        // ignore conflict if the wallet is handled by the same thread and there are enough virtual funds
     bool enable_source_only_conflicts;                  // ignore destination wallets when checking for conflicts
+    bool enable_group_commit;                           // when a wallet is released, admit together all queued debits that its committed balance covers
+    bool enable_escrow;                                 // split the balance of hot wallets (escrow_wallets) across all worker threads, so their TXs run in parallel
+    bool enable_recovery;                               // load persisted wallets (instead of starting all wallets with 0 coins)
+    bool enable_recovery_prefetch;                      // recovery: each thread loads all its wallets at startup (instead of fetching each wallet when first used)
+    bool enable_delta_persistence;                      // the wallet persistence thread puts batches of balance changes, periodically compacted into full wallets (requires enable_wallet_persistence_thread)
+    bool enable_notifications;                          // push the final status of each TX to the client that sent it (instead of clients polling the persisted TXs)
 
     uint64_t num_threads;                               // number of worker threads
+    uint64_t group_commit_max_size;                     // maximum number of TXs admitted together by group commit
 
     uint64_t wallet_persistence_batch_min_size;         // batch minimum size for the wallet persistence thread
     uint64_t wallet_persistence_batch_max_size;         // batch maximum size for the wallet persistence thread
     uint64_t wallet_persistence_batch_time_us;          // maximum time to wait for the batch size (in microseconds)
+    uint64_t delta_compaction_interval_ms;              // time between compactions of the persisted deltas into full wallets
 
     uint64_t chaining_batch_min_size;                   // batch minimum size for the chaining thread
     uint64_t chaining_batch_max_size;                   // batch maximum size for the chaining thread
@@ -45,6 +75,21 @@ using cascade_cbdc_config_t = struct cascade_cbdc_config_t {
     uint64_t tx_persistence_batch_min_size;             // batch minimum size for the tx persistence thread
     uint64_t tx_persistence_batch_max_size;             // batch maximum size for the tx persistence thread
     uint64_t tx_persistence_batch_time_us;              // maximum time to wait for the batch size (in microseconds)
+
+    uint64_t notification_batch_max_size;               // maximum number of completions in a notification to a client
+    uint64_t notification_batch_time_us;                // maximum time a completion waits for the batch to fill (in microseconds)
+
+    uint64_t thread_queue_max_size;                     // new TXs are rejected when a thread has more queued operations than this (0 = unlimited)
+    uint64_t thread_max_pending_transactions;           // new TXs are rejected when a thread has this many TXs in flight (0 = unlimited)
+
+    uint64_t recovery_batch_size;                       // recovery: maximum number of concurrent wallet gets
+    uint64_t checkpoint_interval_ms;                    // time between checkpoints of the wallets of each thread (0 = disabled)
+
+    uint64_t wallet_cache_capacity;                     // maximum number of wallets cached by each thread: idle wallets are evicted and fetched again when needed (0 = unlimited)
+
+    coin_value_t escrow_sub_balance_target;             // coins each thread keeps for an escrow wallet: the excess goes back to the shared reserve
+    uint64_t num_escrow_wallets;                        // number of hot wallets in escrow_wallets
+    wallet_id_t escrow_wallets[CBDC_MAX_ESCROW_WALLETS]; // hot wallets handled in escrow mode
 };
 
 // cascade key paths
@@ -55,13 +100,22 @@ using cascade_cbdc_config_t = struct cascade_cbdc_config_t {
 #define CBDC_REQUEST_MINT_PREFIX CBDC_REQUEST_PREFIX "/m/WID_" // + wallet_id
 #define CBDC_REQUEST_TRANSFER_PREFIX CBDC_REQUEST_PREFIX "/t/WID_" // + wallet_id
 #define CBDC_REQUEST_REDEEM_PREFIX CBDC_REQUEST_PREFIX "/r/WID_" // + wallet_id
+#define CBDC_REQUEST_BULK_MINT_PREFIX CBDC_REQUEST_PREFIX "/b/WID_" // + wallet_id (any wallet in the target shard)
 #define CBDC_REQUEST_LOG_KEY CBDC_REQUEST_PREFIX "/log"
 #define CBDC_REQUEST_INIT_KEY CBDC_REQUEST_PREFIX "/init"
 #define CBDC_REQUEST_RESET_KEY CBDC_REQUEST_PREFIX "/reset"
+#define CBDC_REQUEST_DIGEST_KEY CBDC_REQUEST_PREFIX "/digest"
+
+// keys for storing digests (put directly to the shard that computed them)
+#define CBDC_DIGEST_PREFIX CBDC_PREFIX "/v/" // + shard + "/" + request id
 
 // keys for storing wallets
 #define CBDC_WALLET_PREFIX CBDC_PREFIX "/w/WID_" // + wallet_id
 
+// keys for storing wallet deltas (put directly to the shard of the wallets)
+#define CBDC_DELTA_PREFIX CBDC_PREFIX "/d/" // + shard + "/" + batch sequence number
+#define CBDC_DELTA_COMPACTED_SUFFIX "compacted" // last batch compacted into the wallets
+
 // keys for storing transactions
 #define CBDC_TRANSACTION_PREFIX CBDC_PREFIX "/tx/" // + transaction_id
 
@@ -77,12 +131,14 @@ using cascade_cbdc_config_t = struct cascade_cbdc_config_t {
 // logging
 
 #define CBDC_TAG_CLIENT_DEPLOYMENT_INFO 100005
+#define CBDC_TAG_CLIENT_TRANSFER_INTENDED 100008
 #define CBDC_TAG_CLIENT_TRANSFER_START 100010
 #define CBDC_TAG_CLIENT_TRANSFER_QUEUE 100020
 #define CBDC_TAG_CLIENT_TRANSFER_SENDING 100050
 #define CBDC_TAG_CLIENT_TRANSFER_SENT 100080
 #define CBDC_TAG_CLIENT_STATUS 100100
 #define CBDC_TAG_CLIENT_BATCHING 100110
+#define CBDC_TAG_CLIENT_COMPLETION 100120
 
 #define CBDC_TAG_UDL_HANDLER_START 200010
 #define CBDC_TAG_UDL_HANDLER_QUEUING 200020
@@ -106,6 +162,22 @@ using cascade_cbdc_config_t = struct cascade_cbdc_config_t {
 #define CBDC_TAG_UDL_WALLET_BATCHING 200180
 #define CBDC_TAG_UDL_CHAIN_BATCHING 200190
 #define CBDC_TAG_UDL_TX_BATCHING 200200
+#define CBDC_TAG_UDL_TX_REJECTED 200210
+#define CBDC_TAG_UDL_GROUP_COMMIT 200220
+#define CBDC_TAG_UDL_BULK_MINT_START 200230
+#define CBDC_TAG_UDL_BULK_MINT_END 200240
+#define CBDC_TAG_UDL_RECOVERY_START 200250
+#define CBDC_TAG_UDL_RECOVERY_END 200260
+#define CBDC_TAG_UDL_WALLET_FETCH 200270
+#define CBDC_TAG_UDL_CHECKPOINT_START 200280
+#define CBDC_TAG_UDL_CHECKPOINT_END 200290
+#define CBDC_TAG_UDL_WALLET_CACHE 200300
+#define CBDC_TAG_UDL_MEMORY 200310
+#define CBDC_TAG_UDL_WALLET_BYTES 200320
+#define CBDC_TAG_UDL_COMPACTION_BYTES 200330
+#define CBDC_TAG_UDL_DIGEST_START 200340
+#define CBDC_TAG_UDL_DIGEST_END 200350
+#define CBDC_TAG_UDL_NOTIFICATION_BATCHING 200360
 
 // helpers
 
@@ -129,7 +201,145 @@ inline std::string CBDC_BUILD_REDEEM_KEY(wallet_id_t wallet_id){
     return CBDC_REQUEST_REDEEM_PREFIX + std::to_string(wallet_id);
 }
 
-inline coin_value_t CBDC_COMPUTE_WALLET_BALANCE(wallet_t &wallet){
+inline std::string CBDC_BUILD_BULK_MINT_KEY(wallet_id_t wallet_id){
+    return CBDC_REQUEST_BULK_MINT_PREFIX + std::to_string(wallet_id);
+}
+
+// TXs are numbered by each client: client node ID in the 16 most significant bits, followed by a counter
+inline uint64_t CBDC_TXID_TO_CLIENT(transaction_id_t txid){
+    return txid >> 48;
+}
+
+inline std::string CBDC_BUILD_DELTA_KEY(uint32_t shard,uint64_t seq){
+    return CBDC_DELTA_PREFIX + std::to_string(shard) + "/" + std::to_string(seq);
+}
+
+inline std::string CBDC_BUILD_DELTA_COMPACTED_KEY(uint32_t shard){
+    return CBDC_DELTA_PREFIX + std::to_string(shard) + "/" CBDC_DELTA_COMPACTED_SUFFIX;
+}
+
+inline std::string CBDC_BUILD_DIGEST_KEY(uint32_t shard,uint64_t request_id){
+    return CBDC_DIGEST_PREFIX + std::to_string(shard) + "/" + std::to_string(request_id);
+}
+
+// hash of an (id,value) pair: digests add these up, so they do not depend on the order of the wallets or TXs
+inline uint64_t CBDC_DIGEST_HASH(uint64_t id,uint64_t value){
+    uint64_t x = id * 0x9e3779b97f4a7c15ULL + value; // splitmix64
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inline void CBDC_DIGEST_ADD_WALLET(std::unordered_map<uint64_t,range_digest_t> &ranges,uint64_t range_size,wallet_id_t wallet_id,coin_value_t balance){
+    if(balance == 0){
+        return;
+    }
+
+    auto& range = ranges[wallet_id / range_size];
+    std::get<0>(range) += balance;
+    std::get<1>(range) += CBDC_DIGEST_HASH(wallet_id,balance);
+    std::get<2>(range)++;
+}
+
+// wallet helpers: the same code works with both wallet types
+
+#ifdef CBDC_COIN_WALLET
+inline coin_value_t CBDC_COMPUTE_WALLET_BALANCE(const wallet_t &wallet){
+    return wallet.balance();
+}
+
+inline wallet_t CBDC_WALLET_FROM_BALANCE(coin_value_t value){
+    return CoinSet(value);
+}
+
+// a positive delta is a new coin, a negative one is spent as in a TX
+inline void CBDC_APPLY_WALLET_DELTA(wallet_t &wallet,int64_t delta){
+    if(delta > 0){
+        wallet.add(delta);
+    } else {
+        wallet.remove(0 - static_cast<uint64_t>(delta)); // negated as unsigned, since -INT64_MIN overflows
+    }
+}
+
+inline std::size_t CBDC_WALLET_BYTES_SIZE(const wallet_t &wallet){
+    return wallet.bytes_size();
+}
+
+inline std::size_t CBDC_WALLET_TO_BYTES(const wallet_t &wallet,uint8_t* buffer){
+    return wallet.to_bytes(buffer);
+}
+
+inline wallet_t CBDC_WALLET_FROM_BYTES(const uint8_t* buffer,std::size_t size){
+    return CoinSet::from_bytes(buffer,size);
+}
+#else
+inline coin_value_t CBDC_COMPUTE_WALLET_BALANCE(const wallet_t &wallet){
+    return wallet;
+}
+
+inline wallet_t CBDC_WALLET_FROM_BALANCE(coin_value_t value){
+    return value;
+}
+
+inline void CBDC_APPLY_WALLET_DELTA(wallet_t &wallet,int64_t delta){
+    wallet += delta;
+}
+
+inline std::size_t CBDC_WALLET_BYTES_SIZE(const wallet_t &wallet){
+    return sizeof(wallet);
+}
+
+inline std::size_t CBDC_WALLET_TO_BYTES(const wallet_t &wallet,uint8_t* buffer){
+    std::memcpy(buffer,&wallet,sizeof(wallet));
+    return sizeof(wallet);
+}
+
+inline wallet_t CBDC_WALLET_FROM_BYTES(const uint8_t* buffer,std::size_t size){
+    wallet_t wallet = 0;
+    if(size >= sizeof(wallet)){
+        std::memcpy(&wallet,buffer,sizeof(wallet));
+    }
     return wallet;
 }
+#endif
+
+// persisted wallet with delta persistence: last delta batch included, followed by the wallet
+inline std::size_t CBDC_WALLET_IMAGE_BYTES_SIZE(const wallet_t &wallet){
+    return sizeof(uint64_t) + CBDC_WALLET_BYTES_SIZE(wallet);
+}
+
+inline std::size_t CBDC_WALLET_IMAGE_TO_BYTES(const wallet_t &wallet,uint64_t seq,uint8_t* buffer){
+    std::memcpy(buffer,&seq,sizeof(seq));
+    return sizeof(seq) + CBDC_WALLET_TO_BYTES(wallet,buffer + sizeof(seq));
+}
+
+inline wallet_t CBDC_WALLET_IMAGE_FROM_BYTES(const uint8_t* buffer,std::size_t size,uint64_t &seq){
+    if(size < sizeof(seq)){
+        seq = 0;
+        return CBDC_WALLET_FROM_BYTES(buffer,0);
+    }
+    std::memcpy(&seq,buffer,sizeof(seq));
+    return CBDC_WALLET_FROM_BYTES(buffer + sizeof(seq),size - sizeof(seq));
+}
+
+inline bool CBDC_IS_ESCROW_WALLET(const cascade_cbdc_config_t &config,wallet_id_t wallet_id){
+    if(!config.enable_escrow){
+        return false;
+    }
+
+    for(uint64_t i=0;i<config.num_escrow_wallets;i++){
+        if(config.escrow_wallets[i] == wallet_id){
+            return true;
+        }
+    }
+    return false;
+}
+
+// thread responsible for a wallet in a given TX: escrow wallets are spread across all threads, so different TXs touching them run in parallel
+inline uint64_t CBDC_WALLET_TO_THREAD(const cascade_cbdc_config_t &config,wallet_id_t wallet_id,transaction_id_t txid){
+    if(CBDC_IS_ESCROW_WALLET(config,wallet_id)){
+        return txid % config.num_threads;
+    }
+    return wallet_id % config.num_threads;
+}
 
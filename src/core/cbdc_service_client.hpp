@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cascade/service_client_api.hpp>
+#include <string>
+#include <vector>
+#include "common.hpp"
+
+namespace derecho{
+namespace cascade{
+
+/*
+ * Operations of the Cascade service client used by the CBDC protocol: routing of keys to shards of the
+ * object pool, shard membership, and the puts and notifications sent to other nodes and clients.
+ * The UDL gets a CascadeServiceClient, while a benchmark can run the UDL in-process by providing its own
+ * implementation (e.g. an in-memory cluster of several UDL instances).
+ * Recovery reads (get and list_keys) still use ServiceClientAPI directly.
+ */
+class CBDCServiceClient {
+public:
+    virtual ~CBDCServiceClient() = default;
+
+    virtual node_id_t get_my_id() = 0;
+    virtual uint32_t get_my_shard() = 0; // shard of this node in the object pool subgroup
+    virtual uint32_t get_number_of_shards() = 0;
+    virtual std::vector<node_id_t> get_shard_members(uint32_t shard_index) = 0;
+    virtual uint32_t key_to_shard(const std::string& key) = 0;
+
+    // routed by key, or sent to the given shard of the object pool subgroup
+    virtual void put_and_forget(const ObjectWithStringKey& obj,bool as_trigger = false) = 0;
+    virtual void put_and_forget_to_shard(const ObjectWithStringKey& obj,uint32_t shard_index,bool as_trigger = false) = 0;
+    virtual void put_objects_and_forget(const std::vector<ObjectWithStringKey>& objects) = 0;
+    virtual void put_objects_and_forget_to_shard(const std::vector<ObjectWithStringKey>& objects,uint32_t shard_index,bool as_trigger = false) = 0;
+    virtual void remove_and_forget(const std::string& key,uint32_t shard_index) = 0;
+
+    virtual void notify(const Blob& blob,node_id_t client) = 0;
+};
+
+class CascadeServiceClient: public CBDCServiceClient {
+    ServiceClientAPI& capi;
+
+public:
+    CascadeServiceClient(ServiceClientAPI& capi): capi(capi) {}
+
+    node_id_t get_my_id() override {
+        return capi.get_my_id();
+    }
+
+    uint32_t get_my_shard() override {
+        return capi.get_my_shard<CBDC_OBJECT_POOL_TYPE>(CBDC_OBJECT_POOL_SUBGROUP);
+    }
+
+    uint32_t get_number_of_shards() override {
+        return capi.get_number_of_shards<CBDC_OBJECT_POOL_TYPE>(CBDC_OBJECT_POOL_SUBGROUP);
+    }
+
+    std::vector<node_id_t> get_shard_members(uint32_t shard_index) override {
+        return capi.get_shard_members<CBDC_OBJECT_POOL_TYPE>(CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+    }
+
+    uint32_t key_to_shard(const std::string& key) override {
+        return std::get<2>(capi.key_to_shard(key));
+    }
+
+    void put_and_forget(const ObjectWithStringKey& obj,bool as_trigger = false) override {
+        capi.put_and_forget(obj,as_trigger);
+    }
+
+    void put_and_forget_to_shard(const ObjectWithStringKey& obj,uint32_t shard_index,bool as_trigger = false) override {
+        capi.put_and_forget<CBDC_OBJECT_POOL_TYPE>(obj,CBDC_OBJECT_POOL_SUBGROUP,shard_index,as_trigger);
+    }
+
+    void put_objects_and_forget(const std::vector<ObjectWithStringKey>& objects) override {
+        capi.put_objects_and_forget(objects);
+    }
+
+    void put_objects_and_forget_to_shard(const std::vector<ObjectWithStringKey>& objects,uint32_t shard_index,bool as_trigger = false) override {
+        capi.put_objects_and_forget<CBDC_OBJECT_POOL_TYPE>(objects,CBDC_OBJECT_POOL_SUBGROUP,shard_index,as_trigger);
+    }
+
+    void remove_and_forget(const std::string& key,uint32_t shard_index) override {
+        capi.remove<CBDC_OBJECT_POOL_TYPE>(key,CBDC_OBJECT_POOL_SUBGROUP,shard_index); // the reply is not awaited
+    }
+
+    void notify(const Blob& blob,node_id_t client) override {
+        capi.notify(blob,CBDC_OBJECT_POOL_PREFIX,client);
+    }
+};
+
+} // namespace cascade
+} // namespace derecho
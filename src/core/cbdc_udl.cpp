@@ -4,6 +4,14 @@
 namespace derecho{
 namespace cascade{
 
+// resident memory of this process, in bytes
+static uint64_t resident_memory(){
+    uint64_t size = 0,resident = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> size >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
 CascadeCBDC::CascadeCBDC(){
     config.enable_cross_thread_communication = false;
     config.enable_wallet_persistence_thread = false;
@@ -11,12 +19,20 @@ CascadeCBDC::CascadeCBDC(){
     config.enable_chaining_thread = false;
     config.enable_virtual_balance = false;
     config.enable_source_only_conflicts = false;
+    config.enable_escrow = false;
+    config.enable_group_commit = false;
+    config.enable_recovery = false;
+    config.enable_recovery_prefetch = true;
+    config.enable_delta_persistence = false;
+    config.enable_notifications = false;
 
     config.num_threads = 1;
+    config.group_commit_max_size = 64;
     
     config.wallet_persistence_batch_min_size = 0;
     config.wallet_persistence_batch_max_size = 8;
     config.wallet_persistence_batch_time_us = 1000;
+    config.delta_compaction_interval_ms = 1000;
     
     config.chaining_batch_min_size = 0;
     config.chaining_batch_max_size = 8;
@@ -25,10 +41,29 @@ CascadeCBDC::CascadeCBDC(){
     config.tx_persistence_batch_min_size = 0;
     config.tx_persistence_batch_max_size = 8;
     config.tx_persistence_batch_time_us = 1000;
+
+    config.notification_batch_max_size = 256;
+    config.notification_batch_time_us = 500;
+
+    config.thread_queue_max_size = 0;
+    config.thread_max_pending_transactions = 0;
+
+    config.recovery_batch_size = 1024;
+    config.checkpoint_interval_ms = 0;
+
+    config.wallet_cache_capacity = 0;
+
+    config.escrow_sub_balance_target = 0;
+    config.num_escrow_wallets = 0;
 }
 
 void CascadeCBDC::set_config(DefaultCascadeContextType* typed_ctxt,const nlohmann::json& config){
-    my_id = typed_ctxt->get_service_client_ref().get_my_id();
+    configure(std::make_shared<CascadeServiceClient>(typed_ctxt->get_service_client_ref()),config);
+}
+
+void CascadeCBDC::configure(std::shared_ptr<CBDCServiceClient> service,const nlohmann::json& config){
+    this->service = service;
+    my_id = service->get_my_id();
  
     if(config.count("enable_cross_thread_communication") > 0){
         this->config.enable_cross_thread_communication = std::string(config["enable_cross_thread_communication"]) != "0";
@@ -54,10 +89,39 @@ void CascadeCBDC::set_config(DefaultCascadeContextType* typed_ctxt,const nlohman
         this->config.enable_source_only_conflicts = std::string(config["enable_source_only_conflicts"]) != "0";
     }
     
+    if(config.count("enable_group_commit") > 0){
+        this->config.enable_group_commit = std::string(config["enable_group_commit"]) != "0";
+    }
+    
+    if(config.count("enable_escrow") > 0){
+        this->config.enable_escrow = std::string(config["enable_escrow"]) != "0";
+    }
+    
+    if(config.count("enable_recovery") > 0){
+        this->config.enable_recovery = std::string(config["enable_recovery"]) != "0";
+    }
+    
+    if(config.count("enable_recovery_prefetch") > 0){
+        this->config.enable_recovery_prefetch = std::string(config["enable_recovery_prefetch"]) != "0";
+    }
+    
+    if(config.count("enable_delta_persistence") > 0){
+        // deltas are batched by the wallet persistence thread
+        this->config.enable_delta_persistence = (std::string(config["enable_delta_persistence"]) != "0") && this->config.enable_wallet_persistence_thread;
+    }
+    
+    if(config.count("enable_notifications") > 0){
+        this->config.enable_notifications = std::string(config["enable_notifications"]) != "0";
+    }
+    
     if(config.count("num_threads") > 0){
         this->config.num_threads = std::stoull(std::string(config["num_threads"]));
     }
     
+    if(config.count("group_commit_max_size") > 0){
+        this->config.group_commit_max_size = std::stoull(std::string(config["group_commit_max_size"]));
+    }
+    
     if(config.count("wallet_persistence_batch_min_size") > 0){
         this->config.wallet_persistence_batch_min_size = std::stoull(std::string(config["wallet_persistence_batch_min_size"]));
     }
@@ -70,6 +134,10 @@ void CascadeCBDC::set_config(DefaultCascadeContextType* typed_ctxt,const nlohman
         this->config.wallet_persistence_batch_time_us = std::stoull(std::string(config["wallet_persistence_batch_time_us"]));
     }
     
+    if(config.count("delta_compaction_interval_ms") > 0){
+        this->config.delta_compaction_interval_ms = std::stoull(std::string(config["delta_compaction_interval_ms"]));
+    }
+    
     if(config.count("chaining_batch_min_size") > 0){
         this->config.chaining_batch_min_size = std::stoull(std::string(config["chaining_batch_min_size"]));
     }
@@ -93,10 +161,131 @@ void CascadeCBDC::set_config(DefaultCascadeContextType* typed_ctxt,const nlohman
     if(config.count("tx_persistence_batch_time_us") > 0){
         this->config.tx_persistence_batch_time_us = std::stoull(std::string(config["tx_persistence_batch_time_us"]));
     }
+    
+    if(config.count("notification_batch_max_size") > 0){
+        this->config.notification_batch_max_size = std::max(std::stoull(std::string(config["notification_batch_max_size"])),1ULL);
+    }
+    
+    if(config.count("notification_batch_time_us") > 0){
+        this->config.notification_batch_time_us = std::stoull(std::string(config["notification_batch_time_us"]));
+    }
+    
+    if(config.count("thread_queue_max_size") > 0){
+        this->config.thread_queue_max_size = std::stoull(std::string(config["thread_queue_max_size"]));
+    }
+    
+    if(config.count("thread_max_pending_transactions") > 0){
+        this->config.thread_max_pending_transactions = std::stoull(std::string(config["thread_max_pending_transactions"]));
+    }
+    
+    if(config.count("recovery_batch_size") > 0){
+        this->config.recovery_batch_size = std::stoull(std::string(config["recovery_batch_size"]));
+    }
+    
+    if(config.count("checkpoint_interval_ms") > 0){
+        this->config.checkpoint_interval_ms = std::stoull(std::string(config["checkpoint_interval_ms"]));
+    }
+    
+    if(config.count("wallet_cache_capacity") > 0){
+        this->config.wallet_cache_capacity = std::stoull(std::string(config["wallet_cache_capacity"]));
+    }
+    
+    
+    if(config.count("checkpoint_path") > 0){
+        this->checkpoint_path = std::string(config["checkpoint_path"]);
+    }
+    
+    if(config.count("recovery_snapshot_path") > 0){
+        this->recovery_snapshot_path = std::string(config["recovery_snapshot_path"]);
+    }
+    
+    if(config.count("capture_path") > 0){
+        this->capture_path = std::string(config["capture_path"]);
+    }
+    
+    if(config.count("trace_buffer_size") > 0){
+        CBDCTrace::set_buffer_size(std::stoull(std::string(config["trace_buffer_size"])));
+    }
+    
+    if(config.count("trace_spill") > 0){
+        CBDCTrace::set_spill(std::string(config["trace_spill"]) != "0");
+    }
+    
+    if(config.count("escrow_sub_balance_target") > 0){
+        this->config.escrow_sub_balance_target = std::stoull(std::string(config["escrow_sub_balance_target"]));
+    }
+    
+    if(config.count("escrow_wallets") > 0){ // comma-separated list of wallet IDs
+        std::string escrow_wallets_str = config["escrow_wallets"];
+        std::stringstream escrow_wallets(escrow_wallets_str);
+        std::string wallet_str;
+        while(std::getline(escrow_wallets,wallet_str,',') && (this->config.num_escrow_wallets < CBDC_MAX_ESCROW_WALLETS)){
+            this->config.escrow_wallets[this->config.num_escrow_wallets] = std::stoull(wallet_str);
+            this->config.num_escrow_wallets++;
+        }
+    }
+
+    // a replay only reproduces the order of the messages that go through the handler
+    if(!capture_path.empty() && this->config.enable_cross_thread_communication){
+        std::cout << "WARNING: capture enabled: messages between threads go through the handler (enable_cross_thread_communication = 0)" << std::endl;
+        this->config.enable_cross_thread_communication = false;
+    }
+
+    if(!capture_path.empty()){
+        nlohmann::json captured_config = config;
+        captured_config["enable_cross_thread_communication"] = "0";
+        capture = new CaptureWriter();
+        std::string capture_file = capture_path + "." + std::to_string(my_id) + ".capture";
+        if(!capture->open(capture_file,my_id,service->get_my_shard(),service->get_number_of_shards(),captured_config.dump())){
+            std::cout << "WARNING: could not open capture file " << capture_file << std::endl;
+            delete capture;
+            capture = nullptr;
+        }
+    }
 
     start_threads();
 }
 
+void CascadeCBDC::start_digest(uint64_t request_id,uint64_t range_size){
+    CBDC_TRACE(CBDC_TAG_UDL_DIGEST_START,my_id,request_id,range_size);
+
+    // transfers are counted by the shard that received them from the client (the shard of the first wallet), and their
+    // statuses are read by the thread of the first wallet, which sets them, instead of by the handler
+    auto shard_index = service->get_my_shard();
+    pending_digest_t pending;
+    pending.range_size = range_size;
+    std::get<1>(pending.digest).assign(static_cast<uint64_t>(transaction_status_t::UNKNOWN) + 1,0);
+    std::get<2>(pending.digest) = 0;
+    pending.transfers.resize(config.num_threads);
+    for(auto& item : transaction_database){
+        auto request = item.second->request;
+        if(std::get<1>(*request).empty() || std::get<2>(*request).empty() || std::get<3>(*request).empty()){
+            continue; // mint or redeem
+        }
+
+        auto first_wallet = std::get<3>(*request)[0];
+        if(service->key_to_shard(CBDC_BUILD_TRANSFER_KEY(first_wallet)) != shard_index){
+            continue;
+        }
+
+        pending.transfers[CBDC_WALLET_TO_THREAD(config,first_wallet,item.first)].emplace_back(item.first,item.second);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(digest_mtx);
+        pending_digests[request_id] = std::move(pending);
+    }
+
+    // each thread adds the wallets it owns: the last one puts the digest
+    internal_transaction_t* tx = new internal_transaction_t;
+    tx->request = new cbdc_request_t(request_id,{},{},{});
+    tx->status = transaction_status_t::PENDING;
+    tx->pending_parts = config.num_threads;
+    for(uint64_t i=0;i<config.num_threads;i++){
+        threads[i].push_operation(new queued_operation_t(operation_type_t::DIGEST,i,tx));
+    }
+}
+
 operation_type_t CascadeCBDC::operation_str_to_type(const std::string &operation_str){
     if(operation_str == "m") return operation_type_t::MINT;
     else if(operation_str == "t") return operation_type_t::TRANSFER;
@@ -104,15 +293,74 @@ operation_type_t CascadeCBDC::operation_str_to_type(const std::string &operation
     else if(operation_str == "f") return operation_type_t::FORWARD;
     else if(operation_str == "c") return operation_type_t::COMMIT;
     else if(operation_str == "a") return operation_type_t::ABORT;
+    else if(operation_str == "b") return operation_type_t::BULK_MINT;
+    else if(operation_str == "n") return operation_type_t::ADMIT;
+    else if(operation_str == "j") return operation_type_t::REJECT;
+    else if(operation_str == "e") return operation_type_t::ESCROW_COVERED;
+    else if(operation_str == "u") return operation_type_t::ESCROW_UNCOVERED;
     return operation_type_t::NONE;
 }
 
+bool CascadeCBDC::admission_enabled(){
+    return (config.thread_queue_max_size > 0) || (config.thread_max_pending_transactions > 0);
+}
+
+bool CascadeCBDC::decides_admission(){
+    auto shard = service->get_shard_members(service->get_my_shard());
+    return *std::min_element(shard.begin(),shard.end()) == my_id;
+}
+
+void CascadeCBDC::announce_persisted(const persisted_wallets_t& persisted){
+    if((config.wallet_cache_capacity == 0) || persisted.empty()){
+        return;
+    }
+
+    // same shard and sender as the wallet puts, so it is delivered after them on every replica (this node included)
+    ObjectWithStringKey obj;
+    obj.key = CBDC_REQUEST_PERSISTED_KEY;
+    obj.blob = Blob([&persisted](uint8_t* buffer,const std::size_t size){
+            return mutils::to_bytes(persisted, buffer);
+        },mutils::bytes_size(persisted));
+    service->put_and_forget_to_shard(obj,service->get_my_shard(),true);
+}
+
+void CascadeCBDC::wallets_persisted(const persisted_wallets_t& persisted){
+    for(auto& item : persisted){
+        auto& wallet_id = std::get<0>(item);
+        if(CBDC_IS_ESCROW_WALLET(config,wallet_id)){
+            continue; // never evicted
+        }
+        threads[CBDC_WALLET_TO_THREAD(config,wallet_id,std::get<1>(item))].push_persisted_wallet(wallet_id,std::get<1>(item));
+    }
+}
+
 void CascadeCBDC::start_threads(){
+    if(config.enable_escrow){
+        for(uint64_t i=0;i<config.num_escrow_wallets;i++){
+            auto pool = new escrow_pool_t;
+            pool->reserve = 0;
+            pool->sub_balance.resize(config.num_threads,0);
+            pool->spare.resize(config.num_threads,0);
+            pool->taken.resize(config.num_threads,0);
+            escrow_pools[config.escrow_wallets[i]] = pool;
+        }
+    }
+
     if(config.enable_tx_persistence_thread){
         tx_thread = new TXPersistenceThread(this);
         tx_thread->start();
     }
 
+    if(config.enable_delta_persistence){
+        compaction_thread = new DeltaCompactionThread(this);
+        compaction_thread->start();
+    }
+
+    if(config.enable_notifications){
+        notification_thread = new NotificationThread(this);
+        notification_thread->start();
+    }
+
     if(config.enable_wallet_persistence_thread){
         wallet_thread = new WalletPersistenceThread(this);
         wallet_thread->start();
@@ -122,6 +370,11 @@ void CascadeCBDC::start_threads(){
         chain_thread = new ChainingThread(this);
         chain_thread->start();
     }
+    
+    if(config.enable_recovery || (config.wallet_cache_capacity > 0)){
+        fetch_thread = new WalletFetchThread(this);
+        fetch_thread->start();
+    }
 
     for(uint64_t i=0;i<config.num_threads;i++){
         threads.emplace_back(i,this);
@@ -141,6 +394,11 @@ void CascadeCBDC::stop(){
         t.join();
     }
     
+    if(config.enable_recovery || (config.wallet_cache_capacity > 0)){
+        fetch_thread->signal_stop();
+        fetch_thread->join();
+    }
+    
     if(config.enable_chaining_thread){
         chain_thread->signal_stop();
         chain_thread->join();
@@ -151,10 +409,25 @@ void CascadeCBDC::stop(){
         wallet_thread->join();
     }
 
+    if(config.enable_delta_persistence){
+        compaction_thread->signal_stop();
+        compaction_thread->join();
+    }
+
     if(config.enable_tx_persistence_thread){
         tx_thread->signal_stop();
         tx_thread->join();
     }
+
+    if(config.enable_notifications){
+        notification_thread->signal_stop();
+        notification_thread->join();
+    }
+
+    if(capture != nullptr){
+        delete capture; // flushes the last records
+        capture = nullptr;
+    }
 }
 
 void CascadeCBDC::reset(){
@@ -170,17 +443,267 @@ void CascadeCBDC::reset(){
         wallet_thread->reset();
     }
 
+    if(config.enable_delta_persistence){
+        compaction_thread->reset();
+        remove_persisted_wallets();
+    }
+
     if(config.enable_tx_persistence_thread){
         tx_thread->reset();
     }
 
+    if(config.enable_notifications){
+        notification_thread->reset();
+    }
+    
+    if(config.enable_recovery || (config.wallet_cache_capacity > 0)){
+        fetch_thread->reset();
+    }
+
     for(auto& item : transaction_database){
         delete item.second->request;
         delete item.second;
     }
     transaction_database.clear();
+    early_statuses.clear();
+
+    for(auto& item : escrow_pools){
+        std::unique_lock<std::mutex> lock(item.second->mtx);
+        item.second->reserve = 0;
+        item.second->debt = 0;
+        std::fill(item.second->sub_balance.begin(),item.second->sub_balance.end(),0);
+        std::fill(item.second->spare.begin(),item.second->spare.end(),0);
+        std::fill(item.second->taken.begin(),item.second->taken.end(),0);
+    }
         
     TimestampLogger::clear();
+    CBDCTrace::clear();
+}
+
+void CascadeCBDC::recover_shared_state(){
+    ServiceClientAPI& capi = ServiceClientAPI::get_service_client();
+    recovery_partitions.resize(config.num_threads);
+
+    // escrow wallets are not owned by any thread: the persisted total goes to the reserve
+    if(config.enable_escrow){
+        std::vector<wallet_id_t> wallet_ids(config.escrow_wallets,config.escrow_wallets + config.num_escrow_wallets);
+        std::unordered_map<wallet_id_t,wallet_t> wallets;
+        fetch_wallets(wallet_ids,wallets);
+        for(auto& item : wallets){
+            auto pool = escrow_pools.at(item.first);
+            std::unique_lock<std::mutex> lock(pool->mtx);
+            pool->reserve = CBDC_COMPUTE_WALLET_BALANCE(item.second);
+            pool->debt = 0;
+        }
+    }
+
+    if(!config.enable_recovery_prefetch){
+        return;
+    }
+
+    // no need to list the persisted wallets if all threads have a snapshot or a checkpoint
+    bool local_complete = true;
+    for(auto &t : threads){
+        local_complete = local_complete && t.has_local_state();
+    }
+
+    if(local_complete){
+        return;
+    }
+
+    // list the wallets persisted in this shard only once, and split them by thread
+    auto shard_index = service->get_my_shard();
+    auto res = capi.list_keys<CBDC_OBJECT_POOL_TYPE>(CURRENT_VERSION,false,CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+    std::string wallet_prefix = CBDC_WALLET_PREFIX;
+    std::unordered_set<wallet_id_t> listed;
+    for(auto& reply_future : res.get()){
+        auto keys = reply_future.second.get();
+        for(auto& key : keys){
+            if(key.compare(0,wallet_prefix.size(),wallet_prefix) != 0){
+                continue;
+            }
+
+            wallet_id_t wallet_id = std::stoull(key.substr(wallet_prefix.size()));
+            if(CBDC_IS_ESCROW_WALLET(config,wallet_id)){
+                continue;
+            }
+
+            listed.insert(wallet_id);
+        }
+        break; // all replicas have the same keys
+    }
+
+    // with delta persistence, wallets changed after the last compaction may not have a persisted wallet yet
+    if(config.enable_delta_persistence){
+        std::vector<std::pair<uint64_t,wallet_delta_batch_t>> batches;
+        fetch_deltas(shard_index,fetch_compacted_seq(shard_index),batches);
+        for(auto& batch : batches){
+            for(auto& delta : batch.second){
+                if(!CBDC_IS_ESCROW_WALLET(config,std::get<0>(delta))){
+                    listed.insert(std::get<0>(delta));
+                }
+            }
+        }
+    }
+
+    for(auto wallet_id : listed){
+        recovery_partitions[CBDC_WALLET_TO_THREAD(config,wallet_id,0)].push_back(wallet_id);
+    }
+}
+
+void CascadeCBDC::fetch_wallets(const std::vector<wallet_id_t>& wallet_ids,std::unordered_map<wallet_id_t,wallet_t>& wallets){
+    ServiceClientAPI& capi = ServiceClientAPI::get_service_client();
+    uint64_t window = std::max(config.recovery_batch_size,(uint64_t)1);
+
+    // with delta persistence, the compacted batch must be read before the wallets: a wallet without a persisted wallet has no delta up to it
+    uint32_t shard_index = 0;
+    uint64_t compacted_seq = 0;
+    std::unordered_map<wallet_id_t,uint64_t> image_seq;
+    if(config.enable_delta_persistence){
+        shard_index = service->get_my_shard();
+        compacted_seq = fetch_compacted_seq(shard_index);
+    }
+
+    // keep up to recovery_batch_size gets in flight, instead of waiting for each wallet
+    for(uint64_t start=0;start<wallet_ids.size();start+=window){
+        uint64_t end = std::min(start+window,(uint64_t)wallet_ids.size());
+        std::vector<derecho::rpc::QueryResults<const ObjectWithStringKey>> results;
+        results.reserve(end-start);
+        
+        for(uint64_t i=start;i<end;i++){
+            results.emplace_back(capi.get(CBDC_BUILD_WALLET_KEY(wallet_ids[i]),CURRENT_VERSION,false));
+        }
+
+        for(uint64_t i=start;i<end;i++){
+            auto& wallet_id = wallet_ids[i];
+            wallets[wallet_id] = wallet_t{}; // wallets that were never persisted are new
+            for(auto& reply_future : results[i-start].get()){
+                auto& obj = reply_future.second.get();
+                if(obj.version != INVALID_VERSION){
+                    if(config.enable_delta_persistence){
+                        wallets[wallet_id] = CBDC_WALLET_IMAGE_FROM_BYTES(obj.blob.bytes,obj.blob.size,image_seq[wallet_id]);
+                    } else {
+                        wallets[wallet_id] = CBDC_WALLET_FROM_BYTES(obj.blob.bytes,obj.blob.size);
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    if(!config.enable_delta_persistence || wallet_ids.empty()){
+        return;
+    }
+
+    // apply the deltas that are not in the persisted wallets yet (the compacted batch is read first, see fetch_compacted_seq):
+    // a wallet has no delta up to its image nor up to the compacted batch, and the batches before it may be removed
+    uint64_t from_seq = UINT64_MAX;
+    for(auto& wallet_id : wallet_ids){
+        uint64_t& wallet_seq = image_seq[wallet_id];
+        wallet_seq = std::max(wallet_seq,compacted_seq);
+        from_seq = std::min(from_seq,wallet_seq);
+    }
+
+    std::vector<std::pair<uint64_t,wallet_delta_batch_t>> batches;
+    fetch_deltas(shard_index,from_seq,batches);
+    for(auto& batch : batches){
+        for(auto& delta : batch.second){
+            auto& wallet_id = std::get<0>(delta);
+            auto it = wallets.find(wallet_id);
+            if(it == wallets.end()){
+                continue;
+            }
+
+            if(batch.first > image_seq[wallet_id]){
+                CBDC_APPLY_WALLET_DELTA(it->second,std::get<1>(delta));
+            }
+        }
+    }
+}
+
+uint64_t CascadeCBDC::fetch_compacted_seq(uint32_t shard_index){
+    ServiceClientAPI& capi = ServiceClientAPI::get_service_client();
+    auto res = capi.get<CBDC_OBJECT_POOL_TYPE>(CBDC_BUILD_DELTA_COMPACTED_KEY(shard_index),CURRENT_VERSION,false,CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+    for(auto& reply_future : res.get()){
+        auto& obj = reply_future.second.get();
+        if(obj.version != INVALID_VERSION){
+            return *mutils::from_bytes<uint64_t>(nullptr,obj.blob.bytes);
+        }
+        break;
+    }
+    return 0;
+}
+
+uint64_t CascadeCBDC::fetch_deltas(uint32_t shard_index,uint64_t from_seq,std::vector<std::pair<uint64_t,wallet_delta_batch_t>>& batches){
+    ServiceClientAPI& capi = ServiceClientAPI::get_service_client();
+    uint64_t seq = from_seq;
+    while(true){
+        bool found = false;
+        auto res = capi.get<CBDC_OBJECT_POOL_TYPE>(CBDC_BUILD_DELTA_KEY(shard_index,seq+1),CURRENT_VERSION,false,CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+        for(auto& reply_future : res.get()){
+            auto& obj = reply_future.second.get();
+            if(obj.version != INVALID_VERSION){
+                batches.emplace_back(seq+1,*mutils::from_bytes<wallet_delta_batch_t>(nullptr,obj.blob.bytes));
+                found = true;
+            }
+            break;
+        }
+
+        if(!found){
+            return seq; // last batch put
+        }
+        seq++;
+    }
+}
+
+uint64_t CascadeCBDC::fetch_removed_seq(uint32_t shard_index,uint64_t to_seq){
+    ServiceClientAPI& capi = ServiceClientAPI::get_service_client();
+    uint64_t seq = to_seq;
+    while(seq > 0){
+        bool found = false;
+        auto res = capi.get<CBDC_OBJECT_POOL_TYPE>(CBDC_BUILD_DELTA_KEY(shard_index,seq),CURRENT_VERSION,false,CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+        for(auto& reply_future : res.get()){
+            found = reply_future.second.get().version != INVALID_VERSION;
+            break;
+        }
+
+        if(!found){
+            break;
+        }
+        seq--;
+    }
+    return seq;
+}
+
+void CascadeCBDC::remove_persisted_wallets(){
+    // the wallets are persisted by the first node of the shard
+    auto shard_index = service->get_my_shard();
+    auto shard = service->get_shard_members(shard_index);
+    if(shard.empty() || (*std::min_element(shard.begin(),shard.end()) != service->get_my_id())){
+        return;
+    }
+
+    ServiceClientAPI& capi = ServiceClientAPI::get_service_client();
+    auto res = capi.list_keys<CBDC_OBJECT_POOL_TYPE>(CURRENT_VERSION,false,CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+    std::string wallet_prefix = CBDC_WALLET_PREFIX;
+    std::string delta_prefix = CBDC_DELTA_PREFIX;
+    std::vector<derecho::rpc::QueryResults<version_tuple>> results;
+    for(auto& reply_future : res.get()){
+        auto keys = reply_future.second.get();
+        for(auto& key : keys){
+            if((key.compare(0,wallet_prefix.size(),wallet_prefix) == 0) || (key.compare(0,delta_prefix.size(),delta_prefix) == 0)){
+                results.emplace_back(capi.remove<CBDC_OBJECT_POOL_TYPE>(key,CBDC_OBJECT_POOL_SUBGROUP,shard_index));
+            }
+        }
+        break; // all replicas have the same keys
+    }
+
+    // wait for the removals, so the next run does not recover the wallets of this one
+    for(auto& result : results){
+        for(auto& reply_future : result.get()){
+            reply_future.second.get();
+        }
+    }
 }
 
 void CascadeCBDC::ocdpo_handler(
@@ -191,9 +714,21 @@ void CascadeCBDC::ocdpo_handler(
         const emit_func_t&          emit,
         DefaultCascadeContextType*  typed_ctxt,
         uint32_t                    worker_id){
+    handle_request(sender,key_string,object);
+}
+
+void CascadeCBDC::handle_request(node_id_t sender,const std::string& key_string,const ObjectWithStringKey& object){
+    if(capture != nullptr){
+        capture->record_input(sender,key_string,object.blob.bytes,object.blob.size);
+    }
 
-    if(key_string == "log"){ // flush timestamp log for measurements
-        TimestampLogger::flush(reinterpret_cast<const char *>(object.blob.bytes));
+    if(key_string == "log"){ // flush timestamp logs for measurements: Cascade tags as text, CBDC tags as a binary trace
+        std::string log_file(reinterpret_cast<const char *>(object.blob.bytes));
+        TimestampLogger::flush(log_file);
+        CBDCTrace::flush(log_file + ".trace");
+        if(capture != nullptr){
+            capture->flush();
+        }
         return;
     }
     
@@ -202,9 +737,20 @@ void CascadeCBDC::ocdpo_handler(
         return;
     }
     
+    if(key_string == "digest"){ // balance and status digests of this shard, so clients can verify the final state without reading every wallet and TX
+        auto digest_request = mutils::from_bytes<digest_request_t>(nullptr,object.blob.bytes);
+        start_digest(std::get<0>(*digest_request),std::max(std::get<1>(*digest_request),(uint64_t)1));
+        return;
+    }
+    
+    if(key_string == "persisted"){ // wallet updates put by the persisting node: their wallets can be evicted
+        auto persisted = mutils::from_bytes<persisted_wallets_t>(nullptr,object.blob.bytes);
+        wallets_persisted(*persisted);
+        return;
+    }
+    
     if(key_string == "init"){ // write UDL config so clients can get it
-        auto shard_index = typed_ctxt->get_service_client_ref().get_my_shard<CBDC_OBJECT_POOL_TYPE>(CBDC_OBJECT_POOL_SUBGROUP);
-        auto shard = typed_ctxt->get_service_client_ref().get_shard_members<CBDC_OBJECT_POOL_TYPE>(CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+        auto shard = service->get_shard_members(service->get_my_shard());
         std::sort(shard.begin(),shard.end());
 
         // only one node write the config
@@ -215,7 +761,7 @@ void CascadeCBDC::ocdpo_handler(
                     return mutils::to_bytes(config, buffer);
                 },mutils::bytes_size(config));
 
-            typed_ctxt->get_service_client_ref().put_and_forget(obj);
+            service->put_and_forget(obj);
         }
         return;
     }
@@ -227,7 +773,7 @@ void CascadeCBDC::ocdpo_handler(
     auto request = mutils::from_bytes<cbdc_request_t>(nullptr,object.blob.bytes).release();
     transaction_id_t txid = std::get<0>(*request);
     
-    TimestampLogger::log(CBDC_TAG_UDL_HANDLER_START,my_id,txid,wallet_id);
+    CBDC_TRACE(CBDC_TAG_UDL_HANDLER_START,my_id,txid,wallet_id);
     
     internal_transaction_t *tx = nullptr;
     switch(operation){
@@ -247,21 +793,76 @@ void CascadeCBDC::ocdpo_handler(
                 tx = new internal_transaction_t;
                 tx->request = request;
                 tx->status = transaction_status_t::PENDING;
+                tx->pending_parts = 0;
 
                 transaction_database.emplace(txid,tx);
             }
             break;
 
+        case operation_type_t::BULK_MINT:
+            // ignore if already received
+            if(transaction_database.count(txid) > 0){
+                delete request;
+                break;
+            }
+
+            tx = new internal_transaction_t;
+            tx->request = request;
+            tx->status = transaction_status_t::PENDING;
+            tx->pending_parts = 0;
+            transaction_database.emplace(txid,tx);
+
+            // each thread applies its own wallets: the last one to finish persists the TX
+            {
+                std::vector<bool> has_part(config.num_threads,false);
+                for(auto& dest : std::get<2>(*request)){
+                    has_part[CBDC_WALLET_TO_THREAD(config,dest.first,txid)] = true;
+                }
+
+                tx->pending_parts = std::count(has_part.begin(),has_part.end(),true);
+                for(uint64_t i=0;i<config.num_threads;i++){
+                    if(has_part[i]){
+                        CBDC_TRACE(CBDC_TAG_UDL_HANDLER_QUEUING,my_id,txid,i);
+                        threads[i].push_operation(new queued_operation_t(operation,i,tx));
+                    }
+                }
+            }
+
+            tx = nullptr; // already sent to the threads
+            break;
+
         case operation_type_t::COMMIT:
         case operation_type_t::ABORT:
-            // ignore if transaction does not exist
             if(transaction_database.count(txid) == 0){
+                // ignore if transaction does not exist
+                // (replicas: the status can arrive before the TX from the client, so it is queued when the TX arrives)
+                if(!decides_admission()){
+                    early_statuses[txid].emplace_back(operation,wallet_id);
+                }
+                delete request;
                 break;
             }
 
             tx = transaction_database.at(txid);
             delete request;
             break;
+
+        case operation_type_t::ADMIT:
+        case operation_type_t::REJECT:
+        case operation_type_t::ESCROW_COVERED:
+        case operation_type_t::ESCROW_UNCOVERED:
+            // decision of the chaining node on a TX: the request only carries the txid, since replicas get the TX from the client.
+            // It goes to the thread in a temporary TX, not added to the database: the decision is kept by txid until the TX needs it
+            if(decides_admission()){
+                delete request;
+                break;
+            }
+
+            tx = new internal_transaction_t;
+            tx->request = request;
+            tx->status = transaction_status_t::PENDING;
+            tx->pending_parts = 0;
+            break;
         
         default:
             tx = nullptr;
@@ -270,22 +871,36 @@ void CascadeCBDC::ocdpo_handler(
 
     if(tx != nullptr){
         // send to corresponding thread
-        TimestampLogger::log(CBDC_TAG_UDL_HANDLER_QUEUING,my_id,txid,wallet_id);
-        uint64_t to_thread = wallet_id % config.num_threads;
+        CBDC_TRACE(CBDC_TAG_UDL_HANDLER_QUEUING,my_id,txid,wallet_id);
+        uint64_t to_thread = CBDC_WALLET_TO_THREAD(config,wallet_id,txid);
         queued_operation_t* queued_op = new queued_operation_t(operation,wallet_id,tx);
         threads[to_thread].push_operation(queued_op); 
+
+        // replicas: statuses that arrived before the TX go after it (see defers_status)
+        auto early_it = early_statuses.find(txid);
+        if((early_it != early_statuses.end()) && (transaction_database.count(txid) > 0) && (transaction_database.at(txid) == tx)){
+            for(auto& status : early_it->second){
+                auto status_wallet_id = std::get<1>(status);
+                threads[CBDC_WALLET_TO_THREAD(config,status_wallet_id,txid)].push_operation(new queued_operation_t(std::get<0>(status),status_wallet_id,tx));
+            }
+            early_statuses.erase(early_it);
+        }
     }
     
-    TimestampLogger::log(CBDC_TAG_UDL_HANDLER_END,my_id,txid,wallet_id);
+    CBDC_TRACE(CBDC_TAG_UDL_HANDLER_END,my_id,txid,wallet_id);
     //dbg_default_debug("[CBDC] operation {} invoked in node {} for wallet {} handled by thread {}",operation,my_id,wallet_id,to_thread);
 }
 
 // threads
 
-CascadeCBDC::CBDCThread::CBDCThread(uint64_t my_thread_id,CascadeCBDC* udl){
+CascadeCBDC::CBDCThread::CBDCThread(uint64_t my_thread_id,CascadeCBDC* udl): capi(*udl->service){
     this->my_thread_id = my_thread_id;
     this->udl = udl;
     node_id = capi.get_my_id();
+
+    if((udl->config.checkpoint_interval_ms > 0) && !udl->checkpoint_path.empty()){
+        checkpoint = new WalletCheckpoint(udl->checkpoint_path + "." + std::to_string(node_id) + "." + std::to_string(my_thread_id));
+    }
 }
 
 void CascadeCBDC::CBDCThread::push_operation(queued_operation_t* queued_op){
@@ -294,10 +909,22 @@ void CascadeCBDC::CBDCThread::push_operation(queued_operation_t* queued_op){
     thread_signal.notify_all();
 }
 
+void CascadeCBDC::CBDCThread::push_fetched_wallet(wallet_id_t wallet_id,const wallet_t& wallet){
+    std::unique_lock<std::mutex> lock(thread_mtx);
+    fetched_queue.emplace(wallet_id,wallet);
+    thread_signal.notify_all();
+}
+
+void CascadeCBDC::CBDCThread::push_persisted_wallet(wallet_id_t wallet_id,transaction_id_t txid){
+    // applied when the cache needs to evict (see cache_insert): no need to wake up the thread
+    std::unique_lock<std::mutex> lock(thread_mtx);
+    persisted_queue.emplace_back(wallet_id,txid);
+}
+
 void CascadeCBDC::CBDCThread::reset(){
     std::unique_lock<std::mutex> lock(thread_mtx);
     for(auto& wallet : wallet_cache){
-        wallet.second = 0;
+        wallet.second = wallet_t{};
         committed_balance[wallet.first] = 0;
         virtual_balance[wallet.first] = 0;
     }
@@ -308,12 +935,42 @@ void CascadeCBDC::CBDCThread::reset(){
     pending_transactions_wallet_dependencies.clear();
     already_handled.clear();
     pending_wallets.clear();
+
+    for(auto& item : admission_wallets){
+        for(auto queued_op : item.second){
+            delete queued_op;
+        }
+    }
+    admission_wallets.clear();
+    admission_decisions.clear();
+    escrow_outcomes.clear();
+    escrow_waiting.clear();
+    early_status.clear();
    
     while(!operation_queue.empty()){
         auto queued_op = operation_queue.front();
         operation_queue.pop();
         delete queued_op;
     }
+
+    // wallets start from 0 after a reset: persisted wallets are not fetched anymore
+    for(auto& item : fetching_wallets){
+        for(auto queued_op : item.second){
+            if(bulk_mint_fetches.count(queued_op) == 0){
+                delete queued_op;
+            }
+        }
+    }
+    for(auto& item : bulk_mint_fetches){
+        delete item.first; // waits in the queue of several wallets
+    }
+    fetching_wallets.clear();
+    bulk_mint_fetches.clear();
+    fetched_queue = {};
+    persisted_queue.clear();
+    partition_loaded = true;
+    wallet_pending.clear();
+    last_checkpoint = std::chrono::steady_clock::time_point(); // the zeroed wallets are not in the log: checkpoint them
 }
 
 void CascadeCBDC::CBDCThread::signal_stop(){
@@ -325,83 +982,473 @@ void CascadeCBDC::CBDCThread::signal_stop(){
 void CascadeCBDC::CBDCThread::main_loop(){
     if(!running) return;
 
-    // thread main loop 
+    if(udl->config.enable_recovery){
+        recover_partition();
+    }
+
+    // a checkpoint of a partition that was not recovered would replace the previous checkpoint with an incomplete one
+    if((checkpoint != nullptr) && !partition_loaded){
+        std::cout << "WARNING: thread " << my_thread_id << " did not recover its wallets: checkpoints are disabled, keeping the previous one" << std::endl;
+        delete checkpoint;
+        checkpoint = nullptr;
+    }
+
+    // the log only makes sense on top of a checkpoint
+    if(checkpoint != nullptr){
+        write_checkpoint();
+    }
+
+    // thread main loop 
+    auto checkpoint_interval = std::chrono::milliseconds(udl->config.checkpoint_interval_ms);
     while(true){
+        if((checkpoint != nullptr) && ((std::chrono::steady_clock::now() - last_checkpoint) >= checkpoint_interval)){
+            write_checkpoint();
+        }
+
+        if((udl->config.wallet_cache_capacity > 0) && ((std::chrono::steady_clock::now() - last_cache_log) >= std::chrono::seconds(1))){
+            log_cache_status();
+        }
+
         std::unique_lock<std::mutex> lock(thread_mtx);
-        if(operation_queue.empty()){
-            thread_signal.wait(lock);
+        if(operation_queue.empty() && fetched_queue.empty()){
+            if(checkpoint != nullptr){
+                checkpoint->flush_log();
+                thread_signal.wait_for(lock,checkpoint_interval);
+            } else {
+                thread_signal.wait(lock);
+            }
         }
 
         if(!running) break;
 
+        // wallets fetched in the background: handle the operations that were waiting for them
+        if(!fetched_queue.empty()){
+            auto fetched = fetched_queue.front();
+            fetched_queue.pop();
+            lock.unlock();
+
+            fetched_wallet(fetched.first,fetched.second);
+            continue;
+        }
+
+        if(operation_queue.empty()){
+            continue;
+        }
+
         auto queued_op = operation_queue.front();
         operation_queue.pop();
+        uint64_t queued_count = operation_queue.size();
         lock.unlock();
 
-        auto operation = std::get<0>(*queued_op);
-        auto wallet_id = std::get<1>(*queued_op);
-        auto tx = std::get<2>(*queued_op);
-        auto request = tx->request;
+        handle_operation(queued_op,queued_count);
+    }
 
-        auto& txid = std::get<0>(*request);
-        auto& sources = std::get<1>(*request);
-        auto& destinations = std::get<2>(*request);
-        auto& wallets = std::get<3>(*request);
+    if(!udl->recovery_snapshot_path.empty()){
+        write_snapshot();
+    }
+
+    if(checkpoint != nullptr){
+        write_checkpoint();
+    }
+}
+
+void CascadeCBDC::CBDCThread::handle_operation(queued_operation_t* queued_op,uint64_t queued_count){
+    auto operation = std::get<0>(*queued_op);
+    auto wallet_id = std::get<1>(*queued_op);
+    auto tx = std::get<2>(*queued_op);
+    auto request = tx->request;
 
-        // check if this txid for this wallet_id was already received before: if yes, ignore
-        if(already_handled[tx][wallet_id][operation]){
+    auto& txid = std::get<0>(*request);
+    auto& sources = std::get<1>(*request);
+    auto& destinations = std::get<2>(*request);
+    auto& wallets = std::get<3>(*request);
+
+    // digests only read the wallets of this thread, in between operations
+    if(operation == operation_type_t::DIGEST){
+        compute_digest(tx);
+        delete queued_op;
+        return;
+    }
+
+    // bulk mints do not go through the conflict tracking: they only add coins, and were deduplicated by the handler
+    if(operation == operation_type_t::BULK_MINT){
+        if(!bulk_mint_awaits_fetch(queued_op)){
+            bulk_mint(tx);
             delete queued_op;
+        }
+        return;
+    }
+
+    // replicas: decision of the chaining node on a new TX (see awaits_admission)
+    if((operation == operation_type_t::ADMIT) || (operation == operation_type_t::REJECT)){
+        admission_decided(std::get<0>(*tx->request),wallet_id,operation == operation_type_t::ADMIT);
+        delete tx->request;
+        delete tx;
+        delete queued_op;
+        return;
+    }
+
+    // replicas: outcome of the chaining node on a TX taking coins from an escrow wallet (see awaits_escrow)
+    if((operation == operation_type_t::ESCROW_COVERED) || (operation == operation_type_t::ESCROW_UNCOVERED)){
+        escrow_decided(std::get<0>(*tx->request),wallet_id,operation == operation_type_t::ESCROW_COVERED);
+        delete tx->request;
+        delete tx;
+        delete queued_op;
+        return;
+    }
+
+    // the wallet is being fetched in the background: the operation waits for it, without blocking the thread
+    if(needs_fetch(wallet_id)){
+        fetch_wallet(wallet_id,queued_op);
+        return;
+    }
+
+    // check if this txid for this wallet_id was already received before: if yes, ignore
+    // (before waiting for an admission decision, since the chaining node drops it without sending one)
+    if(already_handled[tx][wallet_id][operation]){
+        delete queued_op;
+        return;
+    }
+
+    auto wallet_it = std::find(wallets.begin(),wallets.end(),wallet_id);
+    if(wallet_it == wallets.end()) {
+        delete queued_op;
+        return;
+    }
+
+    // replicas: a new TX waits for the decision of the chaining node, without blocking the thread
+    if(awaits_admission(queued_op)){
+        return;
+    }
+    already_handled[tx][wallet_id][operation] = true;
+
+    CBDC_TRACE(CBDC_TAG_UDL_OPERATION_START,node_id,txid,wallet_id);
+
+    // admission control: new TXs are rejected when the chaining node is overloaded (forwarded TXs and status updates are always accepted, since other shards depend on them)
+    if(is_new_operation(operation) && !admit_transaction(tx,wallet_id,queued_count)){
+        reject_transaction(tx,wallet_id);
+        delete queued_op;
+        CBDC_TRACE(CBDC_TAG_UDL_OPERATION_END,node_id,txid,wallet_id);
+        return;
+    }
+
+    // check if wallet is in cache
+    cache_wallet(wallet_id);
+
+    // perform operation
+    switch(operation){
+    case operation_type_t::MINT:
+    case operation_type_t::TRANSFER:
+    case operation_type_t::REDEEM:
+    case operation_type_t::FORWARD:
+        CBDC_TRACE(CBDC_TAG_UDL_NEW_START,node_id,txid,wallet_id);
+        enqueue_transaction(tx,wallet_id);
+        CBDC_TRACE(CBDC_TAG_UDL_ENQUEUE_END,node_id,txid,wallet_id);
+        if(!has_conflict(tx,wallet_id)){
+            CBDC_TRACE(CBDC_TAG_UDL_RUN_START,node_id,txid,wallet_id);
+            tx_run_recursive(tx,wallet_id);
+        }
+        break;
+    case operation_type_t::COMMIT:
+        CBDC_TRACE(CBDC_TAG_UDL_COMMIT_START,node_id,txid,wallet_id);
+        if(!defers_status(tx,wallet_id,operation)){
+            tx_committed_recursive(tx,wallet_id);
+        }
+        break;
+    case operation_type_t::ABORT:
+        CBDC_TRACE(CBDC_TAG_UDL_ABORT_START,node_id,txid,wallet_id);
+        if(!defers_status(tx,wallet_id,operation)){
+            tx_aborted_recursive(tx,wallet_id,true);
+        }
+        break;
+    }
+    
+    delete queued_op;
+    CBDC_TRACE(CBDC_TAG_UDL_OPERATION_END,node_id,txid,wallet_id);
+}
+
+void CascadeCBDC::CBDCThread::compute_digest(internal_transaction_t* tx){
+    auto request_id = std::get<0>(*tx->request);
+    uint64_t range_size;
+    std::vector<std::pair<transaction_id_t,internal_transaction_t*>> transfers;
+    {
+        std::unique_lock<std::mutex> lock(udl->digest_mtx);
+        auto& pending = udl->pending_digests.at(request_id);
+        range_size = pending.range_size;
+        transfers.swap(pending.transfers[my_thread_id]);
+    }
+
+    // statuses of the transfers whose first wallet is in this thread
+    std::vector<uint64_t> status_count(static_cast<uint64_t>(transaction_status_t::UNKNOWN) + 1,0);
+    uint64_t status_hash = 0;
+    for(auto& item : transfers){
+        auto status = item.second->status;
+        status_count[static_cast<uint64_t>(status)]++;
+        if((status == transaction_status_t::COMMIT) || (status == transaction_status_t::ABORT)){
+            status_hash += CBDC_DIGEST_HASH(item.first,static_cast<uint64_t>(status));
+        }
+    }
+
+    // escrow wallets are added once, with the coins of all threads
+    std::unordered_map<uint64_t,range_digest_t> ranges;
+    for(auto& item : wallet_cache){
+        if(!is_escrow(item.first)){
+            CBDC_DIGEST_ADD_WALLET(ranges,range_size,item.first,CBDC_COMPUTE_WALLET_BALANCE(item.second));
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(udl->digest_mtx);
+    auto& pending_digest = udl->pending_digests.at(request_id).digest;
+    auto& digest_ranges = std::get<0>(pending_digest);
+    for(auto& item : ranges){
+        auto& range = digest_ranges[item.first];
+        std::get<0>(range) += std::get<0>(item.second);
+        std::get<1>(range) += std::get<1>(item.second);
+        std::get<2>(range) += std::get<2>(item.second);
+    }
+    for(uint64_t i=0;i<status_count.size();i++){
+        std::get<1>(pending_digest)[i] += status_count[i];
+    }
+    std::get<2>(pending_digest) += status_hash;
+
+    if(tx->pending_parts.fetch_sub(1) != 1){
+        return;
+    }
+
+    shard_digest_t digest = std::move(udl->pending_digests.at(request_id).digest);
+    udl->pending_digests.erase(request_id);
+    lock.unlock();
+    delete tx->request;
+    delete tx;
+
+    auto shard_index = capi.get_my_shard();
+    for(auto& item : udl->escrow_pools){
+        if(capi.key_to_shard(CBDC_BUILD_WALLET_KEY(item.first)) != shard_index){
             continue;
         }
-        already_handled[tx][wallet_id][operation] = true;
 
-        auto wallet_it = std::find(wallets.begin(),wallets.end(),wallet_id);
-        if(wallet_it == wallets.end()) {
-            delete queued_op;
+        std::unique_lock<std::mutex> escrow_lock(item.second->mtx);
+        CBDC_DIGEST_ADD_WALLET(std::get<0>(digest),range_size,item.first,escrow_total(item.second));
+    }
+
+    CBDC_TRACE(CBDC_TAG_UDL_DIGEST_END,node_id,request_id,std::get<0>(digest).size());
+
+    // all replicas compute the digest, only one puts it
+    if(!is_my_persistence(0)){
+        return;
+    }
+
+    ObjectWithStringKey obj;
+    obj.key = CBDC_BUILD_DIGEST_KEY(shard_index,request_id);
+    obj.message_id = request_id;
+    obj.blob = Blob([&digest](uint8_t* buffer,const std::size_t size){
+            return mutils::to_bytes(digest, buffer);
+        },mutils::bytes_size(digest));
+    capi.put_and_forget_to_shard(obj,shard_index);
+}
+
+void CascadeCBDC::CBDCThread::bulk_mint(internal_transaction_t* tx){
+    auto request = tx->request;
+    auto& txid = std::get<0>(*request);
+    auto& destinations = std::get<2>(*request);
+
+    CBDC_TRACE(CBDC_TAG_UDL_BULK_MINT_START,node_id,txid,my_thread_id);
+
+    uint64_t count = 0;
+    for(auto& dest : destinations){
+        auto& wallet_id = dest.first;
+        if(CBDC_WALLET_TO_THREAD(udl->config,wallet_id,txid) != my_thread_id){
             continue;
         }
 
-        TimestampLogger::log(CBDC_TAG_UDL_OPERATION_START,node_id,txid,wallet_id);
+        cache_wallet(wallet_id);
+        add_to_wallet(wallet_cache[wallet_id],dest.second);
+        committed_balance[wallet_id] += dest.second;
+        virtual_balance[wallet_id] += dest.second;
 
-        // check if wallet is in cache
-        if(wallet_cache.count(wallet_id) == 0){
-            fetch_wallet(wallet_id);
-            committed_balance[wallet_id] = CBDC_COMPUTE_WALLET_BALANCE(wallet_cache[wallet_id]);
-            virtual_balance[wallet_id] = committed_balance[wallet_id];
+        if(is_escrow(wallet_id)){
+            auto pool = udl->escrow_pools.at(wallet_id);
+            std::unique_lock<std::mutex> lock(pool->mtx);
+            escrow_settle(wallet_id,pool);
         }
 
-        // perform operation
-        switch(operation){
-        case operation_type_t::MINT:
-        case operation_type_t::TRANSFER:
-        case operation_type_t::REDEEM:
-        case operation_type_t::FORWARD:
-            TimestampLogger::log(CBDC_TAG_UDL_NEW_START,node_id,txid,wallet_id);
-            enqueue_transaction(tx,wallet_id);
-            TimestampLogger::log(CBDC_TAG_UDL_ENQUEUE_END,node_id,txid,wallet_id);
-            if(!has_conflict(tx,wallet_id)){
-                TimestampLogger::log(CBDC_TAG_UDL_RUN_START,node_id,txid,wallet_id);
-                tx_run_recursive(tx,wallet_id);
-            }
-            break;
-        case operation_type_t::COMMIT:
-            TimestampLogger::log(CBDC_TAG_UDL_COMMIT_START,node_id,txid,wallet_id);
-            tx_committed_recursive(tx,wallet_id);
-            break;
-        case operation_type_t::ABORT:
-            TimestampLogger::log(CBDC_TAG_UDL_ABORT_START,node_id,txid,wallet_id);
-            tx_aborted_recursive(tx,wallet_id,true);
-            break;
+        persist_wallet(wallet_id,tx);
+
+        if(is_escrow(wallet_id)){
+            escrow_rebalance(wallet_id);
         }
-    
-        delete queued_op;
-        TimestampLogger::log(CBDC_TAG_UDL_OPERATION_END,node_id,txid,wallet_id);
+        count++;
     }
-    
+    CBDC_TRACE(CBDC_TAG_UDL_BULK_MINT_END,node_id,txid,count);
+
+    // the last thread persists a single record for the whole batch
+    if(tx->pending_parts.fetch_sub(1) == 1){
+        tx->status = transaction_status_t::COMMIT;
+        persist_transaction(tx);
+    }
+}
+
+bool CascadeCBDC::CBDCThread::bulk_mint_awaits_fetch(queued_operation_t* queued_op){
+    auto tx = std::get<2>(*queued_op);
+    auto& txid = std::get<0>(*tx->request);
+    auto& destinations = std::get<2>(*tx->request);
+
+    // wallets that were not recovered yet are fetched in the background, all at once, without blocking the thread
+    std::vector<wallet_id_t> missing;
+    for(auto& dest : destinations){
+        if((CBDC_WALLET_TO_THREAD(udl->config,dest.first,txid) == my_thread_id) && needs_fetch(dest.first)){
+            missing.push_back(dest.first);
+        }
+    }
+    if(missing.empty()){
+        return false;
+    }
+
+    // the bulk mint waits in the queue of each wallet, so the operations behind it on these wallets keep their order
+    bulk_mint_fetches[queued_op] = std::make_pair(missing.size(),missing);
+    for(auto wallet_id : missing){
+        fetch_wallet(wallet_id,queued_op);
+    }
+    return true;
+}
+
+void CascadeCBDC::CBDCThread::bulk_mint_fetched(queued_operation_t* queued_op){
+    auto wallets = std::move(bulk_mint_fetches.at(queued_op).second);
+    bulk_mint_fetches.erase(queued_op);
+
+    // the bulk mint is first in the queue of all its wallets
+    for(auto wallet_id : wallets){
+        auto it = fetching_wallets.find(wallet_id);
+        if((it != fetching_wallets.end()) && !it->second.empty() && (it->second.front() == queued_op)){
+            it->second.pop_front();
+        }
+    }
+
+    bulk_mint(std::get<2>(*queued_op));
+    delete queued_op;
+
+    for(auto wallet_id : wallets){
+        release_wallet(wallet_id);
+    }
+}
+
+bool CascadeCBDC::CBDCThread::is_new_operation(operation_type_t operation){
+    return (operation == operation_type_t::MINT) || (operation == operation_type_t::TRANSFER) || (operation == operation_type_t::REDEEM);
+}
+
+bool CascadeCBDC::CBDCThread::is_overloaded(uint64_t queued_count){
+    if((udl->config.thread_queue_max_size > 0) && (queued_count > udl->config.thread_queue_max_size)){
+        return true;
+    }
+
+    if((udl->config.thread_max_pending_transactions > 0) && (pending_transactions.size() >= udl->config.thread_max_pending_transactions)){
+        return true;
+    }
+
+    return false;
+}
+
+bool CascadeCBDC::CBDCThread::awaits_admission(queued_operation_t* queued_op){
+    auto operation = std::get<0>(*queued_op);
+    auto wallet_id = std::get<1>(*queued_op);
+    auto tx = std::get<2>(*queued_op);
+
+    // operations behind one that is waiting for a decision also wait, so they are handled in order
+    auto it = admission_wallets.find(wallet_id);
+    if(it != admission_wallets.end()){
+        it->second.push_back(queued_op);
+        return true;
+    }
+
+    if(!is_new_operation(operation) || !udl->admission_enabled() || is_my_persistence(0)){
+        return false;
+    }
+
+    auto decision_it = admission_decisions.find(std::get<0>(*tx->request));
+    if((decision_it != admission_decisions.end()) && (decision_it->second.count(wallet_id) > 0)){
+        return false;
+    }
+
+    admission_wallets[wallet_id].push_back(queued_op);
+    return true;
+}
+
+bool CascadeCBDC::CBDCThread::admit_transaction(internal_transaction_t* tx,wallet_id_t wallet_id,uint64_t queued_count){
+    if(!udl->admission_enabled()){
+        return true;
+    }
+
+    // replicas apply the decision of the chaining node (see awaits_admission)
+    if(!is_my_persistence(0)){
+        auto decisions_it = admission_decisions.find(std::get<0>(*tx->request));
+        if((decisions_it == admission_decisions.end()) || (decisions_it->second.count(wallet_id) == 0)){
+            std::cout << "WARNING: no admission decision for TX " << std::get<0>(*tx->request) << " on wallet " << wallet_id << ": admitted" << std::endl;
+            return true;
+        }
+
+        auto& decisions = decisions_it->second;
+        bool admitted = decisions[wallet_id];
+        decisions.erase(wallet_id);
+        if(decisions.empty()){
+            admission_decisions.erase(decisions_it);
+        }
+        return admitted;
+    }
+
+    // only the chaining node looks at its load: replicas deciding from their own queues could disagree on the same TX
+    bool admitted = !is_overloaded(queued_count);
+    send_admission(tx,wallet_id,admitted);
+    return admitted;
+}
+
+void CascadeCBDC::CBDCThread::send_admission(internal_transaction_t* tx,wallet_id_t wallet_id,bool admitted){
+    auto shard_index = capi.get_my_shard();
+    if(capi.get_shard_members(shard_index).size() < 2){
+        return; // no other replicas
+    }
+
+    // the replicas already have the TX from the client: the decision only needs the txid (the key has the wallet and the decision)
+    auto& txid = std::get<0>(*tx->request);
+    cbdc_request_t request(txid,{},{},{});
+    ObjectWithStringKey obj;
+    obj.key = admitted ? CBDC_BUILD_ADMIT_KEY(wallet_id) : CBDC_BUILD_REJECT_KEY(wallet_id);
+    obj.message_id = txid;
+    obj.blob = Blob([&request](uint8_t* buffer,const std::size_t size){
+            return mutils::to_bytes(request, buffer);
+        },mutils::bytes_size(request));
+
+    capi.put_and_forget_to_shard(obj,shard_index,true);
+}
+
+void CascadeCBDC::CBDCThread::admission_decided(const transaction_id_t& txid,wallet_id_t wallet_id,bool admitted){
+    admission_decisions[txid][wallet_id] = admitted;
+
+    auto it = admission_wallets.find(wallet_id);
+    if(it == admission_wallets.end()){
+        return; // the TX did not reach this thread yet
+    }
+
+    // handle the waiting operations in order, until one waits for another decision
+    auto waiting = std::move(it->second);
+    admission_wallets.erase(it);
+    for(auto queued_op : waiting){
+        handle_operation(queued_op,0);
+    }
+}
+
+void CascadeCBDC::CBDCThread::reject_transaction(internal_transaction_t* tx,wallet_id_t wallet_id){
+    auto request = tx->request;
+    auto& txid = std::get<0>(*request);
+
+    // the TX never entered the conflict tracking structures and was not forwarded, so we only need to persist the rejected status for the client
+    CBDC_TRACE(CBDC_TAG_UDL_TX_REJECTED,node_id,txid,wallet_id);
+    tx->status = transaction_status_t::REJECTED;
+    persist_transaction(tx);
 }
 
 void CascadeCBDC::CBDCThread::enqueue_transaction(internal_transaction_t* tx,wallet_id_t wallet_id){
     pending_wallets[tx].push_back(wallet_id);
+    wallet_pending[wallet_id]++;
     
     auto request = tx->request;
     auto& sources = std::get<1>(*request);
@@ -419,14 +1466,21 @@ void CascadeCBDC::CBDCThread::enqueue_transaction(internal_transaction_t* tx,wal
         return;
     }
 
+    // an escrow wallet is a different sub-balance in each thread: TXs only conflict on it in the thread that debits it for them
+    // (other threads waiting on it could form cycles, since the escrow part of each TX goes to the thread given by its txid)
+    auto& txid = std::get<0>(*request);
+    auto is_tracked = [&](wallet_id_t src_id){
+        return !is_escrow(src_id) || (CBDC_WALLET_TO_THREAD(udl->config,src_id,txid) == my_thread_id);
+    };
+
     // first check if there is a conflict in general: this accelerates non-conflicting TXs, which should be the majority
-    bool found = false;
     std::unordered_set<internal_transaction_t*> already_inserted;
     for(auto& src : sources){
-        if(!pending_transactions_wallet_dependencies[src.first].empty()){
+        if(is_tracked(src.first) && !pending_transactions_wallet_dependencies[src.first].empty()){
             // optimization: ignore conflict if the wallet is handled by this thread and there are enough virtual funds
             // this should speed up simple TXs with just one source wallet, which should be the majority of TXs
-            if(udl->config.enable_virtual_balance && (virtual_balance.count(src.first) > 0) && (virtual_balance[src.first] >= src.second)){
+            // (not for escrow wallets: their sub-balances differ between replicas, which must track the same conflicts)
+            if(udl->config.enable_virtual_balance && !is_escrow(src.first) && (virtual_balance.count(src.first) > 0) && (virtual_balance[src.first] >= src.second)){
                 continue;
             }
 
@@ -439,16 +1493,15 @@ void CascadeCBDC::CBDCThread::enqueue_transaction(internal_transaction_t* tx,wal
                 }
             }
 
-            found = true;
             break;
         }
     }
 
-    if(!found) return;
-
-    // update the map for general conflict checking
+    // update the map for general conflict checking (also without a conflict: the next TXs taking coins from these wallets wait for this one)
     for(auto& src : sources){
-        pending_transactions_wallet_dependencies[src.first].insert(tx);
+        if(is_tracked(src.first)){
+            pending_transactions_wallet_dependencies[src.first].insert(tx);
+        }
     } 
     if(!udl->config.enable_source_only_conflicts){
         // if this optimization is disabled, add destinations to the conflict checking structure
@@ -459,7 +1512,20 @@ void CascadeCBDC::CBDCThread::enqueue_transaction(internal_transaction_t* tx,wal
 }
 
 bool CascadeCBDC::CBDCThread::dequeue_transaction(internal_transaction_t* tx,wallet_id_t wallet_id){
-    pending_wallets[tx].erase(std::find(pending_wallets[tx].begin(),pending_wallets[tx].end(),wallet_id));
+    // a status update for a wallet that is not pending in this TX: this should not happen
+    auto wallets_it = pending_wallets.find(tx);
+    if(wallets_it == pending_wallets.end()){
+        return false;
+    }
+    auto pending_it = std::find(wallets_it->second.begin(),wallets_it->second.end(),wallet_id);
+    if(pending_it == wallets_it->second.end()){
+        return false;
+    }
+    wallets_it->second.erase(pending_it);
+    if(--wallet_pending[wallet_id] == 0){
+        wallet_pending.erase(wallet_id);
+        cache_sweep_failed = false; // the wallet may be evictable now
+    }
     if(pending_wallets[tx].empty()){
         pending_transactions.erase(pending_transaction_it[tx]);
         pending_transaction_it.erase(tx);
@@ -472,9 +1538,15 @@ bool CascadeCBDC::CBDCThread::dequeue_transaction(internal_transaction_t* tx,wal
         // update the map for general conflict checking
         for(auto& src : sources){
             pending_transactions_wallet_dependencies[src.first].erase(tx);
+            if(pending_transactions_wallet_dependencies[src.first].empty()){
+                pending_transactions_wallet_dependencies.erase(src.first);
+            }
         } 
         for(auto& dest : destinations){
             pending_transactions_wallet_dependencies[dest.first].erase(tx);
+            if(pending_transactions_wallet_dependencies[dest.first].empty()){
+                pending_transactions_wallet_dependencies.erase(dest.first);
+            }
         } 
 
         return true;
@@ -492,6 +1564,28 @@ bool CascadeCBDC::CBDCThread::is_valid(internal_transaction_t* tx,wallet_id_t wa
    
     // a transaction only fails if there are not enough coins in a source wallet 
     if(sources.count(wallet_id) > 0){
+        // escrow wallets can take coins from the shared reserve (and from other threads), and may have lost spare coins to other threads
+        if(is_escrow(wallet_id)){
+            // replicas: apply the outcome of the chaining node (see awaits_escrow)
+            if(!is_my_persistence(0)){
+                auto& txid = std::get<0>(*request);
+                auto outcomes_it = escrow_outcomes.find(txid);
+                bool covered = outcomes_it->second.at(wallet_id);
+                outcomes_it->second.erase(wallet_id);
+                if(outcomes_it->second.empty()){
+                    escrow_outcomes.erase(outcomes_it);
+                }
+
+                escrow_refill(wallet_id,sources[wallet_id],covered);
+                return covered;
+            }
+
+            escrow_refill(wallet_id,sources[wallet_id]);
+            bool covered = committed_balance[wallet_id] >= sources[wallet_id];
+            send_escrow_outcome(tx,wallet_id,covered);
+            return covered;
+        }
+
         if(committed_balance[wallet_id] < sources[wallet_id]){
             return false;
         }
@@ -507,6 +1601,43 @@ void CascadeCBDC::CBDCThread::tx_run_recursive(internal_transaction_t* tx,wallet
 
     tx->status = transaction_status_t::RUNNING;
 
+    // replicas: the TX already finished on the chaining node (see defers_status), so it only applies the status
+    auto early_it = early_status.find(tx);
+    if((early_it != early_status.end()) && (early_it->second.count(wallet_id) > 0)){
+        auto operation = early_it->second.at(wallet_id);
+        early_it->second.erase(wallet_id);
+        if(early_it->second.empty()){
+            early_status.erase(early_it);
+        }
+
+        if(operation == operation_type_t::ABORT){
+            tx_aborted_recursive(tx,wallet_id,false);
+            return;
+        }
+
+        // committed: the wallet covered the TX on the chaining node
+        if(sources.count(wallet_id) > 0){
+            if(is_escrow(wallet_id)){
+                auto outcomes_it = escrow_outcomes.find(std::get<0>(*request));
+                if(outcomes_it != escrow_outcomes.end()){
+                    outcomes_it->second.erase(wallet_id);
+                    if(outcomes_it->second.empty()){
+                        escrow_outcomes.erase(outcomes_it);
+                    }
+                }
+                escrow_refill(wallet_id,sources[wallet_id],true);
+            }
+            virtual_balance[wallet_id] -= sources[wallet_id];
+        }
+        tx_committed_recursive(tx,wallet_id);
+        return;
+    }
+
+    // replicas: whether an escrow wallet covers the TX is decided by the chaining node
+    if(awaits_escrow(tx,wallet_id)){
+        return;
+    }
+
     // first check if the TX is valid
     if(is_valid(tx,wallet_id)){
         if(sources.count(wallet_id) > 0){
@@ -547,25 +1678,7 @@ void CascadeCBDC::CBDCThread::tx_committed_recursive(internal_transaction_t* tx,
     }
 
     // all wallets in the tx were committed, so we need to remove the tx from conflicts and check if other txs can run
-    backward_conflicts.erase(tx);
-
-    if(forward_conflicts.count(tx) > 0){
-        // check transactions that are waiting this one
-        for(internal_transaction_t* ahead_tx : forward_conflicts.at(tx)){
-            // clear conflict
-            auto& clist = backward_conflicts.at(ahead_tx);
-            clist.erase(std::find(clist.begin(),clist.end(),tx));
-
-            // check if ahead_tx can run
-            if(clist.empty()){
-                backward_conflicts.erase(ahead_tx);
-                wallet_id_t start_wallet = pending_wallets[ahead_tx].front();
-                tx_run_recursive(ahead_tx,start_wallet);
-            }
-        }
-
-        forward_conflicts.erase(tx);
-    }
+    tx_release_recursive(tx);
 }
 
 void CascadeCBDC::CBDCThread::tx_aborted_recursive(internal_transaction_t* tx,wallet_id_t wallet_id,bool adjust_virtual){
@@ -592,24 +1705,143 @@ void CascadeCBDC::CBDCThread::tx_aborted_recursive(internal_transaction_t* tx,wa
     }
     
     // tx was aborted, so we need to remove it from conflicts and check if other txs can run
+    tx_release_recursive(tx);
+}
+
+void CascadeCBDC::CBDCThread::tx_release_recursive(internal_transaction_t* tx){
     backward_conflicts.erase(tx);
 
-    if(forward_conflicts.count(tx) > 0){
-        // check transactions that are waiting this one
-        for(internal_transaction_t* ahead_tx : forward_conflicts.at(tx)){
-            // clear conflict
-            auto& clist = backward_conflicts.at(ahead_tx);
-            clist.erase(std::find(clist.begin(),clist.end(),tx));
+    if(forward_conflicts.count(tx) == 0){
+        return;
+    }
+
+    // check transactions that are waiting this one
+    std::vector<internal_transaction_t*> ready;
+    for(internal_transaction_t* ahead_tx : forward_conflicts.at(tx)){
+        // clear conflict
+        auto& clist = backward_conflicts.at(ahead_tx);
+        clist.erase(std::find(clist.begin(),clist.end(),tx));
 
-            // check if ahead_op can run
-            if(clist.empty()){
-                backward_conflicts.erase(ahead_tx);
+        // check if ahead_tx can run
+        if(clist.empty()){
+            backward_conflicts.erase(ahead_tx);
+            if(!udl->config.enable_group_commit){
                 wallet_id_t start_wallet = pending_wallets[ahead_tx].front();
                 tx_run_recursive(ahead_tx,start_wallet);
+            } else {
+                ready.push_back(ahead_tx);
+            }
+        }
+    }
+
+    forward_conflicts.erase(tx);
+
+    if(ready.empty()){
+        return;
+    }
+
+    // group commit: admit the TXs queued behind the ready ones in a single step, then run all of them
+    tx_group_admit(ready);
+    for(auto ahead_tx : ready){
+        wallet_id_t start_wallet = pending_wallets[ahead_tx].front();
+        tx_run_recursive(ahead_tx,start_wallet);
+    }
+}
+
+bool CascadeCBDC::CBDCThread::defers_status(internal_transaction_t* tx,wallet_id_t wallet_id,operation_type_t operation){
+    if(is_my_persistence(0)){
+        return false;
+    }
+
+    // the conflicts of a TX depend on when each replica handled the TXs before it, a replica waits for the outcome of escrow
+    // wallets, and the TX from the client may not even be here yet: the status sent by the next wallet can arrive before the TX ran here
+    auto& txid = std::get<0>(*tx->request);
+    auto waiting_it = escrow_waiting.find(txid);
+    bool waiting_escrow = (waiting_it != escrow_waiting.end()) && (waiting_it->second.count(wallet_id) > 0);
+    auto wallets_it = pending_wallets.find(tx);
+    bool enqueued = (wallets_it != pending_wallets.end()) && (std::find(wallets_it->second.begin(),wallets_it->second.end(),wallet_id) != wallets_it->second.end());
+    if(enqueued && !has_conflict(tx,wallet_id) && !waiting_escrow){
+        return false;
+    }
+
+    early_status[tx][wallet_id] = operation;
+    return true;
+}
+
+void CascadeCBDC::CBDCThread::tx_group_admit(std::vector<internal_transaction_t*>& group){
+    std::unordered_set<internal_transaction_t*> members(group.begin(),group.end());
+    std::unordered_map<wallet_id_t,coin_value_t> reserved; // coins the group may take from each wallet
+    for(auto member : group){
+        for(auto& src : std::get<1>(*member->request)){
+            reserved[src.first] += src.second;
+        }
+    }
+
+    // TXs are visited in the order they were queued, and a TX that cannot be admitted is skipped: the TXs queued behind it on the same wallet wait for it, so they are skipped too (TXs of other wallets can still join the group)
+    std::vector<internal_transaction_t*> admitted;
+    for(uint64_t i=0;(i<group.size()) && (group.size() < udl->config.group_commit_max_size);i++){
+        if(forward_conflicts.count(group[i]) == 0){
+            continue;
+        }
+
+        for(auto candidate : forward_conflicts.at(group[i])){
+            if(group.size() >= udl->config.group_commit_max_size){
+                break;
+            }
+
+            if(members.count(candidate) > 0){
+                continue;
+            }
+
+            // only TXs taking coins from a single wallet in this thread are admitted
+            auto& candidate_wallets = pending_wallets[candidate];
+            if(candidate_wallets.size() != 1){
+                continue;
+            }
+
+            wallet_id_t wallet_id = candidate_wallets.front();
+            auto& sources = std::get<1>(*candidate->request);
+            if((sources.count(wallet_id) == 0) || is_escrow(wallet_id)){ // escrow sub-balances differ between replicas
+                continue;
+            }
+
+            // it can only run if all the TXs it is waiting for are in the group
+            bool waiting_outside = false;
+            for(auto behind_tx : backward_conflicts.at(candidate)){
+                if(members.count(behind_tx) == 0){
+                    waiting_outside = true;
+                    break;
+                }
+            }
+
+            if(waiting_outside){
+                continue;
+            }
+
+            // the committed balance must cover the whole group (otherwise the TX waits and is validated alone later)
+            auto value = sources.at(wallet_id);
+            if(committed_balance[wallet_id] < reserved[wallet_id] + value){
+                continue;
             }
+
+            reserved[wallet_id] += value;
+            members.insert(candidate);
+            group.push_back(candidate);
+            admitted.push_back(candidate);
+        }
+    }
+
+    // batch the conflict updates: admitted TXs no longer wait for the other members of the group
+    for(auto candidate : admitted){
+        for(auto behind_tx : backward_conflicts.at(candidate)){
+            auto& flist = forward_conflicts.at(behind_tx);
+            flist.erase(std::find(flist.begin(),flist.end(),candidate));
         }
+        backward_conflicts.erase(candidate);
+    }
 
-        forward_conflicts.erase(tx);
+    if(!admitted.empty()){
+        CBDC_TRACE(CBDC_TAG_UDL_GROUP_COMMIT,node_id,group.size(),admitted.size());
     }
 }
 
@@ -635,13 +1867,23 @@ void CascadeCBDC::CBDCThread::commit_transaction(internal_transaction_t* tx,wall
         // virtual_balance[wallet_id] was already updated in tx_run_recursive
     }
 
+    if(is_escrow(wallet_id)){
+        auto pool = udl->escrow_pools.at(wallet_id);
+        std::unique_lock<std::mutex> lock(pool->mtx);
+        escrow_settle(wallet_id,pool);
+    }
+
     // put new wallet
     persist_wallet(wallet_id,tx);
+
+    if(is_escrow(wallet_id)){
+        escrow_rebalance(wallet_id);
+    }
 }
 
 std::tuple<bool,bool,uint32_t> CascadeCBDC::CBDCThread::is_mine(internal_transaction_t* tx,wallet_id_t wallet_id,wallet_id_t next_wallet_id){
-    auto shard_index = capi.get_my_shard<CBDC_OBJECT_POOL_TYPE>(CBDC_OBJECT_POOL_SUBGROUP);
-    auto shard = capi.get_shard_members<CBDC_OBJECT_POOL_TYPE>(CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+    auto shard_index = capi.get_my_shard();
+    auto shard = capi.get_shard_members(shard_index);
     std::sort(shard.begin(),shard.end());
     
     //bool chain = shard[wallet_id % shard.size()] == node_id;
@@ -649,9 +1891,7 @@ std::tuple<bool,bool,uint32_t> CascadeCBDC::CBDCThread::is_mine(internal_transac
 
     // check where the next wallet goes, but only of the associated optimization is enabled
     bool same_shard = false;
-    uint32_t subgroup_type_index,subgroup_index,next_shard;
-    std::string wallet_key = CBDC_BUILD_TRANSFER_KEY(next_wallet_id);
-    std::tie(subgroup_type_index,subgroup_index,next_shard) = capi.key_to_shard(wallet_key);
+    uint32_t next_shard = capi.key_to_shard(CBDC_BUILD_TRANSFER_KEY(next_wallet_id));
     if(udl->config.enable_cross_thread_communication){
         same_shard = next_shard == shard_index;
     }
@@ -660,8 +1900,8 @@ std::tuple<bool,bool,uint32_t> CascadeCBDC::CBDCThread::is_mine(internal_transac
 }
 
 bool CascadeCBDC::CBDCThread::is_my_persistence(uint64_t factor){
-    auto shard_index = capi.get_my_shard<CBDC_OBJECT_POOL_TYPE>(CBDC_OBJECT_POOL_SUBGROUP);
-    auto shard = capi.get_shard_members<CBDC_OBJECT_POOL_TYPE>(CBDC_OBJECT_POOL_SUBGROUP,shard_index);
+    auto shard_index = capi.get_my_shard();
+    auto shard = capi.get_shard_members(shard_index);
     std::sort(shard.begin(),shard.end());
     return shard[factor % shard.size()] == node_id;
 }
@@ -679,15 +1919,15 @@ void CascadeCBDC::CBDCThread::send_tx_forward(internal_transaction_t* tx,wallet_
     auto mine = is_mine(tx,wallet_id,next_wallet_id);
 
     if(std::get<1>(mine)){ // send directly to the correspoding thread
-        TimestampLogger::log(CBDC_TAG_UDL_FORWARD_START,node_id,txid,wallet_id);
+        CBDC_TRACE(CBDC_TAG_UDL_FORWARD_START,node_id,txid,wallet_id);
 
         // send to corresponding thread
-        TimestampLogger::log(CBDC_TAG_UDL_HANDLER_QUEUING,node_id,txid,next_wallet_id);
-        uint64_t to_thread = next_wallet_id % udl->config.num_threads;
+        CBDC_TRACE(CBDC_TAG_UDL_HANDLER_QUEUING,node_id,txid,next_wallet_id);
+        uint64_t to_thread = CBDC_WALLET_TO_THREAD(udl->config,next_wallet_id,txid);
         queued_operation_t* queued_op = new queued_operation_t(operation_type_t::FORWARD,next_wallet_id,tx);
         udl->threads[to_thread].push_operation(queued_op);
         
-        TimestampLogger::log(CBDC_TAG_UDL_FORWARD_END,node_id,txid,wallet_id);
+        CBDC_TRACE(CBDC_TAG_UDL_FORWARD_END,node_id,txid,wallet_id);
         return;
     }
      
@@ -701,9 +1941,9 @@ void CascadeCBDC::CBDCThread::send_tx_forward(internal_transaction_t* tx,wallet_
     if(udl->config.enable_chaining_thread){
         queued_chain_t queued_chain(operation_type_t::FORWARD,next_wallet_id,request);
         
-        TimestampLogger::log(CBDC_TAG_UDL_FORWARD_START,node_id,txid,wallet_id);
+        CBDC_TRACE(CBDC_TAG_UDL_FORWARD_START,node_id,txid,wallet_id);
         udl->chain_thread->push_chain(queued_chain,std::get<2>(mine));
-        TimestampLogger::log(CBDC_TAG_UDL_FORWARD_END,node_id,txid,wallet_id);
+        CBDC_TRACE(CBDC_TAG_UDL_FORWARD_END,node_id,txid,wallet_id);
         return;
     }
 
@@ -717,140 +1957,621 @@ void CascadeCBDC::CBDCThread::send_tx_forward(internal_transaction_t* tx,wallet_
         },mutils::bytes_size(*request));
 
     // put the object
-    TimestampLogger::log(CBDC_TAG_UDL_FORWARD_START,node_id,txid,wallet_id);
+    CBDC_TRACE(CBDC_TAG_UDL_FORWARD_START,node_id,txid,wallet_id);
     capi.put_and_forget(obj,true);
-    TimestampLogger::log(CBDC_TAG_UDL_FORWARD_END,node_id,txid,wallet_id);
+    CBDC_TRACE(CBDC_TAG_UDL_FORWARD_END,node_id,txid,wallet_id);
+}
+
+void CascadeCBDC::CBDCThread::send_status_backward(internal_transaction_t* tx,wallet_id_t wallet_id){
+    // this node is responsible for chaining the tx, proceed
+    auto request = tx->request;
+    auto& txid = std::get<0>(*request);
+    auto& wallets = std::get<3>(*request);
+
+    // next wallet
+    auto it = std::find(wallets.begin(),wallets.end(),wallet_id);
+    if(it == wallets.end()) return; // this should not happen
+    auto prev_wallet_id = *std::prev(it);
+
+    auto mine = is_mine(tx,wallet_id,prev_wallet_id);
+    
+    if(std::get<1>(mine)){ // send directly to the correspoding thread
+        CBDC_TRACE(CBDC_TAG_UDL_BACKWARD_START,node_id,txid,wallet_id);
+        
+        // send to corresponding thread
+        CBDC_TRACE(CBDC_TAG_UDL_HANDLER_QUEUING,node_id,txid,prev_wallet_id);
+        uint64_t to_thread = CBDC_WALLET_TO_THREAD(udl->config,prev_wallet_id,txid);
+        auto operation = tx->status == transaction_status_t::COMMIT ? operation_type_t::COMMIT : operation_type_t::ABORT;
+        queued_operation_t* queued_op = new queued_operation_t(operation,prev_wallet_id,tx);
+        udl->threads[to_thread].push_operation(queued_op);
+        
+        CBDC_TRACE(CBDC_TAG_UDL_BACKWARD_END,node_id,txid,wallet_id);
+        return;
+    }
+    
+    if(!std::get<0>(mine)){ // this is not the node responsible for forwarding
+        return;
+    }
+    
+    // this node is responsible for chaining the tx, proceed
+
+    // if using the chaining thread
+    if(udl->config.enable_chaining_thread){
+        auto operation = tx->status == transaction_status_t::COMMIT ? operation_type_t::COMMIT : operation_type_t::ABORT;
+        queued_chain_t queued_chain(operation,prev_wallet_id,request);
+        
+        CBDC_TRACE(CBDC_TAG_UDL_BACKWARD_START,node_id,txid,wallet_id);
+        udl->chain_thread->push_chain(queued_chain,std::get<2>(mine));
+        CBDC_TRACE(CBDC_TAG_UDL_BACKWARD_END,node_id,txid,wallet_id);
+        return;
+    }
+
+    // no chaining thread: we need to chain here
+
+    // build the object
+    ObjectWithStringKey obj;
+    if(tx->status == transaction_status_t::COMMIT){
+        obj.key = CBDC_BUILD_COMMIT_KEY(prev_wallet_id);
+    } else if(tx->status == transaction_status_t::ABORT){
+        obj.key = CBDC_BUILD_ABORT_KEY(prev_wallet_id);
+    } else { 
+        // this should not happen
+        return;
+    }
+
+    cbdc_request_t dummy_request(txid,{},{},{});
+    obj.blob = Blob([&dummy_request](uint8_t* buffer,const std::size_t size){
+            return mutils::to_bytes(dummy_request, buffer);
+        },mutils::bytes_size(dummy_request));
+
+    // put the object
+    CBDC_TRACE(CBDC_TAG_UDL_BACKWARD_START,node_id,txid,wallet_id);
+    capi.put_and_forget(obj,true);
+    CBDC_TRACE(CBDC_TAG_UDL_BACKWARD_END,node_id,txid,wallet_id);
+}
+
+// wallet operations
+
+void CascadeCBDC::CBDCThread::cache_wallet(wallet_id_t wallet_id,const wallet_t& wallet){
+    if(wallet_cache.count(wallet_id) == 0){
+        if((udl->config.wallet_cache_capacity > 0) && !is_escrow(wallet_id)){
+            cache_insert(wallet_id);
+        }
+
+        wallet_cache[wallet_id] = wallet;
+        committed_balance[wallet_id] = CBDC_COMPUTE_WALLET_BALANCE(wallet_cache[wallet_id]);
+        virtual_balance[wallet_id] = committed_balance[wallet_id];
+    } else if(udl->config.wallet_cache_capacity > 0){
+        auto it = cache_entries.find(wallet_id);
+        if(it != cache_entries.end()){
+            it->second.referenced = true;
+        }
+    }
+}
+
+void CascadeCBDC::CBDCThread::cache_insert(wallet_id_t wallet_id){
+    wallet_cache_entry_t entry;
+    entry.referenced = true;
+    entry.last_txid = 0;
+    entry.dirty = false; // just loaded: same as the persisted wallet
+
+    if(clock_ring.size() >= udl->config.wallet_cache_capacity){
+        apply_persisted_wallets();
+    }
+
+    // sweep at most twice around the ring (the first pass may only clear the reference bits), and not again until a wallet may have become evictable
+    if((clock_ring.size() >= udl->config.wallet_cache_capacity) && !cache_sweep_failed){
+        for(uint64_t i=0;i<2*clock_ring.size();i++){
+            auto victim = clock_ring[clock_hand];
+            auto& victim_entry = cache_entries.at(victim);
+            if(is_evictable(victim,victim_entry)){
+                evict_wallet(victim);
+                entry.slot = clock_hand;
+                clock_ring[clock_hand] = wallet_id;
+                clock_hand = (clock_hand + 1) % clock_ring.size();
+                cache_entries[wallet_id] = entry;
+                return;
+            }
+
+            victim_entry.referenced = false;
+            clock_hand = (clock_hand + 1) % clock_ring.size();
+        }
+        cache_sweep_failed = true;
+    }
+
+    // below capacity, or all wallets are in use: the cache grows
+    entry.slot = clock_ring.size();
+    clock_ring.push_back(wallet_id);
+    cache_entries[wallet_id] = entry;
+}
+
+bool CascadeCBDC::CBDCThread::is_evictable(wallet_id_t wallet_id,const wallet_cache_entry_t& entry){
+    if(entry.referenced || (wallet_pending.count(wallet_id) > 0) || (fetching_wallets.count(wallet_id) > 0)){
+        return false;
+    }
+
+    // dirty wallets are kept until their last update is persisted, otherwise fetching them again would return old coins
+    return !entry.dirty;
+}
+
+void CascadeCBDC::CBDCThread::apply_persisted_wallets(){
+    std::vector<std::pair<wallet_id_t,transaction_id_t>> persisted;
+    {
+        std::unique_lock<std::mutex> lock(thread_mtx);
+        std::swap(persisted,persisted_queue);
+    }
+
+    // an older update of a wallet that was updated again does not make it clean
+    for(auto& item : persisted){
+        auto it = cache_entries.find(item.first);
+        if((it != cache_entries.end()) && it->second.dirty && (it->second.last_txid == item.second)){
+            it->second.dirty = false;
+            cache_sweep_failed = false;
+        }
+    }
+}
+
+void CascadeCBDC::CBDCThread::evict_wallet(wallet_id_t wallet_id){
+    wallet_cache.erase(wallet_id);
+    committed_balance.erase(wallet_id);
+    virtual_balance.erase(wallet_id);
+    cache_entries.erase(wallet_id);
+}
+
+void CascadeCBDC::CBDCThread::log_cache_status(){
+    CBDC_TRACE(CBDC_TAG_UDL_WALLET_CACHE,node_id,my_thread_id,wallet_cache.size());
+    CBDC_TRACE(CBDC_TAG_UDL_MEMORY,node_id,my_thread_id,resident_memory());
+    last_cache_log = std::chrono::steady_clock::now();
+}
+
+bool CascadeCBDC::CBDCThread::needs_fetch(wallet_id_t wallet_id){
+    // operations behind one that is waiting for the wallet also wait, so they are handled in order
+    if(fetching_wallets.count(wallet_id) > 0){
+        return true;
+    }
+
+    // escrow wallets are recovered into the reserve, and are never evicted
+    if(is_escrow(wallet_id)){
+        return false;
+    }
+
+    // with a bounded cache, an uncached wallet may have been evicted: it is always fetched
+    if(udl->config.wallet_cache_capacity > 0){
+        return wallet_cache.count(wallet_id) == 0;
+    }
+
+    // without recovery, all wallets start with 0 coins
+    if(!udl->config.enable_recovery || partition_loaded){
+        return false;
+    }
+
+    return wallet_cache.count(wallet_id) == 0;
+}
+
+void CascadeCBDC::CBDCThread::fetch_wallet(wallet_id_t wallet_id,queued_operation_t* queued_op){
+    bool first = fetching_wallets.count(wallet_id) == 0;
+    fetching_wallets[wallet_id].push_back(queued_op);
+
+    if(first){
+        queued_fetch_t queued_fetch(my_thread_id,wallet_id);
+        udl->fetch_thread->push_fetch(queued_fetch);
+    }
+}
+
+void CascadeCBDC::CBDCThread::fetched_wallet(wallet_id_t wallet_id,const wallet_t& wallet){
+    // the wallet may have been cached in the meantime: the cached one is more recent
+    cache_wallet(wallet_id,wallet);
+    release_wallet(wallet_id);
+}
+
+void CascadeCBDC::CBDCThread::release_wallet(wallet_id_t wallet_id){
+    auto it = fetching_wallets.find(wallet_id);
+    if(it == fetching_wallets.end()){
+        return;
+    }
+
+    auto waiting = std::move(it->second);
+    fetching_wallets.erase(it);
+    while(!waiting.empty()){
+        auto queued_op = waiting.front();
+
+        // a bulk mint waiting for other wallets keeps this one, with the operations behind it
+        auto bulk_it = bulk_mint_fetches.find(queued_op);
+        if(bulk_it != bulk_mint_fetches.end()){
+            auto& queue = fetching_wallets[wallet_id];
+            queue.splice(queue.begin(),waiting);
+            if(--bulk_it->second.first == 0){
+                bulk_mint_fetched(queued_op); // releases all its wallets, this one included
+            }
+            return;
+        }
+
+        waiting.pop_front();
+        handle_operation(queued_op,0);
+    }
+}
+
+// recovery
+
+void CascadeCBDC::CBDCThread::recover_partition(){
+    CBDC_TRACE(CBDC_TAG_UDL_RECOVERY_START,node_id,my_thread_id,0);
+    std::call_once(udl->recovery_flag,&CascadeCBDC::recover_shared_state,udl);
+
+    std::unordered_map<wallet_id_t,wallet_t> wallets;
+    if(load_snapshot(wallets)){
+        partition_loaded = true;
+    } else if(load_checkpoint(wallets)){
+        partition_loaded = true;
+    } else if(udl->config.enable_recovery_prefetch){
+        udl->fetch_wallets(udl->recovery_partitions[my_thread_id],wallets);
+        partition_loaded = true;
+    }
+
+    for(auto& item : wallets){
+        if((udl->config.wallet_cache_capacity > 0) && (wallet_cache.size() >= udl->config.wallet_cache_capacity)){
+            break; // the remaining wallets are fetched when needed
+        }
+        cache_wallet(item.first,item.second);
+    }
+    
+    CBDC_TRACE(CBDC_TAG_UDL_RECOVERY_END,node_id,my_thread_id,wallets.size());
+}
+
+bool CascadeCBDC::CBDCThread::has_local_state(){
+    bool snapshot = !udl->recovery_snapshot_path.empty() && std::ifstream(snapshot_file()).good();
+    return snapshot || ((checkpoint != nullptr) && checkpoint->exists());
+}
+
+std::string CascadeCBDC::CBDCThread::snapshot_file(){
+    return udl->recovery_snapshot_path + "." + std::to_string(node_id) + "." + std::to_string(my_thread_id);
+}
+
+// snapshot format: num_threads count [wallet_id wallet_size wallet_bytes] ...
+bool CascadeCBDC::CBDCThread::load_snapshot(std::unordered_map<wallet_id_t,wallet_t>& wallets){
+    if(udl->recovery_snapshot_path.empty()){
+        return false;
+    }
+
+    std::ifstream snapshot(snapshot_file(),std::ios::binary);
+    if(!snapshot.good()){
+        return false;
+    }
+
+    // wallets are split among threads by their ID, so the snapshot is only valid with the same number of threads
+    uint64_t num_threads,count;
+    snapshot.read(reinterpret_cast<char*>(&num_threads),sizeof(num_threads));
+    snapshot.read(reinterpret_cast<char*>(&count),sizeof(count));
+    if(!snapshot.good() || (num_threads != udl->config.num_threads)){
+        return false;
+    }
+
+    wallets.reserve(count);
+    std::vector<char> buffer;
+    for(uint64_t i=0;i<count;i++){
+        wallet_id_t wallet_id;
+        uint64_t size;
+        snapshot.read(reinterpret_cast<char*>(&wallet_id),sizeof(wallet_id));
+        snapshot.read(reinterpret_cast<char*>(&size),sizeof(size));
+        buffer.resize(size);
+        snapshot.read(buffer.data(),size);
+        if(!snapshot.good()){
+            wallets.clear();
+            return false;
+        }
+        wallets[wallet_id] = CBDC_WALLET_FROM_BYTES(reinterpret_cast<const uint8_t*>(buffer.data()),size);
+    }
+    snapshot.close();
+
+    // the snapshot is only valid right after a clean stop: remove it, otherwise a crash would recover stale wallets
+    std::remove(snapshot_file().c_str());
+    return true;
+}
+
+bool CascadeCBDC::CBDCThread::load_checkpoint(std::unordered_map<wallet_id_t,wallet_t>& wallets){
+    if(checkpoint == nullptr){
+        return false;
+    }
+
+    if(!checkpoint->recover(udl->config.num_threads,checkpoint_seq,checkpoint_last_txid,wallets)){
+        wallets.clear();
+        return false;
+    }
+
+    return true;
+}
+
+void CascadeCBDC::CBDCThread::write_checkpoint(){
+    CBDC_TRACE(CBDC_TAG_UDL_CHECKPOINT_START,node_id,my_thread_id,checkpoint_seq);
+    
+    // escrow wallets are recovered from the persisted total
+    checkpoint->write(udl->config.num_threads,checkpoint_seq,checkpoint_last_txid,wallet_cache,[&](wallet_id_t wallet_id){ return !is_escrow(wallet_id); });
+    last_checkpoint = std::chrono::steady_clock::now();
+    
+    CBDC_TRACE(CBDC_TAG_UDL_CHECKPOINT_END,node_id,my_thread_id,wallet_cache.size());
+}
+
+void CascadeCBDC::CBDCThread::write_snapshot(){
+    std::ofstream snapshot(snapshot_file(),std::ios::binary | std::ios::trunc);
+    uint64_t num_threads = udl->config.num_threads;
+    uint64_t count = 0;
+    for(auto& item : wallet_cache){
+        count += is_escrow(item.first) ? 0 : 1;
+    }
+    snapshot.write(reinterpret_cast<const char*>(&num_threads),sizeof(num_threads));
+    snapshot.write(reinterpret_cast<const char*>(&count),sizeof(count));
+
+    // escrow wallets are recovered from the persisted total
+    std::vector<uint8_t> buffer;
+    for(auto& item : wallet_cache){
+        if(is_escrow(item.first)){
+            continue;
+        }
+
+        uint64_t size = CBDC_WALLET_BYTES_SIZE(item.second);
+        buffer.resize(size);
+        CBDC_WALLET_TO_BYTES(item.second,buffer.data());
+        snapshot.write(reinterpret_cast<const char*>(&item.first),sizeof(item.first));
+        snapshot.write(reinterpret_cast<const char*>(&size),sizeof(size));
+        snapshot.write(reinterpret_cast<const char*>(buffer.data()),size);
+    }
+}
+
+#ifdef CBDC_COIN_WALLET
+coin_value_t CascadeCBDC::CBDCThread::add_to_wallet(wallet_t &wallet,coin_value_t value){
+    wallet.add(value);
+    return CBDC_COMPUTE_WALLET_BALANCE(wallet);
+}
+
+coin_value_t CascadeCBDC::CBDCThread::remove_from_wallet(wallet_t &wallet,coin_value_t value){
+    // spends the selected coins and keeps the change (a value above the balance should never happen, and empties the wallet)
+    wallet.remove(value);
+    return CBDC_COMPUTE_WALLET_BALANCE(wallet);
+}
+#else
+coin_value_t CascadeCBDC::CBDCThread::add_to_wallet(wallet_t &wallet,coin_value_t value){
+    wallet += value;
+    return CBDC_COMPUTE_WALLET_BALANCE(wallet);
+}
+
+coin_value_t CascadeCBDC::CBDCThread::remove_from_wallet(wallet_t &wallet,coin_value_t value){
+    if(value > wallet){
+        // this should never happen!
+        wallet = 0;
+    } else {
+        wallet -= value;
+    }
+    return CBDC_COMPUTE_WALLET_BALANCE(wallet);
+}
+#endif
+
+// escrow wallets
+
+bool CascadeCBDC::CBDCThread::is_escrow(wallet_id_t wallet_id){
+    return CBDC_IS_ESCROW_WALLET(udl->config,wallet_id);
+}
+
+void CascadeCBDC::CBDCThread::escrow_refill(wallet_id_t wallet_id,coin_value_t value,bool must_cover){
+    auto pool = udl->escrow_pools.at(wallet_id);
+    std::unique_lock<std::mutex> lock(pool->mtx);
+    escrow_settle(wallet_id,pool);
+    escrow_repay(pool);
+
+    if(committed_balance[wallet_id] < value){
+        // take what is missing plus the target sub-balance, so the next TXs do not need to touch the reserve
+        coin_value_t missing = value - committed_balance[wallet_id];
+
+        // not enough coins in the reserve: take the spare coins of the other threads before giving up on the TX
+        for(uint64_t i=0;(i<pool->spare.size()) && (pool->reserve < missing);i++){
+            if(i == my_thread_id){
+                continue;
+            }
+
+            coin_value_t amount = std::min(pool->spare[i],missing - pool->reserve);
+            pool->spare[i] -= amount;
+            pool->taken[i] += amount;
+            pool->sub_balance[i] -= amount;
+            pool->reserve += amount;
+        }
+
+        // replicas: the threads of the chaining node shared the coins differently, and covered the TX: the missing coins are borrowed
+        if((pool->reserve < missing) && must_cover){
+            pool->debt += missing - pool->reserve;
+            pool->reserve = missing;
+        }
+
+        if(pool->reserve >= missing){
+            coin_value_t amount = std::min(pool->reserve,missing + udl->config.escrow_sub_balance_target);
+            pool->reserve -= amount;
+            add_to_wallet(wallet_cache[wallet_id],amount);
+            committed_balance[wallet_id] += amount;
+            virtual_balance[wallet_id] += amount;
+            pool->sub_balance[my_thread_id] = committed_balance[wallet_id];
+        }
+    }
+
+    // the coins of this TX are not spare until it finishes (it runs right after this check, if valid)
+    pool->spare[my_thread_id] = (virtual_balance[wallet_id] > value) ? virtual_balance[wallet_id] - value : 0;
+}
+
+void CascadeCBDC::CBDCThread::escrow_settle(wallet_id_t wallet_id,escrow_pool_t* pool){
+    // the taken coins were spare, so they are not needed by any running TX of this thread
+    coin_value_t taken = pool->taken[my_thread_id];
+    if(taken > 0){
+        remove_from_wallet(wallet_cache[wallet_id],taken);
+        committed_balance[wallet_id] -= taken;
+        virtual_balance[wallet_id] -= taken;
+        pool->taken[my_thread_id] = 0;
+    }
+
+    pool->sub_balance[my_thread_id] = committed_balance[wallet_id];
+    pool->spare[my_thread_id] = std::min(committed_balance[wallet_id],virtual_balance[wallet_id]);
+}
+
+void CascadeCBDC::CBDCThread::escrow_repay(escrow_pool_t* pool){
+    coin_value_t amount = std::min(pool->reserve,pool->debt);
+    pool->reserve -= amount;
+    pool->debt -= amount;
+}
+
+coin_value_t CascadeCBDC::CBDCThread::escrow_total(escrow_pool_t* pool){
+    coin_value_t total = pool->reserve;
+    for(auto sub_balance : pool->sub_balance){
+        total += sub_balance;
+    }
+    return total - pool->debt;
 }
 
-void CascadeCBDC::CBDCThread::send_status_backward(internal_transaction_t* tx,wallet_id_t wallet_id){
-    // this node is responsible for chaining the tx, proceed
-    auto request = tx->request;
-    auto& txid = std::get<0>(*request);
-    auto& wallets = std::get<3>(*request);
-
-    // next wallet
-    auto it = std::find(wallets.begin(),wallets.end(),wallet_id);
-    if(it == wallets.end()) return; // this should not happen
-    auto prev_wallet_id = *std::prev(it);
+void CascadeCBDC::CBDCThread::escrow_rebalance(wallet_id_t wallet_id){
+    auto target = udl->config.escrow_sub_balance_target;
 
-    auto mine = is_mine(tx,wallet_id,prev_wallet_id);
-    
-    if(std::get<1>(mine)){ // send directly to the correspoding thread
-        TimestampLogger::log(CBDC_TAG_UDL_BACKWARD_START,node_id,txid,wallet_id);
-        
-        // send to corresponding thread
-        TimestampLogger::log(CBDC_TAG_UDL_HANDLER_QUEUING,node_id,txid,prev_wallet_id);
-        uint64_t to_thread = prev_wallet_id % udl->config.num_threads;
-        auto operation = tx->status == transaction_status_t::COMMIT ? operation_type_t::COMMIT : operation_type_t::ABORT;
-        queued_operation_t* queued_op = new queued_operation_t(operation,prev_wallet_id,tx);
-        udl->threads[to_thread].push_operation(queued_op);
-        
-        TimestampLogger::log(CBDC_TAG_UDL_BACKWARD_END,node_id,txid,wallet_id);
+    // coins can only be returned if there are no running TXs taking coins from this sub-balance
+    if(virtual_balance[wallet_id] != committed_balance[wallet_id]){
         return;
     }
-    
-    if(!std::get<0>(mine)){ // this is not the node responsible for forwarding
+
+    // keep some slack above the target, otherwise credits and debits would move coins back and forth all the time
+    if(committed_balance[wallet_id] <= 2 * target){
         return;
     }
-    
-    // this node is responsible for chaining the tx, proceed
 
-    // if using the chaining thread
-    if(udl->config.enable_chaining_thread){
-        auto operation = tx->status == transaction_status_t::COMMIT ? operation_type_t::COMMIT : operation_type_t::ABORT;
-        queued_chain_t queued_chain(operation,prev_wallet_id,request);
-        
-        TimestampLogger::log(CBDC_TAG_UDL_BACKWARD_START,node_id,txid,wallet_id);
-        udl->chain_thread->push_chain(queued_chain,std::get<2>(mine));
-        TimestampLogger::log(CBDC_TAG_UDL_BACKWARD_END,node_id,txid,wallet_id);
+    auto pool = udl->escrow_pools.at(wallet_id);
+    std::unique_lock<std::mutex> lock(pool->mtx);
+    escrow_settle(wallet_id,pool);
+    if(committed_balance[wallet_id] <= 2 * target){
         return;
     }
+    
+    coin_value_t amount = committed_balance[wallet_id] - target;
+    pool->reserve += amount;
+    escrow_repay(pool);
+    remove_from_wallet(wallet_cache[wallet_id],amount);
+    committed_balance[wallet_id] -= amount;
+    virtual_balance[wallet_id] -= amount;
+    pool->sub_balance[my_thread_id] = committed_balance[wallet_id];
+    pool->spare[my_thread_id] = committed_balance[wallet_id];
+}
 
-    // no chaining thread: we need to chain here
-
-    // build the object
-    ObjectWithStringKey obj;
-    if(tx->status == transaction_status_t::COMMIT){
-        obj.key = CBDC_BUILD_COMMIT_KEY(prev_wallet_id);
-    } else if(tx->status == transaction_status_t::ABORT){
-        obj.key = CBDC_BUILD_ABORT_KEY(prev_wallet_id);
-    } else { 
-        // this should not happen
-        return;
+bool CascadeCBDC::CBDCThread::awaits_escrow(internal_transaction_t* tx,wallet_id_t wallet_id){
+    auto request = tx->request;
+    auto& txid = std::get<0>(*request);
+    auto& sources = std::get<1>(*request);
+    if(!is_escrow(wallet_id) || (sources.count(wallet_id) == 0) || is_my_persistence(0)){
+        return false;
     }
 
-    cbdc_request_t dummy_request(txid,{},{},{});
-    obj.blob = Blob([&dummy_request](uint8_t* buffer,const std::size_t size){
-            return mutils::to_bytes(dummy_request, buffer);
-        },mutils::bytes_size(dummy_request));
+    auto outcomes_it = escrow_outcomes.find(txid);
+    if((outcomes_it != escrow_outcomes.end()) && (outcomes_it->second.count(wallet_id) > 0)){
+        return false;
+    }
 
-    // put the object
-    TimestampLogger::log(CBDC_TAG_UDL_BACKWARD_START,node_id,txid,wallet_id);
-    capi.put_and_forget(obj,true);
-    TimestampLogger::log(CBDC_TAG_UDL_BACKWARD_END,node_id,txid,wallet_id);
+    // the TX keeps its place in the wallet queue, so the TXs behind it wait too
+    escrow_waiting[txid][wallet_id] = tx;
+    return true;
 }
 
-// wallet operations
+void CascadeCBDC::CBDCThread::send_escrow_outcome(internal_transaction_t* tx,wallet_id_t wallet_id,bool covered){
+    auto shard_index = capi.get_my_shard();
+    if(capi.get_shard_members(shard_index).size() < 2){
+        return; // no other replicas
+    }
 
-void CascadeCBDC::CBDCThread::fetch_wallet(wallet_id_t wallet_id){
-    wallet_cache[wallet_id] = 0;
+    // as admission decisions: only the txid, the key has the wallet and the outcome
+    auto& txid = std::get<0>(*tx->request);
+    cbdc_request_t request(txid,{},{},{});
+    ObjectWithStringKey obj;
+    obj.key = covered ? CBDC_BUILD_ESCROW_COVERED_KEY(wallet_id) : CBDC_BUILD_ESCROW_UNCOVERED_KEY(wallet_id);
+    obj.message_id = txid;
+    obj.blob = Blob([&request](uint8_t* buffer,const std::size_t size){
+            return mutils::to_bytes(request, buffer);
+        },mutils::bytes_size(request));
 
-    /* TODO
-     * For now, we always start the service with new wallets, even if there were already balances stored in the K/V store.
-     * This is just for convenience: it makes it easier to run the benchmarks while we are still just evaluating performance.
-     * However, in a real deployment, a recovering node should fetch an existing wallet using the code below.
-     *
-    ServiceClientAPI& capi = ServiceClientAPI::get_service_client();
-    const std::string& key = CBDC_BUILD_WALLET_KEY(wallet_id);
+    capi.put_and_forget_to_shard(obj,shard_index,true);
+}
 
-    auto res = capi.get(key,CURRENT_VERSION,false);
-    for (auto& reply_future : res.get()){
-        auto& obj = reply_future.second.get();
+void CascadeCBDC::CBDCThread::escrow_decided(const transaction_id_t& txid,wallet_id_t wallet_id,bool covered){
+    escrow_outcomes[txid][wallet_id] = covered;
 
-        if(obj.version != INVALID_VERSION){
-            wallet_cache[wallet_id] = std::move(*mutils::from_bytes<wallet_t>(nullptr,obj.blob.bytes));
-            //wallet_cache[wallet_id] = *reinterpret_cast<const wallet_t *>(obj.blob.bytes);
-        } else {
-            // create a wallet with 0 coins
-            wallet_cache[wallet_id] = 0;
-        }
+    auto waiting_it = escrow_waiting.find(txid);
+    if((waiting_it == escrow_waiting.end()) || (waiting_it->second.count(wallet_id) == 0)){
+        return; // the TX did not run here yet
     }
-    */
-}
-
-coin_value_t CascadeCBDC::CBDCThread::add_to_wallet(wallet_t &wallet,coin_value_t value){
-    wallet += value;
-    return CBDC_COMPUTE_WALLET_BALANCE(wallet);
-}
 
-coin_value_t CascadeCBDC::CBDCThread::remove_from_wallet(wallet_t &wallet,coin_value_t value){
-    if(value > wallet){
-        // this should never happen!
-        wallet = 0;
-    } else {
-        wallet -= value;
+    auto tx = waiting_it->second.at(wallet_id);
+    waiting_it->second.erase(wallet_id);
+    if(waiting_it->second.empty()){
+        escrow_waiting.erase(waiting_it);
     }
-    return CBDC_COMPUTE_WALLET_BALANCE(wallet);
+    tx_run_recursive(tx,wallet_id);
 }
 
 void CascadeCBDC::CBDCThread::persist_wallet(wallet_id_t wallet_id,internal_transaction_t* tx){
-    auto& wallet = wallet_cache[wallet_id];
+    wallet_t wallet = wallet_cache[wallet_id];
     auto request = tx->request;
     auto& txid = std::get<0>(*request);
 
+    // the wallet cannot be evicted until this update is persisted (see wallets_persisted)
+    if(udl->config.wallet_cache_capacity > 0){
+        auto it = cache_entries.find(wallet_id);
+        if(it != cache_entries.end()){
+            it->second.last_txid = txid;
+            it->second.dirty = true;
+        }
+    }
+
+    // local log of the updates since the last checkpoint (in all replicas)
+    if((checkpoint != nullptr) && !is_escrow(wallet_id)){
+        checkpoint_seq++;
+        checkpoint_last_txid = txid;
+        checkpoint->log_wallet(checkpoint_seq,wallet_id,wallet);
+    }
+
     // check if this node is responsible for this persistence
     //if(!is_my_persistence(wallet_id)){
     if(!is_my_persistence(0)){ // batching is improved if it is always the same node
         return;
     }
 
+    // escrow wallets are persisted with the coins of all threads: the total is computed under the pool lock, and the
+    // puts wait for their turn instead, so the persisted totals stay in order while the other threads use the pool
+    escrow_pool_t* pool = nullptr;
+    std::unique_lock<std::mutex> persist_lock;
+    if(is_escrow(wallet_id)){
+        pool = udl->escrow_pools.at(wallet_id);
+        uint64_t ticket;
+        {
+            std::unique_lock<std::mutex> escrow_lock(pool->mtx);
+            wallet = CBDC_WALLET_FROM_BALANCE(escrow_total(pool)); // a single coin with coin wallets
+            ticket = pool->persist_ticket++;
+        }
+
+        persist_lock = std::unique_lock<std::mutex>(pool->persist_mtx);
+        pool->persist_turn.wait(persist_lock,[&](){ return pool->persist_next == ticket; });
+    }
+    auto escrow_persisted = [&](){
+        if(pool != nullptr){
+            pool->persist_next++;
+            pool->persist_turn.notify_all();
+        }
+    };
+
     // if using the wallet persistence thread
     if(udl->config.enable_wallet_persistence_thread){
-        queued_wallet_t queued_wallet(wallet_id,wallet,txid);
+        auto& sources = std::get<1>(*request);
+        auto& destinations = std::get<2>(*request);
+        int64_t delta = 0;
+        if(destinations.count(wallet_id) > 0){
+            delta += destinations[wallet_id];
+        }
+        if(sources.count(wallet_id) > 0){
+            delta -= sources[wallet_id];
+        }
+
+        queued_wallet_t queued_wallet(wallet_id,wallet,txid,delta);
         
-        TimestampLogger::log(CBDC_TAG_UDL_WALLET_PERSIST_START,node_id,txid,wallet_id);
+        CBDC_TRACE(CBDC_TAG_UDL_WALLET_PERSIST_START,node_id,txid,wallet_id);
         udl->wallet_thread->push_wallet(queued_wallet);
-        TimestampLogger::log(CBDC_TAG_UDL_WALLET_PERSIST_END,node_id,txid,wallet_id);
+        CBDC_TRACE(CBDC_TAG_UDL_WALLET_PERSIST_END,node_id,txid,wallet_id);
+        escrow_persisted();
         return;
     }
 
@@ -861,13 +2582,15 @@ void CascadeCBDC::CBDCThread::persist_wallet(wallet_id_t wallet_id,internal_tran
     obj.key = CBDC_BUILD_WALLET_KEY(wallet_id);
     obj.message_id = txid;
     obj.blob = Blob([&wallet](uint8_t* buffer,const std::size_t size){
-            return mutils::to_bytes(wallet, buffer);
-        },mutils::bytes_size(wallet));
+            return CBDC_WALLET_TO_BYTES(wallet, buffer);
+        },CBDC_WALLET_BYTES_SIZE(wallet));
 
     // put the object
-    TimestampLogger::log(CBDC_TAG_UDL_WALLET_PERSIST_START,node_id,txid,wallet_id);
+    CBDC_TRACE(CBDC_TAG_UDL_WALLET_PERSIST_START,node_id,txid,wallet_id);
     capi.put_and_forget(obj);
-    TimestampLogger::log(CBDC_TAG_UDL_WALLET_PERSIST_END,node_id,txid,wallet_id);
+    udl->announce_persisted(persisted_wallets_t{std::make_tuple(wallet_id,txid)});
+    CBDC_TRACE(CBDC_TAG_UDL_WALLET_PERSIST_END,node_id,txid,wallet_id);
+    escrow_persisted();
 }
 
 // transaction persistence: happens after the first wallet commits or aborts
@@ -880,16 +2603,24 @@ void CascadeCBDC::CBDCThread::persist_transaction(internal_transaction_t* tx){
     if(!is_my_persistence(0)){ // batching is improved if it is always the same node
         return;
     }
+
+    if(udl->capture != nullptr){
+        udl->capture->record_outcome(txid,tx->status);
+    }
+
+    // the TX is final: the client does not need to wait for it to be persisted
+    if(udl->config.enable_notifications){
+        udl->notification_thread->push_completion(txid,tx->status);
+    }
     
     std::string key = CBDC_BUILD_TRANSACTION_KEY(txid);
-    uint32_t subgroup_type_index,subgroup_index,shard_index;
-    std::tie(subgroup_type_index,subgroup_index,shard_index) = capi.key_to_shard(key);
+    uint32_t shard_index = capi.key_to_shard(key);
 
     // if using the tx persistence thread
     if(udl->config.enable_tx_persistence_thread){
-        TimestampLogger::log(CBDC_TAG_UDL_TX_PERSIST_START,node_id,txid,shard_index);
+        CBDC_TRACE(CBDC_TAG_UDL_TX_PERSIST_START,node_id,txid,shard_index);
         udl->tx_thread->push_tx(tx,shard_index);
-        TimestampLogger::log(CBDC_TAG_UDL_TX_PERSIST_END,node_id,txid,shard_index);
+        CBDC_TRACE(CBDC_TAG_UDL_TX_PERSIST_END,node_id,txid,shard_index);
         return;
     }
 
@@ -903,14 +2634,14 @@ void CascadeCBDC::CBDCThread::persist_transaction(internal_transaction_t* tx){
             return mutils::to_bytes(persisted_tx, buffer);
         },mutils::bytes_size(persisted_tx));
  
-    TimestampLogger::log(CBDC_TAG_UDL_TX_PERSIST_START,node_id,txid,shard_index);
-    capi.put_and_forget<CBDC_OBJECT_POOL_TYPE>(obj,subgroup_index,shard_index);
-    TimestampLogger::log(CBDC_TAG_UDL_TX_PERSIST_END,node_id,txid,shard_index);
+    CBDC_TRACE(CBDC_TAG_UDL_TX_PERSIST_START,node_id,txid,shard_index);
+    capi.put_and_forget_to_shard(obj,shard_index);
+    CBDC_TRACE(CBDC_TAG_UDL_TX_PERSIST_END,node_id,txid,shard_index);
 }
 
 // wallet persistence thread methods
 
-CascadeCBDC::WalletPersistenceThread::WalletPersistenceThread(CascadeCBDC* udl){
+CascadeCBDC::WalletPersistenceThread::WalletPersistenceThread(CascadeCBDC* udl): capi(*udl->service){
     this->udl = udl;
     node_id = capi.get_my_id();
 }
@@ -931,6 +2662,7 @@ void CascadeCBDC::WalletPersistenceThread::reset(){
     while(!wallet_queue.empty()){
         wallet_queue.pop();
     }
+    delta_seq_loaded = false;
 }
 
 void CascadeCBDC::WalletPersistenceThread::main_loop(){
@@ -966,9 +2698,12 @@ void CascadeCBDC::WalletPersistenceThread::main_loop(){
         lock.unlock();
 
         // now we are outside the locked region (i.e the cbdc protocol can continue): build objects and call put_objects
-        if(persist_count > 0){
+        if((persist_count > 0) && udl->config.enable_delta_persistence){
+            put_deltas(to_persist,persist_count);
+        } else if(persist_count > 0){
             std::vector<ObjectWithStringKey> objects;
             objects.reserve(persist_count);
+            uint64_t bytes = 0;
 
             for(uint64_t i=0;i<persist_count;i++){
                 auto& queued_wallet = to_persist[i];
@@ -976,23 +2711,246 @@ void CascadeCBDC::WalletPersistenceThread::main_loop(){
                 auto& wallet = std::get<1>(queued_wallet);
                 auto& txid = std::get<2>(queued_wallet);
 
-                std::size_t sz = mutils::bytes_size(wallet);
+                std::size_t sz = CBDC_WALLET_BYTES_SIZE(wallet);
                 uint8_t* buffer = new uint8_t[sz];
-                mutils::to_bytes(wallet, buffer);
+                CBDC_WALLET_TO_BYTES(wallet, buffer);
+                bytes += sz;
 
                 objects.emplace_back(CBDC_BUILD_WALLET_KEY(wallet_id),Blob(buffer,sz));
                 objects[i].message_id = txid;
             }
             
-            TimestampLogger::log(CBDC_TAG_UDL_WALLET_BATCHING,node_id,objects.size(),0);
+            CBDC_TRACE(CBDC_TAG_UDL_WALLET_BATCHING,node_id,objects.size(),0);
+            CBDC_TRACE(CBDC_TAG_UDL_WALLET_BYTES,node_id,0,bytes);
+            capi.put_objects_and_forget(objects);
+        }
+
+        // with a bounded cache, the threads can evict the wallets of this batch once the puts are delivered
+        if((persist_count > 0) && (udl->config.wallet_cache_capacity > 0)){
+            persisted_wallets_t persisted;
+            persisted.reserve(persist_count);
+            for(uint64_t i=0;i<persist_count;i++){
+                persisted.emplace_back(std::get<0>(to_persist[i]),std::get<2>(to_persist[i]));
+            }
+            udl->announce_persisted(persisted);
+        }
+    }
+}
+
+void CascadeCBDC::WalletPersistenceThread::put_deltas(queued_wallet_t* to_persist,uint64_t persist_count){
+    // continue the sequence of a previous run: batches are read in sequence until a missing one
+    if(!delta_seq_loaded){
+        shard_index = capi.get_my_shard();
+        std::vector<std::pair<uint64_t,wallet_delta_batch_t>> batches;
+        delta_seq = udl->fetch_deltas(shard_index,udl->fetch_compacted_seq(shard_index),batches);
+        delta_seq_loaded = true;
+    }
+
+    // a single object with the changes of all wallets in the batch, instead of one full wallet per key
+    wallet_delta_batch_t batch;
+    batch.reserve(persist_count);
+    std::vector<std::pair<wallet_id_t,wallet_t>> images;
+    images.reserve(persist_count);
+    for(uint64_t i=0;i<persist_count;i++){
+        auto& queued_wallet = to_persist[i];
+        batch.emplace_back(std::get<0>(queued_wallet),std::get<3>(queued_wallet),std::get<2>(queued_wallet));
+        images.emplace_back(std::get<0>(queued_wallet),std::get<1>(queued_wallet));
+    }
+
+    delta_seq++;
+    std::size_t sz = mutils::bytes_size(batch);
+    uint8_t* buffer = new uint8_t[sz];
+    mutils::to_bytes(batch, buffer);
+
+    ObjectWithStringKey obj(CBDC_BUILD_DELTA_KEY(shard_index,delta_seq),Blob(buffer,sz));
+    obj.message_id = delta_seq;
+
+    CBDC_TRACE(CBDC_TAG_UDL_WALLET_BATCHING,node_id,persist_count,0);
+    CBDC_TRACE(CBDC_TAG_UDL_WALLET_BYTES,node_id,delta_seq,sz);
+    capi.put_and_forget_to_shard(obj,shard_index);
+
+    udl->compaction_thread->push_images(images,delta_seq);
+}
+
+// delta compaction thread methods
+
+CascadeCBDC::DeltaCompactionThread::DeltaCompactionThread(CascadeCBDC* udl): capi(*udl->service){
+    this->udl = udl;
+    node_id = capi.get_my_id();
+}
+
+void CascadeCBDC::DeltaCompactionThread::push_images(std::vector<std::pair<wallet_id_t,wallet_t>>& wallets,uint64_t seq){
+    std::unique_lock<std::mutex> lock(thread_mtx);
+    for(auto& item : wallets){
+        images[item.first] = item.second;
+    }
+    last_seq = seq;
+}
+
+void CascadeCBDC::DeltaCompactionThread::signal_stop(){
+    std::unique_lock<std::mutex> lock(thread_mtx);
+    running = false;
+    thread_signal.notify_all();
+}
+
+void CascadeCBDC::DeltaCompactionThread::reset(){
+    std::unique_lock<std::mutex> lock(thread_mtx);
+    images.clear();
+    last_seq = 0;
+    compacted_seq_loaded = false;
+}
+
+void CascadeCBDC::DeltaCompactionThread::main_loop(){
+    if(!running) return;
+
+    auto interval = std::chrono::milliseconds(udl->config.delta_compaction_interval_ms);
+    while(true){
+        std::unique_lock<std::mutex> lock(thread_mtx);
+        thread_signal.wait_for(lock,interval);
+        if(!running) break;
+        lock.unlock();
+
+        compact();
+    }
+
+    // wallets changed since the last compaction
+    compact();
+}
+
+void CascadeCBDC::DeltaCompactionThread::compact(){
+    std::unordered_map<wallet_id_t,wallet_t> to_compact;
+    uint64_t seq;
+    bool load;
+    {
+        std::unique_lock<std::mutex> lock(thread_mtx);
+        to_compact.swap(images);
+        seq = last_seq;
+        load = !compacted_seq_loaded;
+        compacted_seq_loaded = true;
+    }
+
+    if(to_compact.empty()){
+        return;
+    }
+
+    // continue the removals of a previous run (or after a reset)
+    auto shard_index = capi.get_my_shard();
+    if(load){
+        compacted_seq = udl->fetch_compacted_seq(shard_index);
+        removed_seq = udl->fetch_removed_seq(shard_index,compacted_seq);
+    }
+
+    // each wallet is written once per compaction, no matter how many deltas it had: the image carries the last batch it includes
+    uint64_t bytes = 0;
+    std::vector<ObjectWithStringKey> objects;
+    objects.reserve(std::min(to_compact.size(),udl->config.wallet_persistence_batch_max_size));
+    for(auto& item : to_compact){
+        std::size_t sz = CBDC_WALLET_IMAGE_BYTES_SIZE(item.second);
+        uint8_t* buffer = new uint8_t[sz];
+        CBDC_WALLET_IMAGE_TO_BYTES(item.second,seq,buffer);
+        bytes += sz;
+
+        objects.emplace_back(CBDC_BUILD_WALLET_KEY(item.first),Blob(buffer,sz));
+        if(objects.size() >= udl->config.wallet_persistence_batch_max_size){
             capi.put_objects_and_forget(objects);
+            objects.clear();
+        }
+    }
+    if(!objects.empty()){
+        capi.put_objects_and_forget(objects);
+    }
+
+    // readers take the deltas after this batch for wallets without an image
+    std::size_t sz = mutils::bytes_size(seq);
+    uint8_t* buffer = new uint8_t[sz];
+    mutils::to_bytes(seq, buffer);
+    ObjectWithStringKey obj(CBDC_BUILD_DELTA_COMPACTED_KEY(shard_index),Blob(buffer,sz));
+    obj.message_id = seq;
+    capi.put_and_forget_to_shard(obj,shard_index);
+    bytes += sz;
+
+    // readers start after the marker they read (or a later image), so the batches up to the previous marker are no longer
+    // read: they are removed one compaction behind, which leaves a compaction interval to readers of the previous marker
+    for(uint64_t i=removed_seq+1;i<=compacted_seq;i++){
+        capi.remove_and_forget(CBDC_BUILD_DELTA_KEY(shard_index,i),shard_index);
+    }
+    removed_seq = compacted_seq;
+    compacted_seq = seq;
+
+    CBDC_TRACE(CBDC_TAG_UDL_COMPACTION_BYTES,node_id,seq,bytes);
+}
+
+// wallet fetch thread methods
+
+CascadeCBDC::WalletFetchThread::WalletFetchThread(CascadeCBDC* udl){
+    this->udl = udl;
+    node_id = udl->service->get_my_id();
+}
+
+void CascadeCBDC::WalletFetchThread::push_fetch(queued_fetch_t &queued_fetch){
+    std::unique_lock<std::mutex> lock(thread_mtx);
+    fetch_queue.push(queued_fetch);
+    thread_signal.notify_all();
+}
+
+void CascadeCBDC::WalletFetchThread::signal_stop(){
+    std::unique_lock<std::mutex> lock(thread_mtx);
+    running = false;
+    thread_signal.notify_all();
+}
+
+void CascadeCBDC::WalletFetchThread::reset(){
+    std::unique_lock<std::mutex> lock(thread_mtx);
+    while(!fetch_queue.empty()){
+        fetch_queue.pop();
+    }
+}
+
+void CascadeCBDC::WalletFetchThread::main_loop(){
+    if(!running) return;
+   
+    // thread main loop: fetch all requested wallets concurrently, then give each one back to the thread that requested it
+    while(true){
+        std::unique_lock<std::mutex> lock(thread_mtx);
+        if(fetch_queue.empty()){
+            thread_signal.wait(lock);
+        }
+
+        if(!running) break;
+
+        std::vector<queued_fetch_t> to_fetch;
+        uint64_t fetch_count = std::min((uint64_t)fetch_queue.size(),std::max(udl->config.recovery_batch_size,(uint64_t)1));
+        to_fetch.reserve(fetch_count);
+        for(uint64_t i=0;i<fetch_count;i++){
+            to_fetch.push_back(fetch_queue.front());
+            fetch_queue.pop();
+        }
+        
+        lock.unlock();
+
+        if(to_fetch.empty()){
+            continue;
+        }
+
+        std::vector<wallet_id_t> wallet_ids;
+        wallet_ids.reserve(to_fetch.size());
+        for(auto& item : to_fetch){
+            wallet_ids.push_back(item.second);
+        }
+
+        CBDC_TRACE(CBDC_TAG_UDL_WALLET_FETCH,node_id,to_fetch.size(),0);
+        std::unordered_map<wallet_id_t,wallet_t> wallets;
+        udl->fetch_wallets(wallet_ids,wallets);
+
+        for(auto& item : to_fetch){
+            udl->threads[item.first].push_fetched_wallet(item.second,wallets[item.second]);
         }
     }
 }
 
 // chaining thread methods
 
-CascadeCBDC::ChainingThread::ChainingThread(CascadeCBDC* udl){
+CascadeCBDC::ChainingThread::ChainingThread(CascadeCBDC* udl): capi(*udl->service){
     this->udl = udl;
     node_id = capi.get_my_id();
 }
@@ -1101,14 +3059,14 @@ void CascadeCBDC::ChainingThread::main_loop(){
                 objects[i].message_id = txid;
             }
 
-            TimestampLogger::log(CBDC_TAG_UDL_CHAIN_BATCHING,node_id,objects.size(),shard);
-            capi.put_objects_and_forget<CBDC_OBJECT_POOL_TYPE>(objects,CBDC_OBJECT_POOL_SUBGROUP,shard,true);
+            CBDC_TRACE(CBDC_TAG_UDL_CHAIN_BATCHING,node_id,objects.size(),shard);
+            capi.put_objects_and_forget_to_shard(objects,shard,true);
         }
     }
 }
 
 // tx persistence thread methods
-CascadeCBDC::TXPersistenceThread::TXPersistenceThread(CascadeCBDC* udl){
+CascadeCBDC::TXPersistenceThread::TXPersistenceThread(CascadeCBDC* udl): capi(*udl->service){
     this->udl = udl;
     node_id = capi.get_my_id();
 }
@@ -1202,12 +3160,126 @@ void CascadeCBDC::TXPersistenceThread::main_loop(){
                 objects[i].message_id = txid;
             }
 
-            TimestampLogger::log(CBDC_TAG_UDL_TX_BATCHING,node_id,objects.size(),shard);
-            capi.put_objects_and_forget<CBDC_OBJECT_POOL_TYPE>(objects,CBDC_OBJECT_POOL_SUBGROUP,shard);
+            CBDC_TRACE(CBDC_TAG_UDL_TX_BATCHING,node_id,objects.size(),shard);
+            capi.put_objects_and_forget_to_shard(objects,shard);
+        }
+    }
+}
+
+// notification thread methods
+CascadeCBDC::NotificationThread::NotificationThread(CascadeCBDC* udl): capi(*udl->service){
+    this->udl = udl;
+    node_id = capi.get_my_id();
+}
+
+void CascadeCBDC::NotificationThread::push_completion(transaction_id_t txid,transaction_status_t status){
+    std::unique_lock<std::mutex> lock(thread_mtx);
+    completion_queues[CBDC_TXID_TO_CLIENT(txid)].emplace_back(txid,status);
+    thread_signal.notify_all();
+}
+
+void CascadeCBDC::NotificationThread::signal_stop(){
+    std::unique_lock<std::mutex> lock(thread_mtx);
+    running = false;
+    thread_signal.notify_all();
+}
+
+void CascadeCBDC::NotificationThread::reset(){
+    std::unique_lock<std::mutex> lock(thread_mtx);
+    completion_queues.clear();
+}
+
+void CascadeCBDC::NotificationThread::main_loop(){
+    if(!running) return;
+   
+    // thread main loop: each client gets a notification when its batch is full or its oldest completion waited batch_time
+    std::unordered_map<node_id_t,std::chrono::steady_clock::time_point> wait_time;
+    std::vector<std::pair<node_id_t,tx_completion_batch_t>> to_notify;
+    auto batch_time = std::chrono::microseconds(udl->config.notification_batch_time_us);
+    while(true){
+        std::unique_lock<std::mutex> lock(thread_mtx);
+        bool empty = true;
+        for(auto& item : completion_queues){
+            empty = empty && item.second.empty();
+        }
+
+        if(empty){
+            thread_signal.wait(lock,[&](){ return !running || !completion_queues.empty(); });
+        } else {
+            thread_signal.wait_for(lock,batch_time);
+        }
+
+        if(!running) break;
+
+        auto now = std::chrono::steady_clock::now();
+        for(auto it = completion_queues.begin(); it != completion_queues.end();){
+            auto& client = it->first;
+            auto& queue = it->second;
+
+            if(wait_time.count(client) == 0){
+                wait_time[client] = now;
+            }
+
+            if((queue.size() >= udl->config.notification_batch_max_size) || ((now-wait_time[client]) >= batch_time)){
+                to_notify.emplace_back(client,std::move(queue));
+                wait_time.erase(client);
+                it = completion_queues.erase(it);
+            } else {
+                it++;
+            }
+        }
+        
+        lock.unlock();
+        
+        // now we are outside the locked region (i.e the cbdc protocol can continue): send the notifications
+        for(auto& item : to_notify){
+            auto& client = item.first;
+            auto& batch = item.second;
+
+            // a batch above the maximum size (built up while the previous notifications were sent) is split
+            for(uint64_t offset=0;offset<batch.size();offset+=udl->config.notification_batch_max_size){
+                tx_completion_batch_t part(batch.begin() + offset,batch.begin() + std::min(offset + udl->config.notification_batch_max_size,(uint64_t)batch.size()));
+                Blob blob([&part](uint8_t* buffer,const std::size_t size){
+                        return mutils::to_bytes(part, buffer);
+                    },mutils::bytes_size(part));
+
+                CBDC_TRACE(CBDC_TAG_UDL_NOTIFICATION_BATCHING,node_id,part.size(),client);
+                capi.notify(blob,client);
+            }
         }
+        to_notify.clear();
     }
 }
 
+// UDL entry points
+
+std::shared_ptr<OffCriticalDataPathObserver> CascadeCBDC::ocdpo_ptr;
+
+void initialize(ICascadeContext* ctxt) {
+    //initialize observer
+    CascadeCBDC::initialize();
+}
+
+std::shared_ptr<OffCriticalDataPathObserver> get_observer(
+        ICascadeContext* ctxt,const nlohmann::json& config) {
+    auto typed_ctxt = dynamic_cast<DefaultCascadeContextType*>(ctxt);
+    std::static_pointer_cast<CascadeCBDC>(CascadeCBDC::get())->set_config(typed_ctxt,config);
+    return CascadeCBDC::get();
+}
+
+void release(ICascadeContext* ctxt) {
+    std::static_pointer_cast<CascadeCBDC>(CascadeCBDC::get())->stop();
+    return;
+}
+
+std::string get_uuid() {
+    return UDL_UUID;
+}
+
+std::string get_description() {
+    return UDL_DESC;
+}
+
 } // namespace cascade
 } // namespace derecho
 
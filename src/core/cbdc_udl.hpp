@@ -5,6 +5,7 @@
 #include <cascade/utils.hpp>
 #include <iostream>
 #include <string>
+#include <sstream>
 #include <algorithm>
 #include <utility>
 #include <tuple>
@@ -17,8 +18,15 @@
 #include <deque>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <chrono>
+#include <fstream>
+#include <unistd.h>
 #include "common.hpp"
+#include "cbdc_trace.hpp"
+#include "wallet_checkpoint.hpp"
+#include "request_capture.hpp"
+#include "cbdc_service_client.hpp"
 
 enum class operation_type_t : uint8_t {
     NONE,
@@ -27,23 +35,69 @@ enum class operation_type_t : uint8_t {
     REDEEM,
     FORWARD,
     COMMIT,
-    ABORT
+    ABORT,
+    BULK_MINT,
+    DIGEST,
+    ADMIT,
+    REJECT,
+    ESCROW_COVERED,
+    ESCROW_UNCOVERED
 };
 
 using internal_transaction_t = struct internal_transaction_t {
     cbdc_request_t *request;
     transaction_status_t status;
+    std::atomic<uint64_t> pending_parts; // bulk mint: number of threads that still have to apply their part
 };
 
 using queued_operation_t = std::tuple<operation_type_t,wallet_id_t,internal_transaction_t*>;
 
-using queued_wallet_t = std::tuple<wallet_id_t,wallet_t,transaction_id_t>;
+using queued_wallet_t = std::tuple<wallet_id_t,wallet_t,transaction_id_t,int64_t>; // wallet_id, wallet, txid, change in the balance
+using persisted_wallets_t = std::vector<std::tuple<wallet_id_t,transaction_id_t>>; // wallet_id, txid of the update that was put
 
 using queued_chain_t = std::tuple<operation_type_t,wallet_id_t,cbdc_request_t*>;
 
+using queued_fetch_t = std::pair<uint64_t,wallet_id_t>; // thread, wallet_id
+
+// position of a cached wallet in the CLOCK ring, and its state for eviction
+using wallet_cache_entry_t = struct wallet_cache_entry_t {
+    uint64_t slot;
+    bool referenced;
+    transaction_id_t last_txid; // TX of the last update of the cached wallet
+    bool dirty; // the last update was not persisted yet: evicting the wallet would lose it
+};
+
+// coins of an escrow wallet that are not held by any thread, plus the sub-balance held by each thread
+using escrow_pool_t = struct escrow_pool_t {
+    std::mutex mtx;
+    coin_value_t reserve;
+    coin_value_t debt = 0; // replicas: coins borrowed to follow the chaining node, repaid by the next coins returned to the reserve
+    std::vector<coin_value_t> sub_balance;
+    std::vector<coin_value_t> spare; // coins of each sub-balance that other threads can take (not needed by running TXs)
+    std::vector<coin_value_t> taken; // coins taken by other threads from each sub-balance, not yet removed by its thread
+
+    // the totals are persisted in the order they were computed (under mtx), without holding mtx during the put
+    std::mutex persist_mtx;
+    std::condition_variable persist_turn;
+    uint64_t persist_ticket = 0; // under mtx
+    uint64_t persist_next = 0; // under persist_mtx
+};
+
+// digest of this shard, filled by all worker threads
+using pending_digest_t = struct pending_digest_t {
+    uint64_t range_size;
+    shard_digest_t digest;
+    std::vector<std::vector<std::pair<transaction_id_t,internal_transaction_t*>>> transfers; // transfers counted by each thread (the one of their first wallet)
+};
+
 #define CBDC_REQUEST_FORWARD_PREFIX CBDC_REQUEST_PREFIX "/f/WID_" // + wallet_id
 #define CBDC_REQUEST_COMMIT_PREFIX CBDC_REQUEST_PREFIX "/c/WID_" // + wallet_id
 #define CBDC_REQUEST_ABORT_PREFIX CBDC_REQUEST_PREFIX "/a/WID_" // + wallet_id
+#define CBDC_REQUEST_ADMIT_PREFIX CBDC_REQUEST_PREFIX "/n/WID_" // + wallet_id (admission decision sent to the other replicas of the shard)
+#define CBDC_REQUEST_REJECT_PREFIX CBDC_REQUEST_PREFIX "/j/WID_" // + wallet_id
+#define CBDC_REQUEST_ESCROW_COVERED_PREFIX CBDC_REQUEST_PREFIX "/e/WID_" // + wallet_id (escrow outcome sent to the other replicas of the shard)
+#define CBDC_REQUEST_ESCROW_UNCOVERED_PREFIX CBDC_REQUEST_PREFIX "/u/WID_" // + wallet_id
+#define CBDC_REQUEST_PERSISTED_KEY CBDC_REQUEST_PREFIX "/persisted" // wallet updates put by the persisting node of the shard
 
 inline std::string CBDC_BUILD_FORWARD_KEY(wallet_id_t wallet_id){
     return CBDC_REQUEST_FORWARD_PREFIX + std::to_string(wallet_id);
@@ -57,6 +111,24 @@ inline std::string CBDC_BUILD_ABORT_KEY(wallet_id_t wallet_id){
     return CBDC_REQUEST_ABORT_PREFIX + std::to_string(wallet_id);
 }
 
+inline std::string CBDC_BUILD_ADMIT_KEY(wallet_id_t wallet_id){
+    return CBDC_REQUEST_ADMIT_PREFIX + std::to_string(wallet_id);
+}
+
+inline std::string CBDC_BUILD_REJECT_KEY(wallet_id_t wallet_id){
+    return CBDC_REQUEST_REJECT_PREFIX + std::to_string(wallet_id);
+}
+
+inline std::string CBDC_BUILD_ESCROW_COVERED_KEY(wallet_id_t wallet_id){
+    return CBDC_REQUEST_ESCROW_COVERED_PREFIX + std::to_string(wallet_id);
+}
+
+inline std::string CBDC_BUILD_ESCROW_UNCOVERED_KEY(wallet_id_t wallet_id){
+    return CBDC_REQUEST_ESCROW_UNCOVERED_PREFIX + std::to_string(wallet_id);
+}
+
+class CBDCEngineProbe; // microbenchmarks of the protocol internals (src/benchmark/benchmark_primitives.cpp)
+
 namespace derecho{
 namespace cascade{
 
@@ -64,19 +136,22 @@ namespace cascade{
 #define UDL_DESC    "UDL implementing the Cascade CBDC service."
 
 class CascadeCBDC: public DefaultOffCriticalDataPathObserver {
+    friend class ::CBDCEngineProbe;
     static std::shared_ptr<OffCriticalDataPathObserver> ocdpo_ptr;
     
     class CBDCThread {
+        friend class ::CBDCEngineProbe;
     private:
         uint64_t my_thread_id;
         CascadeCBDC* udl;
         node_id_t node_id;
         std::thread real_thread;
-        ServiceClientAPI& capi = ServiceClientAPI::get_service_client();
+        CBDCServiceClient& capi;
 
         bool running = false;
         std::mutex thread_mtx;
         std::queue<queued_operation_t*> operation_queue;
+        std::queue<std::pair<wallet_id_t,wallet_t>> fetched_queue; // wallets fetched in the background
         std::condition_variable thread_signal;
 
         std::unordered_map<wallet_id_t,wallet_t> wallet_cache; // committed state of wallets
@@ -92,13 +167,86 @@ class CascadeCBDC: public DefaultOffCriticalDataPathObserver {
         std::unordered_map<internal_transaction_t*,std::unordered_map<wallet_id_t,std::unordered_map<operation_type_t,bool>>> already_handled;
         std::unordered_map<internal_transaction_t*,std::list<wallet_id_t>> pending_wallets; // wallets in a running TX pending in this thread
 
+        bool partition_loaded = false; // all persisted wallets of this thread are cached: uncached wallets are new
+        std::unordered_map<wallet_id_t,std::list<queued_operation_t*>> fetching_wallets; // operations waiting for a wallet being fetched
+        std::unordered_map<queued_operation_t*,std::pair<uint64_t,std::vector<wallet_id_t>>> bulk_mint_fetches; // bulk mints waiting for fetched wallets: wallets they did not reach yet, and all of them
+
+        std::unordered_map<transaction_id_t,std::unordered_map<wallet_id_t,bool>> admission_decisions; // replicas: decisions of the chaining node not applied yet, per TX and wallet (true = admitted)
+        std::unordered_map<wallet_id_t,std::list<queued_operation_t*>> admission_wallets; // replicas: operations waiting for an admission decision
+
+        std::unordered_map<transaction_id_t,std::unordered_map<wallet_id_t,bool>> escrow_outcomes; // replicas: outcomes of the chaining node not applied yet, per TX and escrow wallet (true = covered)
+        std::unordered_map<transaction_id_t,std::unordered_map<wallet_id_t,internal_transaction_t*>> escrow_waiting; // replicas: TXs waiting for the outcome of an escrow wallet
+        std::unordered_map<internal_transaction_t*,std::unordered_map<wallet_id_t,operation_type_t>> early_status; // replicas: commit or abort of TXs that did not run here yet
+
+        std::unordered_map<wallet_id_t,uint64_t> wallet_pending; // number of pending TXs touching each wallet in this thread
+        std::unordered_map<wallet_id_t,wallet_cache_entry_t> cache_entries; // only used with a bounded cache
+        std::vector<wallet_id_t> clock_ring;
+        std::vector<std::pair<wallet_id_t,transaction_id_t>> persisted_queue; // wallet updates that were put (under thread_mtx)
+        bool cache_sweep_failed = false; // the last sweep found nothing to evict: the next inserts do not sweep until a wallet may be evictable
+        uint64_t clock_hand = 0;
+        std::chrono::steady_clock::time_point last_cache_log;
+
+        WalletCheckpoint* checkpoint = nullptr;
+        uint64_t checkpoint_seq = 0; // wallet updates applied by this thread
+        transaction_id_t checkpoint_last_txid = 0;
+        std::chrono::steady_clock::time_point last_checkpoint;
+
         void main_loop();
+        void handle_operation(queued_operation_t* queued_op,uint64_t queued_count);
+
+        // admission control: the chaining node admits or rejects new TXs, and the other replicas follow its decisions
+        bool is_new_operation(operation_type_t operation);
+        bool is_overloaded(uint64_t queued_count);
+        bool awaits_admission(queued_operation_t* queued_op); // replicas: the operation waits for the decision on its TX (or on a previous TX of its wallet)
+        bool admit_transaction(internal_transaction_t* tx,wallet_id_t wallet_id,uint64_t queued_count);
+        void send_admission(internal_transaction_t* tx,wallet_id_t wallet_id,bool admitted);
+        void admission_decided(const transaction_id_t& txid,wallet_id_t wallet_id,bool admitted);
+        void reject_transaction(internal_transaction_t* tx,wallet_id_t wallet_id);
+
+        // bulk mint: apply the part of a bulk mint that belongs to this thread, in a single pass
+        void bulk_mint(internal_transaction_t* tx);
+        bool bulk_mint_awaits_fetch(queued_operation_t* queued_op); // the bulk mint waits until its wallets being fetched arrive
+        void bulk_mint_fetched(queued_operation_t* queued_op); // all its wallets arrived: apply it, then release them
+        void compute_digest(internal_transaction_t* tx);
 
         // wallet operations
-        void fetch_wallet(wallet_id_t wallet_id);
+        void cache_wallet(wallet_id_t wallet_id,const wallet_t& wallet = wallet_t{});
+        bool needs_fetch(wallet_id_t wallet_id);
+        void fetch_wallet(wallet_id_t wallet_id,queued_operation_t* queued_op); // the operation waits until the wallet arrives
+        void fetched_wallet(wallet_id_t wallet_id,const wallet_t& wallet);
+        void release_wallet(wallet_id_t wallet_id); // handle the operations waiting for a wallet that is in the cache
+
+        // bounded cache: CLOCK eviction of clean wallets without pending TXs
+        void cache_insert(wallet_id_t wallet_id);
+        bool is_evictable(wallet_id_t wallet_id,const wallet_cache_entry_t& entry);
+        void apply_persisted_wallets();
+        void evict_wallet(wallet_id_t wallet_id);
+        void log_cache_status();
+
+        // recovery: load the wallets of this thread from a local snapshot or from the persisted wallets
+        void recover_partition();
+        bool load_snapshot(std::unordered_map<wallet_id_t,wallet_t>& wallets);
+        void write_snapshot();
+        
+        // checkpoint: periodic copy of the wallets of this thread, plus a log of the updates since then
+        bool load_checkpoint(std::unordered_map<wallet_id_t,wallet_t>& wallets);
+        void write_checkpoint();
         coin_value_t add_to_wallet(wallet_t &wallet,coin_value_t value);
         coin_value_t remove_from_wallet(wallet_t &wallet,coin_value_t value);
 
+        // escrow wallets: each thread holds a sub-balance, refilled from (and returned to) a shared reserve
+        bool is_escrow(wallet_id_t wallet_id);
+        void escrow_refill(wallet_id_t wallet_id,coin_value_t value,bool must_cover = false); // must_cover: borrow what the pool does not have
+        void escrow_settle(wallet_id_t wallet_id,escrow_pool_t* pool); // with the pool lock: apply the coins taken by other threads and publish the spare coins
+        void escrow_repay(escrow_pool_t* pool); // with the pool lock
+        coin_value_t escrow_total(escrow_pool_t* pool); // with the pool lock
+        void escrow_rebalance(wallet_id_t wallet_id);
+
+        // whether an escrow wallet covers a TX depends on how the threads shared its coins: the chaining node decides, and the other replicas follow
+        bool awaits_escrow(internal_transaction_t* tx,wallet_id_t wallet_id); // replicas: the TX waits for the outcome of the chaining node
+        void send_escrow_outcome(internal_transaction_t* tx,wallet_id_t wallet_id,bool covered);
+        void escrow_decided(const transaction_id_t& txid,wallet_id_t wallet_id,bool covered);
+
         // queue and conflict tracking
         void enqueue_transaction(internal_transaction_t* tx,wallet_id_t wallet_id);
         bool dequeue_transaction(internal_transaction_t* tx,wallet_id_t wallet_id);
@@ -109,6 +257,9 @@ class CascadeCBDC: public DefaultOffCriticalDataPathObserver {
         void tx_run_recursive(internal_transaction_t* tx,wallet_id_t wallet_id);
         void tx_committed_recursive(internal_transaction_t* tx,wallet_id_t wallet_id);
         void tx_aborted_recursive(internal_transaction_t* tx,wallet_id_t wallet_id,bool adjust_virtual);
+        void tx_release_recursive(internal_transaction_t* tx); // remove a finished TX from conflicts and run the TXs waiting for it
+        bool defers_status(internal_transaction_t* tx,wallet_id_t wallet_id,operation_type_t operation); // replicas: the TX did not run here yet, so its status is applied when it runs
+        void tx_group_admit(std::vector<internal_transaction_t*>& group); // add to the group queued debits that the committed balance covers
         
         // chain protocol
         std::tuple<bool,bool,uint32_t> is_mine(internal_transaction_t* tx,wallet_id_t wallet_id,wallet_id_t next_wallet_id); // check if this node is responsible for chaining, and if the next wallet goes to the same shard
@@ -124,6 +275,10 @@ class CascadeCBDC: public DefaultOffCriticalDataPathObserver {
     public:
         CBDCThread(uint64_t my_thread_id,CascadeCBDC *udl);
         void push_operation(queued_operation_t* queued_op);
+        void push_fetched_wallet(wallet_id_t wallet_id,const wallet_t& wallet);
+        void push_persisted_wallet(wallet_id_t wallet_id,transaction_id_t txid);
+        std::string snapshot_file();
+        bool has_local_state(); // a snapshot or a checkpoint is available for recovery
         void reset();
         void signal_stop();
 
@@ -142,14 +297,19 @@ class CascadeCBDC: public DefaultOffCriticalDataPathObserver {
         CascadeCBDC* udl;
         node_id_t node_id;
         std::thread real_thread;
-        ServiceClientAPI& capi = ServiceClientAPI::get_service_client();
+        CBDCServiceClient& capi;
 
         bool running = false;
         std::mutex thread_mtx;
         std::queue<queued_wallet_t> wallet_queue;
         std::condition_variable thread_signal;
 
+        uint32_t shard_index = 0;
+        uint64_t delta_seq = 0; // last delta batch put
+        bool delta_seq_loaded = false;
+
         void main_loop();
+        void put_deltas(queued_wallet_t* to_persist,uint64_t persist_count);
     
     public:
         WalletPersistenceThread(CascadeCBDC *udl);
@@ -167,12 +327,47 @@ class CascadeCBDC: public DefaultOffCriticalDataPathObserver {
         }
     };
     
+    class DeltaCompactionThread {
+    private:
+        CascadeCBDC* udl;
+        node_id_t node_id;
+        std::thread real_thread;
+        CBDCServiceClient& capi;
+
+        bool running = false;
+        std::mutex thread_mtx;
+        std::condition_variable thread_signal;
+        std::unordered_map<wallet_id_t,wallet_t> images; // latest wallets, up to the delta batch last_seq
+        uint64_t last_seq = 0;
+        bool compacted_seq_loaded = false;
+        uint64_t compacted_seq = 0; // batch of the last marker put
+        uint64_t removed_seq = 0; // delta batches removed up to this one
+
+        void main_loop();
+        void compact();
+    
+    public:
+        DeltaCompactionThread(CascadeCBDC *udl);
+        void push_images(std::vector<std::pair<wallet_id_t,wallet_t>>& wallets,uint64_t seq);
+        void signal_stop();
+        void reset();
+
+        inline void start(){
+            running = true;
+            real_thread = std::thread(&DeltaCompactionThread::main_loop,this);
+        }
+
+        inline void join(){
+            real_thread.join();
+        }
+    };
+    
     class ChainingThread {
     private:
         CascadeCBDC* udl;
         node_id_t node_id;
         std::thread real_thread;
-        ServiceClientAPI& capi = ServiceClientAPI::get_service_client();
+        CBDCServiceClient& capi;
 
         bool running = false;
         std::mutex thread_mtx;
@@ -202,7 +397,7 @@ class CascadeCBDC: public DefaultOffCriticalDataPathObserver {
         CascadeCBDC* udl;
         node_id_t node_id;
         std::thread real_thread;
-        ServiceClientAPI& capi = ServiceClientAPI::get_service_client();
+        CBDCServiceClient& capi;
 
         bool running = false;
         std::mutex thread_mtx;
@@ -227,9 +422,102 @@ class CascadeCBDC: public DefaultOffCriticalDataPathObserver {
         }
     };
 
+    class NotificationThread {
+    private:
+        CascadeCBDC* udl;
+        node_id_t node_id;
+        std::thread real_thread;
+        CBDCServiceClient& capi;
+
+        bool running = false;
+        std::mutex thread_mtx;
+        std::condition_variable thread_signal;
+        std::unordered_map<node_id_t,tx_completion_batch_t> completion_queues; // by client
+
+        void main_loop();
+    
+    public:
+        NotificationThread(CascadeCBDC *udl);
+        void push_completion(transaction_id_t txid,transaction_status_t status);
+        void signal_stop();
+        void reset();
+
+        inline void start(){
+            running = true;
+            real_thread = std::thread(&NotificationThread::main_loop,this);
+        }
+
+        inline void join(){
+            real_thread.join();
+        }
+    };
+
+    class WalletFetchThread {
+    private:
+        CascadeCBDC* udl;
+        node_id_t node_id;
+        std::thread real_thread;
+
+        bool running = false;
+        std::mutex thread_mtx;
+        std::condition_variable thread_signal;
+        std::queue<queued_fetch_t> fetch_queue;
+
+        void main_loop();
+    
+    public:
+        WalletFetchThread(CascadeCBDC *udl);
+        void push_fetch(queued_fetch_t &queued_fetch);
+        void signal_stop();
+        void reset();
+
+        inline void start(){
+            running = true;
+            real_thread = std::thread(&WalletFetchThread::main_loop,this);
+        }
+
+        inline void join(){
+            real_thread.join();
+        }
+    };
+
     // main thread
     node_id_t my_id = 0;
+    std::shared_ptr<CBDCServiceClient> service; // used by all threads to reach other nodes
     std::unordered_map<transaction_id_t,internal_transaction_t*> transaction_database; // TODO manage memory: currently TXs are kept forever in memory
+    std::unordered_map<transaction_id_t,std::vector<std::pair<operation_type_t,wallet_id_t>>> early_statuses; // replicas: commits and aborts that arrived before their TX
+    std::unordered_map<wallet_id_t,escrow_pool_t*> escrow_pools; // created when the threads start, read-only afterwards
+
+    // recovery
+    std::string recovery_snapshot_path; // local snapshot of the wallets, written when the service stops (empty = disabled)
+    std::string checkpoint_path; // local checkpoint files of the threads (empty = disabled)
+    std::once_flag recovery_flag;
+    std::vector<std::vector<wallet_id_t>> recovery_partitions; // persisted wallets of this shard, by thread
+    void recover_shared_state(); // list the persisted wallets once for all threads and load the escrow reserves
+    void fetch_wallets(const std::vector<wallet_id_t>& wallet_ids,std::unordered_map<wallet_id_t,wallet_t>& wallets);
+
+    // capture of the handled requests and of the TX outcomes, for replay (see request_capture.hpp)
+    std::string capture_path; // <capture_path>.<node_id>.capture (empty = disabled)
+    CaptureWriter* capture = nullptr;
+
+    // delta persistence: last compacted batch, and the batches after it (until the first missing one)
+    uint64_t fetch_compacted_seq(uint32_t shard_index);
+    uint64_t fetch_deltas(uint32_t shard_index,uint64_t from_seq,std::vector<std::pair<uint64_t,wallet_delta_batch_t>>& batches);
+    uint64_t fetch_removed_seq(uint32_t shard_index,uint64_t to_seq); // last batch up to to_seq that is missing
+    void remove_persisted_wallets(); // wallet images, delta batches and compacted batch of this shard
+
+    // digest verification: the handler splits the TXs by thread, and each worker thread adds their statuses and its wallets
+    std::mutex digest_mtx;
+    std::unordered_map<uint64_t,pending_digest_t> pending_digests;
+    void start_digest(uint64_t request_id,uint64_t range_size);
+
+    // admission control: enabled by thread_queue_max_size or thread_max_pending_transactions, and decided by the chaining node of each shard
+    bool admission_enabled();
+    bool decides_admission();
+
+    // bounded cache: sent to the shard after the wallet puts, so every replica handles it once the wallets are stored
+    void announce_persisted(const persisted_wallets_t& persisted);
+    void wallets_persisted(const persisted_wallets_t& persisted);
 
     void start_threads();
     operation_type_t operation_str_to_type(const std::string &operation_str);
@@ -249,8 +537,13 @@ public:
     WalletPersistenceThread* wallet_thread;
     ChainingThread* chain_thread;
     TXPersistenceThread* tx_thread;
+    WalletFetchThread* fetch_thread;
+    DeltaCompactionThread* compaction_thread;
+    NotificationThread* notification_thread;
     
     void set_config(DefaultCascadeContextType* typed_ctxt,const nlohmann::json& config);
+    void configure(std::shared_ptr<CBDCServiceClient> service,const nlohmann::json& config); // also used without a Cascade context (in-process benchmark)
+    void handle_request(node_id_t sender,const std::string& key_string,const ObjectWithStringKey& object); // key relative to CBDC_REQUEST_PREFIX
     void stop();
     void reset();
 
@@ -265,33 +558,6 @@ public:
     }
 };
 
-std::shared_ptr<OffCriticalDataPathObserver> CascadeCBDC::ocdpo_ptr;
-
-void initialize(ICascadeContext* ctxt) {
-    //initialize observer
-    CascadeCBDC::initialize();
-}
-
-std::shared_ptr<OffCriticalDataPathObserver> get_observer(
-        ICascadeContext* ctxt,const nlohmann::json& config) {
-    auto typed_ctxt = dynamic_cast<DefaultCascadeContextType*>(ctxt);
-    std::static_pointer_cast<CascadeCBDC>(CascadeCBDC::get())->set_config(typed_ctxt,config);
-    return CascadeCBDC::get();
-}
-
-void release(ICascadeContext* ctxt) {
-    std::static_pointer_cast<CascadeCBDC>(CascadeCBDC::get())->stop();
-    return;
-}
-
-std::string get_uuid() {
-    return UDL_UUID;
-}
-
-std::string get_description() {
-    return UDL_DESC;
-}
-
 } // namespace cascade
 } // namespace derecho
 
@@ -0,0 +1,162 @@
+
+#include "request_capture.hpp"
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CBDC_CAPTURE_BUFFER_SIZE (1 << 20)
+
+static uint64_t capture_now_ns(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// writer
+
+CaptureWriter::~CaptureWriter(){
+    flush();
+    if(file.is_open()){
+        file.close();
+    }
+}
+
+bool CaptureWriter::open(const std::string& path,uint64_t node_id,uint32_t shard_index,uint32_t num_shards,const std::string& config){
+    file.open(path,std::ios::binary | std::ios::trunc);
+    if(!file.is_open()){
+        return false;
+    }
+
+    capture_header_t header;
+    header.magic = CBDC_CAPTURE_MAGIC;
+    header.node_id = node_id;
+    header.shard_index = shard_index;
+    header.num_shards = num_shards;
+    header.start_ns = capture_now_ns();
+    header.config_size = config.size();
+    start_ns = header.start_ns;
+
+    buffer.reserve(CBDC_CAPTURE_BUFFER_SIZE);
+    file.write(reinterpret_cast<const char*>(&header),sizeof(header));
+    file.write(config.data(),config.size());
+    return file.good();
+}
+
+void CaptureWriter::append(const capture_record_t& record,const char* key,const uint8_t* blob){
+    auto offset = buffer.size();
+    buffer.resize(offset + sizeof(record) + record.key_size + record.blob_size);
+    std::memcpy(buffer.data() + offset,&record,sizeof(record));
+    offset += sizeof(record);
+    std::memcpy(buffer.data() + offset,key,record.key_size);
+    offset += record.key_size;
+    std::memcpy(buffer.data() + offset,blob,record.blob_size);
+
+    if(buffer.size() >= CBDC_CAPTURE_BUFFER_SIZE){
+        write_buffer();
+    }
+}
+
+void CaptureWriter::write_buffer(){
+    if(file.is_open() && !buffer.empty()){
+        file.write(reinterpret_cast<const char*>(buffer.data()),buffer.size());
+    }
+    buffer.clear();
+}
+
+void CaptureWriter::record_input(uint64_t sender,const std::string& key,const uint8_t* blob,std::size_t blob_size){
+    capture_record_t record;
+    record.id = sender;
+    record.blob_size = blob_size;
+    record.key_size = key.size();
+    record.type = capture_record_type_t::INPUT;
+    record.status = transaction_status_t::UNKNOWN;
+
+    std::unique_lock<std::mutex> lock(mtx);
+    record.timestamp_ns = capture_now_ns() - start_ns; // taken under the lock, so timestamps follow the file order
+    append(record,key.data(),blob);
+}
+
+void CaptureWriter::record_outcome(transaction_id_t txid,transaction_status_t status){
+    capture_record_t record;
+    record.id = txid;
+    record.blob_size = 0;
+    record.key_size = 0;
+    record.type = capture_record_type_t::OUTCOME;
+    record.status = status;
+
+    std::unique_lock<std::mutex> lock(mtx);
+    record.timestamp_ns = capture_now_ns() - start_ns;
+    append(record,nullptr,nullptr);
+}
+
+void CaptureWriter::flush(){
+    std::unique_lock<std::mutex> lock(mtx);
+    write_buffer();
+    if(file.is_open()){
+        file.flush();
+    }
+}
+
+// reader
+
+CaptureReader::~CaptureReader(){
+    if(data != nullptr){
+        munmap(const_cast<uint8_t*>(data),size);
+    }
+}
+
+bool CaptureReader::open(const std::string& path){
+    int fd = ::open(path.c_str(),O_RDONLY);
+    if(fd < 0){
+        return false;
+    }
+
+    struct stat st;
+    if((fstat(fd,&st) != 0) || (static_cast<std::size_t>(st.st_size) < sizeof(capture_header_t))){
+        close(fd);
+        return false;
+    }
+
+    size = st.st_size;
+    void* addr = mmap(nullptr,size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(addr == MAP_FAILED){
+        return false;
+    }
+    madvise(addr,size,MADV_SEQUENTIAL);
+    data = reinterpret_cast<const uint8_t*>(addr);
+
+    if((header().magic != CBDC_CAPTURE_MAGIC) || (header().config_size > size - sizeof(capture_header_t))){
+        munmap(addr,size);
+        data = nullptr;
+        return false;
+    }
+
+    rewind();
+    return true;
+}
+
+std::string CaptureReader::config(){
+    return std::string(reinterpret_cast<const char*>(data + sizeof(capture_header_t)),header().config_size);
+}
+
+bool CaptureReader::next(capture_record_t& record,const char*& key,const uint8_t*& blob){
+    if(size - offset < sizeof(record)){
+        return false;
+    }
+    std::memcpy(&record,data + offset,sizeof(record));
+
+    std::size_t record_size = sizeof(record) + record.key_size + record.blob_size;
+    if(size - offset < record_size){
+        return false;
+    }
+    key = reinterpret_cast<const char*>(data + offset + sizeof(record));
+    blob = data + offset + sizeof(record) + record.key_size;
+    offset += record_size;
+    return true;
+}
+
+void CaptureReader::rewind(){
+    offset = sizeof(capture_header_t) + header().config_size;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <vector>
+#include "common.hpp"
+
+#define CBDC_CAPTURE_MAGIC 0x4342444343415031 // "CBDCCAP1"
+
+// capture file: header, the UDL config (JSON, config_size bytes), then records until the end of the file
+using capture_header_t = struct capture_header_t {
+    uint64_t magic;
+    uint64_t node_id;
+    uint32_t shard_index;
+    uint32_t num_shards;                    // routing of keys to shards depends on it
+    uint64_t start_ns;                      // system clock, so captures of different nodes can be aligned
+    uint64_t config_size;
+};
+
+enum class capture_record_type_t: uint8_t {
+    INPUT,                                  // handler invocation: followed by the key (relative to CBDC_REQUEST_PREFIX) and the blob
+    OUTCOME                                 // final status of a TX, decided by this node
+};
+
+using capture_record_t = struct capture_record_t {
+    uint64_t timestamp_ns;                  // relative to start_ns
+    uint64_t id;                            // sender node (input) or TX ID (outcome)
+    uint32_t blob_size;
+    uint16_t key_size;
+    capture_record_type_t type;
+    transaction_status_t status;            // outcome only
+};
+
+/*
+ * Capture of the requests handled by a node, to replay them later with the same order and timing
+ * (see replay_capture in the benchmark tools). Records are buffered and written by whichever thread fills the
+ * buffer: inputs come from the handler, and outcomes from the worker threads.
+ */
+class CaptureWriter {
+    std::ofstream file;
+    std::vector<uint8_t> buffer;
+    std::mutex mtx;
+    uint64_t start_ns = 0;
+
+    void append(const capture_record_t& record,const char* key,const uint8_t* blob);
+    void write_buffer();
+
+    public:
+
+    ~CaptureWriter();
+
+    bool open(const std::string& path,uint64_t node_id,uint32_t shard_index,uint32_t num_shards,const std::string& config);
+    void record_input(uint64_t sender,const std::string& key,const uint8_t* blob,std::size_t blob_size);
+    void record_outcome(transaction_id_t txid,transaction_status_t status);
+    void flush();
+};
+
+/*
+ * Sequential reader of a capture file, which is memory-mapped: keys and blobs point into the mapping.
+ * A truncated last record (e.g. the node crashed) ends the capture.
+ */
+class CaptureReader {
+    const uint8_t* data = nullptr;
+    std::size_t size = 0;
+    std::size_t offset = 0;
+
+    public:
+
+    ~CaptureReader();
+
+    bool open(const std::string& path);
+    const capture_header_t& header(){ return *reinterpret_cast<const capture_header_t*>(data); }
+    std::string config();
+    bool next(capture_record_t& record,const char*& key,const uint8_t*& blob);
+    void rewind();
+};
+
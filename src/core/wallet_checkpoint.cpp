@@ -0,0 +1,185 @@
+
+#include "wallet_checkpoint.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+WalletCheckpoint::WalletCheckpoint(const std::string& path){
+    checkpoint_file = path + ".ckpt";
+    log_file = path + ".log";
+}
+
+WalletCheckpoint::~WalletCheckpoint(){
+    if(log.is_open()){
+        log.close();
+    }
+}
+
+bool WalletCheckpoint::write(uint64_t num_threads,uint64_t seq,transaction_id_t last_txid,const std::unordered_map<wallet_id_t,wallet_t>& wallets,const std::function<bool(wallet_id_t)>& filter){
+    uint64_t count = 0;
+    std::size_t size = sizeof(checkpoint_header_t);
+    for(auto& item : wallets){
+        if(!filter || filter(item.first)){
+            count++;
+            size += sizeof(checkpoint_record_t) + CBDC_WALLET_BYTES_SIZE(item.second);
+        }
+    }
+
+    std::string tmp_file = checkpoint_file + ".tmp";
+    int fd = open(tmp_file.c_str(),O_RDWR | O_CREAT | O_TRUNC,0644);
+    if(fd < 0){
+        return false;
+    }
+
+    if(ftruncate(fd,size) != 0){
+        close(fd);
+        return false;
+    }
+
+    void* addr = mmap(nullptr,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    if(addr == MAP_FAILED){
+        close(fd);
+        return false;
+    }
+
+    auto header = reinterpret_cast<checkpoint_header_t*>(addr);
+    auto cursor = reinterpret_cast<uint8_t*>(header + 1);
+    for(auto& item : wallets){
+        if(!filter || filter(item.first)){
+            checkpoint_record_t record;
+            record.wallet_id = item.first;
+            record.size = CBDC_WALLET_BYTES_SIZE(item.second);
+            std::memcpy(cursor,&record,sizeof(record));
+            cursor += sizeof(record);
+            cursor += CBDC_WALLET_TO_BYTES(item.second,cursor);
+        }
+    }
+
+    header->num_threads = num_threads;
+    header->seq = seq;
+    header->last_txid = last_txid;
+    header->count = count;
+    header->magic = CBDC_CHECKPOINT_MAGIC;
+
+    bool ok = msync(addr,size,MS_SYNC) == 0;
+    munmap(addr,size);
+    close(fd);
+
+    // replace the previous checkpoint only when the new one is complete
+    if(!ok || (std::rename(tmp_file.c_str(),checkpoint_file.c_str()) != 0)){
+        return false;
+    }
+
+    // the updates in the previous log are all in the checkpoint now
+    if(log.is_open()){
+        log.close();
+    }
+    log.open(log_file,std::ios::binary | std::ios::trunc);
+    return true;
+}
+
+bool WalletCheckpoint::recover(uint64_t num_threads,uint64_t& seq,transaction_id_t& last_txid,std::unordered_map<wallet_id_t,wallet_t>& wallets){
+    int fd = open(checkpoint_file.c_str(),O_RDONLY);
+    if(fd < 0){
+        return false;
+    }
+
+    struct stat st;
+    if((fstat(fd,&st) != 0) || (static_cast<std::size_t>(st.st_size) < sizeof(checkpoint_header_t))){
+        close(fd);
+        return false;
+    }
+
+    std::size_t size = st.st_size;
+    void* addr = mmap(nullptr,size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(addr == MAP_FAILED){
+        return false;
+    }
+    madvise(addr,size,MADV_SEQUENTIAL);
+
+    auto header = reinterpret_cast<const checkpoint_header_t*>(addr);
+    if((header->magic != CBDC_CHECKPOINT_MAGIC) || (header->num_threads != num_threads)){
+        munmap(addr,size);
+        return false;
+    }
+
+    auto cursor = reinterpret_cast<const uint8_t*>(header + 1);
+    auto end = reinterpret_cast<const uint8_t*>(addr) + size;
+    wallets.reserve(wallets.size() + header->count);
+    for(uint64_t i=0;i<header->count;i++){
+        checkpoint_record_t record;
+        if(static_cast<std::size_t>(end - cursor) < sizeof(record)){
+            munmap(addr,size);
+            return false;
+        }
+        std::memcpy(&record,cursor,sizeof(record));
+        cursor += sizeof(record);
+
+        if(static_cast<std::size_t>(end - cursor) < record.size){
+            munmap(addr,size);
+            return false;
+        }
+        wallets[record.wallet_id] = CBDC_WALLET_FROM_BYTES(cursor,record.size);
+        cursor += record.size;
+    }
+
+    seq = header->seq;
+    last_txid = header->last_txid;
+    munmap(addr,size);
+
+    // replay the updates after the checkpoint (a partial last record is ignored)
+    std::ifstream log_in(log_file,std::ios::binary);
+    checkpoint_log_record_t record;
+    std::vector<uint8_t> buffer;
+    while(log_in.read(reinterpret_cast<char*>(&record),sizeof(record))){
+        buffer.resize(record.size);
+        if(!log_in.read(reinterpret_cast<char*>(buffer.data()),record.size)){
+            break;
+        }
+
+        if(record.seq > seq){
+            wallets[record.wallet_id] = CBDC_WALLET_FROM_BYTES(buffer.data(),record.size);
+            seq = record.seq;
+        }
+    }
+
+    return true;
+}
+
+void WalletCheckpoint::log_wallet(uint64_t seq,wallet_id_t wallet_id,const wallet_t& wallet){
+    if(!log.is_open()){
+        log.open(log_file,std::ios::binary | std::ios::app);
+    }
+
+    checkpoint_log_record_t record;
+    record.seq = seq;
+    record.wallet_id = wallet_id;
+    record.size = CBDC_WALLET_BYTES_SIZE(wallet);
+    log_buffer.resize(record.size);
+    CBDC_WALLET_TO_BYTES(wallet,log_buffer.data());
+    log.write(reinterpret_cast<const char*>(&record),sizeof(record));
+    log.write(reinterpret_cast<const char*>(log_buffer.data()),record.size);
+}
+
+void WalletCheckpoint::flush_log(){
+    if(log.is_open()){
+        log.flush();
+    }
+}
+
+bool WalletCheckpoint::exists(){
+    return std::ifstream(checkpoint_file).good();
+}
+
+void WalletCheckpoint::clear(){
+    if(log.is_open()){
+        log.close();
+    }
+    std::remove(checkpoint_file.c_str());
+    std::remove(log_file.c_str());
+}
+
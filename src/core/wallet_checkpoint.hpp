@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include "common.hpp"
+
+#define CBDC_CHECKPOINT_MAGIC 0x43424443434b5032 // "CBDCCKP2"
+
+// checkpoint file: header followed by count records (each one followed by the serialized wallet)
+using checkpoint_header_t = struct checkpoint_header_t {
+    uint64_t magic;
+    uint64_t num_threads;                   // wallets are split among threads by their ID: the checkpoint is only valid with the same number of threads
+    uint64_t seq;                           // last wallet update included in the checkpoint
+    transaction_id_t last_txid;             // last TX applied before the checkpoint
+    uint64_t count;                         // number of records
+};
+
+using checkpoint_record_t = struct checkpoint_record_t {
+    wallet_id_t wallet_id;
+    uint64_t size;                          // wallet bytes (wallets have variable size with coin wallets)
+};
+
+// incremental log: wallet updates after the checkpoint (each record followed by the serialized wallet)
+using checkpoint_log_record_t = struct checkpoint_log_record_t {
+    uint64_t seq;
+    wallet_id_t wallet_id;
+    uint64_t size;
+};
+
+/*
+ * Checkpoint of the wallets of a worker thread, plus a local log of the wallet updates since the checkpoint.
+ * The checkpoint is written to a memory-mapped file, which is then atomically renamed, so a crash while writing keeps the previous checkpoint.
+ * Log records carry a sequence number: records already included in the checkpoint are ignored when recovering.
+ */
+class WalletCheckpoint {
+    std::string checkpoint_file;
+    std::string log_file;
+    std::ofstream log;
+    std::vector<uint8_t> log_buffer;
+
+    public:
+
+    WalletCheckpoint(const std::string& path);
+    ~WalletCheckpoint();
+
+    // write a checkpoint with the wallets accepted by the filter, and start a new log
+    bool write(uint64_t num_threads,uint64_t seq,transaction_id_t last_txid,const std::unordered_map<wallet_id_t,wallet_t>& wallets,const std::function<bool(wallet_id_t)>& filter = nullptr);
+
+    // map the checkpoint and replay the log: returns false if there is no valid checkpoint
+    bool recover(uint64_t num_threads,uint64_t& seq,transaction_id_t& last_txid,std::unordered_map<wallet_id_t,wallet_t>& wallets);
+
+    void log_wallet(uint64_t seq,wallet_id_t wallet_id,const wallet_t& wallet);
+    void flush_log();
+    bool exists();
+    void clear();
+};
+